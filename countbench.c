@@ -0,0 +1,93 @@
+/**
+ * countbench.c - A microbenchmark for the counting kernels.
+ *
+ * Counts the same in-memory block over and over,
+ * with uniform and skewed data and several histogram sizes,
+ * trying each counting strategy.
+ * Build it with `make countbench` and run `./countbench`.
+ */
+
+#include <math.h>
+#include <time.h>
+
+#include <postgres.h>
+
+#include "kernels.h"
+
+#define VALS 262144
+#define ROUNDS 20
+
+static const char *strategy_names[] = {"direct", "replicated", "blocked"};
+
+static double now(void) {
+  struct timespec tp;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &tp)) { perror("clock failed"); exit(1); }
+  return tp.tv_sec + tp.tv_nsec / 1e9;
+}
+
+/**
+ * fill - Puts `VALS` values in [0, 1) into `xs`.
+ *
+ * Skewed data piles up near zero (like our sensor readings),
+ * so most values land in the first few buckets.
+ */
+static void fill(float8 *xs, bool skewed) {
+  int i;
+  float8 u;
+
+  for (i = 0; i < VALS; i++) {
+    u = (float8)random() / ((float8)RAND_MAX + 1);
+    xs[i] = skewed ? pow(u, 16) : u;
+  }
+}
+
+static void bench(const char *distribution, float8 *xs, float8 *ys, bool *nulls, int x_count, int y_count) {
+  size_t bucket_count = (size_t)x_count * y_count;
+  int64 *counts = calloc(bucket_count, sizeof(int64));
+  hist_counter hc;
+  double start, elapsed;
+  int strategy, r;
+
+  for (strategy = COUNT_DIRECT; strategy <= COUNT_BLOCKED; strategy++) {
+    if (!counts || hist_counter_init_with_strategy(&hc, counts, bucket_count, strategy)) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+    start = now();
+    for (r = 0; r < ROUNDS; r++) {
+      if (y_count == 1) {
+        count_vals(&hc, VALS, xs, nulls, 0, 1.0 / x_count, x_count);
+      } else {
+        count_vals_2d(&hc, VALS, xs, nulls, 0, 1.0 / x_count, x_count, ys, nulls, 0, 1.0 / y_count, y_count);
+      }
+    }
+    elapsed = now() - start;
+    hist_counter_finish(&hc);
+    printf("%-8s %8d x %-6d %-10s %6.2f ns/value\n",
+           distribution, x_count, y_count, strategy_names[strategy], elapsed * 1e9 / ROUNDS / VALS);
+  }
+
+  free(counts);
+}
+
+int main(int argc, char **argv) {
+  float8 *xs = malloc(VALS * sizeof(float8));
+  float8 *ys = malloc(VALS * sizeof(float8));
+  bool *nulls = calloc(VALS, sizeof(bool));
+  int sizes[][2] = {{10, 1}, {1000, 1}, {100000, 1}, {100, 100}, {1000, 1000}, {4000, 4000}};
+  int skewed, i;
+
+  if (!xs || !ys || !nulls) { fprintf(stderr, "out of memory\n"); exit(1); }
+  printf("kernel: %s\n", count_vals_kernel_name());
+
+  for (skewed = 0; skewed <= 1; skewed++) {
+    fill(xs, skewed);
+    fill(ys, skewed);
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+      bench(skewed ? "skewed" : "uniform", xs, ys, nulls, sizes[i][0], sizes[i][1]);
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,906 @@
+/* floatfile--1.3.1--1.4.0.sql */
+
+-- complain if script is sourced in psql, rather than via ALTER EXTENSION
+\echo Use "ALTER EXTENSION floatfile UPDATE TO '1.4.0'" to load this file. \quit
+
+CREATE OR REPLACE FUNCTION
+floatfile_to_hists(
+  filename text,
+  buckets_starts float[],
+  bucket_widths float[],
+  bucket_counts int[])
+RETURNS SETOF int[]
+AS 'floatfile', 'floatfile_to_hists'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_to_hists(
+  filename text,
+  buckets_starts float[],
+  bucket_widths float[],
+  bucket_counts int[],
+  timestamps_filename text,
+  timestamps_start float,
+  timestamps_end float)
+RETURNS SETOF int[]
+AS 'floatfile', 'floatfile_with_bounds_to_hists'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_to_hist(
+  filenames text[],
+  buckets_start float,
+  bucket_width float,
+  bucket_count int)
+RETURNS SETOF int[]
+AS 'floatfile', 'floatfiles_to_hist'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_stats(
+  filename text,
+  OUT count bigint, OUT sum float, OUT min float, OUT max float, OUT mean float, OUT stddev float)
+AS 'floatfile', 'floatfile_stats'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_stats(
+  filename text,
+  timestamps_filename text,
+  timestamps_start float,
+  timestamps_end float,
+  OUT count bigint, OUT sum float, OUT min float, OUT max float, OUT mean float, OUT stddev float)
+AS 'floatfile', 'floatfile_with_bounds_stats'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_info(
+  filename text,
+  OUT length bigint, OUT count bigint, OUT sum float, OUT min float, OUT max float, OUT mean float, OUT stddev float)
+AS 'floatfile', 'floatfile_info'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_percentiles(filename text, fractions float[])
+RETURNS float[]
+AS 'floatfile', 'floatfile_percentiles'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_percentiles(
+  filename text,
+  fractions float[],
+  timestamps_filename text,
+  timestamps_start float,
+  timestamps_end float)
+RETURNS float[]
+AS 'floatfile', 'floatfile_with_bounds_percentiles'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_downsample(
+  filename text,
+  timestamps_filename text,
+  timestamps_start float,
+  timestamps_end float,
+  n_points int,
+  method text,
+  OUT timestamps float[], OUT vals float[])
+AS 'floatfile', 'floatfile_downsample'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_time_buckets(
+  filename text,
+  timestamps_filename text,
+  timestamps_start float,
+  timestamps_end float,
+  bucket_width float,
+  aggs text[])
+RETURNS SETOF float[]
+AS 'floatfile', 'floatfile_time_buckets'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_bucket_agg(
+  x_filename text, y_filename text,
+  x_buckets_start float,
+  x_bucket_width float,
+  x_bucket_count int,
+  agg text)
+RETURNS float[]
+AS 'floatfile', 'floatfile_bucket_agg'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_bucket_agg(
+  x_filename text, y_filename text,
+  x_buckets_start float,
+  x_bucket_width float,
+  x_bucket_count int,
+  agg text,
+  timestamps_filename text,
+  timestamps_start float,
+  timestamps_end float)
+RETURNS float[]
+AS 'floatfile', 'floatfile_with_bounds_bucket_agg'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_to_histnd(
+  filenames text[],
+  buckets_starts float[],
+  bucket_widths float[],
+  bucket_counts int[])
+RETURNS int[]
+AS 'floatfile', 'floatfile_to_histnd'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_to_histnd(
+  filenames text[],
+  buckets_starts float[],
+  bucket_widths float[],
+  bucket_counts int[],
+  timestamps_filename text,
+  timestamps_start float,
+  timestamps_end float)
+RETURNS int[]
+AS 'floatfile', 'floatfile_with_bounds_to_histnd'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_to_histnd_sparse(
+  filenames text[],
+  buckets_starts float[],
+  bucket_widths float[],
+  bucket_counts int[],
+  OUT buckets int[], OUT counts bigint[])
+AS 'floatfile', 'floatfile_to_histnd_sparse'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_to_histnd_sparse(
+  filenames text[],
+  buckets_starts float[],
+  bucket_widths float[],
+  bucket_counts int[],
+  timestamps_filename text,
+  timestamps_start float,
+  timestamps_end float,
+  OUT buckets int[], OUT counts bigint[])
+AS 'floatfile', 'floatfile_with_bounds_to_histnd_sparse'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_to_hist_auto(
+  filename text,
+  bucket_count int,
+  OUT edges float[], OUT counts int[])
+AS 'floatfile', 'floatfile_to_hist_auto'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_to_hist_auto(
+  filename text,
+  bucket_count int,
+  timestamps_filename text,
+  timestamps_start float,
+  timestamps_end float,
+  OUT edges float[], OUT counts int[])
+AS 'floatfile', 'floatfile_with_bounds_to_hist_auto'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_to_hist_edges(
+  filename text,
+  edges float[])
+RETURNS int[]
+AS 'floatfile', 'floatfile_to_hist_edges'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_to_hist_edges(
+  filename text,
+  edges float[],
+  timestamps_filename text,
+  timestamps_start float,
+  timestamps_end float)
+RETURNS int[]
+AS 'floatfile', 'floatfile_with_bounds_to_hist_edges'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_to_hist_log(
+  filename text,
+  buckets_start float,
+  bucket_factor float,
+  bucket_count int)
+RETURNS int[]
+AS 'floatfile', 'floatfile_to_hist_log'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_to_hist_log(
+  filename text,
+  buckets_start float,
+  bucket_factor float,
+  bucket_count int,
+  timestamps_filename text,
+  timestamps_start float,
+  timestamps_end float)
+RETURNS int[]
+AS 'floatfile', 'floatfile_with_bounds_to_hist_log'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_combine(out_filename text, op text, a_filename text, b_filename text)
+RETURNS void
+AS 'floatfile', 'floatfile_combine'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_combine(out_filename text, op text, a_filename text, b float)
+RETURNS void
+AS 'floatfile', 'floatfile_combine_scalar'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_apply(out_filename text, op text, filename text)
+RETURNS void
+AS 'floatfile', 'floatfile_apply'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_rolling(out_filename text, in_filename text, window int, func text)
+RETURNS void
+AS 'floatfile', 'floatfile_rolling'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_extend_rolling(out_filename text, in_filename text, window int, func text)
+RETURNS void
+AS 'floatfile', 'floatfile_extend_rolling'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_diff(out_filename text, in_filename text)
+RETURNS void
+AS 'floatfile', 'floatfile_diff'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_extend_diff(out_filename text, in_filename text)
+RETURNS void
+AS 'floatfile', 'floatfile_extend_diff'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_where(
+  filename text,
+  lo float,
+  hi float)
+RETURNS bigint[]
+AS 'floatfile', 'floatfile_where'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_where(
+  filename text,
+  lo float,
+  hi float,
+  timestamps_filename text,
+  timestamps_start float,
+  timestamps_end float)
+RETURNS bigint[]
+AS 'floatfile', 'floatfile_with_bounds_where'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_where_ranges(
+  filename text,
+  lo float,
+  hi float,
+  OUT starts bigint[], OUT lengths bigint[])
+AS 'floatfile', 'floatfile_where_ranges'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_where_ranges(
+  filename text,
+  lo float,
+  hi float,
+  timestamps_filename text,
+  timestamps_start float,
+  timestamps_end float,
+  OUT starts bigint[], OUT lengths bigint[])
+AS 'floatfile', 'floatfile_with_bounds_where_ranges'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+load_floatfile_at(filename text, positions bigint[])
+RETURNS float[]
+AS 'floatfile', 'load_floatfile_at'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_create_index(filename text, bins int, chunk_size int)
+RETURNS void
+AS 'floatfile', 'floatfile_create_index'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_drop_index(filename text)
+RETURNS void
+AS 'floatfile', 'floatfile_drop_index'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_events(
+  filename text,
+  threshold float,
+  min_len int,
+  OUT start_pos bigint, OUT end_pos bigint, OUT peak float)
+RETURNS SETOF record
+AS 'floatfile', 'floatfile_events'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_events(
+  filename text,
+  threshold float,
+  min_len int,
+  timestamps_filename text,
+  timestamps_start float,
+  timestamps_end float,
+  OUT start_pos bigint, OUT end_pos bigint, OUT peak float)
+RETURNS SETOF record
+AS 'floatfile', 'floatfile_with_bounds_events'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_asof_join(
+  a_timestamps_filename text,
+  a_filename text,
+  b_timestamps_filename text,
+  b_filename text,
+  t_start float,
+  t_end float,
+  tolerance float,
+  OUT timestamps float[], OUT a float[], OUT b float[])
+AS 'floatfile', 'floatfile_asof_join'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_save_asof_join(
+  a_out_filename text,
+  b_out_filename text,
+  a_timestamps_filename text,
+  a_filename text,
+  b_timestamps_filename text,
+  b_filename text,
+  t_start float,
+  t_end float,
+  tolerance float)
+RETURNS void
+AS 'floatfile', 'floatfile_save_asof_join'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_corr(
+  x_filename text, y_filename text)
+RETURNS float
+AS 'floatfile', 'floatfile_corr'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_corr(
+  x_filename text, y_filename text,
+  timestamps_filename text,
+  timestamps_start float,
+  timestamps_end float)
+RETURNS float
+AS 'floatfile', 'floatfile_with_bounds_corr'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_covar(
+  x_filename text, y_filename text,
+  OUT covar_pop float, OUT covar_samp float)
+AS 'floatfile', 'floatfile_covar'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_covar(
+  x_filename text, y_filename text,
+  timestamps_filename text,
+  timestamps_start float,
+  timestamps_end float,
+  OUT covar_pop float, OUT covar_samp float)
+AS 'floatfile', 'floatfile_with_bounds_covar'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_regr(
+  x_filename text, y_filename text,
+  OUT count bigint, OUT slope float, OUT intercept float, OUT r2 float)
+AS 'floatfile', 'floatfile_regr'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_regr(
+  x_filename text, y_filename text,
+  timestamps_filename text,
+  timestamps_start float,
+  timestamps_end float,
+  OUT count bigint, OUT slope float, OUT intercept float, OUT r2 float)
+AS 'floatfile', 'floatfile_with_bounds_regr'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_pair_stats(
+  x_filenames text[], y_filenames text[],
+  OUT count bigint, OUT corr float, OUT covar_pop float, OUT covar_samp float,
+  OUT slope float, OUT intercept float, OUT r2 float)
+RETURNS SETOF record
+AS 'floatfile', 'floatfiles_pair_stats'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_to_hists(
+  tablespace_name text,
+  filename text,
+  buckets_starts float[],
+  bucket_widths float[],
+  bucket_counts int[])
+RETURNS SETOF int[]
+AS 'floatfile', 'floatfile_in_tablespace_to_hists'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_to_hists(
+  tablespace_name text,
+  filename text,
+  buckets_starts float[],
+  bucket_widths float[],
+  bucket_counts int[],
+  timestamps_tablespace_name text,
+  timestamps_filename text,
+  timestamps_start float,
+  timestamps_end float)
+RETURNS SETOF int[]
+AS 'floatfile', 'floatfile_in_tablespace_with_bounds_to_hists'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_to_hist(
+  tablespace_name text,
+  filenames text[],
+  buckets_start float,
+  bucket_width float,
+  bucket_count int)
+RETURNS SETOF int[]
+AS 'floatfile', 'floatfiles_in_tablespace_to_hist'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_stats(
+  tablespace_name text,
+  filename text,
+  OUT count bigint, OUT sum float, OUT min float, OUT max float, OUT mean float, OUT stddev float)
+AS 'floatfile', 'floatfile_in_tablespace_stats'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_stats(
+  tablespace_name text,
+  filename text,
+  timestamps_tablespace_name text,
+  timestamps_filename text,
+  timestamps_start float,
+  timestamps_end float,
+  OUT count bigint, OUT sum float, OUT min float, OUT max float, OUT mean float, OUT stddev float)
+AS 'floatfile', 'floatfile_in_tablespace_with_bounds_stats'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_info(
+  tablespace_name text,
+  filename text,
+  OUT length bigint, OUT count bigint, OUT sum float, OUT min float, OUT max float, OUT mean float, OUT stddev float)
+AS 'floatfile', 'floatfile_in_tablespace_info'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_percentiles(tablespace_name text, filename text, fractions float[])
+RETURNS float[]
+AS 'floatfile', 'floatfile_in_tablespace_percentiles'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_percentiles(
+  tablespace_name text,
+  filename text,
+  fractions float[],
+  timestamps_tablespace_name text,
+  timestamps_filename text,
+  timestamps_start float,
+  timestamps_end float)
+RETURNS float[]
+AS 'floatfile', 'floatfile_in_tablespace_with_bounds_percentiles'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_downsample(
+  tablespace_name text,
+  filename text,
+  timestamps_tablespace_name text,
+  timestamps_filename text,
+  timestamps_start float,
+  timestamps_end float,
+  n_points int,
+  method text,
+  OUT timestamps float[], OUT vals float[])
+AS 'floatfile', 'floatfile_in_tablespace_downsample'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_time_buckets(
+  tablespace_name text,
+  filename text,
+  timestamps_tablespace_name text,
+  timestamps_filename text,
+  timestamps_start float,
+  timestamps_end float,
+  bucket_width float,
+  aggs text[])
+RETURNS SETOF float[]
+AS 'floatfile', 'floatfile_in_tablespace_time_buckets'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_bucket_agg(
+  x_tablespace_name text, x_filename text,
+  y_tablespace_name text, y_filename text,
+  x_buckets_start float,
+  x_bucket_width float,
+  x_bucket_count int,
+  agg text)
+RETURNS float[]
+AS 'floatfile', 'floatfile_in_tablespace_bucket_agg'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_bucket_agg(
+  x_tablespace_name text, x_filename text,
+  y_tablespace_name text, y_filename text,
+  x_buckets_start float,
+  x_bucket_width float,
+  x_bucket_count int,
+  agg text,
+  timestamps_tablespace_name text, timestamps_filename text,
+  timestamps_start float, timestamps_end float)
+RETURNS float[]
+AS 'floatfile', 'floatfile_in_tablespace_with_bounds_bucket_agg'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_to_histnd(
+  tablespace_name text, filenames text[],
+  buckets_starts float[],
+  bucket_widths float[],
+  bucket_counts int[])
+RETURNS int[]
+AS 'floatfile', 'floatfile_in_tablespace_to_histnd'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_to_histnd(
+  tablespace_name text, filenames text[],
+  buckets_starts float[],
+  bucket_widths float[],
+  bucket_counts int[],
+  timestamps_tablespace_name text, timestamps_filename text,
+  timestamps_start float, timestamps_end float)
+RETURNS int[]
+AS 'floatfile', 'floatfile_in_tablespace_with_bounds_to_histnd'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_to_histnd_sparse(
+  tablespace_name text, filenames text[],
+  buckets_starts float[],
+  bucket_widths float[],
+  bucket_counts int[],
+  OUT buckets int[], OUT counts bigint[])
+AS 'floatfile', 'floatfile_in_tablespace_to_histnd_sparse'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_to_histnd_sparse(
+  tablespace_name text, filenames text[],
+  buckets_starts float[],
+  bucket_widths float[],
+  bucket_counts int[],
+  timestamps_tablespace_name text, timestamps_filename text,
+  timestamps_start float, timestamps_end float,
+  OUT buckets int[], OUT counts bigint[])
+AS 'floatfile', 'floatfile_in_tablespace_with_bounds_to_histnd_sparse'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_to_hist_auto(
+  tablespace_name text, filename text,
+  bucket_count int,
+  OUT edges float[], OUT counts int[])
+AS 'floatfile', 'floatfile_in_tablespace_to_hist_auto'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_to_hist_auto(
+  tablespace_name text, filename text,
+  bucket_count int,
+  timestamps_tablespace_name text, timestamps_filename text,
+  timestamps_start float, timestamps_end float,
+  OUT edges float[], OUT counts int[])
+AS 'floatfile', 'floatfile_in_tablespace_with_bounds_to_hist_auto'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_to_hist_edges(
+  tablespace_name text, filename text,
+  edges float[])
+RETURNS int[]
+AS 'floatfile', 'floatfile_in_tablespace_to_hist_edges'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_to_hist_edges(
+  tablespace_name text, filename text,
+  edges float[],
+  timestamps_tablespace_name text, timestamps_filename text,
+  timestamps_start float, timestamps_end float)
+RETURNS int[]
+AS 'floatfile', 'floatfile_in_tablespace_with_bounds_to_hist_edges'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_to_hist_log(
+  tablespace_name text, filename text,
+  buckets_start float,
+  bucket_factor float,
+  bucket_count int)
+RETURNS int[]
+AS 'floatfile', 'floatfile_in_tablespace_to_hist_log'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_to_hist_log(
+  tablespace_name text, filename text,
+  buckets_start float,
+  bucket_factor float,
+  bucket_count int,
+  timestamps_tablespace_name text, timestamps_filename text,
+  timestamps_start float, timestamps_end float)
+RETURNS int[]
+AS 'floatfile', 'floatfile_in_tablespace_with_bounds_to_hist_log'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_combine(tablespace_name text, out_filename text, op text, a_filename text, b_filename text)
+RETURNS void
+AS 'floatfile', 'floatfile_in_tablespace_combine'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_combine(tablespace_name text, out_filename text, op text, a_filename text, b float)
+RETURNS void
+AS 'floatfile', 'floatfile_in_tablespace_combine_scalar'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_apply(tablespace_name text, out_filename text, op text, filename text)
+RETURNS void
+AS 'floatfile', 'floatfile_in_tablespace_apply'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_rolling(tablespace_name text, out_filename text, in_filename text, window int, func text)
+RETURNS void
+AS 'floatfile', 'floatfile_in_tablespace_rolling'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_extend_rolling(tablespace_name text, out_filename text, in_filename text, window int, func text)
+RETURNS void
+AS 'floatfile', 'floatfile_in_tablespace_extend_rolling'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_diff(tablespace_name text, out_filename text, in_filename text)
+RETURNS void
+AS 'floatfile', 'floatfile_in_tablespace_diff'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_extend_diff(tablespace_name text, out_filename text, in_filename text)
+RETURNS void
+AS 'floatfile', 'floatfile_in_tablespace_extend_diff'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_where(
+  tablespace_name text, filename text,
+  lo float,
+  hi float)
+RETURNS bigint[]
+AS 'floatfile', 'floatfile_in_tablespace_where'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_where(
+  tablespace_name text, filename text,
+  lo float,
+  hi float,
+  timestamps_tablespace_name text, timestamps_filename text,
+  timestamps_start float,
+  timestamps_end float)
+RETURNS bigint[]
+AS 'floatfile', 'floatfile_in_tablespace_with_bounds_where'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_where_ranges(
+  tablespace_name text, filename text,
+  lo float,
+  hi float,
+  OUT starts bigint[], OUT lengths bigint[])
+AS 'floatfile', 'floatfile_in_tablespace_where_ranges'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_where_ranges(
+  tablespace_name text, filename text,
+  lo float,
+  hi float,
+  timestamps_tablespace_name text, timestamps_filename text,
+  timestamps_start float,
+  timestamps_end float,
+  OUT starts bigint[], OUT lengths bigint[])
+AS 'floatfile', 'floatfile_in_tablespace_with_bounds_where_ranges'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+load_floatfile_at(tablespace_name text, filename text, positions bigint[])
+RETURNS float[]
+AS 'floatfile', 'load_floatfile_at_from_tablespace'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_create_index(tablespace_name text, filename text, bins int, chunk_size int)
+RETURNS void
+AS 'floatfile', 'floatfile_in_tablespace_create_index'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_drop_index(tablespace_name text, filename text)
+RETURNS void
+AS 'floatfile', 'floatfile_in_tablespace_drop_index'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_events(
+  tablespace_name text, filename text,
+  threshold float,
+  min_len int,
+  OUT start_pos bigint, OUT end_pos bigint, OUT peak float)
+RETURNS SETOF record
+AS 'floatfile', 'floatfile_in_tablespace_events'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_events(
+  tablespace_name text, filename text,
+  threshold float,
+  min_len int,
+  timestamps_tablespace_name text, timestamps_filename text,
+  timestamps_start float,
+  timestamps_end float,
+  OUT start_pos bigint, OUT end_pos bigint, OUT peak float)
+RETURNS SETOF record
+AS 'floatfile', 'floatfile_in_tablespace_with_bounds_events'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_asof_join(
+  tablespace_name text,
+  a_timestamps_filename text,
+  a_filename text,
+  b_timestamps_filename text,
+  b_filename text,
+  t_start float,
+  t_end float,
+  tolerance float,
+  OUT timestamps float[], OUT a float[], OUT b float[])
+AS 'floatfile', 'floatfile_in_tablespace_asof_join'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_save_asof_join(
+  tablespace_name text,
+  a_out_filename text,
+  b_out_filename text,
+  a_timestamps_filename text,
+  a_filename text,
+  b_timestamps_filename text,
+  b_filename text,
+  t_start float,
+  t_end float,
+  tolerance float)
+RETURNS void
+AS 'floatfile', 'floatfile_in_tablespace_save_asof_join'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_corr(
+  x_tablespace_name text, x_filename text,
+  y_tablespace_name text, y_filename text)
+RETURNS float
+AS 'floatfile', 'floatfile_in_tablespace_corr'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_corr(
+  x_tablespace_name text, x_filename text,
+  y_tablespace_name text, y_filename text,
+  timestamps_tablespace_name text, timestamps_filename text,
+  timestamps_start float, timestamps_end float)
+RETURNS float
+AS 'floatfile', 'floatfile_in_tablespace_with_bounds_corr'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_covar(
+  x_tablespace_name text, x_filename text,
+  y_tablespace_name text, y_filename text,
+  OUT covar_pop float, OUT covar_samp float)
+AS 'floatfile', 'floatfile_in_tablespace_covar'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_covar(
+  x_tablespace_name text, x_filename text,
+  y_tablespace_name text, y_filename text,
+  timestamps_tablespace_name text, timestamps_filename text,
+  timestamps_start float, timestamps_end float,
+  OUT covar_pop float, OUT covar_samp float)
+AS 'floatfile', 'floatfile_in_tablespace_with_bounds_covar'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_regr(
+  x_tablespace_name text, x_filename text,
+  y_tablespace_name text, y_filename text,
+  OUT count bigint, OUT slope float, OUT intercept float, OUT r2 float)
+AS 'floatfile', 'floatfile_in_tablespace_regr'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_regr(
+  x_tablespace_name text, x_filename text,
+  y_tablespace_name text, y_filename text,
+  timestamps_tablespace_name text, timestamps_filename text,
+  timestamps_start float, timestamps_end float,
+  OUT count bigint, OUT slope float, OUT intercept float, OUT r2 float)
+AS 'floatfile', 'floatfile_in_tablespace_with_bounds_regr'
+LANGUAGE c VOLATILE;
+
+CREATE OR REPLACE FUNCTION
+floatfile_pair_stats(
+  tablespace_name text,
+  x_filenames text[], y_filenames text[],
+  OUT count bigint, OUT corr float, OUT covar_pop float, OUT covar_samp float,
+  OUT slope float, OUT intercept float, OUT r2 float)
+RETURNS SETOF record
+AS 'floatfile', 'floatfiles_in_tablespace_pair_stats'
+LANGUAGE c VOLATILE;
@@ -2,17 +2,21 @@
 #define _FILE_OFFSET_BITS 64
 
 #include <errno.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/uio.h>
 #include <unistd.h>
 #include <string.h>
+#include <math.h>
 
 #include <postgres.h>
 #include <fmgr.h>
+#include <funcapi.h>
 #include <pg_config.h>
 #include <miscadmin.h>
+#include <access/htup_details.h>
 #include <utils/array.h>
 #include <utils/guc.h>
 #include <utils/acl.h>
@@ -34,6 +38,8 @@ PG_MODULE_MAGIC;
 #define FLOATFILE_PREFIX_LEN sizeof FLOATFILE_PREFIX
 #define FLOATFILE_NULLS_SUFFIX  'n'
 #define FLOATFILE_FLOATS_SUFFIX 'v'
+#define FLOATFILE_STATS_SUFFIX  's'   // the rollups
+#define FLOATFILE_INDEX_SUFFIX  'i'   // the value index
 
 #ifndef FLOATFILE_LOCK_PREFIX
 #define FLOATFILE_LOCK_PREFIX 0xF107F11E
@@ -43,6 +49,7 @@ PG_MODULE_MAGIC;
 #define MINIMUM_SANE_DATA_DIR 3
 #endif
 
+#include "kernels.h"
 #include "histogram.h"
 
 // Datums can be eight or four bytes wide, depending on the machine.
@@ -65,6 +72,115 @@ PG_MODULE_MAGIC;
 
 
 
+// How the histogram functions should treat the OS page cache.
+// A huge scan over old data can push out the hot recent data
+// everyone else is using, so above a threshold we drop pages behind us:
+enum floatfile_scan_mode {
+  FLOATFILE_SCAN_AUTO,
+  FLOATFILE_SCAN_CACHED,
+  FLOATFILE_SCAN_DROP_BEHIND
+};
+
+static const struct config_enum_entry floatfile_scan_mode_options[] = {
+  {"auto",        FLOATFILE_SCAN_AUTO,        false},
+  {"cached",      FLOATFILE_SCAN_CACHED,      false},
+  {"drop_behind", FLOATFILE_SCAN_DROP_BEHIND, false},
+  {NULL, 0, false}
+};
+
+static int floatfile_scan_mode = FLOATFILE_SCAN_AUTO;
+static int floatfile_drop_behind_threshold = 1024;   // in MB
+static int floatfile_scan_threads = 0;
+static int floatfile_exact_percentile_limit = 10000000;
+static bool floatfile_rollups = true;
+static int floatfile_index_bins = 0;
+static int floatfile_index_chunk_size = 1024;
+
+void _PG_init(void);
+
+void
+_PG_init(void)
+{
+  DefineCustomEnumVariable("floatfile.scan_mode",
+                           "How floatfile scans use the OS page cache.",
+                           "auto drops pages behind the scan only for files bigger than floatfile.drop_behind_threshold, "
+                           "cached always keeps them, and drop_behind never does.",
+                           &floatfile_scan_mode,
+                           FLOATFILE_SCAN_AUTO,
+                           floatfile_scan_mode_options,
+                           PGC_USERSET,
+                           0,
+                           NULL, NULL, NULL);
+
+  DefineCustomIntVariable("floatfile.drop_behind_threshold",
+                          "Size of a floatfile above which auto scans drop pages behind them.",
+                          NULL,
+                          &floatfile_drop_behind_threshold,
+                          1024,
+                          0, INT_MAX,
+                          PGC_USERSET,
+                          GUC_UNIT_MB,
+                          NULL, NULL, NULL);
+
+  DefineCustomIntVariable("floatfile.scan_threads",
+                          "Maximum number of threads a single histogram may use.",
+                          "The threads never call into Postgres. 0 or 1 means we only use the backend's own thread.",
+                          &floatfile_scan_threads,
+                          0,
+                          0, 1024,
+                          PGC_USERSET,
+                          0,
+                          NULL, NULL, NULL);
+
+  DefineCustomIntVariable("floatfile.exact_percentile_limit",
+                          "Most values floatfile_percentiles will load to compute exact percentiles.",
+                          "Longer ranges are estimated in one pass with a t-digest. 0 means always estimate.",
+                          &floatfile_exact_percentile_limit,
+                          10000000,
+                          0, INT_MAX,
+                          PGC_USERSET,
+                          0,
+                          NULL, NULL, NULL);
+
+  DefineCustomBoolVariable("floatfile.rollups",
+                           "Whether new floatfiles keep rollups.",
+                           "Rollups summarize a floatfile at several resolutions, "
+                           "so stats, histograms, and downsampling can skip reading much of it.",
+                           &floatfile_rollups,
+                           true,
+                           PGC_USERSET,
+                           0,
+                           NULL, NULL, NULL);
+
+  DefineCustomIntVariable("floatfile.index_bins",
+                          "How many bins the value index of each new floatfile has.",
+                          "0 means new floatfiles get no value index. You can add one later with floatfile_create_index.",
+                          &floatfile_index_bins,
+                          0,
+                          0, VALUE_INDEX_MAX_BINS,
+                          PGC_USERSET,
+                          0,
+                          NULL, NULL, NULL);
+
+  DefineCustomIntVariable("floatfile.index_chunk_size",
+                          "How many values share an entry in the value index of each new floatfile.",
+                          NULL,
+                          &floatfile_index_chunk_size,
+                          1024,
+                          1, 1 << 30,
+                          PGC_USERSET,
+                          0,
+                          NULL, NULL, NULL);
+
+#if PG_VERSION_NUM >= 150000
+  MarkGUCPrefixReserved("floatfile");
+#else
+  EmitWarningsOnPlaceholders("floatfile");
+#endif
+}
+
+
+
 static void floatfile_root_path(const char *tablespace, char *path, int path_len) {
   int chars_wrote;
   const char *root_directory;
@@ -348,6 +464,145 @@ static int mkdirs_for_floatfile(const char *root, const char *path) {
   return close(rootfd);
 }
 
+/**
+ * close_floatfile_rollups - Closes whichever of `rf`'s files are open
+ * and resets it to NO_ROLLUPS.
+ *
+ * Returns -1 if any of them wouldn't close.
+ */
+static int close_floatfile_rollups(rollup_files *rf) {
+  int result = 0;
+
+  if (rf->fd != -1 && close(rf->fd)) result = -1;
+  if (rf->index_fd != -1 && close(rf->index_fd)) result = -1;
+  *rf = (rollup_files)NO_ROLLUPS;
+  return result;
+}
+
+/**
+ * open_floatfile_rollups_for_writing - Opens the rollups of a floatfile that has `start_pos` values
+ * so we can append to them.
+ *
+ * `path` can be any of the floatfile's paths (`pathlen` long).
+ *
+ * When `start_pos` is 0 we create the rollups (if floatfile.rollups is on),
+ * but otherwise if there are none (e.g. the floatfile was saved before we kept them)
+ * we leave it that way.
+ * Either way if there are none to keep up to date `rf->fd` is still -1.
+ * We open the value index the same way (creating it if floatfile.index_bins isn't 0),
+ * but we can't fill it in until the new values are written.
+ *
+ * We read the rollups' header just once here (see start_rollups),
+ * so the caller can append to them as many times as it likes.
+ *
+ * Returns 0 on success, 1 if the rollups don't match the data, or -1 on failure.
+ * Either way pass `rf` to finish_floatfile_index and finish_floatfile_rollups afterwards.
+ */
+static int open_floatfile_rollups_for_writing(char *path, int pathlen, ssize_t start_pos, rollup_files *rf) {
+  int flags = start_pos == 0 ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR;
+  char *errstr = NULL;
+
+  if (start_pos > 0 || floatfile_index_bins > 0) {
+    path[pathlen - 1] = FLOATFILE_INDEX_SUFFIX;
+    // If we can't open it, update_value_index will catch it up next time:
+    rf->index_fd = open(path, flags, S_IRUSR | S_IWUSR);
+  }
+
+  if (start_pos == 0 && !floatfile_rollups) return 0;
+
+  path[pathlen - 1] = FLOATFILE_STATS_SUFFIX;
+  rf->fd = open(path, flags, S_IRUSR | S_IWUSR);
+  if (rf->fd == -1) return errno == ENOENT ? 0 : -1;
+  return start_rollups(rf, start_pos, &errstr);
+}
+
+/**
+ * finish_floatfile_rollups - Syncs and closes the rollups from open_floatfile_rollups_for_writing,
+ * writing their header last (see finish_rollups).
+ *
+ * `result` is nonzero if anything went wrong writing them.
+ * The rollups are just a cache, so if anything goes wrong we remove them
+ * rather than fail a write that has already happened.
+ * Readers fall back to scanning the data either way.
+ */
+static void finish_floatfile_rollups(char *path, int pathlen, rollup_files *rf, int result) {
+  char *errstr = NULL;
+
+  if (result == 0 && rf->fd == -1) return;   // there are none
+
+  if (result == 0) result = finish_rollups(rf, &errstr);
+  if (result == 0 && fsync(rf->fd)) result = -1;
+  if (close_floatfile_rollups(rf)) result = -1;
+
+  if (result != 0) {
+    path[pathlen - 1] = FLOATFILE_STATS_SUFFIX;
+    unlink(path);
+  }
+}
+
+/**
+ * finish_floatfile_index - Brings the value index from open_floatfile_rollups_for_writing (if any)
+ * up to date with the floatfile at `path` (`pathlen` long), then syncs and closes it.
+ *
+ * A new index gets its bins from floatfile.index_bins and what we just wrote.
+ * If not `ok` the floatfile is back how it was, so we leave the index alone,
+ * unless it's new and we remove it.
+ * Like the rollups, if anything goes wrong we remove the index rather than fail.
+ */
+static void finish_floatfile_index(char *path, int pathlen, rollup_files *rf, bool ok) {
+  // We just wrote the new values, so they should still be in the page cache:
+  scan_options opts = { .drop_behind = false, .threads = floatfile_scan_threads };
+  struct stat fileinfo;
+  int x_fd, x_nulls_fd, result = -1;
+  bool fresh;
+  char *errstr = NULL;
+
+  if (rf->index_fd == -1) return;
+
+  fresh = !fstat(rf->index_fd, &fileinfo) && fileinfo.st_size == 0;
+  if (ok) {
+    path[pathlen - 1] = FLOATFILE_NULLS_SUFFIX;
+    x_nulls_fd = open(path, O_RDONLY);
+    path[pathlen - 1] = FLOATFILE_FLOATS_SUFFIX;
+    x_fd = open(path, O_RDONLY);
+    if (x_fd != -1 && x_nulls_fd != -1) {
+      result = fresh ? build_value_index(rf->index_fd, x_fd, x_nulls_fd, floatfile_index_bins, floatfile_index_chunk_size,
+                                         floatfile_exact_percentile_limit, &opts, &errstr)
+                     : update_value_index(rf->index_fd, x_fd, x_nulls_fd, &opts, &errstr);
+    }
+    if (x_fd != -1) close(x_fd);
+    if (x_nulls_fd != -1) close(x_nulls_fd);
+  } else if (!fresh) {
+    result = 0;
+  }
+
+  if (result == 0 && fsync(rf->index_fd)) result = -1;
+  if (close(rf->index_fd)) result = -1;
+  rf->index_fd = -1;
+
+  if (result != 0) {
+    path[pathlen - 1] = FLOATFILE_INDEX_SUFFIX;
+    unlink(path);
+  }
+}
+
+/**
+ * extend_floatfile_rollups - Brings a floatfile's rollups (and value index) up to date
+ * after we appended `array_len` values to a floatfile that had `start_pos` values.
+ *
+ * See open_floatfile_rollups_for_writing and finish_floatfile_rollups.
+ */
+static void extend_floatfile_rollups(char *path, int pathlen, ssize_t start_pos, float8* vals, bool* nulls, int array_len) {
+  rollup_files rf = NO_ROLLUPS;
+  int result;
+  char *errstr = NULL;
+
+  result = open_floatfile_rollups_for_writing(path, pathlen, start_pos, &rf);
+  if (result == 0 && rf.fd != -1) result = append_rollups(&rf, start_pos, vals, nulls, array_len, &errstr);
+  finish_floatfile_index(path, pathlen, &rf, true);
+  finish_floatfile_rollups(path, pathlen, &rf, result);
+}
+
 /**
  * save_file_from_floats - Writes the null flags and float vals to their (new) files.
  *
@@ -397,6 +652,11 @@ static int save_file_from_floats(const char *tablespace, const char *filename, f
   if (fsync(fd)) return -1;
   if (close(fd)) return -1;
 
+
+  // Save the rollups:
+
+  extend_floatfile_rollups(path, pathlen, 0, vals, nulls, array_len);
+
   return EXIT_SUCCESS;
 
 bail:
@@ -422,6 +682,8 @@ static int extend_file_from_floats(const char *tablespace, const char *filename,
   int pathlen;
   int fd;
   ssize_t bytes_written;
+  ssize_t start_pos;
+  struct stat fileinfo;
   int err;
 
   validate_target_filename(filename);
@@ -438,6 +700,10 @@ static int extend_file_from_floats(const char *tablespace, const char *filename,
   fd = open(path, O_WRONLY | O_APPEND | O_CREAT, S_IRUSR | S_IWUSR);
   if (fd == -1) return -1;
 
+  // Remember where we started so we can update the rollups:
+  if (fstat(fd, &fileinfo)) goto bail;
+  start_pos = fileinfo.st_size / sizeof(bool);
+
   bytes_written = write(fd, nulls, array_len * sizeof(bool));
   if (bytes_written != array_len * sizeof(bool)) goto bail;
 
@@ -457,6 +723,11 @@ static int extend_file_from_floats(const char *tablespace, const char *filename,
   if (fsync(fd)) return -1;
   if (close(fd)) return -1;
 
+
+  // Save the rollups:
+
+  extend_floatfile_rollups(path, pathlen, start_pos, vals, nulls, array_len);
+
   return EXIT_SUCCESS;
 
 bail:
@@ -885,6 +1156,12 @@ static void _drop_floatfile(const char *tablespace, const char *filename) {
     path[pathlen - 1] = FLOATFILE_FLOATS_SUFFIX;
     if (unlink(path)) ereport(ERROR, (errmsg("Failed to delete floatfile %s: %m", filename)));
 
+    // Files saved before 1.4.0 (or with floatfile.rollups off) have no rollups:
+    path[pathlen - 1] = FLOATFILE_STATS_SUFFIX;
+    if (unlink(path) && errno != ENOENT) ereport(ERROR, (errmsg("Failed to delete floatfile %s: %m", filename)));
+    path[pathlen - 1] = FLOATFILE_INDEX_SUFFIX;
+    if (unlink(path) && errno != ENOENT) ereport(ERROR, (errmsg("Failed to delete floatfile %s: %m", filename)));
+
     // If that was the last file, remove the floatfile dir too
     // so users can drop the tablespace:
 
@@ -984,6 +1261,55 @@ static int open_floatfile_for_reading(char *tablespace, char *filename, int *val
   return 0;
 }
 
+/**
+ * open_floatfile_rollups_for_reading - Opens a floatfile's rollups and value index,
+ * or leaves them -1 (as in NO_ROLLUPS) if it doesn't have them.
+ *
+ * We don't need to tell the caller why,
+ * since they should just scan the data instead.
+ */
+static void open_floatfile_rollups_for_reading(char *tablespace, char *filename, rollup_files *rf) {
+  char path[FLOATFILE_MAX_PATH + 1];
+  int pathlen;
+
+  validate_target_filename(filename);
+  pathlen = floatfile_filename_to_full_path(tablespace, filename, path, FLOATFILE_MAX_PATH + 1);
+
+  path[pathlen - 1] = FLOATFILE_STATS_SUFFIX;
+  rf->fd = open(path, O_RDONLY);
+
+  path[pathlen - 1] = FLOATFILE_INDEX_SUFFIX;
+  rf->index_fd = open(path, O_RDONLY);
+}
+
+/**
+ * floatfile_scan_options - Decides how to scan a floatfile, based on our GUCs.
+ *
+ * `vals_fd` should be the vals file driving the scan,
+ * so that in auto mode we can decide based on its size.
+ */
+static scan_options floatfile_scan_options(int vals_fd) {
+  scan_options opts;
+  struct stat fileinfo;
+
+  opts.threads = floatfile_scan_threads;
+
+  switch (floatfile_scan_mode) {
+    case FLOATFILE_SCAN_CACHED:
+      opts.drop_behind = false;
+      break;
+    case FLOATFILE_SCAN_DROP_BEHIND:
+      opts.drop_behind = true;
+      break;
+    default:
+      opts.drop_behind = !fstat(vals_fd, &fileinfo) &&
+                         fileinfo.st_size >= (off_t)floatfile_drop_behind_threshold * 1024 * 1024;
+      break;
+  }
+
+  return opts;
+}
+
 Datum floatfile_to_hist(PG_FUNCTION_ARGS);
 PG_FUNCTION_INFO_V1(floatfile_to_hist);
 /**
@@ -996,6 +1322,7 @@ floatfile_to_hist(PG_FUNCTION_ARGS)
   char *xs_filename;
   int32 xs_filename_hash;
   int x_fd = 0, x_nulls_fd = 0;
+  rollup_files x_rollups = NO_ROLLUPS;
   float8 x_min, x_width;
   int32 x_count;
   // Make sure `counts` has the same width as Datum
@@ -1006,6 +1333,7 @@ floatfile_to_hist(PG_FUNCTION_ARGS)
   int32 *counts = NULL;
 #endif
   char *errstr = NULL;
+  scan_options opts;
   Datum *histContent;
   int arrayLength;
   ArrayType *histVals;
@@ -1033,18 +1361,21 @@ floatfile_to_hist(PG_FUNCTION_ARGS)
     errstr = strerror(errno);
     goto bail;
   }
+  open_floatfile_rollups_for_reading(NULL, xs_filename, &x_rollups);
 
   arrayLength = x_count;
   counts = palloc0(sizeof(counts[0]) * arrayLength);
   histNulls = palloc0(sizeof(bool) * arrayLength);
 
 
-  build_histogram(x_fd, x_nulls_fd, x_min, x_width, x_count,
-                  counts, &errstr);
+  opts = floatfile_scan_options(x_fd);
+  build_histogram_from_rollups(x_fd, x_nulls_fd, &x_rollups, x_min, x_width, x_count,
+                               counts, 0, -1, &opts, &errstr);
 
 bail:
   if (x_fd       && close(x_fd))       errstr = "Can't close x_fd";
   if (x_nulls_fd && close(x_nulls_fd)) errstr = "Can't close x_nulls_fd";
+  if (close_floatfile_rollups(&x_rollups)) errstr = "Can't close x_rollups";
   DirectFunctionCall2(pg_advisory_unlock_shared_int4, FLOATFILE_LOCK_PREFIX, xs_filename_hash);
   if (errstr) elog(ERROR, "%s", errstr);
 
@@ -1070,6 +1401,7 @@ floatfile_in_tablespace_to_hist(PG_FUNCTION_ARGS)
   char *xs_filename;
   int32 xs_filename_hash;
   int x_fd = 0, x_nulls_fd = 0;
+  rollup_files x_rollups = NO_ROLLUPS;
   float8 x_min, x_width;
   int32 x_count;
   // Make sure `counts` has the same width as Datum
@@ -1080,6 +1412,7 @@ floatfile_in_tablespace_to_hist(PG_FUNCTION_ARGS)
   int32 *counts = NULL;
 #endif
   char *errstr = NULL;
+  scan_options opts;
   Datum *histContent;
   int arrayLength;
   ArrayType *histVals;
@@ -1109,18 +1442,21 @@ floatfile_in_tablespace_to_hist(PG_FUNCTION_ARGS)
     errstr = strerror(errno);
     goto bail;
   }
+  open_floatfile_rollups_for_reading(xs_tablespace, xs_filename, &x_rollups);
 
   arrayLength = x_count;
   counts = palloc0(sizeof(counts[0]) * arrayLength);
   histNulls = palloc0(sizeof(bool) * arrayLength);
 
 
-  build_histogram(x_fd, x_nulls_fd, x_min, x_width, x_count,
-                  counts, &errstr);
+  opts = floatfile_scan_options(x_fd);
+  build_histogram_from_rollups(x_fd, x_nulls_fd, &x_rollups, x_min, x_width, x_count,
+                               counts, 0, -1, &opts, &errstr);
 
 bail:
   if (x_fd       && close(x_fd))       errstr = "Can't close x_fd";
   if (x_nulls_fd && close(x_nulls_fd)) errstr = "Can't close x_nulls_fd";
+  if (close_floatfile_rollups(&x_rollups)) errstr = "Can't close x_rollups";
   DirectFunctionCall2(pg_advisory_unlock_shared_int4, FLOATFILE_LOCK_PREFIX, xs_filename_hash);
   if (errstr) elog(ERROR, "%s", errstr);
 
@@ -1146,6 +1482,7 @@ floatfile_with_bounds_to_hist(PG_FUNCTION_ARGS)
   char *ts_filename;
   int32 ts_filename_hash;
   int x_fd = 0, x_nulls_fd = 0;
+  rollup_files x_rollups = NO_ROLLUPS;
   int t_fd = 0, t_nulls_fd = 0;
   float8 x_min, x_width;
   int32 x_count;
@@ -1159,6 +1496,7 @@ floatfile_with_bounds_to_hist(PG_FUNCTION_ARGS)
   int32 *counts = NULL;
 #endif
   char *errstr = NULL;
+  scan_options opts;
   Datum *histContent;
   int arrayLength;
   ArrayType *histVals;
@@ -1198,24 +1536,28 @@ floatfile_with_bounds_to_hist(PG_FUNCTION_ARGS)
     errstr = strerror(errno);
     goto bail;
   }
+  open_floatfile_rollups_for_reading(NULL, xs_filename, &x_rollups);
 
   arrayLength = x_count;
   counts = palloc0(sizeof(counts[0]) * arrayLength);
   histNulls = palloc0(sizeof(bool) * arrayLength);
 
-  find_bounds_start_end(t_fd, t_nulls_fd, t_min, t_max, &min_pos, &max_pos, &errstr);
+  opts = floatfile_scan_options(t_fd);
+  find_bounds_start_end(t_fd, t_nulls_fd, t_min, t_max, &min_pos, &max_pos, &opts, &errstr);
   if (errstr) goto bail;
   if (min_pos == -1 || max_pos == -1) {
     // The histogram is empty so just return, but with no error.
     goto bail;
   }
 
-  build_histogram_with_bounds(x_fd, x_nulls_fd, x_min, x_width, x_count,
-                  counts, min_pos, max_pos, &errstr);
+  opts = floatfile_scan_options(x_fd);
+  build_histogram_from_rollups(x_fd, x_nulls_fd, &x_rollups, x_min, x_width, x_count,
+                               counts, min_pos, max_pos + 1, &opts, &errstr);
 
 bail:
   if (x_fd       && close(x_fd))       errstr = "Can't close x_fd";
   if (x_nulls_fd && close(x_nulls_fd)) errstr = "Can't close x_nulls_fd";
+  if (close_floatfile_rollups(&x_rollups)) errstr = "Can't close x_rollups";
   DirectFunctionCall2(pg_advisory_unlock_shared_int4, FLOATFILE_LOCK_PREFIX, xs_filename_hash);
   if (t_fd       && close(t_fd))       errstr = "Can't close t_fd";
   if (t_nulls_fd && close(t_nulls_fd)) errstr = "Can't close t_nulls_fd";
@@ -1247,6 +1589,7 @@ floatfile_in_tablespace_with_bounds_to_hist(PG_FUNCTION_ARGS)
   char *ts_filename;
   int32 ts_filename_hash;
   int x_fd = 0, x_nulls_fd = 0;
+  rollup_files x_rollups = NO_ROLLUPS;
   int t_fd = 0, t_nulls_fd = 0;
   float8 x_min, x_width;
   int32 x_count;
@@ -1260,6 +1603,7 @@ floatfile_in_tablespace_with_bounds_to_hist(PG_FUNCTION_ARGS)
   int32 *counts = NULL;
 #endif
   char *errstr = NULL;
+  scan_options opts;
   Datum *histContent;
   int arrayLength;
   ArrayType *histVals;
@@ -1304,24 +1648,28 @@ floatfile_in_tablespace_with_bounds_to_hist(PG_FUNCTION_ARGS)
     errstr = strerror(errno);
     goto bail;
   }
+  open_floatfile_rollups_for_reading(xs_tablespace, xs_filename, &x_rollups);
 
   arrayLength = x_count;
   counts = palloc0(sizeof(counts[0]) * arrayLength);
   histNulls = palloc0(sizeof(bool) * arrayLength);
 
-  find_bounds_start_end(t_fd, t_nulls_fd, t_min, t_max, &min_pos, &max_pos, &errstr);
+  opts = floatfile_scan_options(t_fd);
+  find_bounds_start_end(t_fd, t_nulls_fd, t_min, t_max, &min_pos, &max_pos, &opts, &errstr);
   if (errstr) goto bail;
   if (min_pos == -1 || max_pos == -1) {
     // The histogram is empty so just return, but with no error.
     goto bail;
   }
 
-  build_histogram_with_bounds(x_fd, x_nulls_fd, x_min, x_width, x_count,
-                  counts, min_pos, max_pos, &errstr);
+  opts = floatfile_scan_options(x_fd);
+  build_histogram_from_rollups(x_fd, x_nulls_fd, &x_rollups, x_min, x_width, x_count,
+                               counts, min_pos, max_pos + 1, &opts, &errstr);
 
 bail:
   if (x_fd       && close(x_fd))       errstr = "Can't close x_fd";
   if (x_nulls_fd && close(x_nulls_fd)) errstr = "Can't close x_nulls_fd";
+  if (close_floatfile_rollups(&x_rollups)) errstr = "Can't close x_rollups";
   DirectFunctionCall2(pg_advisory_unlock_shared_int4, FLOATFILE_LOCK_PREFIX, xs_filename_hash);
   if (t_fd       && close(t_fd))       errstr = "Can't close t_fd";
   if (t_nulls_fd && close(t_nulls_fd)) errstr = "Can't close t_nulls_fd";
@@ -1360,6 +1708,7 @@ floatfile_to_hist2d(PG_FUNCTION_ARGS)
   int32 *counts = NULL;
 #endif
   char *errstr = NULL;
+  scan_options opts;
   Datum *histContent;
   int arrayLength;
   ArrayType *histVals;
@@ -1405,9 +1754,10 @@ floatfile_to_hist2d(PG_FUNCTION_ARGS)
   histNulls = palloc0(sizeof(bool) * arrayLength);
 
 
+  opts = floatfile_scan_options(x_fd);
   build_histogram_2d(x_fd, x_nulls_fd, x_min, x_width, x_count,
                      y_fd, y_nulls_fd, y_min, y_width, y_count,
-                     counts, &errstr);
+                     counts, &opts, &errstr);
 
 bail:
   if (x_fd       && close(x_fd))       errstr = "Can't close x_fd";
@@ -1454,6 +1804,7 @@ floatfile_in_tablespace_to_hist2d(PG_FUNCTION_ARGS)
   int32 *counts = NULL;
 #endif
   char *errstr = NULL;
+  scan_options opts;
   Datum *histContent;
   int arrayLength;
   ArrayType *histVals;
@@ -1502,9 +1853,10 @@ floatfile_in_tablespace_to_hist2d(PG_FUNCTION_ARGS)
   histNulls = palloc0(sizeof(bool) * arrayLength);
 
 
+  opts = floatfile_scan_options(x_fd);
   build_histogram_2d(x_fd, x_nulls_fd, x_min, x_width, x_count,
                      y_fd, y_nulls_fd, y_min, y_width, y_count,
-                     counts, &errstr);
+                     counts, &opts, &errstr);
 
 bail:
   if (x_fd       && close(x_fd))       errstr = "Can't close x_fd";
@@ -1554,6 +1906,7 @@ floatfile_with_bounds_to_hist2d(PG_FUNCTION_ARGS)
   int32 *counts = NULL;
 #endif
   char *errstr = NULL;
+  scan_options opts;
   Datum *histContent;
   int arrayLength;
   ArrayType *histVals;
@@ -1609,16 +1962,18 @@ floatfile_with_bounds_to_hist2d(PG_FUNCTION_ARGS)
   counts = palloc0(sizeof(counts[0]) * arrayLength);
   histNulls = palloc0(sizeof(bool) * arrayLength);
 
-  find_bounds_start_end(t_fd, t_nulls_fd, t_min, t_max, &min_pos, &max_pos, &errstr);
+  opts = floatfile_scan_options(t_fd);
+  find_bounds_start_end(t_fd, t_nulls_fd, t_min, t_max, &min_pos, &max_pos, &opts, &errstr);
   if (errstr) goto bail;
   if (min_pos == -1 || max_pos == -1) {
     // The histogram is empty so just return, but with no error.
     goto bail;
   }
 
+  opts = floatfile_scan_options(x_fd);
   build_histogram_2d_with_bounds(x_fd, x_nulls_fd, x_min, x_width, x_count,
                      y_fd, y_nulls_fd, y_min, y_width, y_count,
-                     counts, min_pos, max_pos, &errstr);
+                     counts, min_pos, max_pos, &opts, &errstr);
 
 bail:
   if (x_fd       && close(x_fd))       errstr = "Can't close x_fd";
@@ -1674,6 +2029,7 @@ floatfile_in_tablespace_with_bounds_to_hist2d(PG_FUNCTION_ARGS)
   int32 *counts = NULL;
 #endif
   char *errstr = NULL;
+  scan_options opts;
   Datum *histContent;
   int arrayLength;
   ArrayType *histVals;
@@ -1735,16 +2091,18 @@ floatfile_in_tablespace_with_bounds_to_hist2d(PG_FUNCTION_ARGS)
   counts = palloc0(sizeof(counts[0]) * arrayLength);
   histNulls = palloc0(sizeof(bool) * arrayLength);
 
-  find_bounds_start_end(t_fd, t_nulls_fd, t_min, t_max, &min_pos, &max_pos, &errstr);
+  opts = floatfile_scan_options(t_fd);
+  find_bounds_start_end(t_fd, t_nulls_fd, t_min, t_max, &min_pos, &max_pos, &opts, &errstr);
   if (errstr) goto bail;
   if (min_pos == -1 || max_pos == -1) {
     // The histogram is empty so just return, but with no error.
     goto bail;
   }
 
+  opts = floatfile_scan_options(x_fd);
   build_histogram_2d_with_bounds(x_fd, x_nulls_fd, x_min, x_width, x_count,
                      y_fd, y_nulls_fd, y_min, y_width, y_count,
-                     counts, min_pos, max_pos, &errstr);
+                     counts, min_pos, max_pos, &opts, &errstr);
 
 bail:
   if (x_fd       && close(x_fd))       errstr = "Can't close x_fd";
@@ -1769,3 +2127,4167 @@ bail:
   PG_RETURN_ARRAYTYPE_P(histVals);
 }
 
+
+/**
+ * array_arg_datums - Deconstructs a one-dimensional array argument
+ * whose elements are all `elemType` and not NULL.
+ */
+static Datum *array_arg_datums(ArrayType *arr, Oid elemType, const char *argname, int *arrlen) {
+  Datum *datums;
+  bool *nulls;
+  int16 typeWidth;
+  bool typeByValue;
+  char typeAlignmentCode;
+  int i;
+
+  if (ARR_NDIM(arr) > 1) {
+    ereport(ERROR, (errmsg("%s must be a one-dimensional array", argname)));
+  }
+  if (ARR_ELEMTYPE(arr) != elemType) {
+    ereport(ERROR, (errmsg("%s has the wrong element type", argname)));
+  }
+  get_typlenbyvalalign(elemType, &typeWidth, &typeByValue, &typeAlignmentCode);
+  deconstruct_array(arr, elemType, typeWidth, typeByValue, typeAlignmentCode, &datums, &nulls, arrlen);
+  for (i = 0; i < *arrlen; i++) {
+    if (nulls[i]) ereport(ERROR, (errmsg("%s can't contain NULLs", argname)));
+  }
+  return datums;
+}
+
+/**
+ * _floatfile_to_hists - Builds one histogram per bucket spec
+ * (`starts[i]`, `widths[i]`, `counts[i]`) from a single scan of the floatfile.
+ *
+ * If `ts_filename` is not NULL we only count the values
+ * whose timestamps are between `t_min` and `t_max`, like floatfile_with_bounds_to_hist.
+ *
+ * Returns an int[] Datum per spec and sets `*nhists`.
+ */
+static Datum *_floatfile_to_hists(char *xs_tablespace, char *xs_filename,
+                                  ArrayType *starts, ArrayType *widths, ArrayType *counts,
+                                  char *ts_tablespace, char *ts_filename, float8 t_min, float8 t_max,
+                                  int *nhists) {
+  Datum *start_datums, *width_datums, *count_datums;
+  int nstarts, nwidths, ncounts;
+  int32 xs_filename_hash, ts_filename_hash = 0;
+  int x_fd = 0, x_nulls_fd = 0;
+  rollup_files x_rollups = NO_ROLLUPS;
+  int t_fd = 0, t_nulls_fd = 0;
+  ssize_t min_pos, max_pos;
+  hist_spec *specs;
+  char *errstr = NULL;
+  scan_options opts;
+  Datum *hists;
+  int16 histTypeWidth;
+  bool histTypeByValue;
+  char histTypeAlignmentCode;
+  int dims[1];
+  int lbs[1];     // Lower Bounds of each dimension
+  int i;
+
+  start_datums = array_arg_datums(starts, FLOAT8OID, "buckets_starts", &nstarts);
+  width_datums = array_arg_datums(widths, FLOAT8OID, "bucket_widths", &nwidths);
+  count_datums = array_arg_datums(counts, INT4OID, "bucket_counts", &ncounts);
+  if (nstarts != nwidths || nstarts != ncounts) {
+    ereport(ERROR, (errmsg("buckets_starts, bucket_widths, and bucket_counts must have the same length")));
+  }
+
+  *nhists = nstarts;
+  hists = palloc(sizeof(Datum) * nstarts);
+  specs = palloc(sizeof(hist_spec) * nstarts);
+  for (i = 0; i < nstarts; i++) {
+    specs[i].min = DatumGetFloat8(start_datums[i]);
+    specs[i].width = DatumGetFloat8(width_datums[i]);
+    specs[i].count = DatumGetInt32(count_datums[i]);
+    specs[i].edges = NULL;
+    if (specs[i].count < 0) ereport(ERROR, (errmsg("bucket_counts can't be negative")));
+    specs[i].counts = palloc0(sizeof(int64) * specs[i].count);
+  }
+  if (nstarts == 0) return hists;
+
+  if (ts_filename) {
+    ts_filename_hash = hash_filename(ts_filename);
+    DirectFunctionCall2(pg_advisory_lock_shared_int4, FLOATFILE_LOCK_PREFIX, ts_filename_hash);
+  }
+  xs_filename_hash = hash_filename(xs_filename);
+  DirectFunctionCall2(pg_advisory_lock_shared_int4, FLOATFILE_LOCK_PREFIX, xs_filename_hash);
+
+  if (ts_filename && open_floatfile_for_reading(ts_tablespace, ts_filename, &t_fd, &t_nulls_fd) == -1) {
+    errstr = strerror(errno);
+    goto bail;
+  }
+
+  if (open_floatfile_for_reading(xs_tablespace, xs_filename, &x_fd, &x_nulls_fd) == -1) {
+    errstr = strerror(errno);
+    goto bail;
+  }
+  open_floatfile_rollups_for_reading(xs_tablespace, xs_filename, &x_rollups);
+
+  if (ts_filename) {
+    opts = floatfile_scan_options(t_fd);
+    find_bounds_start_end(t_fd, t_nulls_fd, t_min, t_max, &min_pos, &max_pos, &opts, &errstr);
+    if (errstr) goto bail;
+    if (min_pos == -1 || max_pos == -1) {
+      // The histograms are empty so just return, but with no error.
+      goto bail;
+    }
+
+    opts = floatfile_scan_options(x_fd);
+    build_histograms_from_rollups(x_fd, x_nulls_fd, &x_rollups, nstarts, specs, min_pos, max_pos + 1, &opts, &errstr);
+  } else {
+    opts = floatfile_scan_options(x_fd);
+    build_histograms_from_rollups(x_fd, x_nulls_fd, &x_rollups, nstarts, specs, 0, -1, &opts, &errstr);
+  }
+
+bail:
+  if (x_fd       && close(x_fd))       errstr = "Can't close x_fd";
+  if (x_nulls_fd && close(x_nulls_fd)) errstr = "Can't close x_nulls_fd";
+  if (close_floatfile_rollups(&x_rollups)) errstr = "Can't close x_rollups";
+  DirectFunctionCall2(pg_advisory_unlock_shared_int4, FLOATFILE_LOCK_PREFIX, xs_filename_hash);
+  if (ts_filename) {
+    if (t_fd       && close(t_fd))       errstr = "Can't close t_fd";
+    if (t_nulls_fd && close(t_nulls_fd)) errstr = "Can't close t_nulls_fd";
+    DirectFunctionCall2(pg_advisory_unlock_shared_int4, FLOATFILE_LOCK_PREFIX, ts_filename_hash);
+  }
+  if (errstr) elog(ERROR, "%s", errstr);
+
+  // Wrap the buckets in new PostgreSQL array objects.
+  get_typlenbyvalalign(INT4OID, &histTypeWidth, &histTypeByValue, &histTypeAlignmentCode);
+  lbs[0] = 1;
+  for (i = 0; i < nstarts; i++) {
+    dims[0] = specs[i].count;
+    // safe as long as counts is int64. TODO support 32-bit systems
+    hists[i] = PointerGetDatum(construct_md_array((Datum *)specs[i].counts, NULL, 1, dims, lbs, INT4OID,
+                                                  histTypeWidth, histTypeByValue, histTypeAlignmentCode));
+  }
+  return hists;
+}
+
+/**
+ * floatfile_hists_srf - Returns the histograms from _floatfile_to_hists one row at a time.
+ *
+ * The `*_arg` parameters give where each SQL argument is,
+ * or -1 if this variant doesn't have it.
+ * `ts_arg` is the timestamps filename, followed by the start and end.
+ */
+static Datum floatfile_hists_srf(FunctionCallInfo fcinfo, int xs_tablespace_arg, int xs_filename_arg, int specs_arg,
+                                 int ts_tablespace_arg, int ts_arg) {
+  FuncCallContext *funcctx;
+  MemoryContext oldcontext;
+  char *xs_tablespace = NULL, *ts_tablespace = NULL, *ts_filename = NULL;
+  float8 t_min = 0, t_max = 0;
+  Datum *hists;
+  int nhists = 0;
+
+  if (SRF_IS_FIRSTCALL()) {
+    funcctx = SRF_FIRSTCALL_INIT();
+    oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+    if (!PG_ARGISNULL(xs_filename_arg) &&
+        !PG_ARGISNULL(specs_arg) && !PG_ARGISNULL(specs_arg + 1) && !PG_ARGISNULL(specs_arg + 2) &&
+        (ts_arg == -1 || (!PG_ARGISNULL(ts_arg) && !PG_ARGISNULL(ts_arg + 1) && !PG_ARGISNULL(ts_arg + 2)))) {
+
+      if (xs_tablespace_arg != -1 && !PG_ARGISNULL(xs_tablespace_arg)) xs_tablespace = GET_STR(PG_GETARG_TEXT_P(xs_tablespace_arg));
+      if (ts_tablespace_arg != -1 && !PG_ARGISNULL(ts_tablespace_arg)) ts_tablespace = GET_STR(PG_GETARG_TEXT_P(ts_tablespace_arg));
+      if (ts_arg != -1) {
+        ts_filename = GET_STR(PG_GETARG_TEXT_P(ts_arg));
+        t_min = PG_GETARG_FLOAT8(ts_arg + 1);
+        t_max = PG_GETARG_FLOAT8(ts_arg + 2);
+      }
+
+      funcctx->user_fctx = _floatfile_to_hists(xs_tablespace, GET_STR(PG_GETARG_TEXT_P(xs_filename_arg)),
+                                               PG_GETARG_ARRAYTYPE_P(specs_arg),
+                                               PG_GETARG_ARRAYTYPE_P(specs_arg + 1),
+                                               PG_GETARG_ARRAYTYPE_P(specs_arg + 2),
+                                               ts_tablespace, ts_filename, t_min, t_max, &nhists);
+    }
+    funcctx->max_calls = nhists;
+
+    MemoryContextSwitchTo(oldcontext);
+  }
+
+  funcctx = SRF_PERCALL_SETUP();
+  hists = (Datum *)funcctx->user_fctx;
+
+  if (funcctx->call_cntr < funcctx->max_calls) {
+    SRF_RETURN_NEXT(funcctx, hists[funcctx->call_cntr]);
+  } else {
+    SRF_RETURN_DONE(funcctx);
+  }
+}
+
+Datum floatfile_to_hists(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_to_hists);
+/**
+ * floatfile_to_hists - Uses a floatfile to build several histograms at once,
+ * reading the file only once.
+ *
+ * Returns one row per bucket spec, in the order given.
+ */
+Datum
+floatfile_to_hists(PG_FUNCTION_ARGS)
+{
+  return floatfile_hists_srf(fcinfo, -1, 0, 1, -1, -1);
+}
+
+Datum floatfile_in_tablespace_to_hists(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_in_tablespace_to_hists);
+/**
+ * floatfile_in_tablespace_to_hists - Like floatfile_to_hists but the file is in a tablespace.
+ */
+Datum
+floatfile_in_tablespace_to_hists(PG_FUNCTION_ARGS)
+{
+  return floatfile_hists_srf(fcinfo, 0, 1, 2, -1, -1);
+}
+
+Datum floatfile_with_bounds_to_hists(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_with_bounds_to_hists);
+/**
+ * floatfile_with_bounds_to_hists - Like floatfile_to_hists
+ * but only counts values whose timestamps are in the given range.
+ */
+Datum
+floatfile_with_bounds_to_hists(PG_FUNCTION_ARGS)
+{
+  return floatfile_hists_srf(fcinfo, -1, 0, 1, -1, 4);
+}
+
+Datum floatfile_in_tablespace_with_bounds_to_hists(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_in_tablespace_with_bounds_to_hists);
+/**
+ * floatfile_in_tablespace_with_bounds_to_hists - Like floatfile_with_bounds_to_hists
+ * but the files are in tablespaces.
+ */
+Datum
+floatfile_in_tablespace_with_bounds_to_hists(PG_FUNCTION_ARGS)
+{
+  return floatfile_hists_srf(fcinfo, 0, 1, 2, 5, 6);
+}
+
+static int compare_int32(const void *a, const void *b) {
+  int32 x = *(const int32 *)a, y = *(const int32 *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * _floatfile_to_hist_for_files - Builds the same histogram for each file in `filenames`.
+ *
+ * The scans run concurrently on up to floatfile.scan_threads threads.
+ * We take all the locks up front, in sorted order,
+ * so two callers with overlapping lists can't deadlock against an exclusive locker.
+ *
+ * Returns an int[] Datum per file, or 0 where the filename was NULL, and sets `*nhists`.
+ */
+static Datum *_floatfile_to_hist_for_files(char *tablespace, ArrayType *filenames,
+                                           float8 x_min, float8 x_width, int32 x_count,
+                                           int *nhists) {
+  Datum *filename_datums;
+  bool *filename_nulls;
+  int16 typeWidth;
+  bool typeByValue;
+  char typeAlignmentCode;
+  int nfiles;
+  char *filename;
+  int32 *hashes;
+  int nlocked = 0;
+  hist_file *files;
+  char *errstr = NULL;
+  scan_options opts;
+  Datum *hists;
+  int16 histTypeWidth;
+  bool histTypeByValue;
+  char histTypeAlignmentCode;
+  int dims[1];
+  int lbs[1];     // Lower Bounds of each dimension
+  int i;
+
+  if (ARR_NDIM(filenames) > 1) {
+    ereport(ERROR, (errmsg("filenames must be a one-dimensional array")));
+  }
+  if (x_count < 0) ereport(ERROR, (errmsg("bucket_count can't be negative")));
+  get_typlenbyvalalign(TEXTOID, &typeWidth, &typeByValue, &typeAlignmentCode);
+  deconstruct_array(filenames, TEXTOID, typeWidth, typeByValue, typeAlignmentCode,
+                    &filename_datums, &filename_nulls, &nfiles);
+
+  *nhists = nfiles;
+  hists = palloc0(sizeof(Datum) * nfiles);
+  files = palloc0(sizeof(hist_file) * nfiles);
+  hashes = palloc(sizeof(int32) * nfiles);
+  for (i = 0; i < nfiles; i++) {
+    if (filename_nulls[i]) continue;
+    filename = GET_STR(DatumGetPointer(filename_datums[i]));
+    validate_target_filename(filename);
+    hashes[nlocked++] = hash_filename(filename);
+  }
+
+  qsort(hashes, nlocked, sizeof(int32), compare_int32);
+  for (i = 0; i < nlocked; i++) {
+    DirectFunctionCall2(pg_advisory_lock_shared_int4, FLOATFILE_LOCK_PREFIX, hashes[i]);
+  }
+
+  for (i = 0; i < nfiles; i++) {
+    if (filename_nulls[i]) continue;
+    filename = GET_STR(DatumGetPointer(filename_datums[i]));
+    if (open_floatfile_for_reading(tablespace, filename, &files[i].x_fd, &files[i].x_nulls_fd) == -1) {
+      errstr = psprintf("Failed to open floatfile %s: %s", filename, strerror(errno));
+      files[i].x_fd = files[i].x_nulls_fd = 0;
+      goto bail;
+    }
+    files[i].drop_behind = floatfile_scan_options(files[i].x_fd).drop_behind;
+    files[i].counts = palloc0(sizeof(int64) * x_count);
+  }
+
+  opts.threads = floatfile_scan_threads;
+  opts.drop_behind = false;   // decided per file above
+  build_histogram_for_files(nfiles, files, x_min, x_width, x_count, &opts, &errstr);
+
+bail:
+  for (i = 0; i < nfiles; i++) {
+    if (files[i].x_fd       && close(files[i].x_fd))       errstr = "Can't close x_fd";
+    if (files[i].x_nulls_fd && close(files[i].x_nulls_fd)) errstr = "Can't close x_nulls_fd";
+  }
+  for (i = 0; i < nlocked; i++) {
+    DirectFunctionCall2(pg_advisory_unlock_shared_int4, FLOATFILE_LOCK_PREFIX, hashes[i]);
+  }
+  if (errstr) elog(ERROR, "%s", errstr);
+
+  // Wrap the buckets in new PostgreSQL array objects.
+  get_typlenbyvalalign(INT4OID, &histTypeWidth, &histTypeByValue, &histTypeAlignmentCode);
+  lbs[0] = 1;
+  dims[0] = x_count;
+  for (i = 0; i < nfiles; i++) {
+    if (!files[i].counts) continue;
+    // safe as long as counts is int64. TODO support 32-bit systems
+    hists[i] = PointerGetDatum(construct_md_array((Datum *)files[i].counts, NULL, 1, dims, lbs, INT4OID,
+                                                  histTypeWidth, histTypeByValue, histTypeAlignmentCode));
+  }
+  return hists;
+}
+
+/**
+ * floatfile_hist_for_files_srf - Returns the histograms from _floatfile_to_hist_for_files one row at a time.
+ *
+ * `tablespace_arg` is -1 if this variant doesn't have one.
+ */
+static Datum floatfile_hist_for_files_srf(FunctionCallInfo fcinfo, int tablespace_arg) {
+  FuncCallContext *funcctx;
+  MemoryContext oldcontext;
+  int filenames_arg = tablespace_arg + 1;
+  char *tablespace = NULL;
+  Datum *hists;
+  int nhists = 0;
+
+  if (SRF_IS_FIRSTCALL()) {
+    funcctx = SRF_FIRSTCALL_INIT();
+    oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+    if (!PG_ARGISNULL(filenames_arg) &&
+        !PG_ARGISNULL(filenames_arg + 1) && !PG_ARGISNULL(filenames_arg + 2) && !PG_ARGISNULL(filenames_arg + 3)) {
+      if (tablespace_arg != -1 && !PG_ARGISNULL(tablespace_arg)) tablespace = GET_STR(PG_GETARG_TEXT_P(tablespace_arg));
+
+      funcctx->user_fctx = _floatfile_to_hist_for_files(tablespace, PG_GETARG_ARRAYTYPE_P(filenames_arg),
+                                                        PG_GETARG_FLOAT8(filenames_arg + 1),
+                                                        PG_GETARG_FLOAT8(filenames_arg + 2),
+                                                        PG_GETARG_INT32(filenames_arg + 3),
+                                                        &nhists);
+    }
+    funcctx->max_calls = nhists;
+
+    MemoryContextSwitchTo(oldcontext);
+  }
+
+  funcctx = SRF_PERCALL_SETUP();
+  hists = (Datum *)funcctx->user_fctx;
+
+  if (funcctx->call_cntr < funcctx->max_calls) {
+    if (!hists[funcctx->call_cntr]) SRF_RETURN_NEXT_NULL(funcctx);
+    SRF_RETURN_NEXT(funcctx, hists[funcctx->call_cntr]);
+  } else {
+    SRF_RETURN_DONE(funcctx);
+  }
+}
+
+Datum floatfiles_to_hist(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfiles_to_hist);
+/**
+ * floatfiles_to_hist - Builds the same histogram for many floatfiles at once.
+ *
+ * Returns one row per filename, in the order given.
+ */
+Datum
+floatfiles_to_hist(PG_FUNCTION_ARGS)
+{
+  return floatfile_hist_for_files_srf(fcinfo, -1);
+}
+
+Datum floatfiles_in_tablespace_to_hist(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfiles_in_tablespace_to_hist);
+/**
+ * floatfiles_in_tablespace_to_hist - Like floatfiles_to_hist but the files are in a tablespace.
+ */
+Datum
+floatfiles_in_tablespace_to_hist(PG_FUNCTION_ARGS)
+{
+  return floatfile_hist_for_files_srf(fcinfo, 0);
+}
+
+/**
+ * _floatfile_to_histnd - Builds an N-d histogram of the floatfiles in `filenames`,
+ * all in `tablespace`, read side by side,
+ * with buckets (`starts[i]`, `widths[i]`, `counts[i]`) along dimension `i`.
+ *
+ * If `ts_filename` is not NULL we only count the tuples
+ * whose timestamps are between `t_min` and `t_max`, like floatfile_with_bounds_to_hist2d.
+ *
+ * We take the locks in hash order, like _floatfile_to_hist_for_files.
+ *
+ * If `sparse` we return a (buckets, counts) row of arrays with just the buckets that aren't empty
+ * (numbered row-major from 0) instead of the whole grid.
+ */
+static Datum _floatfile_to_histnd(FunctionCallInfo fcinfo, char *tablespace, ArrayType *filenames,
+                                  ArrayType *starts, ArrayType *widths, ArrayType *counts,
+                                  char *ts_tablespace, char *ts_filename, float8 t_min, float8 t_max,
+                                  bool sparse) {
+  const char *funcname = sparse ? "floatfile_to_histnd_sparse" : "floatfile_to_histnd";
+  Datum *filename_datums, *start_datums, *width_datums, *count_datums;
+  int ndims, nstarts, nwidths, ncounts;
+  int32 hashes[MAX_DIMENSIONS];
+  int32 ts_filename_hash = 0;
+  int t_fd = 0, t_nulls_fd = 0;
+  ssize_t min_pos, max_pos;
+  hist_dimension dims[MAX_DIMENSIONS];
+  size_t bucket_count = 1;
+  size_t max_buckets = sparse ? INT_MAX : MaxAllocSize / sizeof(int64);
+  int64 *hist = NULL;
+  sparse_counts sc;
+  TupleDesc tupdesc;
+  Datum values[2];
+  bool nulls[2] = {false, false};
+  Datum *datums;
+  char *filename;
+  char *errstr = NULL;
+  scan_options opts;
+  int16 histTypeWidth;
+  bool histTypeByValue;
+  char histTypeAlignmentCode;
+  int array_dims[MAX_DIMENSIONS];
+  int lbs[MAX_DIMENSIONS];     // Lower Bounds of each dimension
+  int i;
+  size_t j;
+
+  if (sparse && get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE) {
+    ereport(ERROR, (errmsg("floatfile_to_histnd_sparse must return a row")));
+  }
+  if (sparse) tupdesc = BlessTupleDesc(tupdesc);
+
+  filename_datums = array_arg_datums(filenames, TEXTOID, "filenames", &ndims);
+  start_datums = array_arg_datums(starts, FLOAT8OID, "buckets_starts", &nstarts);
+  width_datums = array_arg_datums(widths, FLOAT8OID, "bucket_widths", &nwidths);
+  count_datums = array_arg_datums(counts, INT4OID, "bucket_counts", &ncounts);
+  if (ndims != nstarts || ndims != nwidths || ndims != ncounts) {
+    ereport(ERROR, (errmsg("filenames, buckets_starts, bucket_widths, and bucket_counts must have the same length")));
+  }
+  if (ndims < 1 || ndims > MAX_DIMENSIONS) {
+    ereport(ERROR, (errmsg("%s needs from 1 to %d filenames", funcname, MAX_DIMENSIONS)));
+  }
+
+  memset(dims, 0, sizeof(dims));
+  for (i = 0; i < ndims; i++) {
+    dims[i].min = DatumGetFloat8(start_datums[i]);
+    dims[i].width = DatumGetFloat8(width_datums[i]);
+    dims[i].count = DatumGetInt32(count_datums[i]);
+    if (dims[i].count < 0) ereport(ERROR, (errmsg("bucket_counts can't be negative")));
+    bucket_count *= dims[i].count;
+    if (bucket_count > max_buckets) ereport(ERROR, (errmsg("too many buckets")));
+    array_dims[i] = dims[i].count;
+    lbs[i] = 1;
+
+    filename = GET_STR(DatumGetPointer(filename_datums[i]));
+    validate_target_filename(filename);
+    hashes[i] = hash_filename(filename);
+  }
+  if (!sparse) {
+    hist = palloc0(sizeof(int64) * Max(bucket_count, 1));
+  } else if (sparse_counts_init(&sc, 0)) {
+    sparse_counts_finish(&sc);
+    ereport(ERROR, (errcode(ERRCODE_OUT_OF_MEMORY), errmsg("out of memory")));
+  }
+
+  if (ts_filename) {
+    ts_filename_hash = hash_filename(ts_filename);
+    DirectFunctionCall2(pg_advisory_lock_shared_int4, FLOATFILE_LOCK_PREFIX, ts_filename_hash);
+  }
+  qsort(hashes, ndims, sizeof(int32), compare_int32);
+  for (i = 0; i < ndims; i++) {
+    DirectFunctionCall2(pg_advisory_lock_shared_int4, FLOATFILE_LOCK_PREFIX, hashes[i]);
+  }
+
+  if (ts_filename && open_floatfile_for_reading(ts_tablespace, ts_filename, &t_fd, &t_nulls_fd) == -1) {
+    errstr = strerror(errno);
+    goto bail;
+  }
+  for (i = 0; i < ndims; i++) {
+    filename = GET_STR(DatumGetPointer(filename_datums[i]));
+    if (open_floatfile_for_reading(tablespace, filename, &dims[i].fd, &dims[i].nulls_fd) == -1) {
+      errstr = psprintf("Failed to open floatfile %s: %s", filename, strerror(errno));
+      dims[i].fd = dims[i].nulls_fd = 0;
+      goto bail;
+    }
+  }
+  if (bucket_count == 0) goto bail;
+
+  if (ts_filename) {
+    opts = floatfile_scan_options(t_fd);
+    find_bounds_start_end(t_fd, t_nulls_fd, t_min, t_max, &min_pos, &max_pos, &opts, &errstr);
+    if (errstr) goto bail;
+    if (min_pos == -1 || max_pos == -1) {
+      // The histogram is empty so just return, but with no error.
+      goto bail;
+    }
+
+    opts = floatfile_scan_options(dims[0].fd);
+    if (sparse) build_sparse_histogram_nd_with_bounds(ndims, dims, &sc, min_pos, max_pos, &opts, &errstr);
+    else build_histogram_nd_with_bounds(ndims, dims, hist, min_pos, max_pos, &opts, &errstr);
+  } else {
+    opts = floatfile_scan_options(dims[0].fd);
+    if (sparse) build_sparse_histogram_nd(ndims, dims, &sc, &opts, &errstr);
+    else build_histogram_nd(ndims, dims, hist, &opts, &errstr);
+  }
+
+bail:
+  for (i = 0; i < ndims; i++) {
+    if (dims[i].fd       && close(dims[i].fd))       errstr = "Can't close fd";
+    if (dims[i].nulls_fd && close(dims[i].nulls_fd)) errstr = "Can't close nulls_fd";
+  }
+  for (i = 0; i < ndims; i++) {
+    DirectFunctionCall2(pg_advisory_unlock_shared_int4, FLOATFILE_LOCK_PREFIX, hashes[i]);
+  }
+  if (ts_filename) {
+    if (t_fd       && close(t_fd))       errstr = "Can't close t_fd";
+    if (t_nulls_fd && close(t_nulls_fd)) errstr = "Can't close t_nulls_fd";
+    DirectFunctionCall2(pg_advisory_unlock_shared_int4, FLOATFILE_LOCK_PREFIX, ts_filename_hash);
+  }
+  if (errstr) {
+    if (sparse) sparse_counts_finish(&sc);
+    elog(ERROR, "%s", errstr);
+  }
+
+  if (!sparse) {
+    // Wrap the buckets in a new PostgreSQL array object.
+    get_typlenbyvalalign(INT4OID, &histTypeWidth, &histTypeByValue, &histTypeAlignmentCode);
+    // safe as long as counts is int64. TODO support 32-bit systems
+    PG_RETURN_ARRAYTYPE_P(construct_md_array((Datum *)hist, NULL, ndims, array_dims, lbs, INT4OID,
+                                             histTypeWidth, histTypeByValue, histTypeAlignmentCode));
+  }
+
+  sparse_counts_sort(&sc);
+  datums = palloc(sizeof(Datum) * Max(sc.used, 1));
+  get_typlenbyvalalign(INT4OID, &histTypeWidth, &histTypeByValue, &histTypeAlignmentCode);
+  for (j = 0; j < sc.used; j++) datums[j] = Int32GetDatum(sc.entries[j].bucket);
+  values[0] = PointerGetDatum(construct_array(datums, sc.used, INT4OID, histTypeWidth, histTypeByValue, histTypeAlignmentCode));
+  get_typlenbyvalalign(INT8OID, &histTypeWidth, &histTypeByValue, &histTypeAlignmentCode);
+  for (j = 0; j < sc.used; j++) datums[j] = Int64GetDatum(sc.entries[j].count);
+  values[1] = PointerGetDatum(construct_array(datums, sc.used, INT8OID, histTypeWidth, histTypeByValue, histTypeAlignmentCode));
+  sparse_counts_finish(&sc);
+
+  PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+Datum floatfile_to_histnd(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_to_histnd);
+/**
+ * floatfile_to_histnd - Uses several floatfiles to build an N-d histogram,
+ * e.g. the occupancy of (x, y, z).
+ */
+Datum
+floatfile_to_histnd(PG_FUNCTION_ARGS)
+{
+  int i;
+
+  for (i = 0; i < 4; i++) {
+    if (PG_ARGISNULL(i)) PG_RETURN_NULL();
+  }
+
+  return _floatfile_to_histnd(fcinfo, NULL, PG_GETARG_ARRAYTYPE_P(0),
+                              PG_GETARG_ARRAYTYPE_P(1), PG_GETARG_ARRAYTYPE_P(2), PG_GETARG_ARRAYTYPE_P(3),
+                              NULL, NULL, 0, 0, false);
+}
+
+Datum floatfile_with_bounds_to_histnd(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_with_bounds_to_histnd);
+/**
+ * floatfile_with_bounds_to_histnd - Like floatfile_to_histnd,
+ * but only for the tuples whose timestamps are between two values.
+ */
+Datum
+floatfile_with_bounds_to_histnd(PG_FUNCTION_ARGS)
+{
+  int i;
+
+  for (i = 0; i < 7; i++) {
+    if (PG_ARGISNULL(i)) PG_RETURN_NULL();
+  }
+
+  return _floatfile_to_histnd(fcinfo, NULL, PG_GETARG_ARRAYTYPE_P(0),
+                              PG_GETARG_ARRAYTYPE_P(1), PG_GETARG_ARRAYTYPE_P(2), PG_GETARG_ARRAYTYPE_P(3),
+                              NULL, GET_STR(PG_GETARG_TEXT_P(4)), PG_GETARG_FLOAT8(5), PG_GETARG_FLOAT8(6), false);
+}
+
+Datum floatfile_in_tablespace_to_histnd(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_in_tablespace_to_histnd);
+/**
+ * floatfile_in_tablespace_to_histnd - Like floatfile_to_histnd but the files are in a tablespace.
+ */
+Datum
+floatfile_in_tablespace_to_histnd(PG_FUNCTION_ARGS)
+{
+  char *tablespace = NULL;
+  int i;
+
+  for (i = 1; i < 5; i++) {
+    if (PG_ARGISNULL(i)) PG_RETURN_NULL();
+  }
+
+  if (!PG_ARGISNULL(0)) tablespace = GET_STR(PG_GETARG_TEXT_P(0));
+  return _floatfile_to_histnd(fcinfo, tablespace, PG_GETARG_ARRAYTYPE_P(1),
+                              PG_GETARG_ARRAYTYPE_P(2), PG_GETARG_ARRAYTYPE_P(3), PG_GETARG_ARRAYTYPE_P(4),
+                              NULL, NULL, 0, 0, false);
+}
+
+Datum floatfile_in_tablespace_with_bounds_to_histnd(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_in_tablespace_with_bounds_to_histnd);
+/**
+ * floatfile_in_tablespace_with_bounds_to_histnd - Like floatfile_with_bounds_to_histnd
+ * but the files are in tablespaces.
+ */
+Datum
+floatfile_in_tablespace_with_bounds_to_histnd(PG_FUNCTION_ARGS)
+{
+  char *tablespace = NULL;
+  char *ts_tablespace = NULL;
+  int i;
+
+  for (i = 1; i < 9; i++) {
+    if (i != 5 && PG_ARGISNULL(i)) PG_RETURN_NULL();
+  }
+
+  if (!PG_ARGISNULL(0)) tablespace = GET_STR(PG_GETARG_TEXT_P(0));
+  if (!PG_ARGISNULL(5)) ts_tablespace = GET_STR(PG_GETARG_TEXT_P(5));
+  return _floatfile_to_histnd(fcinfo, tablespace, PG_GETARG_ARRAYTYPE_P(1),
+                              PG_GETARG_ARRAYTYPE_P(2), PG_GETARG_ARRAYTYPE_P(3), PG_GETARG_ARRAYTYPE_P(4),
+                              ts_tablespace, GET_STR(PG_GETARG_TEXT_P(6)), PG_GETARG_FLOAT8(7), PG_GETARG_FLOAT8(8), false);
+}
+
+Datum floatfile_to_histnd_sparse(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_to_histnd_sparse);
+/**
+ * floatfile_to_histnd_sparse - Like floatfile_to_histnd,
+ * but returns just the buckets that aren't empty, with their counts.
+ * For grids much bigger than the floatfiles, where a dense array would be mostly zeros.
+ */
+Datum
+floatfile_to_histnd_sparse(PG_FUNCTION_ARGS)
+{
+  int i;
+
+  for (i = 0; i < 4; i++) {
+    if (PG_ARGISNULL(i)) PG_RETURN_NULL();
+  }
+
+  return _floatfile_to_histnd(fcinfo, NULL, PG_GETARG_ARRAYTYPE_P(0),
+                              PG_GETARG_ARRAYTYPE_P(1), PG_GETARG_ARRAYTYPE_P(2), PG_GETARG_ARRAYTYPE_P(3),
+                              NULL, NULL, 0, 0, true);
+}
+
+Datum floatfile_with_bounds_to_histnd_sparse(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_with_bounds_to_histnd_sparse);
+/**
+ * floatfile_with_bounds_to_histnd_sparse - Like floatfile_to_histnd_sparse,
+ * but only for the tuples whose timestamps are between two values.
+ */
+Datum
+floatfile_with_bounds_to_histnd_sparse(PG_FUNCTION_ARGS)
+{
+  int i;
+
+  for (i = 0; i < 7; i++) {
+    if (PG_ARGISNULL(i)) PG_RETURN_NULL();
+  }
+
+  return _floatfile_to_histnd(fcinfo, NULL, PG_GETARG_ARRAYTYPE_P(0),
+                              PG_GETARG_ARRAYTYPE_P(1), PG_GETARG_ARRAYTYPE_P(2), PG_GETARG_ARRAYTYPE_P(3),
+                              NULL, GET_STR(PG_GETARG_TEXT_P(4)), PG_GETARG_FLOAT8(5), PG_GETARG_FLOAT8(6), true);
+}
+
+Datum floatfile_in_tablespace_to_histnd_sparse(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_in_tablespace_to_histnd_sparse);
+/**
+ * floatfile_in_tablespace_to_histnd_sparse - Like floatfile_to_histnd_sparse but the files are in a tablespace.
+ */
+Datum
+floatfile_in_tablespace_to_histnd_sparse(PG_FUNCTION_ARGS)
+{
+  char *tablespace = NULL;
+  int i;
+
+  for (i = 1; i < 5; i++) {
+    if (PG_ARGISNULL(i)) PG_RETURN_NULL();
+  }
+
+  if (!PG_ARGISNULL(0)) tablespace = GET_STR(PG_GETARG_TEXT_P(0));
+  return _floatfile_to_histnd(fcinfo, tablespace, PG_GETARG_ARRAYTYPE_P(1),
+                              PG_GETARG_ARRAYTYPE_P(2), PG_GETARG_ARRAYTYPE_P(3), PG_GETARG_ARRAYTYPE_P(4),
+                              NULL, NULL, 0, 0, true);
+}
+
+Datum floatfile_in_tablespace_with_bounds_to_histnd_sparse(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_in_tablespace_with_bounds_to_histnd_sparse);
+/**
+ * floatfile_in_tablespace_with_bounds_to_histnd_sparse - Like floatfile_with_bounds_to_histnd_sparse
+ * but the files are in tablespaces.
+ */
+Datum
+floatfile_in_tablespace_with_bounds_to_histnd_sparse(PG_FUNCTION_ARGS)
+{
+  char *tablespace = NULL;
+  char *ts_tablespace = NULL;
+  int i;
+
+  for (i = 1; i < 9; i++) {
+    if (i != 5 && PG_ARGISNULL(i)) PG_RETURN_NULL();
+  }
+
+  if (!PG_ARGISNULL(0)) tablespace = GET_STR(PG_GETARG_TEXT_P(0));
+  if (!PG_ARGISNULL(5)) ts_tablespace = GET_STR(PG_GETARG_TEXT_P(5));
+  return _floatfile_to_histnd(fcinfo, tablespace, PG_GETARG_ARRAYTYPE_P(1),
+                              PG_GETARG_ARRAYTYPE_P(2), PG_GETARG_ARRAYTYPE_P(3), PG_GETARG_ARRAYTYPE_P(4),
+                              ts_tablespace, GET_STR(PG_GETARG_TEXT_P(6)), PG_GETARG_FLOAT8(7), PG_GETARG_FLOAT8(8), true);
+}
+
+/**
+ * _floatfile_to_hist_auto - Builds a histogram of a floatfile with `x_count` buckets
+ * from its min to its max, and returns the (edges, counts) row.
+ * There is one more edge than there are counts.
+ * If there are no values, both are NULL.
+ *
+ * If `ts_filename` is not NULL we only count the values
+ * whose timestamps are between `t_min` and `t_max`, like floatfile_with_bounds_to_hist,
+ * and the buckets span just those values.
+ */
+static Datum _floatfile_to_hist_auto(FunctionCallInfo fcinfo, char *xs_tablespace, char *xs_filename, int32 x_count,
+                                     char *ts_tablespace, char *ts_filename, float8 t_min, float8 t_max) {
+  int32 xs_filename_hash, ts_filename_hash = 0;
+  int x_fd = 0, x_nulls_fd = 0;
+  rollup_files x_rollups = NO_ROLLUPS;
+  int t_fd = 0, t_nulls_fd = 0;
+  ssize_t min_pos, max_pos;
+  float8 x_min = 0, x_width = 0;
+  int64 *counts;
+  Datum *edges;
+  char *errstr = NULL;
+  scan_options opts;
+  TupleDesc tupdesc;
+  Datum values[2];
+  bool nulls[2];
+  int16 typeWidth;
+  bool typeByValue;
+  char typeAlignmentCode;
+  int i;
+
+  if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE) {
+    ereport(ERROR, (errmsg("floatfile_to_hist_auto must return a row")));
+  }
+  tupdesc = BlessTupleDesc(tupdesc);
+
+  if (x_count < 1) ereport(ERROR, (errmsg("bucket_count must be at least 1")));
+  if (x_count > MaxAllocSize / sizeof(int64) - 1) ereport(ERROR, (errmsg("too many buckets")));
+  counts = palloc0(sizeof(int64) * x_count);
+
+  if (ts_filename) {
+    ts_filename_hash = hash_filename(ts_filename);
+    DirectFunctionCall2(pg_advisory_lock_shared_int4, FLOATFILE_LOCK_PREFIX, ts_filename_hash);
+  }
+  xs_filename_hash = hash_filename(xs_filename);
+  DirectFunctionCall2(pg_advisory_lock_shared_int4, FLOATFILE_LOCK_PREFIX, xs_filename_hash);
+
+  if (ts_filename && open_floatfile_for_reading(ts_tablespace, ts_filename, &t_fd, &t_nulls_fd) == -1) {
+    errstr = strerror(errno);
+    goto bail;
+  }
+
+  if (open_floatfile_for_reading(xs_tablespace, xs_filename, &x_fd, &x_nulls_fd) == -1) {
+    errstr = strerror(errno);
+    goto bail;
+  }
+  open_floatfile_rollups_for_reading(xs_tablespace, xs_filename, &x_rollups);
+
+  if (ts_filename) {
+    opts = floatfile_scan_options(t_fd);
+    find_bounds_start_end(t_fd, t_nulls_fd, t_min, t_max, &min_pos, &max_pos, &opts, &errstr);
+    if (errstr) goto bail;
+    if (min_pos == -1 || max_pos == -1) {
+      // Nothing is in range so just return, but with no error.
+      goto bail;
+    }
+
+    opts = floatfile_scan_options(x_fd);
+    build_histogram_auto(x_fd, x_nulls_fd, &x_rollups, x_count, counts, &x_min, &x_width,
+                         min_pos, max_pos + 1, &opts, &errstr);
+  } else {
+    opts = floatfile_scan_options(x_fd);
+    build_histogram_auto(x_fd, x_nulls_fd, &x_rollups, x_count, counts, &x_min, &x_width,
+                         0, -1, &opts, &errstr);
+  }
+
+bail:
+  if (x_fd       && close(x_fd))       errstr = "Can't close x_fd";
+  if (x_nulls_fd && close(x_nulls_fd)) errstr = "Can't close x_nulls_fd";
+  if (close_floatfile_rollups(&x_rollups)) errstr = "Can't close x_rollups";
+  DirectFunctionCall2(pg_advisory_unlock_shared_int4, FLOATFILE_LOCK_PREFIX, xs_filename_hash);
+  if (ts_filename) {
+    if (t_fd       && close(t_fd))       errstr = "Can't close t_fd";
+    if (t_nulls_fd && close(t_nulls_fd)) errstr = "Can't close t_nulls_fd";
+    DirectFunctionCall2(pg_advisory_unlock_shared_int4, FLOATFILE_LOCK_PREFIX, ts_filename_hash);
+  }
+  if (errstr) elog(ERROR, "%s", errstr);
+
+  // build_histogram_auto leaves the width 0 when there was nothing to count:
+  memset(nulls, x_width == 0, sizeof(nulls));
+  if (x_width != 0) {
+    edges = palloc(sizeof(Datum) * (x_count + 1));
+    for (i = 0; i <= x_count; i++) edges[i] = Float8GetDatum(x_min + i * x_width);
+    get_typlenbyvalalign(FLOAT8OID, &typeWidth, &typeByValue, &typeAlignmentCode);
+    values[0] = PointerGetDatum(construct_array(edges, x_count + 1, FLOAT8OID, typeWidth, typeByValue, typeAlignmentCode));
+
+    get_typlenbyvalalign(INT4OID, &typeWidth, &typeByValue, &typeAlignmentCode);
+    // safe as long as counts is int64. TODO support 32-bit systems
+    values[1] = PointerGetDatum(construct_array((Datum *)counts, x_count, INT4OID, typeWidth, typeByValue, typeAlignmentCode));
+  }
+
+  PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+Datum floatfile_to_hist_auto(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_to_hist_auto);
+/**
+ * floatfile_to_hist_auto - Uses a floatfile to build a histogram
+ * without knowing its range up front.
+ */
+Datum
+floatfile_to_hist_auto(PG_FUNCTION_ARGS)
+{
+  if (PG_ARGISNULL(0) || PG_ARGISNULL(1)) PG_RETURN_NULL();
+
+  return _floatfile_to_hist_auto(fcinfo, NULL, GET_STR(PG_GETARG_TEXT_P(0)), PG_GETARG_INT32(1), NULL, NULL, 0, 0);
+}
+
+Datum floatfile_in_tablespace_to_hist_auto(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_in_tablespace_to_hist_auto);
+/**
+ * floatfile_in_tablespace_to_hist_auto - Like floatfile_to_hist_auto but the file is in a tablespace.
+ */
+Datum
+floatfile_in_tablespace_to_hist_auto(PG_FUNCTION_ARGS)
+{
+  char *xs_tablespace = NULL;
+
+  if (PG_ARGISNULL(1) || PG_ARGISNULL(2)) PG_RETURN_NULL();
+
+  if (!PG_ARGISNULL(0)) xs_tablespace = GET_STR(PG_GETARG_TEXT_P(0));
+  return _floatfile_to_hist_auto(fcinfo, xs_tablespace, GET_STR(PG_GETARG_TEXT_P(1)), PG_GETARG_INT32(2), NULL, NULL, 0, 0);
+}
+
+Datum floatfile_with_bounds_to_hist_auto(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_with_bounds_to_hist_auto);
+/**
+ * floatfile_with_bounds_to_hist_auto - Like floatfile_to_hist_auto
+ * but only includes values whose timestamps are in the given range.
+ */
+Datum
+floatfile_with_bounds_to_hist_auto(PG_FUNCTION_ARGS)
+{
+  int i;
+
+  for (i = 0; i < 5; i++) {
+    if (PG_ARGISNULL(i)) PG_RETURN_NULL();
+  }
+
+  return _floatfile_to_hist_auto(fcinfo, NULL, GET_STR(PG_GETARG_TEXT_P(0)), PG_GETARG_INT32(1),
+                                 NULL, GET_STR(PG_GETARG_TEXT_P(2)), PG_GETARG_FLOAT8(3), PG_GETARG_FLOAT8(4));
+}
+
+Datum floatfile_in_tablespace_with_bounds_to_hist_auto(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_in_tablespace_with_bounds_to_hist_auto);
+/**
+ * floatfile_in_tablespace_with_bounds_to_hist_auto - Like floatfile_with_bounds_to_hist_auto
+ * but the files are in tablespaces.
+ */
+Datum
+floatfile_in_tablespace_with_bounds_to_hist_auto(PG_FUNCTION_ARGS)
+{
+  char *xs_tablespace = NULL;
+  char *ts_tablespace = NULL;
+  int i;
+
+  for (i = 1; i < 7; i++) {
+    if (i != 3 && PG_ARGISNULL(i)) PG_RETURN_NULL();
+  }
+
+  if (!PG_ARGISNULL(0)) xs_tablespace = GET_STR(PG_GETARG_TEXT_P(0));
+  if (!PG_ARGISNULL(3)) ts_tablespace = GET_STR(PG_GETARG_TEXT_P(3));
+  return _floatfile_to_hist_auto(fcinfo, xs_tablespace, GET_STR(PG_GETARG_TEXT_P(1)), PG_GETARG_INT32(2),
+                                 ts_tablespace, GET_STR(PG_GETARG_TEXT_P(4)), PG_GETARG_FLOAT8(5), PG_GETARG_FLOAT8(6));
+}
+
+/**
+ * _floatfile_to_hist_edges - Builds a histogram of a floatfile
+ * whose bucket k holds the values from `edges[k]` up to (not including) `edges[k + 1]`,
+ * and returns its `x_count` counts. There must be `x_count` + 1 edges.
+ *
+ * If `ts_filename` is not NULL we only count the values
+ * whose timestamps are between `t_min` and `t_max`, like floatfile_with_bounds_to_hist.
+ */
+static Datum _floatfile_to_hist_edges(char *xs_tablespace, char *xs_filename, float8 *edges, int32 x_count,
+                                      char *ts_tablespace, char *ts_filename, float8 t_min, float8 t_max) {
+  int32 xs_filename_hash, ts_filename_hash = 0;
+  int x_fd = 0, x_nulls_fd = 0;
+  rollup_files x_rollups = NO_ROLLUPS;
+  int t_fd = 0, t_nulls_fd = 0;
+  ssize_t min_pos, max_pos;
+  bucket_edges be;
+  int64 *counts;
+  char *errstr = NULL;
+  scan_options opts;
+  int16 typeWidth;
+  bool typeByValue;
+  char typeAlignmentCode;
+  int i;
+
+  if (x_count < 1) ereport(ERROR, (errmsg("there must be at least two edges")));
+  for (i = 0; i < x_count; i++) {
+    if (!(edges[i] < edges[i + 1])) ereport(ERROR, (errmsg("edges must be increasing")));
+  }
+  counts = palloc0(sizeof(int64) * x_count);
+  bucket_edges_init(&be, edges, x_count);
+
+  if (ts_filename) {
+    ts_filename_hash = hash_filename(ts_filename);
+    DirectFunctionCall2(pg_advisory_lock_shared_int4, FLOATFILE_LOCK_PREFIX, ts_filename_hash);
+  }
+  xs_filename_hash = hash_filename(xs_filename);
+  DirectFunctionCall2(pg_advisory_lock_shared_int4, FLOATFILE_LOCK_PREFIX, xs_filename_hash);
+
+  if (ts_filename && open_floatfile_for_reading(ts_tablespace, ts_filename, &t_fd, &t_nulls_fd) == -1) {
+    errstr = strerror(errno);
+    goto bail;
+  }
+
+  if (open_floatfile_for_reading(xs_tablespace, xs_filename, &x_fd, &x_nulls_fd) == -1) {
+    errstr = strerror(errno);
+    goto bail;
+  }
+  open_floatfile_rollups_for_reading(xs_tablespace, xs_filename, &x_rollups);
+
+  if (ts_filename) {
+    opts = floatfile_scan_options(t_fd);
+    find_bounds_start_end(t_fd, t_nulls_fd, t_min, t_max, &min_pos, &max_pos, &opts, &errstr);
+    if (errstr) goto bail;
+    if (min_pos == -1 || max_pos == -1) {
+      // The histogram is empty so just return, but with no error.
+      goto bail;
+    }
+
+    opts = floatfile_scan_options(x_fd);
+    build_histogram_edges(x_fd, x_nulls_fd, &x_rollups, &be, counts, min_pos, max_pos + 1, &opts, &errstr);
+  } else {
+    opts = floatfile_scan_options(x_fd);
+    build_histogram_edges(x_fd, x_nulls_fd, &x_rollups, &be, counts, 0, -1, &opts, &errstr);
+  }
+
+bail:
+  bucket_edges_finish(&be);
+  if (x_fd       && close(x_fd))       errstr = "Can't close x_fd";
+  if (x_nulls_fd && close(x_nulls_fd)) errstr = "Can't close x_nulls_fd";
+  if (close_floatfile_rollups(&x_rollups)) errstr = "Can't close x_rollups";
+  DirectFunctionCall2(pg_advisory_unlock_shared_int4, FLOATFILE_LOCK_PREFIX, xs_filename_hash);
+  if (ts_filename) {
+    if (t_fd       && close(t_fd))       errstr = "Can't close t_fd";
+    if (t_nulls_fd && close(t_nulls_fd)) errstr = "Can't close t_nulls_fd";
+    DirectFunctionCall2(pg_advisory_unlock_shared_int4, FLOATFILE_LOCK_PREFIX, ts_filename_hash);
+  }
+  if (errstr) elog(ERROR, "%s", errstr);
+
+  get_typlenbyvalalign(INT4OID, &typeWidth, &typeByValue, &typeAlignmentCode);
+  // safe as long as counts is int64. TODO support 32-bit systems
+  PG_RETURN_ARRAYTYPE_P(construct_array((Datum *)counts, x_count, INT4OID, typeWidth, typeByValue, typeAlignmentCode));
+}
+
+/**
+ * edges_arg - Returns the float8s of `arr`, and sets `*x_count` to the number of buckets between them.
+ */
+static float8 *edges_arg(ArrayType *arr, int32 *x_count) {
+  Datum *edge_datums;
+  float8 *edges;
+  int nedges, i;
+
+  edge_datums = array_arg_datums(arr, FLOAT8OID, "edges", &nedges);
+  edges = palloc(sizeof(float8) * Max(nedges, 1));
+  for (i = 0; i < nedges; i++) edges[i] = DatumGetFloat8(edge_datums[i]);
+  *x_count = nedges - 1;
+  return edges;
+}
+
+/**
+ * log_edges - Returns the `x_count` + 1 edges from `start`, each `factor` times the one before.
+ *
+ * We just hand these to _floatfile_to_hist_edges:
+ * they are evenly spaced in the bits of a float8, so its index stays small.
+ */
+static float8 *log_edges(float8 start, float8 factor, int32 x_count) {
+  float8 *edges;
+  int i;
+
+  if (!(start > 0) || isinf(start)) ereport(ERROR, (errmsg("buckets_start must be positive")));
+  if (!(factor > 1) || isinf(factor)) ereport(ERROR, (errmsg("bucket_factor must be greater than 1")));
+  if (x_count < 1) ereport(ERROR, (errmsg("bucket_count must be at least 1")));
+  if (x_count > MaxAllocSize / sizeof(int64) - 1) ereport(ERROR, (errmsg("too many buckets")));
+
+  edges = palloc(sizeof(float8) * (x_count + 1));
+  for (i = 0; i <= x_count; i++) {
+    edges[i] = start * pow(factor, i);
+    if (isinf(edges[i])) ereport(ERROR, (errmsg("the last bucket ends past the largest float")));
+    if (i > 0 && !(edges[i] > edges[i - 1])) ereport(ERROR, (errmsg("bucket_factor is too close to 1")));
+  }
+  return edges;
+}
+
+Datum floatfile_to_hist_edges(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_to_hist_edges);
+/**
+ * floatfile_to_hist_edges - Uses a floatfile to build a histogram
+ * with the bucket edges you choose.
+ */
+Datum
+floatfile_to_hist_edges(PG_FUNCTION_ARGS)
+{
+  float8 *edges;
+  int32 x_count;
+
+  if (PG_ARGISNULL(0) || PG_ARGISNULL(1)) PG_RETURN_NULL();
+
+  edges = edges_arg(PG_GETARG_ARRAYTYPE_P(1), &x_count);
+  return _floatfile_to_hist_edges(NULL, GET_STR(PG_GETARG_TEXT_P(0)), edges, x_count, NULL, NULL, 0, 0);
+}
+
+Datum floatfile_in_tablespace_to_hist_edges(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_in_tablespace_to_hist_edges);
+/**
+ * floatfile_in_tablespace_to_hist_edges - Like floatfile_to_hist_edges but the file is in a tablespace.
+ */
+Datum
+floatfile_in_tablespace_to_hist_edges(PG_FUNCTION_ARGS)
+{
+  char *xs_tablespace = NULL;
+  float8 *edges;
+  int32 x_count;
+
+  if (PG_ARGISNULL(1) || PG_ARGISNULL(2)) PG_RETURN_NULL();
+
+  if (!PG_ARGISNULL(0)) xs_tablespace = GET_STR(PG_GETARG_TEXT_P(0));
+  edges = edges_arg(PG_GETARG_ARRAYTYPE_P(2), &x_count);
+  return _floatfile_to_hist_edges(xs_tablespace, GET_STR(PG_GETARG_TEXT_P(1)), edges, x_count, NULL, NULL, 0, 0);
+}
+
+Datum floatfile_with_bounds_to_hist_edges(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_with_bounds_to_hist_edges);
+/**
+ * floatfile_with_bounds_to_hist_edges - Like floatfile_to_hist_edges
+ * but only includes values whose timestamps are in the given range.
+ */
+Datum
+floatfile_with_bounds_to_hist_edges(PG_FUNCTION_ARGS)
+{
+  float8 *edges;
+  int32 x_count;
+  int i;
+
+  for (i = 0; i < 5; i++) {
+    if (PG_ARGISNULL(i)) PG_RETURN_NULL();
+  }
+
+  edges = edges_arg(PG_GETARG_ARRAYTYPE_P(1), &x_count);
+  return _floatfile_to_hist_edges(NULL, GET_STR(PG_GETARG_TEXT_P(0)), edges, x_count,
+                                  NULL, GET_STR(PG_GETARG_TEXT_P(2)), PG_GETARG_FLOAT8(3), PG_GETARG_FLOAT8(4));
+}
+
+Datum floatfile_in_tablespace_with_bounds_to_hist_edges(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_in_tablespace_with_bounds_to_hist_edges);
+/**
+ * floatfile_in_tablespace_with_bounds_to_hist_edges - Like floatfile_with_bounds_to_hist_edges
+ * but the files are in tablespaces.
+ */
+Datum
+floatfile_in_tablespace_with_bounds_to_hist_edges(PG_FUNCTION_ARGS)
+{
+  char *xs_tablespace = NULL;
+  char *ts_tablespace = NULL;
+  float8 *edges;
+  int32 x_count;
+  int i;
+
+  for (i = 1; i < 7; i++) {
+    if (i != 3 && PG_ARGISNULL(i)) PG_RETURN_NULL();
+  }
+
+  if (!PG_ARGISNULL(0)) xs_tablespace = GET_STR(PG_GETARG_TEXT_P(0));
+  if (!PG_ARGISNULL(3)) ts_tablespace = GET_STR(PG_GETARG_TEXT_P(3));
+  edges = edges_arg(PG_GETARG_ARRAYTYPE_P(2), &x_count);
+  return _floatfile_to_hist_edges(xs_tablespace, GET_STR(PG_GETARG_TEXT_P(1)), edges, x_count,
+                                  ts_tablespace, GET_STR(PG_GETARG_TEXT_P(4)), PG_GETARG_FLOAT8(5), PG_GETARG_FLOAT8(6));
+}
+
+Datum floatfile_to_hist_log(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_to_hist_log);
+/**
+ * floatfile_to_hist_log - Uses a floatfile to build a histogram
+ * whose buckets each end `bucket_factor` times as far from 0 as they start.
+ */
+Datum
+floatfile_to_hist_log(PG_FUNCTION_ARGS)
+{
+  int32 x_count;
+  int i;
+
+  for (i = 0; i < 4; i++) {
+    if (PG_ARGISNULL(i)) PG_RETURN_NULL();
+  }
+
+  x_count = PG_GETARG_INT32(3);
+  return _floatfile_to_hist_edges(NULL, GET_STR(PG_GETARG_TEXT_P(0)),
+                                  log_edges(PG_GETARG_FLOAT8(1), PG_GETARG_FLOAT8(2), x_count), x_count,
+                                  NULL, NULL, 0, 0);
+}
+
+Datum floatfile_in_tablespace_to_hist_log(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_in_tablespace_to_hist_log);
+/**
+ * floatfile_in_tablespace_to_hist_log - Like floatfile_to_hist_log but the file is in a tablespace.
+ */
+Datum
+floatfile_in_tablespace_to_hist_log(PG_FUNCTION_ARGS)
+{
+  char *xs_tablespace = NULL;
+  int32 x_count;
+  int i;
+
+  for (i = 1; i < 5; i++) {
+    if (PG_ARGISNULL(i)) PG_RETURN_NULL();
+  }
+
+  if (!PG_ARGISNULL(0)) xs_tablespace = GET_STR(PG_GETARG_TEXT_P(0));
+  x_count = PG_GETARG_INT32(4);
+  return _floatfile_to_hist_edges(xs_tablespace, GET_STR(PG_GETARG_TEXT_P(1)),
+                                  log_edges(PG_GETARG_FLOAT8(2), PG_GETARG_FLOAT8(3), x_count), x_count,
+                                  NULL, NULL, 0, 0);
+}
+
+Datum floatfile_with_bounds_to_hist_log(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_with_bounds_to_hist_log);
+/**
+ * floatfile_with_bounds_to_hist_log - Like floatfile_to_hist_log
+ * but only includes values whose timestamps are in the given range.
+ */
+Datum
+floatfile_with_bounds_to_hist_log(PG_FUNCTION_ARGS)
+{
+  int32 x_count;
+  int i;
+
+  for (i = 0; i < 7; i++) {
+    if (PG_ARGISNULL(i)) PG_RETURN_NULL();
+  }
+
+  x_count = PG_GETARG_INT32(3);
+  return _floatfile_to_hist_edges(NULL, GET_STR(PG_GETARG_TEXT_P(0)),
+                                  log_edges(PG_GETARG_FLOAT8(1), PG_GETARG_FLOAT8(2), x_count), x_count,
+                                  NULL, GET_STR(PG_GETARG_TEXT_P(4)), PG_GETARG_FLOAT8(5), PG_GETARG_FLOAT8(6));
+}
+
+Datum floatfile_in_tablespace_with_bounds_to_hist_log(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_in_tablespace_with_bounds_to_hist_log);
+/**
+ * floatfile_in_tablespace_with_bounds_to_hist_log - Like floatfile_with_bounds_to_hist_log
+ * but the files are in tablespaces.
+ */
+Datum
+floatfile_in_tablespace_with_bounds_to_hist_log(PG_FUNCTION_ARGS)
+{
+  char *xs_tablespace = NULL;
+  char *ts_tablespace = NULL;
+  int32 x_count;
+  int i;
+
+  for (i = 1; i < 9; i++) {
+    if (i != 5 && PG_ARGISNULL(i)) PG_RETURN_NULL();
+  }
+
+  if (!PG_ARGISNULL(0)) xs_tablespace = GET_STR(PG_GETARG_TEXT_P(0));
+  if (!PG_ARGISNULL(5)) ts_tablespace = GET_STR(PG_GETARG_TEXT_P(5));
+  x_count = PG_GETARG_INT32(4);
+  return _floatfile_to_hist_edges(xs_tablespace, GET_STR(PG_GETARG_TEXT_P(1)),
+                                  log_edges(PG_GETARG_FLOAT8(2), PG_GETARG_FLOAT8(3), x_count), x_count,
+                                  ts_tablespace, GET_STR(PG_GETARG_TEXT_P(6)), PG_GETARG_FLOAT8(7), PG_GETARG_FLOAT8(8));
+}
+
+/**
+ * _floatfile_stats - Summarizes a floatfile
+ * and returns the (count, sum, min, max, mean, stddev) row,
+ * or if `with_length` the (length, count, sum, min, max, mean, stddev) row.
+ *
+ * Whole chunks come from the floatfile's rollups when it has them,
+ * so we only read the values at either edge of the range.
+ *
+ * If `ts_filename` is not NULL we only include the values
+ * whose timestamps are between `t_min` and `t_max`, like floatfile_with_bounds_to_hist.
+ */
+static Datum _floatfile_stats(FunctionCallInfo fcinfo, char *xs_tablespace, char *xs_filename,
+                              char *ts_tablespace, char *ts_filename, float8 t_min, float8 t_max,
+                              bool with_length) {
+  int32 xs_filename_hash, ts_filename_hash = 0;
+  int x_fd = 0, x_nulls_fd = 0;
+  rollup_files x_rollups = NO_ROLLUPS;
+  int t_fd = 0, t_nulls_fd = 0;
+  ssize_t min_pos, max_pos, nvals = 0;
+  float_stats stats;
+  char *errstr = NULL;
+  scan_options opts;
+  TupleDesc tupdesc;
+  Datum values[7];
+  bool nulls[7];
+  int i = 0;
+
+  if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE) {
+    ereport(ERROR, (errmsg("floatfile_stats must return a row")));
+  }
+  tupdesc = BlessTupleDesc(tupdesc);
+
+  stats_init(&stats);
+
+  if (ts_filename) {
+    ts_filename_hash = hash_filename(ts_filename);
+    DirectFunctionCall2(pg_advisory_lock_shared_int4, FLOATFILE_LOCK_PREFIX, ts_filename_hash);
+  }
+  xs_filename_hash = hash_filename(xs_filename);
+  DirectFunctionCall2(pg_advisory_lock_shared_int4, FLOATFILE_LOCK_PREFIX, xs_filename_hash);
+
+  if (ts_filename && open_floatfile_for_reading(ts_tablespace, ts_filename, &t_fd, &t_nulls_fd) == -1) {
+    errstr = strerror(errno);
+    goto bail;
+  }
+
+  if (open_floatfile_for_reading(xs_tablespace, xs_filename, &x_fd, &x_nulls_fd) == -1) {
+    errstr = strerror(errno);
+    goto bail;
+  }
+  open_floatfile_rollups_for_reading(xs_tablespace, xs_filename, &x_rollups);
+
+  if (ts_filename) {
+    opts = floatfile_scan_options(t_fd);
+    find_bounds_start_end(t_fd, t_nulls_fd, t_min, t_max, &min_pos, &max_pos, &opts, &errstr);
+    if (errstr) goto bail;
+    if (min_pos == -1 || max_pos == -1) {
+      // Nothing is in range so just return, but with no error.
+      goto bail;
+    }
+
+    opts = floatfile_scan_options(x_fd);
+    build_stats_from_rollups(x_fd, x_nulls_fd, &x_rollups, min_pos, max_pos + 1, &stats, &nvals, &opts, &errstr);
+  } else {
+    opts = floatfile_scan_options(x_fd);
+    build_stats_from_rollups(x_fd, x_nulls_fd, &x_rollups, 0, -1, &stats, &nvals, &opts, &errstr);
+  }
+
+bail:
+  if (x_fd       && close(x_fd))       errstr = "Can't close x_fd";
+  if (x_nulls_fd && close(x_nulls_fd)) errstr = "Can't close x_nulls_fd";
+  if (close_floatfile_rollups(&x_rollups)) errstr = "Can't close x_rollups";
+  DirectFunctionCall2(pg_advisory_unlock_shared_int4, FLOATFILE_LOCK_PREFIX, xs_filename_hash);
+  if (ts_filename) {
+    if (t_fd       && close(t_fd))       errstr = "Can't close t_fd";
+    if (t_nulls_fd && close(t_nulls_fd)) errstr = "Can't close t_nulls_fd";
+    DirectFunctionCall2(pg_advisory_unlock_shared_int4, FLOATFILE_LOCK_PREFIX, ts_filename_hash);
+  }
+  if (errstr) elog(ERROR, "%s", errstr);
+
+  // Like the SQL aggregates, everything but count is NULL when there are no values,
+  // and stddev (the sample standard deviation) needs at least two.
+  memset(nulls, stats.count == 0, sizeof(nulls));
+  if (with_length) {
+    values[i] = Int64GetDatum(nvals);
+    nulls[i++] = false;
+  }
+  values[i] = Int64GetDatum(stats.count);
+  nulls[i++] = false;
+  values[i++] = Float8GetDatum(stats.sum);
+  values[i++] = Float8GetDatum(stats.min);
+  values[i++] = Float8GetDatum(stats.max);
+  values[i++] = Float8GetDatum(stats.mean);
+  values[i] = Float8GetDatum(stats.count > 1 ? sqrt(stats.m2 / (stats.count - 1)) : 0);
+  nulls[i] = stats.count < 2;
+
+  PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+Datum floatfile_stats(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_stats);
+/**
+ * floatfile_stats - Returns the count, sum, min, max, mean, and stddev of a floatfile's non-null values
+ * without loading it into an array.
+ */
+Datum
+floatfile_stats(PG_FUNCTION_ARGS)
+{
+  if (PG_ARGISNULL(0)) PG_RETURN_NULL();
+
+  return _floatfile_stats(fcinfo, NULL, GET_STR(PG_GETARG_TEXT_P(0)), NULL, NULL, 0, 0, false);
+}
+
+Datum floatfile_in_tablespace_stats(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_in_tablespace_stats);
+/**
+ * floatfile_in_tablespace_stats - Like floatfile_stats but the file is in a tablespace.
+ */
+Datum
+floatfile_in_tablespace_stats(PG_FUNCTION_ARGS)
+{
+  char *xs_tablespace = NULL;
+
+  if (PG_ARGISNULL(1)) PG_RETURN_NULL();
+
+  if (!PG_ARGISNULL(0)) xs_tablespace = GET_STR(PG_GETARG_TEXT_P(0));
+  return _floatfile_stats(fcinfo, xs_tablespace, GET_STR(PG_GETARG_TEXT_P(1)), NULL, NULL, 0, 0, false);
+}
+
+Datum floatfile_with_bounds_stats(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_with_bounds_stats);
+/**
+ * floatfile_with_bounds_stats - Like floatfile_stats
+ * but only includes values whose timestamps are in the given range.
+ */
+Datum
+floatfile_with_bounds_stats(PG_FUNCTION_ARGS)
+{
+  if (PG_ARGISNULL(0) || PG_ARGISNULL(1) || PG_ARGISNULL(2) || PG_ARGISNULL(3)) PG_RETURN_NULL();
+
+  return _floatfile_stats(fcinfo, NULL, GET_STR(PG_GETARG_TEXT_P(0)),
+                          NULL, GET_STR(PG_GETARG_TEXT_P(1)), PG_GETARG_FLOAT8(2), PG_GETARG_FLOAT8(3), false);
+}
+
+Datum floatfile_in_tablespace_with_bounds_stats(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_in_tablespace_with_bounds_stats);
+/**
+ * floatfile_in_tablespace_with_bounds_stats - Like floatfile_with_bounds_stats
+ * but the files are in tablespaces.
+ */
+Datum
+floatfile_in_tablespace_with_bounds_stats(PG_FUNCTION_ARGS)
+{
+  char *xs_tablespace = NULL;
+  char *ts_tablespace = NULL;
+
+  if (PG_ARGISNULL(1) || PG_ARGISNULL(3) || PG_ARGISNULL(4) || PG_ARGISNULL(5)) PG_RETURN_NULL();
+
+  if (!PG_ARGISNULL(0)) xs_tablespace = GET_STR(PG_GETARG_TEXT_P(0));
+  if (!PG_ARGISNULL(2)) ts_tablespace = GET_STR(PG_GETARG_TEXT_P(2));
+  return _floatfile_stats(fcinfo, xs_tablespace, GET_STR(PG_GETARG_TEXT_P(1)),
+                          ts_tablespace, GET_STR(PG_GETARG_TEXT_P(3)), PG_GETARG_FLOAT8(4), PG_GETARG_FLOAT8(5), false);
+}
+
+Datum floatfile_info(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_info);
+/**
+ * floatfile_info - Returns a floatfile's length and the stats of its non-null values
+ * from its stats file, without reading the data.
+ */
+Datum
+floatfile_info(PG_FUNCTION_ARGS)
+{
+  if (PG_ARGISNULL(0)) PG_RETURN_NULL();
+
+  return _floatfile_stats(fcinfo, NULL, GET_STR(PG_GETARG_TEXT_P(0)), NULL, NULL, 0, 0, true);
+}
+
+Datum floatfile_in_tablespace_info(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_in_tablespace_info);
+/**
+ * floatfile_in_tablespace_info - Like floatfile_info but the file is in a tablespace.
+ */
+Datum
+floatfile_in_tablespace_info(PG_FUNCTION_ARGS)
+{
+  char *xs_tablespace = NULL;
+
+  if (PG_ARGISNULL(1)) PG_RETURN_NULL();
+
+  if (!PG_ARGISNULL(0)) xs_tablespace = GET_STR(PG_GETARG_TEXT_P(0));
+  return _floatfile_stats(fcinfo, xs_tablespace, GET_STR(PG_GETARG_TEXT_P(1)), NULL, NULL, 0, 0, true);
+}
+
+/**
+ * _floatfile_percentiles - Returns a float[] with the value at each of `fractions`
+ * of the way through the sorted non-null values of the floatfile,
+ * interpolating like percentile_cont, or NULL if there are no values.
+ *
+ * If `ts_filename` is not NULL we only include the values
+ * whose timestamps are between `t_min` and `t_max`, like floatfile_with_bounds_to_hist.
+ */
+static Datum _floatfile_percentiles(FunctionCallInfo fcinfo, char *xs_tablespace, char *xs_filename, ArrayType *fractions_arg,
+                                    char *ts_tablespace, char *ts_filename, float8 t_min, float8 t_max) {
+  Datum *fraction_datums;
+  int nfractions;
+  float8 *fractions, *results;
+  int64 nvals = 0;
+  int32 xs_filename_hash, ts_filename_hash = 0;
+  int x_fd = 0, x_nulls_fd = 0;
+  int t_fd = 0, t_nulls_fd = 0;
+  ssize_t min_pos, max_pos;
+  char *errstr = NULL;
+  scan_options opts;
+  int16 typeWidth;
+  bool typeByValue;
+  char typeAlignmentCode;
+  int i;
+
+  fraction_datums = array_arg_datums(fractions_arg, FLOAT8OID, "fractions", &nfractions);
+  fractions = palloc(sizeof(float8) * Max(nfractions, 1));
+  results = palloc(sizeof(float8) * Max(nfractions, 1));
+  for (i = 0; i < nfractions; i++) {
+    fractions[i] = DatumGetFloat8(fraction_datums[i]);
+    // Same check (and message) as percentile_cont:
+    if (fractions[i] < 0 || fractions[i] > 1 || isnan(fractions[i])) {
+      ereport(ERROR, (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                      errmsg("percentile value %g is not between 0 and 1", fractions[i])));
+    }
+  }
+
+  if (ts_filename) {
+    ts_filename_hash = hash_filename(ts_filename);
+    DirectFunctionCall2(pg_advisory_lock_shared_int4, FLOATFILE_LOCK_PREFIX, ts_filename_hash);
+  }
+  xs_filename_hash = hash_filename(xs_filename);
+  DirectFunctionCall2(pg_advisory_lock_shared_int4, FLOATFILE_LOCK_PREFIX, xs_filename_hash);
+
+  if (ts_filename && open_floatfile_for_reading(ts_tablespace, ts_filename, &t_fd, &t_nulls_fd) == -1) {
+    errstr = strerror(errno);
+    goto bail;
+  }
+
+  if (open_floatfile_for_reading(xs_tablespace, xs_filename, &x_fd, &x_nulls_fd) == -1) {
+    errstr = strerror(errno);
+    goto bail;
+  }
+
+  if (ts_filename) {
+    opts = floatfile_scan_options(t_fd);
+    find_bounds_start_end(t_fd, t_nulls_fd, t_min, t_max, &min_pos, &max_pos, &opts, &errstr);
+    if (errstr) goto bail;
+    if (min_pos == -1 || max_pos == -1) {
+      // Nothing is in range so just return, but with no error.
+      goto bail;
+    }
+
+    opts = floatfile_scan_options(x_fd);
+    build_percentiles_with_bounds(x_fd, x_nulls_fd, nfractions, fractions, results, &nvals,
+                                  min_pos, max_pos, floatfile_exact_percentile_limit, &opts, &errstr);
+  } else {
+    opts = floatfile_scan_options(x_fd);
+    build_percentiles(x_fd, x_nulls_fd, nfractions, fractions, results, &nvals,
+                      floatfile_exact_percentile_limit, &opts, &errstr);
+  }
+
+bail:
+  if (x_fd       && close(x_fd))       errstr = "Can't close x_fd";
+  if (x_nulls_fd && close(x_nulls_fd)) errstr = "Can't close x_nulls_fd";
+  DirectFunctionCall2(pg_advisory_unlock_shared_int4, FLOATFILE_LOCK_PREFIX, xs_filename_hash);
+  if (ts_filename) {
+    if (t_fd       && close(t_fd))       errstr = "Can't close t_fd";
+    if (t_nulls_fd && close(t_nulls_fd)) errstr = "Can't close t_nulls_fd";
+    DirectFunctionCall2(pg_advisory_unlock_shared_int4, FLOATFILE_LOCK_PREFIX, ts_filename_hash);
+  }
+  if (errstr) elog(ERROR, "%s", errstr);
+
+  // Like percentile_cont, no values means NULL:
+  if (nvals == 0) PG_RETURN_NULL();
+
+  get_typlenbyvalalign(FLOAT8OID, &typeWidth, &typeByValue, &typeAlignmentCode);
+  for (i = 0; i < nfractions; i++) fraction_datums[i] = Float8GetDatum(results[i]);
+  PG_RETURN_ARRAYTYPE_P(construct_array(fraction_datums, nfractions, FLOAT8OID, typeWidth, typeByValue, typeAlignmentCode));
+}
+
+Datum floatfile_percentiles(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_percentiles);
+/**
+ * floatfile_percentiles - Returns the value at each of `fractions` of the way through a floatfile's sorted values.
+ */
+Datum
+floatfile_percentiles(PG_FUNCTION_ARGS)
+{
+  if (PG_ARGISNULL(0) || PG_ARGISNULL(1)) PG_RETURN_NULL();
+
+  return _floatfile_percentiles(fcinfo, NULL, GET_STR(PG_GETARG_TEXT_P(0)), PG_GETARG_ARRAYTYPE_P(1),
+                                NULL, NULL, 0, 0);
+}
+
+Datum floatfile_in_tablespace_percentiles(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_in_tablespace_percentiles);
+/**
+ * floatfile_in_tablespace_percentiles - Like floatfile_percentiles but the file is in a tablespace.
+ */
+Datum
+floatfile_in_tablespace_percentiles(PG_FUNCTION_ARGS)
+{
+  char *xs_tablespace = NULL;
+
+  if (PG_ARGISNULL(1) || PG_ARGISNULL(2)) PG_RETURN_NULL();
+
+  if (!PG_ARGISNULL(0)) xs_tablespace = GET_STR(PG_GETARG_TEXT_P(0));
+  return _floatfile_percentiles(fcinfo, xs_tablespace, GET_STR(PG_GETARG_TEXT_P(1)), PG_GETARG_ARRAYTYPE_P(2),
+                                NULL, NULL, 0, 0);
+}
+
+Datum floatfile_with_bounds_percentiles(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_with_bounds_percentiles);
+/**
+ * floatfile_with_bounds_percentiles - Like floatfile_percentiles
+ * but only includes values whose timestamps are in the given range.
+ */
+Datum
+floatfile_with_bounds_percentiles(PG_FUNCTION_ARGS)
+{
+  if (PG_ARGISNULL(0) || PG_ARGISNULL(1) || PG_ARGISNULL(2) || PG_ARGISNULL(3) || PG_ARGISNULL(4)) PG_RETURN_NULL();
+
+  return _floatfile_percentiles(fcinfo, NULL, GET_STR(PG_GETARG_TEXT_P(0)), PG_GETARG_ARRAYTYPE_P(1),
+                                NULL, GET_STR(PG_GETARG_TEXT_P(2)), PG_GETARG_FLOAT8(3), PG_GETARG_FLOAT8(4));
+}
+
+Datum floatfile_in_tablespace_with_bounds_percentiles(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_in_tablespace_with_bounds_percentiles);
+/**
+ * floatfile_in_tablespace_with_bounds_percentiles - Like floatfile_with_bounds_percentiles
+ * but the files are in tablespaces.
+ */
+Datum
+floatfile_in_tablespace_with_bounds_percentiles(PG_FUNCTION_ARGS)
+{
+  char *xs_tablespace = NULL;
+  char *ts_tablespace = NULL;
+
+  if (PG_ARGISNULL(1) || PG_ARGISNULL(2) || PG_ARGISNULL(4) || PG_ARGISNULL(5) || PG_ARGISNULL(6)) PG_RETURN_NULL();
+
+  if (!PG_ARGISNULL(0)) xs_tablespace = GET_STR(PG_GETARG_TEXT_P(0));
+  if (!PG_ARGISNULL(3)) ts_tablespace = GET_STR(PG_GETARG_TEXT_P(3));
+  return _floatfile_percentiles(fcinfo, xs_tablespace, GET_STR(PG_GETARG_TEXT_P(1)), PG_GETARG_ARRAYTYPE_P(2),
+                                ts_tablespace, GET_STR(PG_GETARG_TEXT_P(4)), PG_GETARG_FLOAT8(5), PG_GETARG_FLOAT8(6));
+}
+
+/**
+ * _floatfile_downsample - Returns a (timestamps, vals) row of arrays
+ * with at most `n_points` points summarizing the values whose timestamps are between `t_start` and `t_end`.
+ *
+ * `method` is minmax, mean, or lttb (see build_downsample).
+ */
+static Datum _floatfile_downsample(FunctionCallInfo fcinfo, char *xs_tablespace, char *xs_filename,
+                                   char *ts_tablespace, char *ts_filename, float8 t_start, float8 t_end,
+                                   int32 n_points, char *method_name) {
+  downsample_method method;
+  int32 xs_filename_hash, ts_filename_hash;
+  int x_fd = 0, x_nulls_fd = 0;
+  rollup_files x_rollups = NO_ROLLUPS;
+  int t_fd = 0, t_nulls_fd = 0;
+  rollup_files t_rollups = NO_ROLLUPS;
+  ssize_t min_pos, max_pos;
+  float8 *out_ts, *out_xs;
+  int out_count = 0;
+  char *errstr = NULL;
+  scan_options opts;
+  TupleDesc tupdesc;
+  Datum values[2];
+  bool nulls[2] = {false, false};
+  Datum *datums;
+  int16 typeWidth;
+  bool typeByValue;
+  char typeAlignmentCode;
+  int i;
+
+  if (strcmp(method_name, "minmax") == 0) {
+    method = DOWNSAMPLE_MINMAX;
+    if (n_points < 2) ereport(ERROR, (errmsg("minmax downsampling needs at least 2 points")));
+  } else if (strcmp(method_name, "mean") == 0) {
+    method = DOWNSAMPLE_MEAN;
+    if (n_points < 1) ereport(ERROR, (errmsg("mean downsampling needs at least 1 point")));
+  } else if (strcmp(method_name, "lttb") == 0) {
+    method = DOWNSAMPLE_LTTB;
+    if (n_points < 3) ereport(ERROR, (errmsg("lttb downsampling needs at least 3 points")));
+  } else {
+    ereport(ERROR, (errmsg("method must be minmax, mean, or lttb, not %s", method_name)));
+  }
+  if (n_points > MaxAllocSize / sizeof(Datum)) ereport(ERROR, (errmsg("n_points is too big")));
+
+  if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE) {
+    ereport(ERROR, (errmsg("floatfile_downsample must return a row")));
+  }
+  tupdesc = BlessTupleDesc(tupdesc);
+
+  out_ts = palloc(sizeof(float8) * n_points);
+  out_xs = palloc(sizeof(float8) * n_points);
+
+  ts_filename_hash = hash_filename(ts_filename);
+  DirectFunctionCall2(pg_advisory_lock_shared_int4, FLOATFILE_LOCK_PREFIX, ts_filename_hash);
+  xs_filename_hash = hash_filename(xs_filename);
+  DirectFunctionCall2(pg_advisory_lock_shared_int4, FLOATFILE_LOCK_PREFIX, xs_filename_hash);
+
+  if (open_floatfile_for_reading(ts_tablespace, ts_filename, &t_fd, &t_nulls_fd) == -1) {
+    errstr = strerror(errno);
+    goto bail;
+  }
+  open_floatfile_rollups_for_reading(ts_tablespace, ts_filename, &t_rollups);
+
+  if (open_floatfile_for_reading(xs_tablespace, xs_filename, &x_fd, &x_nulls_fd) == -1) {
+    errstr = strerror(errno);
+    goto bail;
+  }
+  open_floatfile_rollups_for_reading(xs_tablespace, xs_filename, &x_rollups);
+
+  opts = floatfile_scan_options(t_fd);
+  find_bounds_start_end(t_fd, t_nulls_fd, t_start, t_end, &min_pos, &max_pos, &opts, &errstr);
+  if (errstr) goto bail;
+  if (min_pos == -1 || max_pos == -1) {
+    // Nothing is in range so just return, but with no error.
+    goto bail;
+  }
+
+  opts = floatfile_scan_options(x_fd);
+  build_downsample(x_fd, x_nulls_fd, &x_rollups, t_fd, t_nulls_fd, &t_rollups, min_pos, max_pos,
+                   t_start, t_end, n_points, method, out_ts, out_xs, &out_count, &opts, &errstr);
+
+bail:
+  if (x_fd       && close(x_fd))       errstr = "Can't close x_fd";
+  if (x_nulls_fd && close(x_nulls_fd)) errstr = "Can't close x_nulls_fd";
+  if (close_floatfile_rollups(&x_rollups)) errstr = "Can't close x_rollups";
+  if (t_fd       && close(t_fd))       errstr = "Can't close t_fd";
+  if (t_nulls_fd && close(t_nulls_fd)) errstr = "Can't close t_nulls_fd";
+  if (close_floatfile_rollups(&t_rollups)) errstr = "Can't close t_rollups";
+  DirectFunctionCall2(pg_advisory_unlock_shared_int4, FLOATFILE_LOCK_PREFIX, xs_filename_hash);
+  DirectFunctionCall2(pg_advisory_unlock_shared_int4, FLOATFILE_LOCK_PREFIX, ts_filename_hash);
+  if (errstr) elog(ERROR, "%s", errstr);
+
+  get_typlenbyvalalign(FLOAT8OID, &typeWidth, &typeByValue, &typeAlignmentCode);
+  datums = palloc(sizeof(Datum) * Max(out_count, 1));
+  for (i = 0; i < out_count; i++) datums[i] = Float8GetDatum(out_ts[i]);
+  values[0] = PointerGetDatum(construct_array(datums, out_count, FLOAT8OID, typeWidth, typeByValue, typeAlignmentCode));
+  for (i = 0; i < out_count; i++) datums[i] = Float8GetDatum(out_xs[i]);
+  values[1] = PointerGetDatum(construct_array(datums, out_count, FLOAT8OID, typeWidth, typeByValue, typeAlignmentCode));
+
+  PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+Datum floatfile_downsample(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_downsample);
+/**
+ * floatfile_downsample - Returns at most `n_points` (timestamp, value) pairs for charting a floatfile
+ * between two timestamps.
+ */
+Datum
+floatfile_downsample(PG_FUNCTION_ARGS)
+{
+  int i;
+
+  for (i = 0; i < 6; i++) {
+    if (PG_ARGISNULL(i)) PG_RETURN_NULL();
+  }
+
+  return _floatfile_downsample(fcinfo, NULL, GET_STR(PG_GETARG_TEXT_P(0)), NULL, GET_STR(PG_GETARG_TEXT_P(1)),
+                               PG_GETARG_FLOAT8(2), PG_GETARG_FLOAT8(3), PG_GETARG_INT32(4), GET_STR(PG_GETARG_TEXT_P(5)));
+}
+
+Datum floatfile_in_tablespace_downsample(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_in_tablespace_downsample);
+/**
+ * floatfile_in_tablespace_downsample - Like floatfile_downsample but the files are in tablespaces.
+ */
+Datum
+floatfile_in_tablespace_downsample(PG_FUNCTION_ARGS)
+{
+  char *xs_tablespace = NULL;
+  char *ts_tablespace = NULL;
+  int i;
+
+  for (i = 1; i < 8; i++) {
+    if (i != 2 && PG_ARGISNULL(i)) PG_RETURN_NULL();
+  }
+
+  if (!PG_ARGISNULL(0)) xs_tablespace = GET_STR(PG_GETARG_TEXT_P(0));
+  if (!PG_ARGISNULL(2)) ts_tablespace = GET_STR(PG_GETARG_TEXT_P(2));
+  return _floatfile_downsample(fcinfo, xs_tablespace, GET_STR(PG_GETARG_TEXT_P(1)), ts_tablespace, GET_STR(PG_GETARG_TEXT_P(3)),
+                               PG_GETARG_FLOAT8(4), PG_GETARG_FLOAT8(5), PG_GETARG_INT32(6), GET_STR(PG_GETARG_TEXT_P(7)));
+}
+
+/**
+ * stats_agg - One of the aggregates of a float_stats
+ * that floatfile_time_buckets and floatfile_bucket_agg can return.
+ */
+typedef enum {
+  STATS_AGG_COUNT,
+  STATS_AGG_SUM,
+  STATS_AGG_MIN,
+  STATS_AGG_MAX,
+  STATS_AGG_MEAN,
+  STATS_AGG_STDDEV
+} stats_agg;
+
+// In the same order as stats_agg:
+static const char *const stats_agg_names[] = {"count", "sum", "min", "max", "mean", "stddev"};
+
+/**
+ * parse_stats_agg - Returns the stats_agg named `name`,
+ * or reports an error about the argument `argname`.
+ */
+static stats_agg parse_stats_agg(const char *argname, const char *name) {
+  int i;
+
+  for (i = 0; i < lengthof(stats_agg_names); i++) {
+    if (strcmp(name, stats_agg_names[i]) == 0) return (stats_agg)i;
+  }
+  ereport(ERROR, (errmsg("%s must be count, sum, min, max, mean, or stddev, not %s", argname, name)));
+  return STATS_AGG_COUNT;   // not reached
+}
+
+/**
+ * stats_agg_array - Returns a float[] with aggregate `agg` of each bucket.
+ *
+ * Like floatfile_stats, everything but count is NULL for an empty bucket,
+ * and stddev needs at least two values.
+ */
+static Datum stats_agg_array(stats_agg agg, int nbuckets, const float_stats *buckets) {
+  Datum *datums;
+  bool *nulls;
+  int16 typeWidth;
+  bool typeByValue;
+  char typeAlignmentCode;
+  int dims[1];
+  int lbs[1];     // Lower Bounds of each dimension
+  const float_stats *s;
+  int i;
+
+  datums = palloc(sizeof(Datum) * Max(nbuckets, 1));
+  nulls = palloc(sizeof(bool) * Max(nbuckets, 1));
+  for (i = 0; i < nbuckets; i++) {
+    s = &buckets[i];
+    nulls[i] = agg == STATS_AGG_STDDEV ? s->count < 2 : agg != STATS_AGG_COUNT && s->count == 0;
+    switch (agg) {
+      case STATS_AGG_COUNT:  datums[i] = Float8GetDatum(s->count); break;
+      case STATS_AGG_SUM:    datums[i] = Float8GetDatum(s->sum); break;
+      case STATS_AGG_MIN:    datums[i] = Float8GetDatum(s->min); break;
+      case STATS_AGG_MAX:    datums[i] = Float8GetDatum(s->max); break;
+      case STATS_AGG_MEAN:   datums[i] = Float8GetDatum(s->mean); break;
+      case STATS_AGG_STDDEV: datums[i] = Float8GetDatum(nulls[i] ? 0 : sqrt(s->m2 / (s->count - 1))); break;
+    }
+  }
+
+  dims[0] = nbuckets;
+  lbs[0] = 1;
+  get_typlenbyvalalign(FLOAT8OID, &typeWidth, &typeByValue, &typeAlignmentCode);
+  return PointerGetDatum(construct_md_array(datums, nulls, 1, dims, lbs, FLOAT8OID,
+                                            typeWidth, typeByValue, typeAlignmentCode));
+}
+
+/**
+ * _floatfile_time_buckets - Splits `t_start` up to (not including) `t_end`
+ * into buckets `width` apart (the last one may be short),
+ * and returns a float[] per aggregate in `aggs`
+ * with that aggregate of the values whose timestamps fall in each bucket.
+ *
+ * We read the two floatfiles side by side just once however many aggregates you ask for,
+ * and take whole chunks from their rollups when they can (see build_time_buckets).
+ * Sets `*narrays`.
+ */
+static Datum *_floatfile_time_buckets(char *xs_tablespace, char *xs_filename,
+                                      char *ts_tablespace, char *ts_filename,
+                                      float8 t_start, float8 t_end, float8 width, ArrayType *aggs_arg,
+                                      int *narrays) {
+  Datum *agg_datums;
+  stats_agg *aggs;
+  int naggs;
+  float8 span;
+  int nbuckets = 0;
+  float4 t_min, t_max;
+  int32 xs_filename_hash, ts_filename_hash;
+  int x_fd = 0, x_nulls_fd = 0;
+  rollup_files x_rollups = NO_ROLLUPS;
+  int t_fd = 0, t_nulls_fd = 0;
+  rollup_files t_rollups = NO_ROLLUPS;
+  ssize_t min_pos, max_pos;
+  float_stats *buckets;
+  char *errstr = NULL;
+  scan_options opts;
+  Datum *arrays;
+  int i;
+
+  agg_datums = array_arg_datums(aggs_arg, TEXTOID, "aggs", &naggs);
+  aggs = palloc(sizeof(stats_agg) * Max(naggs, 1));
+  for (i = 0; i < naggs; i++) {
+    aggs[i] = parse_stats_agg("aggs", GET_STR(DatumGetTextP(agg_datums[i])));
+  }
+  if (!(width > 0)) ereport(ERROR, (errmsg("bucket_width must be positive")));
+  if (t_end > t_start) {
+    span = ceil((t_end - t_start) / width);
+    if (!(span <= MaxAllocSize / sizeof(float_stats))) ereport(ERROR, (errmsg("too many buckets")));
+    nbuckets = (int)span;
+  }
+
+  *narrays = naggs;
+  arrays = palloc(sizeof(Datum) * Max(naggs, 1));
+  buckets = palloc0(sizeof(float_stats) * Max(nbuckets, 1));
+  for (i = 0; i < nbuckets; i++) stats_init(&buckets[i]);
+  if (naggs == 0 || nbuckets == 0) goto done;
+
+  ts_filename_hash = hash_filename(ts_filename);
+  DirectFunctionCall2(pg_advisory_lock_shared_int4, FLOATFILE_LOCK_PREFIX, ts_filename_hash);
+  xs_filename_hash = hash_filename(xs_filename);
+  DirectFunctionCall2(pg_advisory_lock_shared_int4, FLOATFILE_LOCK_PREFIX, xs_filename_hash);
+
+  if (open_floatfile_for_reading(ts_tablespace, ts_filename, &t_fd, &t_nulls_fd) == -1) {
+    errstr = strerror(errno);
+    goto bail;
+  }
+  open_floatfile_rollups_for_reading(ts_tablespace, ts_filename, &t_rollups);
+
+  if (open_floatfile_for_reading(xs_tablespace, xs_filename, &x_fd, &x_nulls_fd) == -1) {
+    errstr = strerror(errno);
+    goto bail;
+  }
+  open_floatfile_rollups_for_reading(xs_tablespace, xs_filename, &x_rollups);
+
+  // find_bounds_start_end compares with floats,
+  // so round the range outward and let build_time_buckets trim it exactly:
+  t_min = (float4)t_start;
+  if (t_min > t_start) t_min = nextafterf(t_min, -INFINITY);
+  t_max = (float4)t_end;
+  if (t_max < t_end) t_max = nextafterf(t_max, INFINITY);
+
+  opts = floatfile_scan_options(t_fd);
+  find_bounds_start_end(t_fd, t_nulls_fd, t_min, t_max, &min_pos, &max_pos, &opts, &errstr);
+  if (errstr) goto bail;
+  if (min_pos == -1 || max_pos == -1) {
+    // Nothing is in range so just return, but with no error.
+    goto bail;
+  }
+
+  opts = floatfile_scan_options(x_fd);
+  build_time_buckets(x_fd, x_nulls_fd, &x_rollups, t_fd, t_nulls_fd, &t_rollups, min_pos, max_pos,
+                     t_start, t_end, width, nbuckets, buckets, &opts, &errstr);
+
+bail:
+  if (x_fd       && close(x_fd))       errstr = "Can't close x_fd";
+  if (x_nulls_fd && close(x_nulls_fd)) errstr = "Can't close x_nulls_fd";
+  if (close_floatfile_rollups(&x_rollups)) errstr = "Can't close x_rollups";
+  if (t_fd       && close(t_fd))       errstr = "Can't close t_fd";
+  if (t_nulls_fd && close(t_nulls_fd)) errstr = "Can't close t_nulls_fd";
+  if (close_floatfile_rollups(&t_rollups)) errstr = "Can't close t_rollups";
+  DirectFunctionCall2(pg_advisory_unlock_shared_int4, FLOATFILE_LOCK_PREFIX, xs_filename_hash);
+  DirectFunctionCall2(pg_advisory_unlock_shared_int4, FLOATFILE_LOCK_PREFIX, ts_filename_hash);
+  if (errstr) elog(ERROR, "%s", errstr);
+
+done:
+  for (i = 0; i < naggs; i++) arrays[i] = stats_agg_array(aggs[i], nbuckets, buckets);
+  return arrays;
+}
+
+/**
+ * floatfile_time_buckets_srf - Returns the arrays from _floatfile_time_buckets one row at a time.
+ *
+ * `xs_tablespace_arg` and `ts_tablespace_arg` give where the tablespace arguments are,
+ * or -1 if this variant doesn't have them.
+ * The values filename comes right after its tablespace (or first),
+ * and the timestamps filename, start, end, bucket width, and aggs after that.
+ */
+static Datum floatfile_time_buckets_srf(FunctionCallInfo fcinfo, int xs_tablespace_arg, int ts_tablespace_arg) {
+  FuncCallContext *funcctx;
+  MemoryContext oldcontext;
+  char *xs_tablespace = NULL, *ts_tablespace = NULL;
+  int xs_arg = xs_tablespace_arg + 1;
+  int ts_arg = ts_tablespace_arg == -1 ? xs_arg + 1 : ts_tablespace_arg + 1;
+  Datum *arrays;
+  int narrays = 0, i;
+  bool any_null = false;
+
+  if (SRF_IS_FIRSTCALL()) {
+    funcctx = SRF_FIRSTCALL_INIT();
+    oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+    if (PG_ARGISNULL(xs_arg)) any_null = true;
+    for (i = ts_arg; i < ts_arg + 5; i++) {
+      if (PG_ARGISNULL(i)) any_null = true;
+    }
+
+    if (!any_null) {
+      if (xs_tablespace_arg != -1 && !PG_ARGISNULL(xs_tablespace_arg)) xs_tablespace = GET_STR(PG_GETARG_TEXT_P(xs_tablespace_arg));
+      if (ts_tablespace_arg != -1 && !PG_ARGISNULL(ts_tablespace_arg)) ts_tablespace = GET_STR(PG_GETARG_TEXT_P(ts_tablespace_arg));
+      funcctx->user_fctx = _floatfile_time_buckets(xs_tablespace, GET_STR(PG_GETARG_TEXT_P(xs_arg)),
+                                                   ts_tablespace, GET_STR(PG_GETARG_TEXT_P(ts_arg)),
+                                                   PG_GETARG_FLOAT8(ts_arg + 1), PG_GETARG_FLOAT8(ts_arg + 2),
+                                                   PG_GETARG_FLOAT8(ts_arg + 3), PG_GETARG_ARRAYTYPE_P(ts_arg + 4),
+                                                   &narrays);
+    }
+    funcctx->max_calls = narrays;
+
+    MemoryContextSwitchTo(oldcontext);
+  }
+
+  funcctx = SRF_PERCALL_SETUP();
+  arrays = (Datum *)funcctx->user_fctx;
+
+  if (funcctx->call_cntr < funcctx->max_calls) {
+    SRF_RETURN_NEXT(funcctx, arrays[funcctx->call_cntr]);
+  } else {
+    SRF_RETURN_DONE(funcctx);
+  }
+}
+
+Datum floatfile_time_buckets(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_time_buckets);
+/**
+ * floatfile_time_buckets - Groups a floatfile's values into equal time buckets by a timestamps floatfile
+ * and returns one array per aggregate, like a GROUP BY on the bucket.
+ */
+Datum
+floatfile_time_buckets(PG_FUNCTION_ARGS)
+{
+  return floatfile_time_buckets_srf(fcinfo, -1, -1);
+}
+
+Datum floatfile_in_tablespace_time_buckets(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_in_tablespace_time_buckets);
+/**
+ * floatfile_in_tablespace_time_buckets - Like floatfile_time_buckets but the files are in tablespaces.
+ */
+Datum
+floatfile_in_tablespace_time_buckets(PG_FUNCTION_ARGS)
+{
+  return floatfile_time_buckets_srf(fcinfo, 0, 2);
+}
+
+/**
+ * _floatfile_bucket_agg - Returns a float[] with aggregate `agg_name` of the ys
+ * whose xs fall in each of `x_count` buckets starting at `x_min`, `x_width` apart.
+ *
+ * If `ts_filename` is not NULL we only include the pairs
+ * whose timestamps are between `t_min` and `t_max`, like floatfile_with_bounds_to_hist2d.
+ */
+static Datum _floatfile_bucket_agg(char *xs_tablespace, char *xs_filename, char *ys_tablespace, char *ys_filename,
+                                   float8 x_min, float8 x_width, int32 x_count, char *agg_name,
+                                   char *ts_tablespace, char *ts_filename, float8 t_min, float8 t_max) {
+  stats_agg agg;
+  int32 xs_filename_hash, ys_filename_hash, ts_filename_hash = 0;
+  int x_fd = 0, x_nulls_fd = 0, y_fd = 0, y_nulls_fd = 0;
+  int t_fd = 0, t_nulls_fd = 0;
+  ssize_t min_pos, max_pos;
+  float_stats *buckets;
+  char *errstr = NULL;
+  scan_options opts;
+  int i;
+
+  agg = parse_stats_agg("agg", agg_name);
+  if (x_count < 0) ereport(ERROR, (errmsg("x_bucket_count can't be negative")));
+  if (x_count > MaxAllocSize / sizeof(float_stats)) ereport(ERROR, (errmsg("x_bucket_count is too big")));
+
+  buckets = palloc(sizeof(float_stats) * Max(x_count, 1));
+  for (i = 0; i < x_count; i++) stats_init(&buckets[i]);
+
+  if (ts_filename) {
+    ts_filename_hash = hash_filename(ts_filename);
+    DirectFunctionCall2(pg_advisory_lock_shared_int4, FLOATFILE_LOCK_PREFIX, ts_filename_hash);
+  }
+  xs_filename_hash = hash_filename(xs_filename);
+  ys_filename_hash = hash_filename(ys_filename);
+  DirectFunctionCall2(pg_advisory_lock_shared_int4, FLOATFILE_LOCK_PREFIX, xs_filename_hash);
+  DirectFunctionCall2(pg_advisory_lock_shared_int4, FLOATFILE_LOCK_PREFIX, ys_filename_hash);
+
+  if (ts_filename && open_floatfile_for_reading(ts_tablespace, ts_filename, &t_fd, &t_nulls_fd) == -1) {
+    errstr = strerror(errno);
+    goto bail;
+  }
+  if (open_floatfile_for_reading(xs_tablespace, xs_filename, &x_fd, &x_nulls_fd) == -1) {
+    errstr = strerror(errno);
+    goto bail;
+  }
+  if (open_floatfile_for_reading(ys_tablespace, ys_filename, &y_fd, &y_nulls_fd) == -1) {
+    errstr = strerror(errno);
+    goto bail;
+  }
+
+  if (ts_filename) {
+    opts = floatfile_scan_options(t_fd);
+    find_bounds_start_end(t_fd, t_nulls_fd, t_min, t_max, &min_pos, &max_pos, &opts, &errstr);
+    if (errstr) goto bail;
+    if (min_pos == -1 || max_pos == -1) {
+      // The buckets are empty so just return, but with no error.
+      goto bail;
+    }
+
+    opts = floatfile_scan_options(x_fd);
+    build_bucket_stats_with_bounds(x_fd, x_nulls_fd, x_min, x_width, x_count, y_fd, y_nulls_fd, buckets,
+                                   min_pos, max_pos, &opts, &errstr);
+  } else {
+    opts = floatfile_scan_options(x_fd);
+    build_bucket_stats(x_fd, x_nulls_fd, x_min, x_width, x_count, y_fd, y_nulls_fd, buckets, &opts, &errstr);
+  }
+
+bail:
+  if (x_fd       && close(x_fd))       errstr = "Can't close x_fd";
+  if (x_nulls_fd && close(x_nulls_fd)) errstr = "Can't close x_nulls_fd";
+  if (y_fd       && close(y_fd))       errstr = "Can't close y_fd";
+  if (y_nulls_fd && close(y_nulls_fd)) errstr = "Can't close y_nulls_fd";
+  DirectFunctionCall2(pg_advisory_unlock_shared_int4, FLOATFILE_LOCK_PREFIX, xs_filename_hash);
+  DirectFunctionCall2(pg_advisory_unlock_shared_int4, FLOATFILE_LOCK_PREFIX, ys_filename_hash);
+  if (ts_filename) {
+    if (t_fd       && close(t_fd))       errstr = "Can't close t_fd";
+    if (t_nulls_fd && close(t_nulls_fd)) errstr = "Can't close t_nulls_fd";
+    DirectFunctionCall2(pg_advisory_unlock_shared_int4, FLOATFILE_LOCK_PREFIX, ts_filename_hash);
+  }
+  if (errstr) elog(ERROR, "%s", errstr);
+
+  return stats_agg_array(agg, x_count, buckets);
+}
+
+Datum floatfile_bucket_agg(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_bucket_agg);
+/**
+ * floatfile_bucket_agg - Groups one floatfile's values by the buckets of another's,
+ * e.g. the mean y for each range of x, or a histogram of x weighted by y.
+ */
+Datum
+floatfile_bucket_agg(PG_FUNCTION_ARGS)
+{
+  int i;
+
+  for (i = 0; i < 6; i++) {
+    if (PG_ARGISNULL(i)) PG_RETURN_NULL();
+  }
+
+  PG_RETURN_DATUM(_floatfile_bucket_agg(NULL, GET_STR(PG_GETARG_TEXT_P(0)), NULL, GET_STR(PG_GETARG_TEXT_P(1)),
+                                        PG_GETARG_FLOAT8(2), PG_GETARG_FLOAT8(3), PG_GETARG_INT32(4),
+                                        GET_STR(PG_GETARG_TEXT_P(5)), NULL, NULL, 0, 0));
+}
+
+Datum floatfile_with_bounds_bucket_agg(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_with_bounds_bucket_agg);
+/**
+ * floatfile_with_bounds_bucket_agg - Like floatfile_bucket_agg,
+ * but only for the pairs whose timestamps are between two values.
+ */
+Datum
+floatfile_with_bounds_bucket_agg(PG_FUNCTION_ARGS)
+{
+  int i;
+
+  for (i = 0; i < 9; i++) {
+    if (PG_ARGISNULL(i)) PG_RETURN_NULL();
+  }
+
+  PG_RETURN_DATUM(_floatfile_bucket_agg(NULL, GET_STR(PG_GETARG_TEXT_P(0)), NULL, GET_STR(PG_GETARG_TEXT_P(1)),
+                                        PG_GETARG_FLOAT8(2), PG_GETARG_FLOAT8(3), PG_GETARG_INT32(4),
+                                        GET_STR(PG_GETARG_TEXT_P(5)),
+                                        NULL, GET_STR(PG_GETARG_TEXT_P(6)), PG_GETARG_FLOAT8(7), PG_GETARG_FLOAT8(8)));
+}
+
+Datum floatfile_in_tablespace_bucket_agg(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_in_tablespace_bucket_agg);
+/**
+ * floatfile_in_tablespace_bucket_agg - Like floatfile_bucket_agg but the files are in tablespaces.
+ */
+Datum
+floatfile_in_tablespace_bucket_agg(PG_FUNCTION_ARGS)
+{
+  char *xs_tablespace = NULL;
+  char *ys_tablespace = NULL;
+  int i;
+
+  for (i = 1; i < 8; i++) {
+    if (i != 2 && PG_ARGISNULL(i)) PG_RETURN_NULL();
+  }
+
+  if (!PG_ARGISNULL(0)) xs_tablespace = GET_STR(PG_GETARG_TEXT_P(0));
+  if (!PG_ARGISNULL(2)) ys_tablespace = GET_STR(PG_GETARG_TEXT_P(2));
+  PG_RETURN_DATUM(_floatfile_bucket_agg(xs_tablespace, GET_STR(PG_GETARG_TEXT_P(1)), ys_tablespace, GET_STR(PG_GETARG_TEXT_P(3)),
+                                        PG_GETARG_FLOAT8(4), PG_GETARG_FLOAT8(5), PG_GETARG_INT32(6),
+                                        GET_STR(PG_GETARG_TEXT_P(7)), NULL, NULL, 0, 0));
+}
+
+Datum floatfile_in_tablespace_with_bounds_bucket_agg(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_in_tablespace_with_bounds_bucket_agg);
+/**
+ * floatfile_in_tablespace_with_bounds_bucket_agg - Like floatfile_with_bounds_bucket_agg
+ * but the files are in tablespaces.
+ */
+Datum
+floatfile_in_tablespace_with_bounds_bucket_agg(PG_FUNCTION_ARGS)
+{
+  char *xs_tablespace = NULL;
+  char *ys_tablespace = NULL;
+  char *ts_tablespace = NULL;
+  int i;
+
+  for (i = 1; i < 12; i++) {
+    if (i != 2 && i != 8 && PG_ARGISNULL(i)) PG_RETURN_NULL();
+  }
+
+  if (!PG_ARGISNULL(0)) xs_tablespace = GET_STR(PG_GETARG_TEXT_P(0));
+  if (!PG_ARGISNULL(2)) ys_tablespace = GET_STR(PG_GETARG_TEXT_P(2));
+  if (!PG_ARGISNULL(8)) ts_tablespace = GET_STR(PG_GETARG_TEXT_P(8));
+  PG_RETURN_DATUM(_floatfile_bucket_agg(xs_tablespace, GET_STR(PG_GETARG_TEXT_P(1)), ys_tablespace, GET_STR(PG_GETARG_TEXT_P(3)),
+                                        PG_GETARG_FLOAT8(4), PG_GETARG_FLOAT8(5), PG_GETARG_INT32(6),
+                                        GET_STR(PG_GETARG_TEXT_P(7)),
+                                        ts_tablespace, GET_STR(PG_GETARG_TEXT_P(9)), PG_GETARG_FLOAT8(10), PG_GETARG_FLOAT8(11)));
+}
+
+/**
+ * combine_op_arg - Returns the combine_op named `op`.
+ */
+static combine_op combine_op_arg(const char *op) {
+  if (strcmp(op, "+") == 0) return COMBINE_ADD;
+  if (strcmp(op, "-") == 0) return COMBINE_SUB;
+  if (strcmp(op, "*") == 0) return COMBINE_MUL;
+  if (strcmp(op, "/") == 0) return COMBINE_DIV;
+  if (strcmp(op, "min") == 0) return COMBINE_MIN;
+  if (strcmp(op, "max") == 0) return COMBINE_MAX;
+  if (strcmp(op, "neg") == 0) return COMBINE_NEG;
+  if (strcmp(op, "abs") == 0) return COMBINE_ABS;
+  if (strcmp(op, "sqrt") == 0) return COMBINE_SQRT;
+  if (strcmp(op, "exp") == 0) return COMBINE_EXP;
+  if (strcmp(op, "ln") == 0) return COMBINE_LN;
+  ereport(ERROR, (errmsg("unknown op: %s", op)));
+  return COMBINE_ADD;   // not reached
+}
+
+/**
+ * floatfile_writer - A floatfile we're streaming values into, from open_floatfile_for_writing.
+ */
+typedef struct floatfile_writer {
+  char path[FLOATFILE_MAX_PATH + 1];
+  int pathlen;
+  int vals_fd, nulls_fd;
+  ssize_t start_pos;    // how many values it had when we opened it
+  bool created;
+  rollup_files rollups;
+  int rollups_result;
+} floatfile_writer;
+
+/**
+ * open_floatfile_for_writing - Creates the floatfile `filename` to stream values into,
+ * or if `append` then opens it to append to (creating it if it doesn't exist).
+ *
+ * Returns 0 on success or -1 on failure (and sets errno).
+ * Either way call finish_floatfile_writer afterwards.
+ */
+static int open_floatfile_for_writing(const char *tablespace, const char *filename, bool append, floatfile_writer *w) {
+  char root_directory[FLOATFILE_MAX_PATH + 1],
+       relative_target[FLOATFILE_MAX_PATH + 1];
+  struct stat fileinfo;
+
+  memset(w, 0, sizeof(floatfile_writer));
+  w->vals_fd = w->nulls_fd = -1;
+  w->rollups = (rollup_files)NO_ROLLUPS;
+
+  validate_target_filename(filename);
+  floatfile_root_path(tablespace, root_directory, FLOATFILE_MAX_PATH + 1);
+  floatfile_relative_target_path(filename, relative_target, FLOATFILE_MAX_PATH + 1);
+  mkdirs_for_floatfile(root_directory, relative_target);
+  w->pathlen = floatfile_filename_to_full_path(tablespace, filename, w->path, FLOATFILE_MAX_PATH + 1);
+
+  w->nulls_fd = open(w->path, O_WRONLY | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+  if (w->nulls_fd != -1) {
+    w->created = true;
+  } else if (append && errno == EEXIST) {
+    w->nulls_fd = open(w->path, O_WRONLY | O_APPEND);
+    if (w->nulls_fd == -1 || fstat(w->nulls_fd, &fileinfo)) return -1;
+    w->start_pos = fileinfo.st_size / sizeof(bool);
+  } else {
+    return -1;
+  }
+
+  w->path[w->pathlen - 1] = FLOATFILE_FLOATS_SUFFIX;
+  w->vals_fd = open(w->path, w->created ? O_WRONLY | O_CREAT | O_EXCL : O_WRONLY | O_APPEND | O_CREAT, S_IRUSR | S_IWUSR);
+  if (w->vals_fd == -1) return -1;
+
+  w->rollups_result = open_floatfile_rollups_for_writing(w->path, w->pathlen, w->start_pos, &w->rollups);
+  return 0;
+}
+
+/**
+ * finish_floatfile_writer - Syncs and closes a floatfile from open_floatfile_for_writing,
+ * or if not `ok` then puts it back how it was:
+ * removing it if we created it, or else cutting off whatever we appended.
+ *
+ * Returns 0 on success or -1 on failure (and sets errno).
+ */
+static int finish_floatfile_writer(floatfile_writer *w, bool ok) {
+  int result = 0, err = 0;
+
+  if (ok && ((w->nulls_fd != -1 && fsync(w->nulls_fd)) || (w->vals_fd != -1 && fsync(w->vals_fd)))) {
+    err = errno;
+    ok = false;
+    result = -1;
+  }
+  if (!ok && !w->created) {
+    if (w->nulls_fd != -1) (void)!ftruncate(w->nulls_fd, w->start_pos * sizeof(bool));
+    if (w->vals_fd != -1) (void)!ftruncate(w->vals_fd, w->start_pos * sizeof(float8));
+  }
+  if (w->nulls_fd != -1 && close(w->nulls_fd) && result == 0) {
+    err = errno;
+    result = -1;
+  }
+  if (w->vals_fd != -1 && close(w->vals_fd) && result == 0) {
+    err = errno;
+    result = -1;
+  }
+  w->vals_fd = w->nulls_fd = -1;
+
+  if (w->pathlen) finish_floatfile_index(w->path, w->pathlen, &w->rollups, ok && result == 0);
+  if (w->pathlen) finish_floatfile_rollups(w->path, w->pathlen, &w->rollups, ok && result == 0 ? w->rollups_result : -1);
+  if ((!ok || result) && w->created) {
+    w->path[w->pathlen - 1] = FLOATFILE_NULLS_SUFFIX;
+    unlink(w->path);
+    w->path[w->pathlen - 1] = FLOATFILE_FLOATS_SUFFIX;
+    unlink(w->path);
+  }
+
+  errno = err;
+  return result;
+}
+
+/**
+ * is_out_hash - Tells whether `hash` is one of the `nout` in `out_hashes`.
+ */
+static bool is_out_hash(int32 hash, const int32 *out_hashes, int nout) {
+  int i;
+
+  for (i = 0; i < nout; i++) {
+    if (out_hashes[i] == hash) return true;
+  }
+  return false;
+}
+
+/**
+ * lock_floatfiles_for_writing - Takes the locks of the `n` floatfiles whose hashes are in `hashes`,
+ * exclusively for the `nout` in `out_hashes` and shared for the rest.
+ *
+ * We sort `hashes` first (so pass the same array to unlock_floatfiles_for_writing)
+ * so that two callers can't deadlock.
+ */
+static void lock_floatfiles_for_writing(int32 *hashes, int n, const int32 *out_hashes, int nout) {
+  int i;
+
+  qsort(hashes, n, sizeof(int32), compare_int32);
+  for (i = 0; i < n; i++) {
+    if (is_out_hash(hashes[i], out_hashes, nout)) {
+      DirectFunctionCall2(pg_advisory_lock_int4, FLOATFILE_LOCK_PREFIX, hashes[i]);
+    } else {
+      DirectFunctionCall2(pg_advisory_lock_shared_int4, FLOATFILE_LOCK_PREFIX, hashes[i]);
+    }
+  }
+}
+
+static void unlock_floatfiles_for_writing(const int32 *hashes, int n, const int32 *out_hashes, int nout) {
+  int i;
+
+  for (i = 0; i < n; i++) {
+    if (is_out_hash(hashes[i], out_hashes, nout)) {
+      DirectFunctionCall2(pg_advisory_unlock_int4, FLOATFILE_LOCK_PREFIX, hashes[i]);
+    } else {
+      DirectFunctionCall2(pg_advisory_unlock_shared_int4, FLOATFILE_LOCK_PREFIX, hashes[i]);
+    }
+  }
+}
+
+/**
+ * _floatfile_combine - Saves `a_filename` `op` `b_filename` as the new floatfile `out_filename`,
+ * or `a_filename` `op` `b` if `b_filename` is NULL.
+ *
+ * We stream a block at a time, so the floatfiles can be as big as you like,
+ * and fsync the new files just once at the end.
+ * We take `out_filename`'s lock exclusively and the others' shared,
+ * all in sorted order so we can't deadlock against another combine.
+ * If anything goes wrong we remove whatever we wrote.
+ */
+static void _floatfile_combine(char *tablespace, char *out_filename, combine_op op,
+                               char *a_filename, char *b_filename, float8 b) {
+  int32 out_filename_hash, hashes[3];
+  int nlocked = 0;
+  int a_fd = 0, a_nulls_fd = 0;
+  int b_fd = -1, b_nulls_fd = -1;
+  floatfile_writer w = { .vals_fd = -1, .nulls_fd = -1 };
+  char *errstr = NULL;
+  scan_options opts;
+
+  validate_target_filename(out_filename);
+  if (COMBINE_UNARY(op)) b_filename = NULL;
+
+  out_filename_hash = hash_filename(out_filename);
+  hashes[nlocked++] = out_filename_hash;
+  hashes[nlocked++] = hash_filename(a_filename);
+  if (b_filename) hashes[nlocked++] = hash_filename(b_filename);
+  lock_floatfiles_for_writing(hashes, nlocked, &out_filename_hash, 1);
+
+  if (open_floatfile_for_reading(tablespace, a_filename, &a_fd, &a_nulls_fd) == -1) {
+    errstr = psprintf("Failed to open floatfile %s: %s", a_filename, strerror(errno));
+    a_fd = a_nulls_fd = 0;
+    goto bail;
+  }
+  if (b_filename && open_floatfile_for_reading(tablespace, b_filename, &b_fd, &b_nulls_fd) == -1) {
+    errstr = psprintf("Failed to open floatfile %s: %s", b_filename, strerror(errno));
+    b_fd = b_nulls_fd = -1;
+    goto bail;
+  }
+
+  if (open_floatfile_for_writing(tablespace, out_filename, false, &w)) {
+    errstr = psprintf("Failed to save floatfile %s: %s", out_filename, strerror(errno));
+    goto bail;
+  }
+
+  opts = floatfile_scan_options(a_fd);
+  build_combine(a_fd, a_nulls_fd, b_fd, b_nulls_fd, b, op, w.vals_fd, w.nulls_fd,
+                w.rollups.fd != -1 ? &w.rollups : NULL, &w.rollups_result, &opts, &errstr);
+
+bail:
+  if (a_fd       && close(a_fd))       errstr = "Can't close a_fd";
+  if (a_nulls_fd && close(a_nulls_fd)) errstr = "Can't close a_nulls_fd";
+  if (b_fd       != -1 && close(b_fd))       errstr = "Can't close b_fd";
+  if (b_nulls_fd != -1 && close(b_nulls_fd)) errstr = "Can't close b_nulls_fd";
+  if (finish_floatfile_writer(&w, !errstr) && !errstr) {
+    errstr = psprintf("Failed to save floatfile %s: %s", out_filename, strerror(errno));
+  }
+  unlock_floatfiles_for_writing(hashes, nlocked, &out_filename_hash, 1);
+  if (errstr) elog(ERROR, "%s", errstr);
+}
+
+Datum floatfile_combine(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_combine);
+/**
+ * floatfile_combine - Saves a new floatfile
+ * by applying a binary op to each pair of values from two floatfiles.
+ *
+ * Parameters:
+ *   `out_filename` - The floatfile to save. Must not already exist!
+ *   `op` - One of +, -, *, /, min, or max.
+ *   `a_filename` - The floatfile on the left of the op.
+ *   `b_filename` - The floatfile on the right of the op. Must be as long as `a_filename`.
+ */
+Datum
+floatfile_combine(PG_FUNCTION_ARGS)
+{
+  combine_op op;
+  int i;
+
+  for (i = 0; i < 4; i++) {
+    if (PG_ARGISNULL(i)) PG_RETURN_VOID();
+  }
+
+  op = combine_op_arg(GET_STR(PG_GETARG_TEXT_P(1)));
+  if (COMBINE_UNARY(op)) ereport(ERROR, (errmsg("floatfile_combine needs a binary op (use floatfile_apply)")));
+  _floatfile_combine(NULL, GET_STR(PG_GETARG_TEXT_P(0)), op,
+                     GET_STR(PG_GETARG_TEXT_P(2)), GET_STR(PG_GETARG_TEXT_P(3)), 0);
+  PG_RETURN_VOID();
+}
+
+Datum floatfile_in_tablespace_combine(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_in_tablespace_combine);
+/**
+ * floatfile_in_tablespace_combine - Like floatfile_combine but the files are in a tablespace.
+ */
+Datum
+floatfile_in_tablespace_combine(PG_FUNCTION_ARGS)
+{
+  char *tablespace = NULL;
+  combine_op op;
+  int i;
+
+  for (i = 1; i < 5; i++) {
+    if (PG_ARGISNULL(i)) PG_RETURN_VOID();
+  }
+
+  if (!PG_ARGISNULL(0)) tablespace = GET_STR(PG_GETARG_TEXT_P(0));
+  op = combine_op_arg(GET_STR(PG_GETARG_TEXT_P(2)));
+  if (COMBINE_UNARY(op)) ereport(ERROR, (errmsg("floatfile_combine needs a binary op (use floatfile_apply)")));
+  _floatfile_combine(tablespace, GET_STR(PG_GETARG_TEXT_P(1)), op,
+                     GET_STR(PG_GETARG_TEXT_P(3)), GET_STR(PG_GETARG_TEXT_P(4)), 0);
+  PG_RETURN_VOID();
+}
+
+Datum floatfile_combine_scalar(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_combine_scalar);
+/**
+ * floatfile_combine_scalar - Like floatfile_combine but the right of the op is always `b`.
+ */
+Datum
+floatfile_combine_scalar(PG_FUNCTION_ARGS)
+{
+  combine_op op;
+  int i;
+
+  for (i = 0; i < 4; i++) {
+    if (PG_ARGISNULL(i)) PG_RETURN_VOID();
+  }
+
+  op = combine_op_arg(GET_STR(PG_GETARG_TEXT_P(1)));
+  if (COMBINE_UNARY(op)) ereport(ERROR, (errmsg("floatfile_combine needs a binary op (use floatfile_apply)")));
+  _floatfile_combine(NULL, GET_STR(PG_GETARG_TEXT_P(0)), op,
+                     GET_STR(PG_GETARG_TEXT_P(2)), NULL, PG_GETARG_FLOAT8(3));
+  PG_RETURN_VOID();
+}
+
+Datum floatfile_in_tablespace_combine_scalar(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_in_tablespace_combine_scalar);
+/**
+ * floatfile_in_tablespace_combine_scalar - Like floatfile_combine_scalar but the files are in a tablespace.
+ */
+Datum
+floatfile_in_tablespace_combine_scalar(PG_FUNCTION_ARGS)
+{
+  char *tablespace = NULL;
+  combine_op op;
+  int i;
+
+  for (i = 1; i < 5; i++) {
+    if (PG_ARGISNULL(i)) PG_RETURN_VOID();
+  }
+
+  if (!PG_ARGISNULL(0)) tablespace = GET_STR(PG_GETARG_TEXT_P(0));
+  op = combine_op_arg(GET_STR(PG_GETARG_TEXT_P(2)));
+  if (COMBINE_UNARY(op)) ereport(ERROR, (errmsg("floatfile_combine needs a binary op (use floatfile_apply)")));
+  _floatfile_combine(tablespace, GET_STR(PG_GETARG_TEXT_P(1)), op,
+                     GET_STR(PG_GETARG_TEXT_P(3)), NULL, PG_GETARG_FLOAT8(4));
+  PG_RETURN_VOID();
+}
+
+Datum floatfile_apply(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_apply);
+/**
+ * floatfile_apply - Saves a new floatfile
+ * by applying a unary op (neg, abs, sqrt, exp, or ln) to each value of another.
+ */
+Datum
+floatfile_apply(PG_FUNCTION_ARGS)
+{
+  combine_op op;
+  int i;
+
+  for (i = 0; i < 3; i++) {
+    if (PG_ARGISNULL(i)) PG_RETURN_VOID();
+  }
+
+  op = combine_op_arg(GET_STR(PG_GETARG_TEXT_P(1)));
+  if (!COMBINE_UNARY(op)) ereport(ERROR, (errmsg("floatfile_apply needs a unary op (use floatfile_combine)")));
+  _floatfile_combine(NULL, GET_STR(PG_GETARG_TEXT_P(0)), op, GET_STR(PG_GETARG_TEXT_P(2)), NULL, 0);
+  PG_RETURN_VOID();
+}
+
+Datum floatfile_in_tablespace_apply(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_in_tablespace_apply);
+/**
+ * floatfile_in_tablespace_apply - Like floatfile_apply but the files are in a tablespace.
+ */
+Datum
+floatfile_in_tablespace_apply(PG_FUNCTION_ARGS)
+{
+  char *tablespace = NULL;
+  combine_op op;
+  int i;
+
+  for (i = 1; i < 4; i++) {
+    if (PG_ARGISNULL(i)) PG_RETURN_VOID();
+  }
+
+  if (!PG_ARGISNULL(0)) tablespace = GET_STR(PG_GETARG_TEXT_P(0));
+  op = combine_op_arg(GET_STR(PG_GETARG_TEXT_P(2)));
+  if (!COMBINE_UNARY(op)) ereport(ERROR, (errmsg("floatfile_apply needs a unary op (use floatfile_combine)")));
+  _floatfile_combine(tablespace, GET_STR(PG_GETARG_TEXT_P(1)), op, GET_STR(PG_GETARG_TEXT_P(3)), NULL, 0);
+  PG_RETURN_VOID();
+}
+
+/**
+ * rolling_func_arg - Returns the rolling_func named `func`.
+ */
+static rolling_func rolling_func_arg(const char *func) {
+  if (strcmp(func, "sum") == 0) return ROLLING_SUM;
+  if (strcmp(func, "mean") == 0) return ROLLING_MEAN;
+  if (strcmp(func, "stddev") == 0) return ROLLING_STDDEV;
+  if (strcmp(func, "min") == 0) return ROLLING_MIN;
+  if (strcmp(func, "max") == 0) return ROLLING_MAX;
+  ereport(ERROR, (errmsg("func must be sum, mean, stddev, min, or max, not %s", func)));
+  return ROLLING_SUM;   // not reached
+}
+
+/**
+ * _floatfile_rolling - Saves `func` of each trailing window of `window` values of `in_filename`
+ * as the new floatfile `out_filename`.
+ *
+ * If `extend` then `out_filename` may already exist,
+ * in which case we assume it holds our output for the first part of `in_filename`
+ * (e.g. from before more values were appended to it) and just add the rest.
+ * That only reads the last `window - 1` values it already covers.
+ *
+ * We keep just the window in memory and stream a block at a time,
+ * so this is one pass no matter how big the floatfile is.
+ * Locking and failure work like _floatfile_combine.
+ */
+static void _floatfile_rolling(char *tablespace, char *out_filename, char *in_filename,
+                               rolling_func func, int32 window, bool extend) {
+  int32 out_filename_hash, hashes[2];
+  int nlocked = 0;
+  int x_fd = 0, x_nulls_fd = 0;
+  floatfile_writer w = { .vals_fd = -1, .nulls_fd = -1 };
+  char *errstr = NULL;
+  scan_options opts;
+
+  validate_target_filename(out_filename);
+  if (window < 1) ereport(ERROR, (errmsg("window must be at least 1")));
+  if (strcmp(out_filename, in_filename) == 0) ereport(ERROR, (errmsg("out_filename must be different from in_filename")));
+
+  out_filename_hash = hash_filename(out_filename);
+  hashes[nlocked++] = out_filename_hash;
+  hashes[nlocked++] = hash_filename(in_filename);
+  lock_floatfiles_for_writing(hashes, nlocked, &out_filename_hash, 1);
+
+  if (open_floatfile_for_reading(tablespace, in_filename, &x_fd, &x_nulls_fd) == -1) {
+    errstr = psprintf("Failed to open floatfile %s: %s", in_filename, strerror(errno));
+    x_fd = x_nulls_fd = 0;
+    goto bail;
+  }
+
+  if (open_floatfile_for_writing(tablespace, out_filename, extend, &w)) {
+    errstr = psprintf("Failed to save floatfile %s: %s", out_filename, strerror(errno));
+    goto bail;
+  }
+
+  opts = floatfile_scan_options(x_fd);
+  build_rolling(x_fd, x_nulls_fd, func, window, w.start_pos, w.vals_fd, w.nulls_fd,
+                w.rollups.fd != -1 ? &w.rollups : NULL, &w.rollups_result, &opts, &errstr);
+
+bail:
+  if (x_fd       && close(x_fd))       errstr = "Can't close x_fd";
+  if (x_nulls_fd && close(x_nulls_fd)) errstr = "Can't close x_nulls_fd";
+  if (finish_floatfile_writer(&w, !errstr) && !errstr) {
+    errstr = psprintf("Failed to save floatfile %s: %s", out_filename, strerror(errno));
+  }
+  unlock_floatfiles_for_writing(hashes, nlocked, &out_filename_hash, 1);
+  if (errstr) elog(ERROR, "%s", errstr);
+}
+
+Datum floatfile_rolling(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_rolling);
+/**
+ * floatfile_rolling - Saves a new floatfile holding a rolling sum, mean, stddev, min, or max
+ * of another.
+ *
+ * Each output value covers the input value at the same position and the `window - 1` before it,
+ * so the first `window - 1` windows are short.
+ * NULLs are skipped, and a window with nothing left (or for stddev, just one value) gives NULL.
+ *
+ * Parameters:
+ *   `out_filename` - The floatfile to save. Must not already exist!
+ *   `in_filename` - The floatfile to read.
+ *   `window` - How many values each window covers.
+ *   `func` - One of sum, mean, stddev, min, or max.
+ */
+Datum
+floatfile_rolling(PG_FUNCTION_ARGS)
+{
+  int i;
+
+  for (i = 0; i < 4; i++) {
+    if (PG_ARGISNULL(i)) PG_RETURN_VOID();
+  }
+
+  _floatfile_rolling(NULL, GET_STR(PG_GETARG_TEXT_P(0)), GET_STR(PG_GETARG_TEXT_P(1)),
+                     rolling_func_arg(GET_STR(PG_GETARG_TEXT_P(3))), PG_GETARG_INT32(2), false);
+  PG_RETURN_VOID();
+}
+
+Datum floatfile_in_tablespace_rolling(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_in_tablespace_rolling);
+/**
+ * floatfile_in_tablespace_rolling - Like floatfile_rolling but the files are in a tablespace.
+ */
+Datum
+floatfile_in_tablespace_rolling(PG_FUNCTION_ARGS)
+{
+  char *tablespace = NULL;
+  int i;
+
+  for (i = 1; i < 5; i++) {
+    if (PG_ARGISNULL(i)) PG_RETURN_VOID();
+  }
+
+  if (!PG_ARGISNULL(0)) tablespace = GET_STR(PG_GETARG_TEXT_P(0));
+  _floatfile_rolling(tablespace, GET_STR(PG_GETARG_TEXT_P(1)), GET_STR(PG_GETARG_TEXT_P(2)),
+                     rolling_func_arg(GET_STR(PG_GETARG_TEXT_P(4))), PG_GETARG_INT32(3), false);
+  PG_RETURN_VOID();
+}
+
+Datum floatfile_extend_rolling(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_extend_rolling);
+/**
+ * floatfile_extend_rolling - Like floatfile_rolling,
+ * but if `out_filename` already exists we just append the windows it's missing.
+ *
+ * Call it again with the same arguments after you extend `in_filename`.
+ */
+Datum
+floatfile_extend_rolling(PG_FUNCTION_ARGS)
+{
+  int i;
+
+  for (i = 0; i < 4; i++) {
+    if (PG_ARGISNULL(i)) PG_RETURN_VOID();
+  }
+
+  _floatfile_rolling(NULL, GET_STR(PG_GETARG_TEXT_P(0)), GET_STR(PG_GETARG_TEXT_P(1)),
+                     rolling_func_arg(GET_STR(PG_GETARG_TEXT_P(3))), PG_GETARG_INT32(2), true);
+  PG_RETURN_VOID();
+}
+
+Datum floatfile_in_tablespace_extend_rolling(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_in_tablespace_extend_rolling);
+/**
+ * floatfile_in_tablespace_extend_rolling - Like floatfile_extend_rolling but the files are in a tablespace.
+ */
+Datum
+floatfile_in_tablespace_extend_rolling(PG_FUNCTION_ARGS)
+{
+  char *tablespace = NULL;
+  int i;
+
+  for (i = 1; i < 5; i++) {
+    if (PG_ARGISNULL(i)) PG_RETURN_VOID();
+  }
+
+  if (!PG_ARGISNULL(0)) tablespace = GET_STR(PG_GETARG_TEXT_P(0));
+  _floatfile_rolling(tablespace, GET_STR(PG_GETARG_TEXT_P(1)), GET_STR(PG_GETARG_TEXT_P(2)),
+                     rolling_func_arg(GET_STR(PG_GETARG_TEXT_P(4))), PG_GETARG_INT32(3), true);
+  PG_RETURN_VOID();
+}
+
+Datum floatfile_diff(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_diff);
+/**
+ * floatfile_diff - Saves a new floatfile holding each value of another minus the one before.
+ *
+ * The first value, and any value next to a NULL, gives NULL.
+ *
+ * Parameters:
+ *   `out_filename` - The floatfile to save. Must not already exist!
+ *   `in_filename` - The floatfile to read.
+ */
+Datum
+floatfile_diff(PG_FUNCTION_ARGS)
+{
+  int i;
+
+  for (i = 0; i < 2; i++) {
+    if (PG_ARGISNULL(i)) PG_RETURN_VOID();
+  }
+
+  _floatfile_rolling(NULL, GET_STR(PG_GETARG_TEXT_P(0)), GET_STR(PG_GETARG_TEXT_P(1)), ROLLING_DIFF, 2, false);
+  PG_RETURN_VOID();
+}
+
+Datum floatfile_in_tablespace_diff(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_in_tablespace_diff);
+/**
+ * floatfile_in_tablespace_diff - Like floatfile_diff but the files are in a tablespace.
+ */
+Datum
+floatfile_in_tablespace_diff(PG_FUNCTION_ARGS)
+{
+  char *tablespace = NULL;
+  int i;
+
+  for (i = 1; i < 3; i++) {
+    if (PG_ARGISNULL(i)) PG_RETURN_VOID();
+  }
+
+  if (!PG_ARGISNULL(0)) tablespace = GET_STR(PG_GETARG_TEXT_P(0));
+  _floatfile_rolling(tablespace, GET_STR(PG_GETARG_TEXT_P(1)), GET_STR(PG_GETARG_TEXT_P(2)), ROLLING_DIFF, 2, false);
+  PG_RETURN_VOID();
+}
+
+Datum floatfile_extend_diff(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_extend_diff);
+/**
+ * floatfile_extend_diff - Like floatfile_diff,
+ * but if `out_filename` already exists we just append the values it's missing.
+ */
+Datum
+floatfile_extend_diff(PG_FUNCTION_ARGS)
+{
+  int i;
+
+  for (i = 0; i < 2; i++) {
+    if (PG_ARGISNULL(i)) PG_RETURN_VOID();
+  }
+
+  _floatfile_rolling(NULL, GET_STR(PG_GETARG_TEXT_P(0)), GET_STR(PG_GETARG_TEXT_P(1)), ROLLING_DIFF, 2, true);
+  PG_RETURN_VOID();
+}
+
+Datum floatfile_in_tablespace_extend_diff(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_in_tablespace_extend_diff);
+/**
+ * floatfile_in_tablespace_extend_diff - Like floatfile_extend_diff but the files are in a tablespace.
+ */
+Datum
+floatfile_in_tablespace_extend_diff(PG_FUNCTION_ARGS)
+{
+  char *tablespace = NULL;
+  int i;
+
+  for (i = 1; i < 3; i++) {
+    if (PG_ARGISNULL(i)) PG_RETURN_VOID();
+  }
+
+  if (!PG_ARGISNULL(0)) tablespace = GET_STR(PG_GETARG_TEXT_P(0));
+  _floatfile_rolling(tablespace, GET_STR(PG_GETARG_TEXT_P(1)), GET_STR(PG_GETARG_TEXT_P(2)), ROLLING_DIFF, 2, true);
+  PG_RETURN_VOID();
+}
+
+/**
+ * _floatfile_where - Finds the values of a floatfile from `lo` to `hi` (inclusive).
+ *
+ * Returns their positions, counting from 1 like array subscripts, as an int8[],
+ * or if `ranges` a row of `starts` and `lengths` arrays with an element per run of consecutive positions.
+ *
+ * If `ts_filename` is not NULL we only look at the values
+ * whose timestamps are between `t_min` and `t_max`, like floatfile_with_bounds_to_hist.
+ */
+static Datum _floatfile_where(FunctionCallInfo fcinfo, char *xs_tablespace, char *xs_filename, float8 lo, float8 hi,
+                              bool ranges, char *ts_tablespace, char *ts_filename, float8 t_min, float8 t_max) {
+  int32 xs_filename_hash, ts_filename_hash = 0;
+  int x_fd = 0, x_nulls_fd = 0;
+  rollup_files x_rollups = NO_ROLLUPS;
+  int t_fd = 0, t_nulls_fd = 0;
+  ssize_t min_pos, max_pos, i, n;
+  where_result wr = { .vals = NULL, .len = 0, .cap = 0, .max_len = MaxAllocSize / sizeof(Datum), .ranges = ranges };
+  Datum *datums, *lengths;
+  char *errstr = NULL;
+  scan_options opts;
+  TupleDesc tupdesc = NULL;
+  Datum values[2];
+  bool nulls[2] = {false, false};
+  int16 typeWidth;
+  bool typeByValue;
+  char typeAlignmentCode;
+
+  if (ranges) {
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE) {
+      ereport(ERROR, (errmsg("floatfile_where_ranges must return a row")));
+    }
+    tupdesc = BlessTupleDesc(tupdesc);
+  }
+
+  if (ts_filename) {
+    ts_filename_hash = hash_filename(ts_filename);
+    DirectFunctionCall2(pg_advisory_lock_shared_int4, FLOATFILE_LOCK_PREFIX, ts_filename_hash);
+  }
+  xs_filename_hash = hash_filename(xs_filename);
+  DirectFunctionCall2(pg_advisory_lock_shared_int4, FLOATFILE_LOCK_PREFIX, xs_filename_hash);
+
+  if (ts_filename && open_floatfile_for_reading(ts_tablespace, ts_filename, &t_fd, &t_nulls_fd) == -1) {
+    errstr = strerror(errno);
+    goto bail;
+  }
+
+  if (open_floatfile_for_reading(xs_tablespace, xs_filename, &x_fd, &x_nulls_fd) == -1) {
+    errstr = strerror(errno);
+    goto bail;
+  }
+  open_floatfile_rollups_for_reading(xs_tablespace, xs_filename, &x_rollups);
+
+  if (ts_filename) {
+    opts = floatfile_scan_options(t_fd);
+    find_bounds_start_end(t_fd, t_nulls_fd, t_min, t_max, &min_pos, &max_pos, &opts, &errstr);
+    if (errstr) goto bail;
+    if (min_pos == -1 || max_pos == -1) {
+      // Nothing is in range so just return, but with no error.
+      goto bail;
+    }
+
+    opts = floatfile_scan_options(x_fd);
+    build_where(x_fd, x_nulls_fd, &x_rollups, lo, hi, min_pos, max_pos + 1, &wr, &opts, &errstr);
+  } else {
+    opts = floatfile_scan_options(x_fd);
+    build_where(x_fd, x_nulls_fd, &x_rollups, lo, hi, 0, -1, &wr, &opts, &errstr);
+  }
+
+bail:
+  if (x_fd       && close(x_fd))       errstr = "Can't close x_fd";
+  if (x_nulls_fd && close(x_nulls_fd)) errstr = "Can't close x_nulls_fd";
+  if (close_floatfile_rollups(&x_rollups)) errstr = "Can't close x_rollups";
+  DirectFunctionCall2(pg_advisory_unlock_shared_int4, FLOATFILE_LOCK_PREFIX, xs_filename_hash);
+  if (ts_filename) {
+    if (t_fd       && close(t_fd))       errstr = "Can't close t_fd";
+    if (t_nulls_fd && close(t_nulls_fd)) errstr = "Can't close t_nulls_fd";
+    DirectFunctionCall2(pg_advisory_unlock_shared_int4, FLOATFILE_LOCK_PREFIX, ts_filename_hash);
+  }
+  if (errstr) {
+    free(wr.vals);
+    elog(ERROR, "%s", errstr);
+  }
+
+  get_typlenbyvalalign(INT8OID, &typeWidth, &typeByValue, &typeAlignmentCode);
+  if (ranges) {
+    n = wr.len / 2;
+    datums = palloc(sizeof(Datum) * Max(n, 1));
+    lengths = palloc(sizeof(Datum) * Max(n, 1));
+    for (i = 0; i < n; i++) {
+      datums[i] = Int64GetDatum(wr.vals[2 * i] + 1);
+      lengths[i] = Int64GetDatum(wr.vals[2 * i + 1]);
+    }
+    free(wr.vals);
+    values[0] = PointerGetDatum(construct_array(datums, n, INT8OID, typeWidth, typeByValue, typeAlignmentCode));
+    values[1] = PointerGetDatum(construct_array(lengths, n, INT8OID, typeWidth, typeByValue, typeAlignmentCode));
+    PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+  }
+
+  n = wr.len;
+  datums = palloc(sizeof(Datum) * Max(n, 1));
+  for (i = 0; i < n; i++) datums[i] = Int64GetDatum(wr.vals[i] + 1);
+  free(wr.vals);
+  PG_RETURN_ARRAYTYPE_P(construct_array(datums, n, INT8OID, typeWidth, typeByValue, typeAlignmentCode));
+}
+
+Datum floatfile_where(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_where);
+/**
+ * floatfile_where - Returns the positions of the values from `lo` to `hi`,
+ * so you needn't load and unnest the floatfile to filter it.
+ */
+Datum
+floatfile_where(PG_FUNCTION_ARGS)
+{
+  if (PG_ARGISNULL(0) || PG_ARGISNULL(1) || PG_ARGISNULL(2)) PG_RETURN_NULL();
+
+  return _floatfile_where(fcinfo, NULL, GET_STR(PG_GETARG_TEXT_P(0)), PG_GETARG_FLOAT8(1), PG_GETARG_FLOAT8(2),
+                          false, NULL, NULL, 0, 0);
+}
+
+Datum floatfile_in_tablespace_where(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_in_tablespace_where);
+/**
+ * floatfile_in_tablespace_where - Like floatfile_where but the file is in a tablespace.
+ */
+Datum
+floatfile_in_tablespace_where(PG_FUNCTION_ARGS)
+{
+  char *xs_tablespace = NULL;
+  int i;
+
+  for (i = 1; i < 4; i++) {
+    if (PG_ARGISNULL(i)) PG_RETURN_NULL();
+  }
+
+  if (!PG_ARGISNULL(0)) xs_tablespace = GET_STR(PG_GETARG_TEXT_P(0));
+  return _floatfile_where(fcinfo, xs_tablespace, GET_STR(PG_GETARG_TEXT_P(1)), PG_GETARG_FLOAT8(2), PG_GETARG_FLOAT8(3),
+                          false, NULL, NULL, 0, 0);
+}
+
+Datum floatfile_with_bounds_where(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_with_bounds_where);
+/**
+ * floatfile_with_bounds_where - Like floatfile_where
+ * but only for the values whose timestamps are between `t_min` and `t_max`.
+ */
+Datum
+floatfile_with_bounds_where(PG_FUNCTION_ARGS)
+{
+  int i;
+
+  for (i = 0; i < 6; i++) {
+    if (PG_ARGISNULL(i)) PG_RETURN_NULL();
+  }
+
+  return _floatfile_where(fcinfo, NULL, GET_STR(PG_GETARG_TEXT_P(0)), PG_GETARG_FLOAT8(1), PG_GETARG_FLOAT8(2),
+                          false, NULL, GET_STR(PG_GETARG_TEXT_P(3)), PG_GETARG_FLOAT8(4), PG_GETARG_FLOAT8(5));
+}
+
+Datum floatfile_in_tablespace_with_bounds_where(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_in_tablespace_with_bounds_where);
+/**
+ * floatfile_in_tablespace_with_bounds_where - Like floatfile_with_bounds_where but the files are in tablespaces.
+ */
+Datum
+floatfile_in_tablespace_with_bounds_where(PG_FUNCTION_ARGS)
+{
+  char *xs_tablespace = NULL, *ts_tablespace = NULL;
+  int i;
+
+  for (i = 1; i < 8; i++) {
+    if (i != 4 && PG_ARGISNULL(i)) PG_RETURN_NULL();
+  }
+
+  if (!PG_ARGISNULL(0)) xs_tablespace = GET_STR(PG_GETARG_TEXT_P(0));
+  if (!PG_ARGISNULL(4)) ts_tablespace = GET_STR(PG_GETARG_TEXT_P(4));
+  return _floatfile_where(fcinfo, xs_tablespace, GET_STR(PG_GETARG_TEXT_P(1)), PG_GETARG_FLOAT8(2), PG_GETARG_FLOAT8(3),
+                          false, ts_tablespace, GET_STR(PG_GETARG_TEXT_P(5)), PG_GETARG_FLOAT8(6), PG_GETARG_FLOAT8(7));
+}
+
+Datum floatfile_where_ranges(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_where_ranges);
+/**
+ * floatfile_where_ranges - Like floatfile_where,
+ * but returns a start and a length for each run of consecutive positions,
+ * which is much smaller when the matches come in long stretches.
+ */
+Datum
+floatfile_where_ranges(PG_FUNCTION_ARGS)
+{
+  if (PG_ARGISNULL(0) || PG_ARGISNULL(1) || PG_ARGISNULL(2)) PG_RETURN_NULL();
+
+  return _floatfile_where(fcinfo, NULL, GET_STR(PG_GETARG_TEXT_P(0)), PG_GETARG_FLOAT8(1), PG_GETARG_FLOAT8(2),
+                          true, NULL, NULL, 0, 0);
+}
+
+Datum floatfile_in_tablespace_where_ranges(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_in_tablespace_where_ranges);
+/**
+ * floatfile_in_tablespace_where_ranges - Like floatfile_where_ranges but the file is in a tablespace.
+ */
+Datum
+floatfile_in_tablespace_where_ranges(PG_FUNCTION_ARGS)
+{
+  char *xs_tablespace = NULL;
+  int i;
+
+  for (i = 1; i < 4; i++) {
+    if (PG_ARGISNULL(i)) PG_RETURN_NULL();
+  }
+
+  if (!PG_ARGISNULL(0)) xs_tablespace = GET_STR(PG_GETARG_TEXT_P(0));
+  return _floatfile_where(fcinfo, xs_tablespace, GET_STR(PG_GETARG_TEXT_P(1)), PG_GETARG_FLOAT8(2), PG_GETARG_FLOAT8(3),
+                          true, NULL, NULL, 0, 0);
+}
+
+Datum floatfile_with_bounds_where_ranges(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_with_bounds_where_ranges);
+/**
+ * floatfile_with_bounds_where_ranges - Like floatfile_where_ranges
+ * but only for the values whose timestamps are between `t_min` and `t_max`.
+ */
+Datum
+floatfile_with_bounds_where_ranges(PG_FUNCTION_ARGS)
+{
+  int i;
+
+  for (i = 0; i < 6; i++) {
+    if (PG_ARGISNULL(i)) PG_RETURN_NULL();
+  }
+
+  return _floatfile_where(fcinfo, NULL, GET_STR(PG_GETARG_TEXT_P(0)), PG_GETARG_FLOAT8(1), PG_GETARG_FLOAT8(2),
+                          true, NULL, GET_STR(PG_GETARG_TEXT_P(3)), PG_GETARG_FLOAT8(4), PG_GETARG_FLOAT8(5));
+}
+
+Datum floatfile_in_tablespace_with_bounds_where_ranges(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_in_tablespace_with_bounds_where_ranges);
+/**
+ * floatfile_in_tablespace_with_bounds_where_ranges - Like floatfile_with_bounds_where_ranges
+ * but the files are in tablespaces.
+ */
+Datum
+floatfile_in_tablespace_with_bounds_where_ranges(PG_FUNCTION_ARGS)
+{
+  char *xs_tablespace = NULL, *ts_tablespace = NULL;
+  int i;
+
+  for (i = 1; i < 8; i++) {
+    if (i != 4 && PG_ARGISNULL(i)) PG_RETURN_NULL();
+  }
+
+  if (!PG_ARGISNULL(0)) xs_tablespace = GET_STR(PG_GETARG_TEXT_P(0));
+  if (!PG_ARGISNULL(4)) ts_tablespace = GET_STR(PG_GETARG_TEXT_P(4));
+  return _floatfile_where(fcinfo, xs_tablespace, GET_STR(PG_GETARG_TEXT_P(1)), PG_GETARG_FLOAT8(2), PG_GETARG_FLOAT8(3),
+                          true, ts_tablespace, GET_STR(PG_GETARG_TEXT_P(5)), PG_GETARG_FLOAT8(6), PG_GETARG_FLOAT8(7));
+}
+
+/**
+ * _floatfile_events - Finds each run of at least `min_len` consecutive values of a floatfile above `threshold`.
+ *
+ * Returns the runs in order, in the current memory context, and sets `*nevents`.
+ *
+ * If `ts_filename` is not NULL we only look at the values
+ * whose timestamps are between `t_min` and `t_max`, like floatfile_with_bounds_to_hist.
+ */
+static value_event *_floatfile_events(char *xs_tablespace, char *xs_filename, float8 threshold, int32 min_len,
+                                      char *ts_tablespace, char *ts_filename, float8 t_min, float8 t_max,
+                                      int *nevents) {
+  int32 xs_filename_hash, ts_filename_hash = 0;
+  int x_fd = 0, x_nulls_fd = 0;
+  int t_fd = 0, t_nulls_fd = 0;
+  ssize_t min_pos, max_pos;
+  event_result er = { .events = NULL, .len = 0, .cap = 0, .max_len = MaxAllocSize / sizeof(value_event) };
+  value_event *events;
+  char *errstr = NULL;
+  scan_options opts;
+
+  if (min_len < 1) ereport(ERROR, (errmsg("min_len must be at least 1")));
+
+  if (ts_filename) {
+    ts_filename_hash = hash_filename(ts_filename);
+    DirectFunctionCall2(pg_advisory_lock_shared_int4, FLOATFILE_LOCK_PREFIX, ts_filename_hash);
+  }
+  xs_filename_hash = hash_filename(xs_filename);
+  DirectFunctionCall2(pg_advisory_lock_shared_int4, FLOATFILE_LOCK_PREFIX, xs_filename_hash);
+
+  if (ts_filename && open_floatfile_for_reading(ts_tablespace, ts_filename, &t_fd, &t_nulls_fd) == -1) {
+    errstr = strerror(errno);
+    goto bail;
+  }
+
+  if (open_floatfile_for_reading(xs_tablespace, xs_filename, &x_fd, &x_nulls_fd) == -1) {
+    errstr = strerror(errno);
+    goto bail;
+  }
+
+  if (ts_filename) {
+    opts = floatfile_scan_options(t_fd);
+    find_bounds_start_end(t_fd, t_nulls_fd, t_min, t_max, &min_pos, &max_pos, &opts, &errstr);
+    if (errstr) goto bail;
+    if (min_pos == -1 || max_pos == -1) {
+      // Nothing is in range so just return, but with no error.
+      goto bail;
+    }
+
+    opts = floatfile_scan_options(x_fd);
+    build_events(x_fd, x_nulls_fd, threshold, min_len, min_pos, max_pos + 1, &er, &opts, &errstr);
+  } else {
+    opts = floatfile_scan_options(x_fd);
+    build_events(x_fd, x_nulls_fd, threshold, min_len, 0, -1, &er, &opts, &errstr);
+  }
+
+bail:
+  if (x_fd       && close(x_fd))       errstr = "Can't close x_fd";
+  if (x_nulls_fd && close(x_nulls_fd)) errstr = "Can't close x_nulls_fd";
+  DirectFunctionCall2(pg_advisory_unlock_shared_int4, FLOATFILE_LOCK_PREFIX, xs_filename_hash);
+  if (ts_filename) {
+    if (t_fd       && close(t_fd))       errstr = "Can't close t_fd";
+    if (t_nulls_fd && close(t_nulls_fd)) errstr = "Can't close t_nulls_fd";
+    DirectFunctionCall2(pg_advisory_unlock_shared_int4, FLOATFILE_LOCK_PREFIX, ts_filename_hash);
+  }
+  if (errstr) {
+    free(er.events);
+    elog(ERROR, "%s", errstr);
+  }
+
+  events = palloc(sizeof(value_event) * Max(er.len, 1));
+  if (er.len > 0) memcpy(events, er.events, sizeof(value_event) * er.len);
+  free(er.events);
+  *nevents = er.len;
+  return events;
+}
+
+/**
+ * floatfile_events_srf - Returns the runs from _floatfile_events one row at a time,
+ * as a 1-based start and (inclusive) end position and the peak value.
+ *
+ * The `*_arg` parameters give where each SQL argument is,
+ * or -1 if this variant doesn't have it.
+ * The threshold and min_len follow the values filename,
+ * and `ts_arg` is the timestamps filename, followed by the start and end.
+ */
+static Datum floatfile_events_srf(FunctionCallInfo fcinfo, int xs_tablespace_arg, int xs_filename_arg,
+                                  int ts_tablespace_arg, int ts_arg) {
+  FuncCallContext *funcctx;
+  MemoryContext oldcontext;
+  TupleDesc tupdesc;
+  char *xs_tablespace = NULL, *ts_tablespace = NULL, *ts_filename = NULL;
+  float8 t_min = 0, t_max = 0;
+  value_event *events, *e;
+  int nevents = 0;
+  Datum values[3];
+  bool nulls[3] = {false, false, false};
+
+  if (SRF_IS_FIRSTCALL()) {
+    funcctx = SRF_FIRSTCALL_INIT();
+    oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE) {
+      ereport(ERROR, (errmsg("floatfile_events must return rows")));
+    }
+    funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+    if (!PG_ARGISNULL(xs_filename_arg) && !PG_ARGISNULL(xs_filename_arg + 1) && !PG_ARGISNULL(xs_filename_arg + 2) &&
+        (ts_arg == -1 || (!PG_ARGISNULL(ts_arg) && !PG_ARGISNULL(ts_arg + 1) && !PG_ARGISNULL(ts_arg + 2)))) {
+
+      if (xs_tablespace_arg != -1 && !PG_ARGISNULL(xs_tablespace_arg)) xs_tablespace = GET_STR(PG_GETARG_TEXT_P(xs_tablespace_arg));
+      if (ts_tablespace_arg != -1 && !PG_ARGISNULL(ts_tablespace_arg)) ts_tablespace = GET_STR(PG_GETARG_TEXT_P(ts_tablespace_arg));
+      if (ts_arg != -1) {
+        ts_filename = GET_STR(PG_GETARG_TEXT_P(ts_arg));
+        t_min = PG_GETARG_FLOAT8(ts_arg + 1);
+        t_max = PG_GETARG_FLOAT8(ts_arg + 2);
+      }
+
+      funcctx->user_fctx = _floatfile_events(xs_tablespace, GET_STR(PG_GETARG_TEXT_P(xs_filename_arg)),
+                                             PG_GETARG_FLOAT8(xs_filename_arg + 1), PG_GETARG_INT32(xs_filename_arg + 2),
+                                             ts_tablespace, ts_filename, t_min, t_max, &nevents);
+    }
+    funcctx->max_calls = nevents;
+
+    MemoryContextSwitchTo(oldcontext);
+  }
+
+  funcctx = SRF_PERCALL_SETUP();
+  events = (value_event *)funcctx->user_fctx;
+
+  if (funcctx->call_cntr < funcctx->max_calls) {
+    e = &events[funcctx->call_cntr];
+    values[0] = Int64GetDatum(e->start + 1);
+    values[1] = Int64GetDatum(e->end);
+    values[2] = Float8GetDatum(e->peak);
+    SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(heap_form_tuple(funcctx->tuple_desc, values, nulls)));
+  } else {
+    SRF_RETURN_DONE(funcctx);
+  }
+}
+
+Datum floatfile_events(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_events);
+/**
+ * floatfile_events - Returns a row for each run of at least `min_len` consecutive values above `threshold`,
+ * so you can find where a signal stayed high without unnesting the floatfile.
+ */
+Datum
+floatfile_events(PG_FUNCTION_ARGS)
+{
+  return floatfile_events_srf(fcinfo, -1, 0, -1, -1);
+}
+
+Datum floatfile_in_tablespace_events(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_in_tablespace_events);
+/**
+ * floatfile_in_tablespace_events - Like floatfile_events but the file is in a tablespace.
+ */
+Datum
+floatfile_in_tablespace_events(PG_FUNCTION_ARGS)
+{
+  return floatfile_events_srf(fcinfo, 0, 1, -1, -1);
+}
+
+Datum floatfile_with_bounds_events(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_with_bounds_events);
+/**
+ * floatfile_with_bounds_events - Like floatfile_events
+ * but only for the values whose timestamps are between `t_min` and `t_max`.
+ */
+Datum
+floatfile_with_bounds_events(PG_FUNCTION_ARGS)
+{
+  return floatfile_events_srf(fcinfo, -1, 0, -1, 3);
+}
+
+Datum floatfile_in_tablespace_with_bounds_events(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_in_tablespace_with_bounds_events);
+/**
+ * floatfile_in_tablespace_with_bounds_events - Like floatfile_with_bounds_events
+ * but the files are in tablespaces.
+ */
+Datum
+floatfile_in_tablespace_with_bounds_events(PG_FUNCTION_ARGS)
+{
+  return floatfile_events_srf(fcinfo, 0, 1, 4, 5);
+}
+
+/**
+ * float8_array_with_nulls - Returns a float[] of the `n` values in `vals`, with NULL wherever `nulls` says.
+ */
+static Datum float8_array_with_nulls(float8 *vals, bool *nulls, int n) {
+  Datum *datums;
+  int16 typeWidth;
+  bool typeByValue;
+  char typeAlignmentCode;
+  int dims[1];
+  int lbs[1];
+  int i;
+
+  if (SAFE_TO_CAST_FLOATS_AND_DATUMS) {
+    datums = (Datum *)vals;
+  } else {
+    datums = palloc(sizeof(Datum) * Max(n, 1));
+    for (i = 0; i < n; i++) datums[i] = Float8GetDatum(vals[i]);
+  }
+
+  get_typlenbyvalalign(FLOAT8OID, &typeWidth, &typeByValue, &typeAlignmentCode);
+  dims[0] = n;
+  lbs[0] = 1;
+  return PointerGetDatum(construct_md_array(datums, nulls, 1, dims, lbs, FLOAT8OID,
+                                            typeWidth, typeByValue, typeAlignmentCode));
+}
+
+/**
+ * _floatfile_asof_join - Lines up `b_filename` with `a_filename` by their timestamps (see build_asof_join),
+ * for the rows of `a_filename` whose timestamps are between `t_start` and `t_end`.
+ *
+ * If `a_out_filename` is NULL we return a row of `timestamps`, `a`, and `b` arrays.
+ * Otherwise we save the `a` and `b` values as the new floatfiles `a_out_filename` and `b_out_filename`,
+ * with locking and failure like _floatfile_combine.
+ */
+static Datum _floatfile_asof_join(FunctionCallInfo fcinfo, char *tablespace, char *a_out_filename, char *b_out_filename,
+                                  char *at_filename, char *a_filename, char *bt_filename, char *b_filename,
+                                  float8 t_start, float8 t_end, float8 tolerance) {
+  int32 hashes[6], out_hashes[2];
+  int nlocked = 0, nout = 0;
+  int at_fd = 0, at_nulls_fd = 0, a_fd = 0, a_nulls_fd = 0;
+  int bt_fd = 0, bt_nulls_fd = 0, b_fd = 0, b_nulls_fd = 0;
+  floatfile_writer a_w = { .vals_fd = -1, .nulls_fd = -1 }, b_w = { .vals_fd = -1, .nulls_fd = -1 };
+  asof_output out = { .a_fd = -1, .max_len = MaxAllocSize / sizeof(Datum) };
+  ssize_t min_pos, max_pos;
+  char *errstr = NULL;
+  scan_options opts;
+  TupleDesc tupdesc = NULL;
+  Datum values[3];
+  bool nulls[3] = {false, false, false};
+
+  if (!(tolerance >= 0)) ereport(ERROR, (errmsg("tolerance must not be negative")));
+  if (a_out_filename) {
+    validate_target_filename(a_out_filename);
+    validate_target_filename(b_out_filename);
+    if (strcmp(a_out_filename, b_out_filename) == 0) {
+      ereport(ERROR, (errmsg("a_out_filename must be different from b_out_filename")));
+    }
+    out_hashes[nout++] = hashes[nlocked++] = hash_filename(a_out_filename);
+    out_hashes[nout++] = hashes[nlocked++] = hash_filename(b_out_filename);
+  } else {
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE) {
+      ereport(ERROR, (errmsg("floatfile_asof_join must return a row")));
+    }
+    tupdesc = BlessTupleDesc(tupdesc);
+  }
+
+  hashes[nlocked++] = hash_filename(at_filename);
+  hashes[nlocked++] = hash_filename(a_filename);
+  hashes[nlocked++] = hash_filename(bt_filename);
+  hashes[nlocked++] = hash_filename(b_filename);
+  lock_floatfiles_for_writing(hashes, nlocked, out_hashes, nout);
+
+  if (open_floatfile_for_reading(tablespace, at_filename, &at_fd, &at_nulls_fd) == -1) {
+    errstr = psprintf("Failed to open floatfile %s: %s", at_filename, strerror(errno));
+    at_fd = at_nulls_fd = 0;
+    goto bail;
+  }
+  if (open_floatfile_for_reading(tablespace, a_filename, &a_fd, &a_nulls_fd) == -1) {
+    errstr = psprintf("Failed to open floatfile %s: %s", a_filename, strerror(errno));
+    a_fd = a_nulls_fd = 0;
+    goto bail;
+  }
+  if (open_floatfile_for_reading(tablespace, bt_filename, &bt_fd, &bt_nulls_fd) == -1) {
+    errstr = psprintf("Failed to open floatfile %s: %s", bt_filename, strerror(errno));
+    bt_fd = bt_nulls_fd = 0;
+    goto bail;
+  }
+  if (open_floatfile_for_reading(tablespace, b_filename, &b_fd, &b_nulls_fd) == -1) {
+    errstr = psprintf("Failed to open floatfile %s: %s", b_filename, strerror(errno));
+    b_fd = b_nulls_fd = 0;
+    goto bail;
+  }
+
+  if (a_out_filename) {
+    if (open_floatfile_for_writing(tablespace, a_out_filename, false, &a_w)) {
+      errstr = psprintf("Failed to save floatfile %s: %s", a_out_filename, strerror(errno));
+      goto bail;
+    }
+    if (open_floatfile_for_writing(tablespace, b_out_filename, false, &b_w)) {
+      errstr = psprintf("Failed to save floatfile %s: %s", b_out_filename, strerror(errno));
+      goto bail;
+    }
+    out.a_fd = a_w.vals_fd;
+    out.a_nulls_fd = a_w.nulls_fd;
+    out.a_rollups = a_w.rollups.fd != -1 ? &a_w.rollups : NULL;
+    out.a_rollups_result = &a_w.rollups_result;
+    out.b_fd = b_w.vals_fd;
+    out.b_nulls_fd = b_w.nulls_fd;
+    out.b_rollups = b_w.rollups.fd != -1 ? &b_w.rollups : NULL;
+    out.b_rollups_result = &b_w.rollups_result;
+  }
+
+  opts = floatfile_scan_options(at_fd);
+  find_bounds_start_end(at_fd, at_nulls_fd, t_start, t_end, &min_pos, &max_pos, &opts, &errstr);
+  if (errstr) goto bail;
+  if (min_pos == -1 || max_pos == -1) {
+    // Nothing is in range so just return (or save empty floatfiles), but with no error.
+    goto bail;
+  }
+
+  opts = floatfile_scan_options(a_fd);
+  build_asof_join(at_fd, at_nulls_fd, a_fd, a_nulls_fd, bt_fd, bt_nulls_fd, b_fd, b_nulls_fd,
+                  min_pos, max_pos + 1, tolerance, &out, &opts, &errstr);
+
+bail:
+  if (at_fd       && close(at_fd))       errstr = "Can't close at_fd";
+  if (at_nulls_fd && close(at_nulls_fd)) errstr = "Can't close at_nulls_fd";
+  if (a_fd        && close(a_fd))        errstr = "Can't close a_fd";
+  if (a_nulls_fd  && close(a_nulls_fd))  errstr = "Can't close a_nulls_fd";
+  if (bt_fd       && close(bt_fd))       errstr = "Can't close bt_fd";
+  if (bt_nulls_fd && close(bt_nulls_fd)) errstr = "Can't close bt_nulls_fd";
+  if (b_fd        && close(b_fd))        errstr = "Can't close b_fd";
+  if (b_nulls_fd  && close(b_nulls_fd))  errstr = "Can't close b_nulls_fd";
+  if (a_out_filename) {
+    if (finish_floatfile_writer(&a_w, !errstr) && !errstr) {
+      errstr = psprintf("Failed to save floatfile %s: %s", a_out_filename, strerror(errno));
+    }
+    if (finish_floatfile_writer(&b_w, !errstr) && !errstr) {
+      errstr = psprintf("Failed to save floatfile %s: %s", b_out_filename, strerror(errno));
+    }
+  }
+  unlock_floatfiles_for_writing(hashes, nlocked, out_hashes, nout);
+  if (errstr) {
+    free(out.ts);
+    free(out.t_nulls);
+    free(out.as);
+    free(out.a_nulls);
+    free(out.bs);
+    free(out.b_nulls);
+    elog(ERROR, "%s", errstr);
+  }
+  if (a_out_filename) PG_RETURN_VOID();
+
+  values[0] = float8_array_with_nulls(out.ts, out.t_nulls, out.len);
+  values[1] = float8_array_with_nulls(out.as, out.a_nulls, out.len);
+  values[2] = float8_array_with_nulls(out.bs, out.b_nulls, out.len);
+  free(out.ts);
+  free(out.t_nulls);
+  free(out.as);
+  free(out.a_nulls);
+  free(out.bs);
+  free(out.b_nulls);
+  PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+Datum floatfile_asof_join(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_asof_join);
+/**
+ * floatfile_asof_join - Lines up two floatfiles sampled at different times,
+ * giving each value of `a` the latest value of `b` at or before it (within `tolerance`),
+ * so you needn't unnest both and join them.
+ *
+ * Returns a row of `timestamps`, `a`, and `b` arrays, one element per value of `a` from `t_start` to `t_end`.
+ */
+Datum
+floatfile_asof_join(PG_FUNCTION_ARGS)
+{
+  int i;
+
+  for (i = 0; i < 7; i++) {
+    if (PG_ARGISNULL(i)) PG_RETURN_NULL();
+  }
+
+  return _floatfile_asof_join(fcinfo, NULL, NULL, NULL,
+                              GET_STR(PG_GETARG_TEXT_P(0)), GET_STR(PG_GETARG_TEXT_P(1)),
+                              GET_STR(PG_GETARG_TEXT_P(2)), GET_STR(PG_GETARG_TEXT_P(3)),
+                              PG_GETARG_FLOAT8(4), PG_GETARG_FLOAT8(5), PG_GETARG_FLOAT8(6));
+}
+
+Datum floatfile_in_tablespace_asof_join(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_in_tablespace_asof_join);
+/**
+ * floatfile_in_tablespace_asof_join - Like floatfile_asof_join but the files are in a tablespace.
+ */
+Datum
+floatfile_in_tablespace_asof_join(PG_FUNCTION_ARGS)
+{
+  char *tablespace = NULL;
+  int i;
+
+  for (i = 1; i < 8; i++) {
+    if (PG_ARGISNULL(i)) PG_RETURN_NULL();
+  }
+
+  if (!PG_ARGISNULL(0)) tablespace = GET_STR(PG_GETARG_TEXT_P(0));
+  return _floatfile_asof_join(fcinfo, tablespace, NULL, NULL,
+                              GET_STR(PG_GETARG_TEXT_P(1)), GET_STR(PG_GETARG_TEXT_P(2)),
+                              GET_STR(PG_GETARG_TEXT_P(3)), GET_STR(PG_GETARG_TEXT_P(4)),
+                              PG_GETARG_FLOAT8(5), PG_GETARG_FLOAT8(6), PG_GETARG_FLOAT8(7));
+}
+
+Datum floatfile_save_asof_join(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_save_asof_join);
+/**
+ * floatfile_save_asof_join - Like floatfile_asof_join,
+ * but saves the lined-up values as two new floatfiles (without the timestamps),
+ * so you can go on to use them together, e.g. with floatfile_to_hist2d.
+ *
+ * Parameters:
+ *   `a_out_filename` - The floatfile to save `a`'s values in. Must not already exist!
+ *   `b_out_filename` - The floatfile to save the matching `b` values in. Must not already exist!
+ *   The rest are like floatfile_asof_join.
+ */
+Datum
+floatfile_save_asof_join(PG_FUNCTION_ARGS)
+{
+  int i;
+
+  for (i = 0; i < 9; i++) {
+    if (PG_ARGISNULL(i)) PG_RETURN_VOID();
+  }
+
+  return _floatfile_asof_join(fcinfo, NULL, GET_STR(PG_GETARG_TEXT_P(0)), GET_STR(PG_GETARG_TEXT_P(1)),
+                              GET_STR(PG_GETARG_TEXT_P(2)), GET_STR(PG_GETARG_TEXT_P(3)),
+                              GET_STR(PG_GETARG_TEXT_P(4)), GET_STR(PG_GETARG_TEXT_P(5)),
+                              PG_GETARG_FLOAT8(6), PG_GETARG_FLOAT8(7), PG_GETARG_FLOAT8(8));
+}
+
+Datum floatfile_in_tablespace_save_asof_join(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_in_tablespace_save_asof_join);
+/**
+ * floatfile_in_tablespace_save_asof_join - Like floatfile_save_asof_join but the files are in a tablespace.
+ */
+Datum
+floatfile_in_tablespace_save_asof_join(PG_FUNCTION_ARGS)
+{
+  char *tablespace = NULL;
+  int i;
+
+  for (i = 1; i < 10; i++) {
+    if (PG_ARGISNULL(i)) PG_RETURN_VOID();
+  }
+
+  if (!PG_ARGISNULL(0)) tablespace = GET_STR(PG_GETARG_TEXT_P(0));
+  return _floatfile_asof_join(fcinfo, tablespace, GET_STR(PG_GETARG_TEXT_P(1)), GET_STR(PG_GETARG_TEXT_P(2)),
+                              GET_STR(PG_GETARG_TEXT_P(3)), GET_STR(PG_GETARG_TEXT_P(4)),
+                              GET_STR(PG_GETARG_TEXT_P(5)), GET_STR(PG_GETARG_TEXT_P(6)),
+                              PG_GETARG_FLOAT8(7), PG_GETARG_FLOAT8(8), PG_GETARG_FLOAT8(9));
+}
+
+/**
+ * _floatfile_pair_stats - Summarizes the pairs of `xs_filename` and `ys_filename`, read side by side,
+ * where neither value is null.
+ *
+ * If `ts_filename` is not NULL we only include the pairs
+ * whose timestamps are between `t_min` and `t_max`, like floatfile_with_bounds_to_hist2d.
+ */
+static void _floatfile_pair_stats(char *xs_tablespace, char *xs_filename, char *ys_tablespace, char *ys_filename,
+                                  char *ts_tablespace, char *ts_filename, float8 t_min, float8 t_max,
+                                  pair_stats *stats) {
+  int32 xs_filename_hash, ys_filename_hash, ts_filename_hash = 0;
+  int x_fd = 0, x_nulls_fd = 0, y_fd = 0, y_nulls_fd = 0;
+  int t_fd = 0, t_nulls_fd = 0;
+  ssize_t min_pos, max_pos;
+  char *errstr = NULL;
+  scan_options opts;
+
+  pair_stats_init(stats);
+
+  if (ts_filename) {
+    ts_filename_hash = hash_filename(ts_filename);
+    DirectFunctionCall2(pg_advisory_lock_shared_int4, FLOATFILE_LOCK_PREFIX, ts_filename_hash);
+  }
+  xs_filename_hash = hash_filename(xs_filename);
+  ys_filename_hash = hash_filename(ys_filename);
+  DirectFunctionCall2(pg_advisory_lock_shared_int4, FLOATFILE_LOCK_PREFIX, xs_filename_hash);
+  DirectFunctionCall2(pg_advisory_lock_shared_int4, FLOATFILE_LOCK_PREFIX, ys_filename_hash);
+
+  if (ts_filename && open_floatfile_for_reading(ts_tablespace, ts_filename, &t_fd, &t_nulls_fd) == -1) {
+    errstr = strerror(errno);
+    goto bail;
+  }
+  if (open_floatfile_for_reading(xs_tablespace, xs_filename, &x_fd, &x_nulls_fd) == -1) {
+    errstr = strerror(errno);
+    goto bail;
+  }
+  if (open_floatfile_for_reading(ys_tablespace, ys_filename, &y_fd, &y_nulls_fd) == -1) {
+    errstr = strerror(errno);
+    goto bail;
+  }
+
+  if (ts_filename) {
+    opts = floatfile_scan_options(t_fd);
+    find_bounds_start_end(t_fd, t_nulls_fd, t_min, t_max, &min_pos, &max_pos, &opts, &errstr);
+    if (errstr) goto bail;
+    if (min_pos == -1 || max_pos == -1) {
+      // Nothing is in range so just return, but with no error.
+      goto bail;
+    }
+
+    opts = floatfile_scan_options(x_fd);
+    build_pair_stats_with_bounds(x_fd, x_nulls_fd, y_fd, y_nulls_fd, stats, min_pos, max_pos, &opts, &errstr);
+  } else {
+    opts = floatfile_scan_options(x_fd);
+    build_pair_stats(x_fd, x_nulls_fd, y_fd, y_nulls_fd, stats, &opts, &errstr);
+  }
+
+bail:
+  if (x_fd       && close(x_fd))       errstr = "Can't close x_fd";
+  if (x_nulls_fd && close(x_nulls_fd)) errstr = "Can't close x_nulls_fd";
+  if (y_fd       && close(y_fd))       errstr = "Can't close y_fd";
+  if (y_nulls_fd && close(y_nulls_fd)) errstr = "Can't close y_nulls_fd";
+  DirectFunctionCall2(pg_advisory_unlock_shared_int4, FLOATFILE_LOCK_PREFIX, xs_filename_hash);
+  DirectFunctionCall2(pg_advisory_unlock_shared_int4, FLOATFILE_LOCK_PREFIX, ys_filename_hash);
+  if (ts_filename) {
+    if (t_fd       && close(t_fd))       errstr = "Can't close t_fd";
+    if (t_nulls_fd && close(t_nulls_fd)) errstr = "Can't close t_nulls_fd";
+    DirectFunctionCall2(pg_advisory_unlock_shared_int4, FLOATFILE_LOCK_PREFIX, ts_filename_hash);
+  }
+  if (errstr) elog(ERROR, "%s", errstr);
+}
+
+// Where pair_stats_values puts each result:
+#define PAIR_COUNT      0
+#define PAIR_CORR       1
+#define PAIR_COVAR_POP  2
+#define PAIR_COVAR_SAMP 3
+#define PAIR_SLOPE      4
+#define PAIR_INTERCEPT  5
+#define PAIR_R2         6
+#define PAIR_RESULTS    7
+
+/**
+ * pair_stats_values - Fills in the count, corr, covar_pop, covar_samp, slope, intercept, and r2 of `stats`.
+ *
+ * Each is NULL exactly when the SQL aggregate of the same name
+ * (regr_slope, regr_intercept, regr_r2 for the last three) would be.
+ */
+static void pair_stats_values(const pair_stats *stats, Datum *values, bool *nulls) {
+  float8 sxx = stats->m2_x, syy = stats->m2_y, sxy = stats->c_xy;
+
+  memset(nulls, true, sizeof(bool) * PAIR_RESULTS);
+  values[PAIR_COUNT] = Int64GetDatum(stats->count);
+  nulls[PAIR_COUNT] = false;
+  if (stats->count == 0) return;
+
+  values[PAIR_COVAR_POP] = Float8GetDatum(sxy / stats->count);
+  nulls[PAIR_COVAR_POP] = false;
+  if (stats->count > 1) {
+    values[PAIR_COVAR_SAMP] = Float8GetDatum(sxy / (stats->count - 1));
+    nulls[PAIR_COVAR_SAMP] = false;
+  }
+  if (sxx == 0) return;
+
+  values[PAIR_SLOPE] = Float8GetDatum(sxy / sxx);
+  values[PAIR_INTERCEPT] = Float8GetDatum(stats->mean_y - sxy / sxx * stats->mean_x);
+  values[PAIR_R2] = Float8GetDatum(syy == 0 ? 1.0 : sxy * sxy / (sxx * syy));
+  nulls[PAIR_SLOPE] = nulls[PAIR_INTERCEPT] = nulls[PAIR_R2] = false;
+  if (syy == 0) return;
+
+  values[PAIR_CORR] = Float8GetDatum(sxy / sqrt(sxx * syy));
+  nulls[PAIR_CORR] = false;
+}
+
+/**
+ * pair_stats_fn - Which results floatfile_pair_stats_fn returns.
+ */
+typedef enum pair_stats_fn {
+  PAIR_STATS_CORR,    // corr
+  PAIR_STATS_COVAR,   // (covar_pop, covar_samp)
+  PAIR_STATS_REGR     // (count, slope, intercept, r2)
+} pair_stats_fn;
+
+/**
+ * floatfile_pair_stats_fn - Summarizes the pairs of two floatfiles and returns the results `fn` wants.
+ *
+ * The `*_arg` parameters give where each SQL argument is,
+ * or -1 if this variant doesn't have it.
+ * `ts_arg` is the timestamps filename, followed by the start and end.
+ */
+static Datum floatfile_pair_stats_fn(FunctionCallInfo fcinfo, pair_stats_fn fn,
+                                     int xs_tablespace_arg, int xs_filename_arg, int ys_tablespace_arg, int ys_filename_arg,
+                                     int ts_tablespace_arg, int ts_arg) {
+  static const int covar_fields[] = {PAIR_COVAR_POP, PAIR_COVAR_SAMP};
+  static const int regr_fields[] = {PAIR_COUNT, PAIR_SLOPE, PAIR_INTERCEPT, PAIR_R2};
+  char *xs_tablespace = NULL, *ys_tablespace = NULL, *ts_tablespace = NULL, *ts_filename = NULL;
+  float8 t_min = 0, t_max = 0;
+  pair_stats stats;
+  Datum results[PAIR_RESULTS], values[4];
+  bool result_nulls[PAIR_RESULTS], nulls[4];
+  const int *fields;
+  int nfields, i;
+  TupleDesc tupdesc;
+
+  if (PG_ARGISNULL(xs_filename_arg) || PG_ARGISNULL(ys_filename_arg)) PG_RETURN_NULL();
+  if (ts_arg != -1 && (PG_ARGISNULL(ts_arg) || PG_ARGISNULL(ts_arg + 1) || PG_ARGISNULL(ts_arg + 2))) PG_RETURN_NULL();
+
+  if (xs_tablespace_arg != -1 && !PG_ARGISNULL(xs_tablespace_arg)) xs_tablespace = GET_STR(PG_GETARG_TEXT_P(xs_tablespace_arg));
+  if (ys_tablespace_arg != -1 && !PG_ARGISNULL(ys_tablespace_arg)) ys_tablespace = GET_STR(PG_GETARG_TEXT_P(ys_tablespace_arg));
+  if (ts_tablespace_arg != -1 && !PG_ARGISNULL(ts_tablespace_arg)) ts_tablespace = GET_STR(PG_GETARG_TEXT_P(ts_tablespace_arg));
+  if (ts_arg != -1) {
+    ts_filename = GET_STR(PG_GETARG_TEXT_P(ts_arg));
+    t_min = PG_GETARG_FLOAT8(ts_arg + 1);
+    t_max = PG_GETARG_FLOAT8(ts_arg + 2);
+  }
+
+  _floatfile_pair_stats(xs_tablespace, GET_STR(PG_GETARG_TEXT_P(xs_filename_arg)),
+                        ys_tablespace, GET_STR(PG_GETARG_TEXT_P(ys_filename_arg)),
+                        ts_tablespace, ts_filename, t_min, t_max, &stats);
+  pair_stats_values(&stats, results, result_nulls);
+
+  if (fn == PAIR_STATS_CORR) {
+    if (result_nulls[PAIR_CORR]) PG_RETURN_NULL();
+    PG_RETURN_DATUM(results[PAIR_CORR]);
+  }
+
+  if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE) {
+    ereport(ERROR, (errmsg("%s must return a row", fn == PAIR_STATS_COVAR ? "floatfile_covar" : "floatfile_regr")));
+  }
+  tupdesc = BlessTupleDesc(tupdesc);
+
+  fields = fn == PAIR_STATS_COVAR ? covar_fields : regr_fields;
+  nfields = fn == PAIR_STATS_COVAR ? lengthof(covar_fields) : lengthof(regr_fields);
+  for (i = 0; i < nfields; i++) {
+    values[i] = results[fields[i]];
+    nulls[i] = result_nulls[fields[i]];
+  }
+  PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+Datum floatfile_corr(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_corr);
+/**
+ * floatfile_corr - Returns the correlation coefficient of two floatfiles read side by side,
+ * like the corr aggregate, skipping the pairs where either is null.
+ */
+Datum
+floatfile_corr(PG_FUNCTION_ARGS)
+{
+  return floatfile_pair_stats_fn(fcinfo, PAIR_STATS_CORR, -1, 0, -1, 1, -1, -1);
+}
+
+Datum floatfile_in_tablespace_corr(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_in_tablespace_corr);
+/**
+ * floatfile_in_tablespace_corr - Like floatfile_corr but the files are in tablespaces.
+ */
+Datum
+floatfile_in_tablespace_corr(PG_FUNCTION_ARGS)
+{
+  return floatfile_pair_stats_fn(fcinfo, PAIR_STATS_CORR, 0, 1, 2, 3, -1, -1);
+}
+
+Datum floatfile_with_bounds_corr(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_with_bounds_corr);
+/**
+ * floatfile_with_bounds_corr - Like floatfile_corr
+ * but only for the pairs whose timestamps are between `t_min` and `t_max`.
+ */
+Datum
+floatfile_with_bounds_corr(PG_FUNCTION_ARGS)
+{
+  return floatfile_pair_stats_fn(fcinfo, PAIR_STATS_CORR, -1, 0, -1, 1, -1, 2);
+}
+
+Datum floatfile_in_tablespace_with_bounds_corr(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_in_tablespace_with_bounds_corr);
+/**
+ * floatfile_in_tablespace_with_bounds_corr - Like floatfile_with_bounds_corr
+ * but the files are in tablespaces.
+ */
+Datum
+floatfile_in_tablespace_with_bounds_corr(PG_FUNCTION_ARGS)
+{
+  return floatfile_pair_stats_fn(fcinfo, PAIR_STATS_CORR, 0, 1, 2, 3, 4, 5);
+}
+
+Datum floatfile_covar(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_covar);
+/**
+ * floatfile_covar - Returns the (covar_pop, covar_samp) row of two floatfiles read side by side.
+ */
+Datum
+floatfile_covar(PG_FUNCTION_ARGS)
+{
+  return floatfile_pair_stats_fn(fcinfo, PAIR_STATS_COVAR, -1, 0, -1, 1, -1, -1);
+}
+
+Datum floatfile_in_tablespace_covar(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_in_tablespace_covar);
+/**
+ * floatfile_in_tablespace_covar - Like floatfile_covar but the files are in tablespaces.
+ */
+Datum
+floatfile_in_tablespace_covar(PG_FUNCTION_ARGS)
+{
+  return floatfile_pair_stats_fn(fcinfo, PAIR_STATS_COVAR, 0, 1, 2, 3, -1, -1);
+}
+
+Datum floatfile_with_bounds_covar(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_with_bounds_covar);
+/**
+ * floatfile_with_bounds_covar - Like floatfile_covar
+ * but only for the pairs whose timestamps are between `t_min` and `t_max`.
+ */
+Datum
+floatfile_with_bounds_covar(PG_FUNCTION_ARGS)
+{
+  return floatfile_pair_stats_fn(fcinfo, PAIR_STATS_COVAR, -1, 0, -1, 1, -1, 2);
+}
+
+Datum floatfile_in_tablespace_with_bounds_covar(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_in_tablespace_with_bounds_covar);
+/**
+ * floatfile_in_tablespace_with_bounds_covar - Like floatfile_with_bounds_covar
+ * but the files are in tablespaces.
+ */
+Datum
+floatfile_in_tablespace_with_bounds_covar(PG_FUNCTION_ARGS)
+{
+  return floatfile_pair_stats_fn(fcinfo, PAIR_STATS_COVAR, 0, 1, 2, 3, 4, 5);
+}
+
+Datum floatfile_regr(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_regr);
+/**
+ * floatfile_regr - Fits y = slope * x + intercept to two floatfiles read side by side
+ * and returns the (count, slope, intercept, r2) row.
+ */
+Datum
+floatfile_regr(PG_FUNCTION_ARGS)
+{
+  return floatfile_pair_stats_fn(fcinfo, PAIR_STATS_REGR, -1, 0, -1, 1, -1, -1);
+}
+
+Datum floatfile_in_tablespace_regr(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_in_tablespace_regr);
+/**
+ * floatfile_in_tablespace_regr - Like floatfile_regr but the files are in tablespaces.
+ */
+Datum
+floatfile_in_tablespace_regr(PG_FUNCTION_ARGS)
+{
+  return floatfile_pair_stats_fn(fcinfo, PAIR_STATS_REGR, 0, 1, 2, 3, -1, -1);
+}
+
+Datum floatfile_with_bounds_regr(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_with_bounds_regr);
+/**
+ * floatfile_with_bounds_regr - Like floatfile_regr
+ * but only for the pairs whose timestamps are between `t_min` and `t_max`.
+ */
+Datum
+floatfile_with_bounds_regr(PG_FUNCTION_ARGS)
+{
+  return floatfile_pair_stats_fn(fcinfo, PAIR_STATS_REGR, -1, 0, -1, 1, -1, 2);
+}
+
+Datum floatfile_in_tablespace_with_bounds_regr(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_in_tablespace_with_bounds_regr);
+/**
+ * floatfile_in_tablespace_with_bounds_regr - Like floatfile_with_bounds_regr
+ * but the files are in tablespaces.
+ */
+Datum
+floatfile_in_tablespace_with_bounds_regr(PG_FUNCTION_ARGS)
+{
+  return floatfile_pair_stats_fn(fcinfo, PAIR_STATS_REGR, 0, 1, 2, 3, 4, 5);
+}
+
+/**
+ * _floatfiles_pair_stats - Summarizes each pair `x_filenames[i]`, `y_filenames[i]`.
+ *
+ * The pairs are scanned concurrently on up to floatfile.scan_threads threads,
+ * and we take the locks up front in sorted order like _floatfile_to_hist_for_files.
+ *
+ * Returns a pair_file per pair, with `skip` set where either filename was NULL, and sets `*npairs`.
+ */
+static pair_file *_floatfiles_pair_stats(char *tablespace, ArrayType *x_filenames, ArrayType *y_filenames, int *npairs) {
+  Datum *x_datums, *y_datums;
+  bool *x_nulls, *y_nulls;
+  int16 typeWidth;
+  bool typeByValue;
+  char typeAlignmentCode;
+  int nxs, nys;
+  char *x_filename, *y_filename;
+  int32 *hashes;
+  int nlocked = 0;
+  pair_file *files;
+  char *errstr = NULL;
+  scan_options opts;
+  int i;
+
+  if (ARR_NDIM(x_filenames) > 1 || ARR_NDIM(y_filenames) > 1) {
+    ereport(ERROR, (errmsg("filenames must be one-dimensional arrays")));
+  }
+  get_typlenbyvalalign(TEXTOID, &typeWidth, &typeByValue, &typeAlignmentCode);
+  deconstruct_array(x_filenames, TEXTOID, typeWidth, typeByValue, typeAlignmentCode, &x_datums, &x_nulls, &nxs);
+  deconstruct_array(y_filenames, TEXTOID, typeWidth, typeByValue, typeAlignmentCode, &y_datums, &y_nulls, &nys);
+  if (nxs != nys) ereport(ERROR, (errmsg("x_filenames and y_filenames must be the same length")));
+
+  *npairs = nxs;
+  files = palloc0(sizeof(pair_file) * Max(nxs, 1));
+  hashes = palloc(sizeof(int32) * Max(nxs, 1) * 2);
+  for (i = 0; i < nxs; i++) {
+    files[i].skip = x_nulls[i] || y_nulls[i];
+    if (files[i].skip) continue;
+    x_filename = GET_STR(DatumGetPointer(x_datums[i]));
+    y_filename = GET_STR(DatumGetPointer(y_datums[i]));
+    validate_target_filename(x_filename);
+    validate_target_filename(y_filename);
+    hashes[nlocked++] = hash_filename(x_filename);
+    hashes[nlocked++] = hash_filename(y_filename);
+  }
+
+  qsort(hashes, nlocked, sizeof(int32), compare_int32);
+  for (i = 0; i < nlocked; i++) {
+    DirectFunctionCall2(pg_advisory_lock_shared_int4, FLOATFILE_LOCK_PREFIX, hashes[i]);
+  }
+
+  for (i = 0; i < nxs; i++) {
+    if (files[i].skip) continue;
+    x_filename = GET_STR(DatumGetPointer(x_datums[i]));
+    y_filename = GET_STR(DatumGetPointer(y_datums[i]));
+    if (open_floatfile_for_reading(tablespace, x_filename, &files[i].x_fd, &files[i].x_nulls_fd) == -1) {
+      errstr = psprintf("Failed to open floatfile %s: %s", x_filename, strerror(errno));
+      files[i].x_fd = files[i].x_nulls_fd = 0;
+      goto bail;
+    }
+    if (open_floatfile_for_reading(tablespace, y_filename, &files[i].y_fd, &files[i].y_nulls_fd) == -1) {
+      errstr = psprintf("Failed to open floatfile %s: %s", y_filename, strerror(errno));
+      files[i].y_fd = files[i].y_nulls_fd = 0;
+      goto bail;
+    }
+    files[i].drop_behind = floatfile_scan_options(files[i].x_fd).drop_behind;
+  }
+
+  opts.threads = floatfile_scan_threads;
+  opts.drop_behind = false;   // decided per pair above
+  build_pair_stats_for_files(nxs, files, &opts, &errstr);
+
+bail:
+  for (i = 0; i < nxs; i++) {
+    if (files[i].x_fd       && close(files[i].x_fd))       errstr = "Can't close x_fd";
+    if (files[i].x_nulls_fd && close(files[i].x_nulls_fd)) errstr = "Can't close x_nulls_fd";
+    if (files[i].y_fd       && close(files[i].y_fd))       errstr = "Can't close y_fd";
+    if (files[i].y_nulls_fd && close(files[i].y_nulls_fd)) errstr = "Can't close y_nulls_fd";
+  }
+  for (i = 0; i < nlocked; i++) {
+    DirectFunctionCall2(pg_advisory_unlock_shared_int4, FLOATFILE_LOCK_PREFIX, hashes[i]);
+  }
+  if (errstr) elog(ERROR, "%s", errstr);
+
+  return files;
+}
+
+/**
+ * floatfiles_pair_stats_srf - Returns the results from _floatfiles_pair_stats one row at a time.
+ *
+ * `tablespace_arg` is -1 if this variant doesn't have one.
+ */
+static Datum floatfiles_pair_stats_srf(FunctionCallInfo fcinfo, int tablespace_arg) {
+  FuncCallContext *funcctx;
+  MemoryContext oldcontext;
+  TupleDesc tupdesc;
+  int filenames_arg = tablespace_arg + 1;
+  char *tablespace = NULL;
+  pair_file *files;
+  int npairs = 0;
+  Datum values[PAIR_RESULTS];
+  bool nulls[PAIR_RESULTS];
+
+  if (SRF_IS_FIRSTCALL()) {
+    funcctx = SRF_FIRSTCALL_INIT();
+    oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE) {
+      ereport(ERROR, (errmsg("floatfiles_pair_stats must return rows")));
+    }
+    funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+    if (!PG_ARGISNULL(filenames_arg) && !PG_ARGISNULL(filenames_arg + 1)) {
+      if (tablespace_arg != -1 && !PG_ARGISNULL(tablespace_arg)) tablespace = GET_STR(PG_GETARG_TEXT_P(tablespace_arg));
+
+      funcctx->user_fctx = _floatfiles_pair_stats(tablespace, PG_GETARG_ARRAYTYPE_P(filenames_arg),
+                                                  PG_GETARG_ARRAYTYPE_P(filenames_arg + 1), &npairs);
+    }
+    funcctx->max_calls = npairs;
+
+    MemoryContextSwitchTo(oldcontext);
+  }
+
+  funcctx = SRF_PERCALL_SETUP();
+  files = (pair_file *)funcctx->user_fctx;
+
+  if (funcctx->call_cntr < funcctx->max_calls) {
+    if (files[funcctx->call_cntr].skip) {
+      memset(nulls, true, sizeof(nulls));
+    } else {
+      pair_stats_values(&files[funcctx->call_cntr].stats, values, nulls);
+    }
+    SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(heap_form_tuple(funcctx->tuple_desc, values, nulls)));
+  } else {
+    SRF_RETURN_DONE(funcctx);
+  }
+}
+
+Datum floatfiles_pair_stats(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfiles_pair_stats);
+/**
+ * floatfiles_pair_stats - Returns the count, corr, covar_pop, covar_samp, slope, intercept, and r2
+ * of many pairs of floatfiles at once.
+ *
+ * Returns one row per pair, in the order given.
+ */
+Datum
+floatfiles_pair_stats(PG_FUNCTION_ARGS)
+{
+  return floatfiles_pair_stats_srf(fcinfo, -1);
+}
+
+Datum floatfiles_in_tablespace_pair_stats(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfiles_in_tablespace_pair_stats);
+/**
+ * floatfiles_in_tablespace_pair_stats - Like floatfiles_pair_stats but the files are in a tablespace.
+ */
+Datum
+floatfiles_in_tablespace_pair_stats(PG_FUNCTION_ARGS)
+{
+  return floatfiles_pair_stats_srf(fcinfo, 0);
+}
+
+/**
+ * _load_floatfile_at - Loads just the values of a floatfile at `positions` (counting from 1),
+ * in the same order, with NULL for any position past either end.
+ *
+ * We read the positions in file order and coalesce nearby ones into one pread (see build_gather),
+ * so gathering the matches of floatfile_where from another floatfile
+ * reads each page at most once.
+ */
+static ArrayType *_load_floatfile_at(char *tablespace, char *filename, ArrayType *positions_arg) {
+  int32 filename_hash;
+  Datum *position_datums, *datums;
+  int64 *positions;
+  float8 *vals;
+  bool *nulls;
+  int npositions, i;
+  int x_fd = 0, x_nulls_fd = 0;
+  char *errstr = NULL;
+  int16 typeWidth;
+  bool typeByValue;
+  char typeAlignmentCode;
+  int dims[1];
+  int lbs[1];
+
+  position_datums = array_arg_datums(positions_arg, INT8OID, "positions", &npositions);
+  positions = palloc(sizeof(int64) * Max(npositions, 1));
+  for (i = 0; i < npositions; i++) positions[i] = DatumGetInt64(position_datums[i]) - 1;
+  vals = palloc(sizeof(float8) * Max(npositions, 1));
+  nulls = palloc(sizeof(bool) * Max(npositions, 1));
+
+  filename_hash = hash_filename(filename);
+  DirectFunctionCall2(pg_advisory_lock_shared_int4, FLOATFILE_LOCK_PREFIX, filename_hash);
+
+  if (open_floatfile_for_reading(tablespace, filename, &x_fd, &x_nulls_fd) == -1) {
+    errstr = psprintf("Failed to load floatfile %s: %s", filename, strerror(errno));
+    x_fd = x_nulls_fd = 0;
+    goto bail;
+  }
+
+  build_gather(x_fd, x_nulls_fd, npositions, positions, vals, nulls, &errstr);
+
+bail:
+  if (x_fd       && close(x_fd))       errstr = "Can't close x_fd";
+  if (x_nulls_fd && close(x_nulls_fd)) errstr = "Can't close x_nulls_fd";
+  DirectFunctionCall2(pg_advisory_unlock_shared_int4, FLOATFILE_LOCK_PREFIX, filename_hash);
+  if (errstr) elog(ERROR, "%s", errstr);
+
+  if (SAFE_TO_CAST_FLOATS_AND_DATUMS) {
+    datums = (Datum *)vals;
+  } else {
+    datums = palloc(sizeof(Datum) * Max(npositions, 1));
+    for (i = 0; i < npositions; i++) datums[i] = Float8GetDatum(vals[i]);
+  }
+
+  get_typlenbyvalalign(FLOAT8OID, &typeWidth, &typeByValue, &typeAlignmentCode);
+  dims[0] = npositions;
+  lbs[0] = 1;
+  return construct_md_array(datums, nulls, 1, dims, lbs, FLOAT8OID, typeWidth, typeByValue, typeAlignmentCode);
+}
+
+Datum load_floatfile_at(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(load_floatfile_at);
+/**
+ * load_floatfile_at - Loads the values at the given positions of a floatfile.
+ *
+ * Parameters:
+ *
+ *   `file` - the name of the file, relative to the default tablespace + our prefix.
+ *   `positions` - an int8[] of positions counting from 1, e.g. from floatfile_where.
+ */
+Datum
+load_floatfile_at(PG_FUNCTION_ARGS)
+{
+  if (PG_ARGISNULL(0) || PG_ARGISNULL(1)) PG_RETURN_NULL();
+
+  PG_RETURN_ARRAYTYPE_P(_load_floatfile_at(NULL, GET_STR(PG_GETARG_TEXT_P(0)), PG_GETARG_ARRAYTYPE_P(1)));
+}
+
+Datum load_floatfile_at_from_tablespace(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(load_floatfile_at_from_tablespace);
+/**
+ * load_floatfile_at_from_tablespace - Like load_floatfile_at but the file is in a tablespace.
+ */
+Datum
+load_floatfile_at_from_tablespace(PG_FUNCTION_ARGS)
+{
+  char *tablespace = NULL;
+
+  if (PG_ARGISNULL(1) || PG_ARGISNULL(2)) PG_RETURN_NULL();
+
+  if (!PG_ARGISNULL(0)) tablespace = GET_STR(PG_GETARG_TEXT_P(0));
+  PG_RETURN_ARRAYTYPE_P(_load_floatfile_at(tablespace, GET_STR(PG_GETARG_TEXT_P(1)), PG_GETARG_ARRAYTYPE_P(2)));
+}
+
+/**
+ * _floatfile_create_index - Builds (or rebuilds) the value index of a floatfile
+ * with up to `bins` bins and an entry for every `chunk_size` values.
+ *
+ * We take the floatfile's lock exclusively, so nobody reads a half-built index.
+ * If anything goes wrong we remove whatever we wrote.
+ */
+static void _floatfile_create_index(char *tablespace, char *filename, int32 bins, int32 chunk_size) {
+  char path[FLOATFILE_MAX_PATH + 1];
+  int pathlen;
+  int32 filename_hash;
+  int x_fd = 0, x_nulls_fd = 0, index_fd = -1;
+  char *errstr = NULL;
+  scan_options opts;
+
+  if (bins < 1 || bins > VALUE_INDEX_MAX_BINS) {
+    ereport(ERROR, (errmsg("bins must be from 1 to %d", VALUE_INDEX_MAX_BINS)));
+  }
+  if (chunk_size < 1) ereport(ERROR, (errmsg("chunk_size must be at least 1")));
+
+  validate_target_filename(filename);
+  pathlen = floatfile_filename_to_full_path(tablespace, filename, path, FLOATFILE_MAX_PATH + 1);
+
+  filename_hash = hash_filename(filename);
+  DirectFunctionCall2(pg_advisory_lock_int4, FLOATFILE_LOCK_PREFIX, filename_hash);
+
+  if (open_floatfile_for_reading(tablespace, filename, &x_fd, &x_nulls_fd) == -1) {
+    errstr = psprintf("Failed to open floatfile %s: %s", filename, strerror(errno));
+    x_fd = x_nulls_fd = 0;
+    goto bail;
+  }
+
+  path[pathlen - 1] = FLOATFILE_INDEX_SUFFIX;
+  index_fd = open(path, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+  if (index_fd == -1) {
+    errstr = psprintf("Failed to index floatfile %s: %s", filename, strerror(errno));
+    goto bail;
+  }
+
+  opts = floatfile_scan_options(x_fd);
+  if (build_value_index(index_fd, x_fd, x_nulls_fd, bins, chunk_size, floatfile_exact_percentile_limit, &opts, &errstr)) {
+    if (!errstr) errstr = "floatfile changed while we indexed it";
+  } else if (fsync(index_fd)) {
+    errstr = strerror(errno);
+  }
+
+bail:
+  if (x_fd       && close(x_fd))       errstr = "Can't close x_fd";
+  if (x_nulls_fd && close(x_nulls_fd)) errstr = "Can't close x_nulls_fd";
+  if (index_fd != -1) {
+    if (close(index_fd)) errstr = "Can't close index_fd";
+    if (errstr) unlink(path);
+  }
+  DirectFunctionCall2(pg_advisory_unlock_int4, FLOATFILE_LOCK_PREFIX, filename_hash);
+  if (errstr) elog(ERROR, "%s", errstr);
+}
+
+Datum floatfile_create_index(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_create_index);
+/**
+ * floatfile_create_index - Builds a value index for a floatfile,
+ * so scans for a narrow range of values can skip most of it.
+ *
+ * Parameters:
+ *   `filename` - The floatfile to index.
+ *   `bins` - How many bins to split the values into, from 1 to 64.
+ *   `chunk_size` - How many values share an entry of the index.
+ */
+Datum
+floatfile_create_index(PG_FUNCTION_ARGS)
+{
+  if (PG_ARGISNULL(0) || PG_ARGISNULL(1) || PG_ARGISNULL(2)) PG_RETURN_NULL();
+
+  _floatfile_create_index(NULL, GET_STR(PG_GETARG_TEXT_P(0)), PG_GETARG_INT32(1), PG_GETARG_INT32(2));
+  PG_RETURN_VOID();
+}
+
+Datum floatfile_in_tablespace_create_index(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_in_tablespace_create_index);
+/**
+ * floatfile_in_tablespace_create_index - Like floatfile_create_index but the file is in a tablespace.
+ */
+Datum
+floatfile_in_tablespace_create_index(PG_FUNCTION_ARGS)
+{
+  char *tablespace = NULL;
+
+  if (PG_ARGISNULL(1) || PG_ARGISNULL(2) || PG_ARGISNULL(3)) PG_RETURN_NULL();
+
+  if (!PG_ARGISNULL(0)) tablespace = GET_STR(PG_GETARG_TEXT_P(0));
+  _floatfile_create_index(tablespace, GET_STR(PG_GETARG_TEXT_P(1)), PG_GETARG_INT32(2), PG_GETARG_INT32(3));
+  PG_RETURN_VOID();
+}
+
+/**
+ * _floatfile_drop_index - Removes the value index of a floatfile, if it has one.
+ */
+static void _floatfile_drop_index(char *tablespace, char *filename) {
+  char path[FLOATFILE_MAX_PATH + 1];
+  int pathlen;
+  int32 filename_hash;
+  char *errstr = NULL;
+
+  validate_target_filename(filename);
+  pathlen = floatfile_filename_to_full_path(tablespace, filename, path, FLOATFILE_MAX_PATH + 1);
+  path[pathlen - 1] = FLOATFILE_INDEX_SUFFIX;
+
+  filename_hash = hash_filename(filename);
+  DirectFunctionCall2(pg_advisory_lock_int4, FLOATFILE_LOCK_PREFIX, filename_hash);
+  if (unlink(path) && errno != ENOENT) {
+    errstr = psprintf("Failed to delete index of floatfile %s: %s", filename, strerror(errno));
+  }
+  DirectFunctionCall2(pg_advisory_unlock_int4, FLOATFILE_LOCK_PREFIX, filename_hash);
+  if (errstr) elog(ERROR, "%s", errstr);
+}
+
+Datum floatfile_drop_index(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_drop_index);
+/**
+ * floatfile_drop_index - Removes a floatfile's value index.
+ *
+ * Parameters:
+ *   `filename` - The floatfile whose index to remove.
+ */
+Datum
+floatfile_drop_index(PG_FUNCTION_ARGS)
+{
+  if (PG_ARGISNULL(0)) PG_RETURN_NULL();
+
+  _floatfile_drop_index(NULL, GET_STR(PG_GETARG_TEXT_P(0)));
+  PG_RETURN_VOID();
+}
+
+Datum floatfile_in_tablespace_drop_index(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(floatfile_in_tablespace_drop_index);
+/**
+ * floatfile_in_tablespace_drop_index - Like floatfile_drop_index but the file is in a tablespace.
+ */
+Datum
+floatfile_in_tablespace_drop_index(PG_FUNCTION_ARGS)
+{
+  char *tablespace = NULL;
+
+  if (PG_ARGISNULL(1)) PG_RETURN_NULL();
+
+  if (!PG_ARGISNULL(0)) tablespace = GET_STR(PG_GETARG_TEXT_P(0));
+  _floatfile_drop_index(tablespace, GET_STR(PG_GETARG_TEXT_P(1)));
+  PG_RETURN_VOID();
+}
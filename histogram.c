@@ -6,6 +6,7 @@
  */
 
 #include <errno.h>
+#include <math.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -13,10 +14,14 @@
 #include <unistd.h>
 #include <string.h>
 #include <time.h>
+#include <pthread.h>
+#include <signal.h>
 
 #include <postgres.h>
 #include <catalog/pg_type.h>
 
+#include "kernels.h"
+#include "tdigest.h"
 #include "histogram.h"
 
 #define min(a,b) \
@@ -31,55 +36,86 @@
 #define CAN_FADVISE
 #endif
 
-// macOS has a max stack frame of 8MB:
-// If this were an executable we could use
-//
-//     LDFLAGS=-Wl,-stack_size,1000000
-//
-// but that won't work when building an .so.
+// How many values we read from each file at a time.
+// These used to live on the stack, where macOS limited us to 8MB,
+// but now the scanner mallocs them (two per file, for double-buffering).
 // #define HIST_BUFFER 1024*1024
 #define HIST_BUFFER 512*512
 // #define HIST_BUFFER BUFSIZ
 
+#ifdef PROFILING
+static void profile_step(struct timespec *last_tp, const char *what) {
+  struct timespec tp;
+  long elapsed;
+
+  if (clock_gettime(CLOCK_MONOTONIC, &tp)) { perror("clock failed"); exit(1); }
+  elapsed = 1000000000*(tp.tv_sec - last_tp->tv_sec) + (tp.tv_nsec - last_tp->tv_nsec);
+  fprintf(stderr, "%s: %ld ns\n", what, elapsed);
+  *last_tp = tp;
+}
+#endif
+
+/**
+ * drop_behind - tells the OS we won't need the given part of the file again.
+ *
+ * Used when opts->drop_behind is set so that a big cold scan
+ * doesn't evict everyone else's hot pages from the cache.
+ */
+static int drop_behind(int fd, off_t offset, off_t len, char **errstr) {
+#ifdef CAN_FADVISE
+  if (posix_fadvise(fd, offset, len, POSIX_FADV_DONTNEED)) {
+    *errstr = "can't give advise to drop behind";
+    return -1;
+  }
+#endif
+  return 0;
+}
+
 /**
- * load_dimension - loads the vals and nulls from a floatfile.
+ * load_dimension - loads the vals and nulls from a floatfile,
+ * starting with the value at position `pos`.
+ *
+ * We use pread so that we don't depend on (or change) the file offset.
+ * This runs on the scanner's reader thread and the scan workers,
+ * so our error messages are fixed strings (strerror isn't thread-safe).
  *
  * Returns the number of values read (not the number of bytes read),
  * or -1 on an error.
  */
-static int load_dimension(int already_read, int vals_fd, int nulls_fd, float8 *vals, bool *nulls, ssize_t max_vals_to_read, char **errstr) {
+static int load_dimension(ssize_t pos, int vals_fd, int nulls_fd, float8 *vals, bool *nulls, ssize_t max_vals_to_read, const scan_options *opts, char **errstr) {
   ssize_t bytes_read;
   int vals_read;
 
   max_vals_to_read = min(max_vals_to_read, HIST_BUFFER);
 
-  bytes_read = read(vals_fd, vals, max_vals_to_read*sizeof(float8));
+  bytes_read = pread(vals_fd, vals, max_vals_to_read*sizeof(float8), pos*sizeof(float8));
   if (bytes_read == 0) {
     return 0;
   } else if (bytes_read == -1) {
-    *errstr = strerror(errno);
+    *errstr = "can't read floatfile vals";
     return -1;
   }
+  if (opts->drop_behind && drop_behind(vals_fd, pos*sizeof(float8), bytes_read, errstr)) return -1;
 
   vals_read = bytes_read / sizeof(float8);
-  already_read += vals_read;
 #ifdef CAN_FADVISE
-  if (posix_fadvise(vals_fd, already_read * sizeof(float8), HIST_BUFFER, POSIX_FADV_WILLNEED)) {
+  if (posix_fadvise(vals_fd, (pos + vals_read) * sizeof(float8), HIST_BUFFER * sizeof(float8), POSIX_FADV_WILLNEED)) {
     *errstr = "can't give advise to vals_fd";
     return -1;
   }
 #endif
 
-  bytes_read = read(nulls_fd, nulls, max_vals_to_read*sizeof(bool));
+  bytes_read = pread(nulls_fd, nulls, vals_read*sizeof(bool), pos*sizeof(bool));
   if (bytes_read == -1) {
-    *errstr = strerror(errno);
+    *errstr = "can't read floatfile nulls";
     return -1;
   } else if (bytes_read != vals_read*sizeof(bool)) {
     *errstr = "nulls count doesn't equal val count";
     return -1;
   }
+  if (opts->drop_behind && drop_behind(nulls_fd, pos*sizeof(bool), bytes_read, errstr)) return -1;
 #ifdef CAN_FADVISE
-  if (posix_fadvise(nulls_fd, already_read * sizeof(bool), HIST_BUFFER, POSIX_FADV_WILLNEED)) {
+  if (posix_fadvise(nulls_fd, (pos + vals_read) * sizeof(bool), HIST_BUFFER * sizeof(bool), POSIX_FADV_WILLNEED)) {
     *errstr = "can't give advise to nulls_fd";
     return -1;
   }
@@ -88,129 +124,326 @@ static int load_dimension(int already_read, int vals_fd, int nulls_fd, float8 *v
   return vals_read;
 }
 
-static void count_vals(int more_vals, int64 *counts, float8 *xs, bool *x_nulls, float8 x_min, float8 x_width, int x_count) {
-  size_t i;
-  float8 x;
-  float8 x_pos;
+/**
+ * start_thread - Like pthread_create, but the new thread blocks all signals.
+ *
+ * We run inside a Postgres backend,
+ * and its signal handlers expect to run on the main thread.
+ */
+static int start_thread(pthread_t *thread, void *(*start_routine)(void *), void *arg) {
+  sigset_t all_signals, old_signals;
+  int result;
 
-  for (i = 0; i < more_vals; i += 1) {
-    if (x_nulls[i]) continue;
-    x = xs[i];
+  sigfillset(&all_signals);
+  pthread_sigmask(SIG_SETMASK, &all_signals, &old_signals);
+  result = pthread_create(thread, NULL, start_routine, arg);
+  pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+  return result;
+}
 
-    x_pos = (x - x_min) / x_width;
+/**
+ * scan_block - One block of values read in lock-step from each file.
+ *
+ * `count` is the number of values in the block,
+ * 0 once we've read everything, or -1 on an error (and then `errstr` is set).
+ */
+typedef struct scan_block {
+  float8 *vals[MAX_DIMENSIONS];
+  bool *nulls[MAX_DIMENSIONS];
+  int count;
+  char *errstr;
+} scan_block;
 
-    if (x_pos >= 0 && x_pos < x_count) {
-      counts[(int)x_pos] += 1;
-    }
-  }
-}
+/**
+ * scanner - Reads one or more aligned floatfiles a block at a time.
+ *
+ * We keep two blocks. The caller counts one while we read into the other.
+ * The first block is read synchronously,
+ * and if there is more to come we start a reader thread
+ * that keeps the next block in flight,
+ * so that the disk doesn't sit idle while we count
+ * and the CPU doesn't sit idle while we read.
+ * Small scans never pay for a thread.
+ *
+ * The reader thread only calls pread/posix_fadvise,
+ * never anything from Postgres.
+ */
+typedef struct scanner {
+  int ndims;
+  int vals_fds[MAX_DIMENSIONS];
+  int nulls_fds[MAX_DIMENSIONS];
+  ssize_t next_pos;   // where the next read starts
+  ssize_t end_pos;    // one past the last value to read, or -1 to read until EOF
+  const scan_options *opts;
 
-static void count_vals_2d(int more_vals, int64 *counts, float8 *xs, bool *x_nulls, float8 x_min, float8 x_width, int x_count, float8 *ys, bool *y_nulls, float8 y_min, float8 y_width, int y_count) {
-  size_t i;
-  float8 x, y;
-  float8 x_pos, y_pos;
+  scan_block blocks[2];
+  bool full[2];       // whether the reader has filled each block
+  int current;        // the block the caller is looking at, or -1
+  int fill;           // the block the reader thread should fill first
+  bool done;          // we've already read everything (only used without a thread)
+
+  bool threaded;
+  bool stopping;
+  pthread_t reader;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+} scanner;
 
-  for (i = 0; i < more_vals; i += 1) {
-    if (x_nulls[i] || y_nulls[i]) continue;
-    x = xs[i];
-    y = ys[i];
+/**
+ * read_block - Reads the next block of every dimension into `b`.
+ *
+ * Returns the number of values read, 0 at the end, or -1 on an error.
+ */
+static int read_block(scanner *sc, scan_block *b) {
+  ssize_t max_vals_to_read = HIST_BUFFER;
+  int vals_read = 0, more_vals;
+  int i;
 
-    x_pos = (x - x_min) / x_width;
-    y_pos = (y - y_min) / y_width;
+  if (sc->end_pos != -1) {
+    max_vals_to_read = min(max_vals_to_read, sc->end_pos - sc->next_pos);
+    if (max_vals_to_read <= 0) return b->count = 0;
+  }
 
-    if (x_pos >= 0 && x_pos < x_count && y_pos >= 0 && y_pos < y_count) {
-      counts[(int)x_pos * y_count + (int)y_pos] += 1;
+  for (i = 0; i < sc->ndims; i++) {
+    more_vals = load_dimension(sc->next_pos, sc->vals_fds[i], sc->nulls_fds[i], b->vals[i], b->nulls[i], max_vals_to_read, sc->opts, &b->errstr);
+    if (more_vals == -1) return b->count = -1;    // errstr is already set
+    if (i == 0) {
+      if (more_vals == 0) return b->count = 0;
+      vals_read = more_vals;
+    } else if (more_vals != vals_read) {
+      b->errstr = "read unequal xs and ys";
+      return b->count = -1;
     }
   }
+
+  sc->next_pos += vals_read;
+  return b->count = vals_read;
 }
 
-int build_histogram(int x_fd, int x_nulls_fd, float8 x_min, float8 x_width, int32 x_count,
-                    int64 *counts, char **errstr) {
-  // TODO: int64 or int32 depending....
-  float8 xs[HIST_BUFFER];
-  bool x_nulls[HIST_BUFFER];
-  int already_read = 0, x_vals_read;
+static void *scanner_reader(void *arg) {
+  scanner *sc = (scanner *)arg;
+  int slot = sc->fill;
+  bool stopping;
+  int count;
 #ifdef PROFILING
-  struct timespec last_tp, tp;
-  long elapsed;
+  struct timespec last_tp;
 #endif
 
+  for (;;) {
+    pthread_mutex_lock(&sc->mutex);
+    while (sc->full[slot] && !sc->stopping) pthread_cond_wait(&sc->cond, &sc->mutex);
+    stopping = sc->stopping;
+    pthread_mutex_unlock(&sc->mutex);
+    if (stopping) break;
+
 #ifdef PROFILING
-  fprintf(stderr, "another run\n");
-  if (clock_gettime(CLOCK_MONOTONIC, &last_tp)) { perror("clock failed"); exit(1); }
+    if (clock_gettime(CLOCK_MONOTONIC, &last_tp)) { perror("clock failed"); exit(1); }
 #endif
-  while ((x_vals_read = load_dimension(already_read, x_fd, x_nulls_fd, xs, x_nulls, HIST_BUFFER, errstr))) {
-    if (x_vals_read == -1) return -1;   // errstr is already set
-
+    count = read_block(sc, &sc->blocks[slot]);
 #ifdef PROFILING
-    if (clock_gettime(CLOCK_MONOTONIC, &tp)) { perror("clock failed"); exit(1); }
-    elapsed = 1000000000*(tp.tv_sec - last_tp.tv_sec) + (tp.tv_nsec - last_tp.tv_nsec);
-    fprintf(stderr, "reading files: %ld ns\n", elapsed);
-    last_tp = tp;
+    profile_step(&last_tp, "reading files in background");
 #endif
 
-    already_read += x_vals_read;
+    pthread_mutex_lock(&sc->mutex);
+    sc->full[slot] = true;
+    pthread_cond_broadcast(&sc->cond);
+    pthread_mutex_unlock(&sc->mutex);
 
-    count_vals(x_vals_read, counts, xs, x_nulls, x_min, x_width, x_count);
-#ifdef PROFILING
-    if (clock_gettime(CLOCK_MONOTONIC, &tp)) { perror("clock failed"); exit(1); }
-    elapsed = 1000000000*(tp.tv_sec - last_tp.tv_sec) + (tp.tv_nsec - last_tp.tv_nsec);
-    fprintf(stderr, "counting vals: %ld ns\n", elapsed);
-    last_tp = tp;
-#endif
+    if (count <= 0) break;
+    slot = (slot + 1) % 2;
+  }
+
+  return NULL;
+}
+
+/**
+ * scanner_init - Prepares to read `ndims` aligned floatfiles
+ * from `start_pos` up to (but not including) `end_pos`.
+ * Pass -1 for `end_pos` to read until the end of the files.
+ *
+ * Returns 0 on success or -1 on an error.
+ * Either way you should call scanner_finish afterwards.
+ */
+static int scanner_init(scanner *sc, int ndims, const int *vals_fds, const int *nulls_fds,
+                        ssize_t start_pos, ssize_t end_pos, const scan_options *opts, char **errstr) {
+  int i, j;
+
+  memset(sc, 0, sizeof(scanner));
+  sc->ndims = ndims;
+  sc->next_pos = start_pos;
+  sc->end_pos = end_pos;
+  sc->opts = opts;
+  sc->current = -1;
+
+  for (i = 0; i < 2; i++) {
+    for (j = 0; j < ndims; j++) {
+      sc->vals_fds[j] = vals_fds[j];
+      sc->nulls_fds[j] = nulls_fds[j];
+      sc->blocks[i].vals[j] = malloc(HIST_BUFFER * sizeof(float8));
+      sc->blocks[i].nulls[j] = malloc(HIST_BUFFER * sizeof(bool));
+      if (!sc->blocks[i].vals[j] || !sc->blocks[i].nulls[j]) {
+        *errstr = "out of memory";
+        return -1;
+      }
+    }
   }
 
   return 0;
 }
 
-int build_histogram_with_bounds(int x_fd, int x_nulls_fd, float8 x_min, float8 x_width, int32 x_count,
-                    int64 *counts, ssize_t min_pos, ssize_t max_pos, char **errstr) {
+static void scanner_start_reader(scanner *sc) {
+  if (pthread_mutex_init(&sc->mutex, NULL)) return;
+  if (pthread_cond_init(&sc->cond, NULL)) {
+    pthread_mutex_destroy(&sc->mutex);
+    return;
+  }
+  sc->fill = (sc->current + 1) % 2;
+  if (start_thread(&sc->reader, scanner_reader, sc)) {
+    // No thread, so just keep reading synchronously:
+    pthread_cond_destroy(&sc->cond);
+    pthread_mutex_destroy(&sc->mutex);
+    return;
+  }
+  sc->threaded = true;
+}
+
+/**
+ * scanner_next - Hands back the next block of values.
+ *
+ * The block stays valid until the next call.
+ * Returns the number of values in the block, 0 at the end, or -1 on an error.
+ */
+static int scanner_next(scanner *sc, scan_block **block, char **errstr) {
+  scan_block *b;
+  int slot;
+
+  if (sc->current != -1) {
+    if (sc->threaded) {
+      pthread_mutex_lock(&sc->mutex);
+      sc->full[sc->current] = false;
+      pthread_cond_broadcast(&sc->cond);
+      pthread_mutex_unlock(&sc->mutex);
+    } else {
+      sc->full[sc->current] = false;
+    }
+  }
+  slot = sc->current = (sc->current + 1) % 2;
+  b = *block = &sc->blocks[slot];
+
+  if (sc->threaded) {
+    pthread_mutex_lock(&sc->mutex);
+    while (!sc->full[slot]) pthread_cond_wait(&sc->cond, &sc->mutex);
+    pthread_mutex_unlock(&sc->mutex);
+  } else if (sc->done) {
+    b->count = 0;
+  } else {
+    read_block(sc, b);
+    sc->full[slot] = true;
+    // A short block means we hit the end of the file:
+    sc->done = b->count < HIST_BUFFER || (sc->end_pos != -1 && sc->next_pos >= sc->end_pos);
+    if (!sc->done) scanner_start_reader(sc);
+  }
+
+  if (b->count == -1) *errstr = b->errstr;
+  return b->count;
+}
+
+static void scanner_finish(scanner *sc) {
+  int i, j;
+
+  if (sc->threaded) {
+    pthread_mutex_lock(&sc->mutex);
+    sc->stopping = true;
+    pthread_cond_broadcast(&sc->cond);
+    pthread_mutex_unlock(&sc->mutex);
+    pthread_join(sc->reader, NULL);
+    pthread_cond_destroy(&sc->cond);
+    pthread_mutex_destroy(&sc->mutex);
+    sc->threaded = false;
+  }
+
+  for (i = 0; i < 2; i++) {
+    for (j = 0; j < sc->ndims; j++) {
+      free(sc->blocks[i].vals[j]);
+      free(sc->blocks[i].nulls[j]);
+    }
+  }
+}
+
+/**
+ * scan_histograms - Counts the values from `start_pos` up to (not including) `end_pos`,
+ * or to the end of the file if `end_pos` is -1,
+ * into each of the `nspecs` histograms in `specs`.
+ *
+ * We read each block once no matter how many histograms there are.
+ */
+static int scan_histograms(int x_fd, int x_nulls_fd, int nspecs, hist_spec *specs,
+                           ssize_t start_pos, ssize_t end_pos, const scan_options *opts, char **errstr) {
   // TODO: int64 or int32 depending....
-  float8 xs[HIST_BUFFER];
-  bool x_nulls[HIST_BUFFER];
-  int already_read = 0, x_vals_read;
-  ssize_t max_vals_to_read;
+  scanner sc;
+  scan_block *b;
+  hist_counter *hcs;
+  int x_vals_read;
+  int i;
 #ifdef PROFILING
-  struct timespec last_tp, tp;
-  long elapsed;
+  struct timespec last_tp;
 #endif
 
+  hcs = calloc(nspecs, sizeof(hist_counter));
+  if (!hcs) {
+    *errstr = "out of memory";
+    return -1;
+  }
+  for (i = 0; i < nspecs; i++) {
+    if (hist_counter_init(&hcs[i], specs[i].counts, specs[i].count)) {
+      *errstr = "out of memory";
+      goto fail;
+    }
+  }
+  if (scanner_init(&sc, 1, &x_fd, &x_nulls_fd, start_pos, end_pos, opts, errstr)) {
+    scanner_finish(&sc);
+    goto fail;
+  }
 
 #ifdef PROFILING
   fprintf(stderr, "another run\n");
   if (clock_gettime(CLOCK_MONOTONIC, &last_tp)) { perror("clock failed"); exit(1); }
 #endif
-
-  lseek(x_nulls_fd, min_pos * sizeof(bool),   SEEK_SET);
-  lseek(x_fd,       min_pos * sizeof(float8), SEEK_SET);
-
-  max_vals_to_read = max_pos - min_pos + 1;
-  while (max_vals_to_read > 0 &&
-         (x_vals_read = load_dimension(already_read, x_fd, x_nulls_fd, xs, x_nulls, max_vals_to_read, errstr))) {
-    if (x_vals_read == -1) return -1;   // errstr is already set
-
+  while ((x_vals_read = scanner_next(&sc, &b, errstr))) {
+    if (x_vals_read == -1) {
+      scanner_finish(&sc);
+      goto fail;   // errstr is already set
+    }
 #ifdef PROFILING
-    if (clock_gettime(CLOCK_MONOTONIC, &tp)) { perror("clock failed"); exit(1); }
-    elapsed = 1000000000*(tp.tv_sec - last_tp.tv_sec) + (tp.tv_nsec - last_tp.tv_nsec);
-    fprintf(stderr, "reading files: %ld ns\n", elapsed);
-    last_tp = tp;
+    // With the reader thread this is just how long we waited for it:
+    profile_step(&last_tp, "reading files");
 #endif
 
-    already_read += x_vals_read;
-    max_vals_to_read -= x_vals_read;
-
-    count_vals(x_vals_read, counts, xs, x_nulls, x_min, x_width, x_count);
+    for (i = 0; i < nspecs; i++) {
+      if (specs[i].edges ? count_vals_edges(&hcs[i], x_vals_read, b->vals[0], b->nulls[0], specs[i].edges)
+                         : count_vals(&hcs[i], x_vals_read, b->vals[0], b->nulls[0], specs[i].min, specs[i].width, specs[i].count)) {
+        scanner_finish(&sc);
+        *errstr = "out of memory";
+        goto fail;
+      }
+    }
 #ifdef PROFILING
-    if (clock_gettime(CLOCK_MONOTONIC, &tp)) { perror("clock failed"); exit(1); }
-    elapsed = 1000000000*(tp.tv_sec - last_tp.tv_sec) + (tp.tv_nsec - last_tp.tv_nsec);
-    fprintf(stderr, "counting vals: %ld ns\n", elapsed);
-    last_tp = tp;
+    profile_step(&last_tp, "counting vals");
 #endif
   }
 
+  scanner_finish(&sc);
+  for (i = 0; i < nspecs; i++) hist_counter_finish(&hcs[i]);
+  free(hcs);
   return 0;
+
+fail:
+  for (i = 0; i < nspecs; i++) hist_counter_finish(&hcs[i]);
+  free(hcs);
+  return -1;
 }
 
+
 /**
  * find_bounds_start_end - returns the start/stop file positions of values within the given range.
  * Used to limit what is included in a histogram.
@@ -218,18 +451,31 @@ int build_histogram_with_bounds(int x_fd, int x_nulls_fd, float8 x_min, float8 x
  * If everything is greater than the requested max_t, then max_pos will be -1.
  * So if either of those parameters come back as -1, then no values are in range.
  */
-int find_bounds_start_end(int t_fd, int t_nulls_fd, float min_t, float max_t, ssize_t *min_pos, ssize_t *max_pos, char **errstr) {
-  float8 ts[HIST_BUFFER];
-  bool t_nulls[HIST_BUFFER];
-  int already_read = 0, t_vals_read;
+int find_bounds_start_end(int t_fd, int t_nulls_fd, float min_t, float max_t, ssize_t *min_pos, ssize_t *max_pos, const scan_options *opts, char **errstr) {
+  scanner sc;
+  scan_block *b;
+  float8 *ts;
+  bool *t_nulls;
+  ssize_t already_read = 0;
+  int t_vals_read;
   size_t i;
   float8 t;
   bool found_start = false;
 
   *min_pos = -1;
   *max_pos = -1;
-  while ((t_vals_read = load_dimension(already_read, t_fd, t_nulls_fd, ts, t_nulls, HIST_BUFFER, errstr))) {
-    if (t_vals_read == -1) return -1;   // errstr is already set
+  if (scanner_init(&sc, 1, &t_fd, &t_nulls_fd, 0, -1, opts, errstr)) {
+    scanner_finish(&sc);
+    return -1;
+  }
+
+  while ((t_vals_read = scanner_next(&sc, &b, errstr))) {
+    if (t_vals_read == -1) {
+      scanner_finish(&sc);
+      return -1;   // errstr is already set
+    }
+    ts = b->vals[0];
+    t_nulls = b->nulls[0];
 
     for (i = 0; i < t_vals_read; i += 1) {
       if (t_nulls[i]) continue;
@@ -243,6 +489,7 @@ int find_bounds_start_end(int t_fd, int t_nulls_fd, float min_t, float max_t, ss
       }
       if (t > max_t) {
         *max_pos = already_read + i - 1;  // could be -1
+        scanner_finish(&sc);
         return 0;
       }
     }
@@ -251,111 +498,3591 @@ int find_bounds_start_end(int t_fd, int t_nulls_fd, float min_t, float max_t, ss
   }
 
   *max_pos = already_read;
+  scanner_finish(&sc);
   return 0;
 }
 
-int build_histogram_2d(int x_fd, int x_nulls_fd, float8 x_min, float8 x_width, int32 x_count,
-                       int y_fd, int y_nulls_fd, float8 y_min, float8 y_width, int32 y_count,
-                       int64 *counts, char **errstr) {
+/**
+ * scan_histogram_2d - Counts the (x, y) pairs from `start_pos` up to (not including) `end_pos`,
+ * or to the end of the files if `end_pos` is -1.
+ */
+static int scan_histogram_2d(int x_fd, int x_nulls_fd, float8 x_min, float8 x_width, int32 x_count,
+                             int y_fd, int y_nulls_fd, float8 y_min, float8 y_width, int32 y_count,
+                             int64 *counts, ssize_t start_pos, ssize_t end_pos, const scan_options *opts, char **errstr) {
   // TODO: int64 or int32 depending....
-  float8 xs[HIST_BUFFER];
-  float8 ys[HIST_BUFFER];
-  bool x_nulls[HIST_BUFFER];
-  bool y_nulls[HIST_BUFFER];
-  int already_read = 0, x_vals_read, y_vals_read;
+  int vals_fds[2] = {x_fd, y_fd};
+  int nulls_fds[2] = {x_nulls_fd, y_nulls_fd};
+  scanner sc;
+  scan_block *b;
+  hist_counter hc;
+  int vals_read;
 #ifdef PROFILING
-  struct timespec last_tp, tp;
-  long elapsed;
+  struct timespec last_tp;
 #endif
 
+  if (hist_counter_init(&hc, counts, (size_t)x_count * y_count)) {
+    hist_counter_finish(&hc);
+    *errstr = "out of memory";
+    return -1;
+  }
+  if (scanner_init(&sc, 2, vals_fds, nulls_fds, start_pos, end_pos, opts, errstr)) {
+    scanner_finish(&sc);
+    hist_counter_finish(&hc);
+    return -1;
+  }
+
 #ifdef PROFILING
   fprintf(stderr, "another run\n");
   if (clock_gettime(CLOCK_MONOTONIC, &last_tp)) { perror("clock failed"); exit(1); }
 #endif
-  while ((x_vals_read = load_dimension(already_read, x_fd, x_nulls_fd, xs, x_nulls, HIST_BUFFER, errstr))) {
-    if (x_vals_read == -1) return -1;   // errstr is already set
-
-    y_vals_read = load_dimension(already_read, y_fd, y_nulls_fd, ys, y_nulls, HIST_BUFFER, errstr);
-    if (y_vals_read == -1) return -1;   // errstr is already set
-    if (x_vals_read != y_vals_read) {
-      *errstr = "read unequal xs and ys";
-      return -1;
+  while ((vals_read = scanner_next(&sc, &b, errstr))) {
+    if (vals_read == -1) {
+      scanner_finish(&sc);
+      hist_counter_finish(&hc);
+      return -1;   // errstr is already set
     }
 #ifdef PROFILING
-    if (clock_gettime(CLOCK_MONOTONIC, &tp)) { perror("clock failed"); exit(1); }
-    elapsed = 1000000000*(tp.tv_sec - last_tp.tv_sec) + (tp.tv_nsec - last_tp.tv_nsec);
-    fprintf(stderr, "reading files: %ld ns\n", elapsed);
-    last_tp = tp;
+    // With the reader thread this is just how long we waited for it:
+    profile_step(&last_tp, "reading files");
 #endif
 
-    already_read += x_vals_read;
-
-    count_vals_2d(x_vals_read, counts, xs, x_nulls, x_min, x_width, x_count, ys, y_nulls, y_min, y_width, y_count);
+    if (count_vals_2d(&hc, vals_read, b->vals[0], b->nulls[0], x_min, x_width, x_count,
+                                      b->vals[1], b->nulls[1], y_min, y_width, y_count)) {
+      scanner_finish(&sc);
+      hist_counter_finish(&hc);
+      *errstr = "out of memory";
+      return -1;
+    }
 #ifdef PROFILING
-    if (clock_gettime(CLOCK_MONOTONIC, &tp)) { perror("clock failed"); exit(1); }
-    elapsed = 1000000000*(tp.tv_sec - last_tp.tv_sec) + (tp.tv_nsec - last_tp.tv_nsec);
-    fprintf(stderr, "counting vals: %ld ns\n", elapsed);
-    last_tp = tp;
+    profile_step(&last_tp, "counting vals");
 #endif
   }
 
+  scanner_finish(&sc);
+  hist_counter_finish(&hc);
   return 0;
 }
 
-int build_histogram_2d_with_bounds(int x_fd, int x_nulls_fd, float8 x_min, float8 x_width, int32 x_count,
-                                   int y_fd, int y_nulls_fd, float8 y_min, float8 y_width, int32 y_count,
-                                   int64 *counts, ssize_t min_pos, ssize_t max_pos, char **errstr) {
-  // TODO: int64 or int32 depending....
-  float8 xs[HIST_BUFFER];
-  float8 ys[HIST_BUFFER];
-  bool x_nulls[HIST_BUFFER];
-  bool y_nulls[HIST_BUFFER];
-  int already_read = 0, x_vals_read, y_vals_read;
-  ssize_t max_vals_to_read;
-#ifdef PROFILING
-  struct timespec last_tp, tp;
-  long elapsed;
-#endif
+/**
+ * scan_histogram_nd - Counts the tuples of `ndims` floatfiles from `start_pos` up to (not including) `end_pos`,
+ * or to the end of the files if `end_pos` is -1.
+ * `counts` is row-major, so the last dimension varies fastest.
+ * If `sparse` isn't NULL we count into it instead of `counts`, with the same bucket numbers.
+ */
+static int scan_histogram_nd(int ndims, const hist_dimension *dims, int64 *counts, sparse_counts *sparse,
+                             ssize_t start_pos, ssize_t end_pos, const scan_options *opts, char **errstr) {
+  int vals_fds[MAX_DIMENSIONS], nulls_fds[MAX_DIMENSIONS];
+  float8 mins[MAX_DIMENSIONS], widths[MAX_DIMENSIONS];
+  int32 bucket_counts[MAX_DIMENSIONS];
+  size_t bucket_count = 1;
+  scanner sc;
+  scan_block *b;
+  hist_counter hc;
+  int vals_read, d;
 
-#ifdef PROFILING
-  fprintf(stderr, "another run\n");
-  if (clock_gettime(CLOCK_MONOTONIC, &last_tp)) { perror("clock failed"); exit(1); }
-#endif
-  lseek(x_nulls_fd, min_pos * sizeof(bool),   SEEK_SET);
-  lseek(x_fd,       min_pos * sizeof(float8), SEEK_SET);
-  lseek(y_nulls_fd, min_pos * sizeof(bool),   SEEK_SET);
-  lseek(y_fd,       min_pos * sizeof(float8), SEEK_SET);
-
-  max_vals_to_read = max_pos - min_pos + 1;
-  while (max_vals_to_read > 0 &&
-         (x_vals_read = load_dimension(already_read, x_fd, x_nulls_fd, xs, x_nulls, max_vals_to_read, errstr))) {
-    if (x_vals_read == -1) return -1;   // errstr is already set
-
-    y_vals_read = load_dimension(already_read, y_fd, y_nulls_fd, ys, y_nulls, max_vals_to_read, errstr);
-    if (y_vals_read == -1) return -1;   // errstr is already set
-    if (x_vals_read != y_vals_read) {
-      *errstr = "read unequal xs and ys";
+  for (d = 0; d < ndims; d++) {
+    vals_fds[d] = dims[d].fd;
+    nulls_fds[d] = dims[d].nulls_fd;
+    mins[d] = dims[d].min;
+    widths[d] = dims[d].width;
+    bucket_counts[d] = dims[d].count;
+    bucket_count *= dims[d].count;
+  }
+
+  if (sparse ? hist_counter_init_sparse(&hc, sparse) : hist_counter_init(&hc, counts, bucket_count)) {
+    hist_counter_finish(&hc);
+    *errstr = "out of memory";
+    return -1;
+  }
+  if (scanner_init(&sc, ndims, vals_fds, nulls_fds, start_pos, end_pos, opts, errstr)) {
+    scanner_finish(&sc);
+    hist_counter_finish(&hc);
+    return -1;
+  }
+
+  while ((vals_read = scanner_next(&sc, &b, errstr))) {
+    if (vals_read == -1) {
+      scanner_finish(&sc);
+      hist_counter_finish(&hc);
+      return -1;   // errstr is already set
+    }
+    if (count_vals_nd(&hc, vals_read, ndims, b->vals, b->nulls, mins, widths, bucket_counts)) {
+      scanner_finish(&sc);
+      hist_counter_finish(&hc);
+      *errstr = "out of memory";
       return -1;
     }
+  }
 
-#ifdef PROFILING
-    if (clock_gettime(CLOCK_MONOTONIC, &tp)) { perror("clock failed"); exit(1); }
-    elapsed = 1000000000*(tp.tv_sec - last_tp.tv_sec) + (tp.tv_nsec - last_tp.tv_nsec);
-    fprintf(stderr, "reading files: %ld ns\n", elapsed);
-    last_tp = tp;
-#endif
+  scanner_finish(&sc);
+  hist_counter_finish(&hc);
+  return 0;
+}
 
-    already_read += x_vals_read;
-    max_vals_to_read -= x_vals_read;
+/**
+ * scan_bucket_stats - Adds each y from `start_pos` up to (not including) `end_pos`
+ * to the stats of its x's bucket, or to the end of the files if `end_pos` is -1.
+ */
+static int scan_bucket_stats(int x_fd, int x_nulls_fd, float8 x_min, float8 x_width, int32 x_count,
+                             int y_fd, int y_nulls_fd, float_stats *buckets,
+                             ssize_t start_pos, ssize_t end_pos, const scan_options *opts, char **errstr) {
+  int vals_fds[2] = {x_fd, y_fd};
+  int nulls_fds[2] = {x_nulls_fd, y_nulls_fd};
+  scanner sc;
+  scan_block *b;
+  bucket_stats_counter bc;
+  int vals_read;
 
-    count_vals_2d(x_vals_read, counts, xs, x_nulls, x_min, x_width, x_count, ys, y_nulls, y_min, y_width, y_count);
-#ifdef PROFILING
-    if (clock_gettime(CLOCK_MONOTONIC, &tp)) { perror("clock failed"); exit(1); }
-    elapsed = 1000000000*(tp.tv_sec - last_tp.tv_sec) + (tp.tv_nsec - last_tp.tv_nsec);
-    fprintf(stderr, "counting vals: %ld ns\n", elapsed);
-    last_tp = tp;
-#endif
+  if (bucket_stats_counter_init(&bc, buckets, x_count)) {
+    bucket_stats_counter_finish(&bc);
+    *errstr = "out of memory";
+    return -1;
+  }
+  if (scanner_init(&sc, 2, vals_fds, nulls_fds, start_pos, end_pos, opts, errstr)) {
+    scanner_finish(&sc);
+    bucket_stats_counter_finish(&bc);
+    return -1;
+  }
+
+  while ((vals_read = scanner_next(&sc, &b, errstr))) {
+    if (vals_read == -1) {
+      scanner_finish(&sc);
+      bucket_stats_counter_finish(&bc);
+      return -1;   // errstr is already set
+    }
+    bucket_stats_vals(&bc, vals_read, b->vals[0], b->nulls[0], x_min, x_width, x_count, b->vals[1], b->nulls[1]);
+  }
+
+  scanner_finish(&sc);
+  bucket_stats_counter_finish(&bc);
+  return 0;
+}
+
+/**
+ * hist_worker - One thread's share of a histogram.
+ *
+ * Each worker reads its own range of positions (with pread, so they can share fds)
+ * into its own counts, and we add them all up at the end.
+ * 1d workers count into each of `specs`;
+ * 2d workers count into `counts`,
+ * or if they have `y_stats`, add each y to the stats of its x's bucket instead.
+ * Workers with `dims` count the tuples of `ndims` floatfiles into `counts` instead,
+ * or into `sparse` if they have it.
+ * Workers must never call into Postgres.
+ */
+typedef struct hist_worker {
+  int ndims;
+  int x_fd, x_nulls_fd;
+  int nspecs;
+  hist_spec *specs;
+  float8 x_min, x_width;
+  int32 x_count;
+  int y_fd, y_nulls_fd;
+  float8 y_min, y_width;
+  int32 y_count;
+  int64 *counts;
+  float_stats *y_stats;
+  const hist_dimension *dims;
+  sparse_counts *sparse;
+  ssize_t start_pos, end_pos;
+  const scan_options *opts;
+  char *errstr;
+  int result;
+  pthread_t thread;
+  bool started;
+} hist_worker;
+
+static void *hist_worker_main(void *arg) {
+  hist_worker *w = (hist_worker *)arg;
+
+  if (w->dims) {
+    w->result = scan_histogram_nd(w->ndims, w->dims, w->counts, w->sparse, w->start_pos, w->end_pos, w->opts, &w->errstr);
+  } else if (w->ndims == 1) {
+    w->result = scan_histograms(w->x_fd, w->x_nulls_fd, w->nspecs, w->specs,
+                                w->start_pos, w->end_pos, w->opts, &w->errstr);
+  } else if (w->y_stats) {
+    w->result = scan_bucket_stats(w->x_fd, w->x_nulls_fd, w->x_min, w->x_width, w->x_count,
+                                  w->y_fd, w->y_nulls_fd, w->y_stats,
+                                  w->start_pos, w->end_pos, w->opts, &w->errstr);
+  } else {
+    w->result = scan_histogram_2d(w->x_fd, w->x_nulls_fd, w->x_min, w->x_width, w->x_count,
+                                  w->y_fd, w->y_nulls_fd, w->y_min, w->y_width, w->y_count,
+                                  w->counts, w->start_pos, w->end_pos, w->opts, &w->errstr);
   }
+  return NULL;
+}
+
+/**
+ * worker_bucket_count - Returns how many buckets the worker counts into, across all its histograms.
+ */
+static size_t worker_bucket_count(const hist_worker *w) {
+  size_t total = 1;
+  int k;
+
+  if (w->dims) {
+    for (k = 0; k < w->ndims; k++) total *= w->dims[k].count;
+    return total;
+  }
+  if (w->ndims == 2) return (size_t)w->x_count * w->y_count;
+  total = 0;
+  for (k = 0; k < w->nspecs; k++) total += w->specs[k].count;
+  return total;
+}
+
+/**
+ * worker_private_counts - Gives the worker its own zeroed counts,
+ * so it doesn't share them with the other threads.
+ * For 1d workers all the specs' counts go in one allocation.
+ * Sparse workers get their own empty table.
+ */
+static int worker_private_counts(hist_worker *w) {
+  hist_spec *specs;
+  size_t offset = 0;
+  int k;
 
+  if (w->y_stats) {
+    w->y_stats = malloc(Max(w->x_count, 1) * sizeof(float_stats));
+    if (!w->y_stats) return -1;
+    for (k = 0; k < w->x_count; k++) stats_init(&w->y_stats[k]);
+    return 0;
+  }
+  if (w->sparse) {
+    w->sparse = malloc(sizeof(sparse_counts));
+    if (!w->sparse) return -1;
+    if (sparse_counts_init(w->sparse, 0)) {
+      sparse_counts_finish(w->sparse);
+      free(w->sparse);
+      w->sparse = NULL;
+      return -1;
+    }
+    return 0;
+  }
+  w->counts = calloc(worker_bucket_count(w), sizeof(int64));
+  if (!w->counts) return -1;
+  if (w->ndims == 1 && !w->dims) {
+    specs = malloc(w->nspecs * sizeof(hist_spec));
+    if (!specs) {
+      free(w->counts);
+      w->counts = NULL;
+      return -1;
+    }
+    for (k = 0; k < w->nspecs; k++) {
+      specs[k] = w->specs[k];
+      specs[k].counts = w->counts + offset;
+      offset += specs[k].count;
+    }
+    w->specs = specs;
+  }
   return 0;
 }
+
+/**
+ * worker_merge_counts - Adds a worker's private counts to `tmpl`'s and frees them.
+ *
+ * Returns -1 if we ran out of memory growing `tmpl`'s sparse counts.
+ */
+static int worker_merge_counts(hist_worker *tmpl, hist_worker *w) {
+  size_t j, bucket_count;
+  int k, result = 0;
+
+  if (w->y_stats && w->y_stats != tmpl->y_stats) {
+    for (k = 0; k < w->x_count; k++) stats_merge(&tmpl->y_stats[k], &w->y_stats[k]);
+    free(w->y_stats);
+  }
+  if (w->sparse && w->sparse != tmpl->sparse) {
+    result = sparse_counts_merge(tmpl->sparse, w->sparse);
+    sparse_counts_finish(w->sparse);
+    free(w->sparse);
+  }
+  if (!w->counts) return result;
+  if (w->ndims == 1 && !w->dims) {
+    for (k = 0; k < w->nspecs; k++) {
+      for (j = 0; j < w->specs[k].count; j++) tmpl->specs[k].counts[j] += w->specs[k].counts[j];
+    }
+    free(w->specs);
+  } else {
+    bucket_count = worker_bucket_count(w);
+    for (j = 0; j < bucket_count; j++) tmpl->counts[j] += w->counts[j];
+  }
+  free(w->counts);
+  return result;
+}
+
+/**
+ * plan_threads - Decides how many threads should share the scan
+ * from `start_pos` to `*end_pos` of `fd`.
+ *
+ * We only split when each thread gets at least a full block to read.
+ * If we split an open-ended scan, we set `*end_pos` to the end of the file.
+ * Returns -1 on error.
+ */
+static int plan_threads(int fd, ssize_t start_pos, ssize_t *end_pos, const scan_options *opts, char **errstr) {
+  int nthreads = opts->threads;
+  struct stat fileinfo;
+
+  if (nthreads > 1 && *end_pos == -1) {
+    if (fstat(fd, &fileinfo)) {
+      *errstr = strerror(errno);
+      return -1;
+    }
+    *end_pos = fileinfo.st_size / sizeof(float8);
+  }
+  if (*end_pos != -1) nthreads = min(nthreads, (*end_pos - start_pos) / HIST_BUFFER);
+  return nthreads;
+}
+
+/**
+ * parallel_histogram - Splits the histogram(s) described by `tmpl`
+ * across up to opts->threads workers.
+ *
+ * `tmpl`'s counts get the final result.
+ * The calling thread does the first share itself.
+ */
+static int parallel_histogram(hist_worker *tmpl, char **errstr) {
+  hist_worker *workers;
+  int nthreads;
+  ssize_t start_pos = tmpl->start_pos, end_pos = tmpl->end_pos;
+  ssize_t share;
+  int i, result = 0;
+
+  nthreads = plan_threads(tmpl->x_fd, start_pos, &end_pos, tmpl->opts, errstr);
+  if (nthreads == -1) return -1;
+
+  if (nthreads <= 1) {
+    hist_worker_main(tmpl);
+    if (tmpl->result) *errstr = tmpl->errstr;
+    return tmpl->result;
+  }
+
+  workers = calloc(nthreads, sizeof(hist_worker));
+  if (!workers) {
+    *errstr = "out of memory";
+    return -1;
+  }
+
+  share = (end_pos - start_pos + nthreads - 1) / nthreads;
+  for (i = 0; i < nthreads; i++) {
+    workers[i] = *tmpl;
+    workers[i].start_pos = start_pos + i * share;
+    workers[i].end_pos = i == nthreads - 1 ? end_pos : start_pos + (i + 1) * share;
+    workers[i].errstr = NULL;
+    workers[i].started = false;
+    if (i > 0) {
+      if (worker_private_counts(&workers[i])) {
+        workers[i].y_stats = NULL;
+        workers[i].sparse = NULL;
+        workers[i].result = -1;
+        workers[i].errstr = "out of memory";
+        continue;
+      }
+      // If we can't get a thread, just do it ourselves below:
+      workers[i].started = !start_thread(&workers[i].thread, hist_worker_main, &workers[i]);
+    }
+  }
+
+  for (i = 0; i < nthreads; i++) {
+    if (i == 0 || (!workers[i].result && !workers[i].started)) hist_worker_main(&workers[i]);
+  }
+
+  for (i = 0; i < nthreads; i++) {
+    if (workers[i].started) pthread_join(workers[i].thread, NULL);
+    if (workers[i].result && !result) {
+      result = workers[i].result;
+      *errstr = workers[i].errstr;
+    }
+    if (i > 0 && worker_merge_counts(tmpl, &workers[i]) && !result) {
+      result = -1;
+      *errstr = "out of memory";
+    }
+  }
+
+  free(workers);
+  return result;
+}
+
+int build_histogram(int x_fd, int x_nulls_fd, float8 x_min, float8 x_width, int32 x_count,
+                    int64 *counts, const scan_options *opts, char **errstr) {
+  hist_spec spec = { .min = x_min, .width = x_width, .count = x_count, .counts = counts };
+  return build_histograms(x_fd, x_nulls_fd, 1, &spec, opts, errstr);
+}
+
+int build_histogram_with_bounds(int x_fd, int x_nulls_fd, float8 x_min, float8 x_width, int32 x_count,
+                    int64 *counts, ssize_t min_pos, ssize_t max_pos, const scan_options *opts, char **errstr) {
+  hist_spec spec = { .min = x_min, .width = x_width, .count = x_count, .counts = counts };
+  return build_histograms_with_bounds(x_fd, x_nulls_fd, 1, &spec, min_pos, max_pos, opts, errstr);
+}
+
+/**
+ * build_histograms - Counts one floatfile into several 1d histograms
+ * while reading it only once.
+ */
+int build_histograms(int x_fd, int x_nulls_fd, int nspecs, hist_spec *specs,
+                     const scan_options *opts, char **errstr) {
+  hist_worker w = {
+    .ndims = 1,
+    .x_fd = x_fd, .x_nulls_fd = x_nulls_fd, .nspecs = nspecs, .specs = specs,
+    .start_pos = 0, .end_pos = -1, .opts = opts
+  };
+  return parallel_histogram(&w, errstr);
+}
+
+int build_histograms_with_bounds(int x_fd, int x_nulls_fd, int nspecs, hist_spec *specs,
+                                 ssize_t min_pos, ssize_t max_pos, const scan_options *opts, char **errstr) {
+  hist_worker w = {
+    .ndims = 1,
+    .x_fd = x_fd, .x_nulls_fd = x_nulls_fd, .nspecs = nspecs, .specs = specs,
+    .start_pos = min_pos, .end_pos = max_pos + 1, .opts = opts
+  };
+  return parallel_histogram(&w, errstr);
+}
+/**
+ * file_pool - Hands out files to the threads of build_histogram_for_files
+ * and build_pair_stats_for_files.
+ *
+ * `scan_file` does file `i` with one thread and returns 0 or -1 (setting `*errstr`).
+ */
+typedef struct file_pool {
+  pthread_mutex_t lock;
+  int next_file;
+  int nfiles;
+  int (*scan_file)(void *ctx, int i, char **errstr);
+  void *ctx;
+  int result;
+  char *errstr;
+} file_pool;
+
+static void *file_pool_main(void *arg) {
+  file_pool *pool = (file_pool *)arg;
+  char *errstr = NULL;
+  int i;
+
+  while (true) {
+    pthread_mutex_lock(&pool->lock);
+    i = pool->next_file++;
+    pthread_mutex_unlock(&pool->lock);
+    if (i >= pool->nfiles) break;
+
+    if (pool->scan_file(pool->ctx, i, &errstr)) {
+      pthread_mutex_lock(&pool->lock);
+      if (!pool->result) {
+        pool->result = -1;
+        pool->errstr = errstr;
+      }
+      pthread_mutex_unlock(&pool->lock);
+    }
+  }
+  return NULL;
+}
+
+/**
+ * run_file_pool - Calls `scan_file` for each of `nfiles` files.
+ *
+ * Files are scanned concurrently, one per thread,
+ * using up to opts->threads threads (including the caller's).
+ */
+static int run_file_pool(int nfiles, int (*scan_file)(void *ctx, int i, char **errstr), void *ctx,
+                         const scan_options *opts, char **errstr) {
+  file_pool pool = {
+    .next_file = 0, .nfiles = nfiles, .scan_file = scan_file, .ctx = ctx,
+    .result = 0, .errstr = NULL
+  };
+  pthread_t *threads;
+  int nthreads = min(opts->threads, nfiles);
+  int i, started = 0;
+
+  if (pthread_mutex_init(&pool.lock, NULL)) {
+    *errstr = "can't create mutex";
+    return -1;
+  }
+
+  threads = nthreads > 1 ? calloc(nthreads - 1, sizeof(pthread_t)) : NULL;
+  if (threads) {
+    // If we can't get a thread, the rest just do less:
+    while (started < nthreads - 1 && !start_thread(&threads[started], file_pool_main, &pool)) started++;
+  }
+
+  file_pool_main(&pool);
+  for (i = 0; i < started; i++) pthread_join(threads[i], NULL);
+
+  free(threads);
+  pthread_mutex_destroy(&pool.lock);
+  if (pool.result) *errstr = pool.errstr;
+  return pool.result;
+}
+
+/**
+ * hist_files - What build_histogram_for_files gives run_file_pool.
+ */
+typedef struct hist_files {
+  hist_file *files;
+  float8 x_min, x_width;
+  int32 x_count;
+} hist_files;
+
+static int hist_files_scan(void *ctx, int i, char **errstr) {
+  hist_files *hf = (hist_files *)ctx;
+  hist_file *f = &hf->files[i];
+  hist_spec spec;
+  scan_options opts;
+
+  if (!f->counts) return 0;   // skipped by the caller
+  spec = (hist_spec) { .min = hf->x_min, .width = hf->x_width, .count = hf->x_count, .counts = f->counts };
+  opts = (scan_options) { .drop_behind = f->drop_behind, .threads = 1 };
+  return scan_histograms(f->x_fd, f->x_nulls_fd, 1, &spec, 0, -1, &opts, errstr);
+}
+
+/**
+ * build_histogram_for_files - Builds the same histogram for each of `files`.
+ *
+ * Files are scanned concurrently, one per thread,
+ * using up to opts->threads threads (including the caller's).
+ * Files with NULL `counts` are skipped.
+ */
+int build_histogram_for_files(int nfiles, hist_file *files, float8 x_min, float8 x_width, int32 x_count,
+                              const scan_options *opts, char **errstr) {
+  hist_files hf = { .files = files, .x_min = x_min, .x_width = x_width, .x_count = x_count };
+
+  return run_file_pool(nfiles, hist_files_scan, &hf, opts, errstr);
+}
+
+/**
+ * scan_stats - Summarizes the values from `start_pos` up to (not including) `end_pos`,
+ * or to the end of the file if `end_pos` is -1.
+ */
+static int scan_stats(int x_fd, int x_nulls_fd, ssize_t start_pos, ssize_t end_pos,
+                      const scan_options *opts, float_stats *stats, char **errstr) {
+  scanner sc;
+  scan_block *b;
+  int x_vals_read;
+
+  if (scanner_init(&sc, 1, &x_fd, &x_nulls_fd, start_pos, end_pos, opts, errstr)) {
+    scanner_finish(&sc);
+    return -1;
+  }
+
+  while ((x_vals_read = scanner_next(&sc, &b, errstr))) {
+    if (x_vals_read == -1) {
+      scanner_finish(&sc);
+      return -1;   // errstr is already set
+    }
+    stats_vals(x_vals_read, b->vals[0], b->nulls[0], stats);
+  }
+
+  scanner_finish(&sc);
+  return 0;
+}
+
+/**
+ * stats_worker - One thread's share of build_stats.
+ */
+typedef struct stats_worker {
+  int x_fd, x_nulls_fd;
+  ssize_t start_pos, end_pos;
+  const scan_options *opts;
+  float_stats stats;
+  char *errstr;
+  int result;
+  pthread_t thread;
+  bool started;
+} stats_worker;
+
+static void *stats_worker_main(void *arg) {
+  stats_worker *w = (stats_worker *)arg;
+
+  w->result = scan_stats(w->x_fd, w->x_nulls_fd, w->start_pos, w->end_pos, w->opts, &w->stats, &w->errstr);
+  return NULL;
+}
+
+/**
+ * parallel_stats - Like parallel_histogram, but for summary statistics.
+ * Each worker summarizes its own range and we merge them at the end.
+ */
+static int parallel_stats(int x_fd, int x_nulls_fd, ssize_t start_pos, ssize_t end_pos,
+                          const scan_options *opts, float_stats *stats, char **errstr) {
+  stats_worker *workers;
+  int nthreads;
+  ssize_t share;
+  int i, result = 0;
+
+  stats_init(stats);
+  nthreads = plan_threads(x_fd, start_pos, &end_pos, opts, errstr);
+  if (nthreads == -1) return -1;
+  if (nthreads <= 1) return scan_stats(x_fd, x_nulls_fd, start_pos, end_pos, opts, stats, errstr);
+
+  workers = calloc(nthreads, sizeof(stats_worker));
+  if (!workers) {
+    *errstr = "out of memory";
+    return -1;
+  }
+
+  share = (end_pos - start_pos + nthreads - 1) / nthreads;
+  for (i = 0; i < nthreads; i++) {
+    workers[i].x_fd = x_fd;
+    workers[i].x_nulls_fd = x_nulls_fd;
+    workers[i].start_pos = start_pos + i * share;
+    workers[i].end_pos = i == nthreads - 1 ? end_pos : start_pos + (i + 1) * share;
+    workers[i].opts = opts;
+    stats_init(&workers[i].stats);
+    // If we can't get a thread, just do it ourselves below:
+    if (i > 0) workers[i].started = !start_thread(&workers[i].thread, stats_worker_main, &workers[i]);
+  }
+
+  for (i = 0; i < nthreads; i++) {
+    if (!workers[i].started) stats_worker_main(&workers[i]);
+  }
+
+  for (i = 0; i < nthreads; i++) {
+    if (workers[i].started) pthread_join(workers[i].thread, NULL);
+    if (workers[i].result && !result) {
+      result = workers[i].result;
+      *errstr = workers[i].errstr;
+    }
+    stats_merge(stats, &workers[i].stats);
+  }
+
+  free(workers);
+  return result;
+}
+
+/**
+ * build_stats - Summarizes all the non-null values in a floatfile.
+ */
+int build_stats(int x_fd, int x_nulls_fd, float_stats *stats, const scan_options *opts, char **errstr) {
+  return parallel_stats(x_fd, x_nulls_fd, 0, -1, opts, stats, errstr);
+}
+
+int build_stats_with_bounds(int x_fd, int x_nulls_fd, float_stats *stats,
+                            ssize_t min_pos, ssize_t max_pos, const scan_options *opts, char **errstr) {
+  return parallel_stats(x_fd, x_nulls_fd, min_pos, max_pos + 1, opts, stats, errstr);
+}
+
+/**
+ * scan_pair_stats - Summarizes the pairs from `start_pos` up to (not including) `end_pos`,
+ * or to the end of the files if `end_pos` is -1,
+ * reading the two floatfiles side by side like build_histogram_2d.
+ */
+static int scan_pair_stats(int x_fd, int x_nulls_fd, int y_fd, int y_nulls_fd, ssize_t start_pos, ssize_t end_pos,
+                           const scan_options *opts, pair_stats *stats, char **errstr) {
+  int vals_fds[2] = {x_fd, y_fd}, nulls_fds[2] = {x_nulls_fd, y_nulls_fd};
+  scanner sc;
+  scan_block *b;
+  int vals_read;
+
+  if (scanner_init(&sc, 2, vals_fds, nulls_fds, start_pos, end_pos, opts, errstr)) {
+    scanner_finish(&sc);
+    return -1;
+  }
+
+  while ((vals_read = scanner_next(&sc, &b, errstr))) {
+    if (vals_read == -1) {
+      scanner_finish(&sc);
+      return -1;   // errstr is already set
+    }
+    pair_stats_vals(vals_read, b->vals[0], b->nulls[0], b->vals[1], b->nulls[1], stats);
+  }
+
+  scanner_finish(&sc);
+  return 0;
+}
+
+/**
+ * pair_stats_worker - One thread's share of build_pair_stats.
+ */
+typedef struct pair_stats_worker {
+  int x_fd, x_nulls_fd, y_fd, y_nulls_fd;
+  ssize_t start_pos, end_pos;
+  const scan_options *opts;
+  pair_stats stats;
+  char *errstr;
+  int result;
+  pthread_t thread;
+  bool started;
+} pair_stats_worker;
+
+static void *pair_stats_worker_main(void *arg) {
+  pair_stats_worker *w = (pair_stats_worker *)arg;
+
+  w->result = scan_pair_stats(w->x_fd, w->x_nulls_fd, w->y_fd, w->y_nulls_fd, w->start_pos, w->end_pos,
+                              w->opts, &w->stats, &w->errstr);
+  return NULL;
+}
+
+/**
+ * parallel_pair_stats - Like parallel_stats, but for pairs.
+ */
+static int parallel_pair_stats(int x_fd, int x_nulls_fd, int y_fd, int y_nulls_fd, ssize_t start_pos, ssize_t end_pos,
+                               const scan_options *opts, pair_stats *stats, char **errstr) {
+  pair_stats_worker *workers;
+  int nthreads;
+  ssize_t share;
+  int i, result = 0;
+
+  pair_stats_init(stats);
+  nthreads = plan_threads(x_fd, start_pos, &end_pos, opts, errstr);
+  if (nthreads == -1) return -1;
+  if (nthreads <= 1) return scan_pair_stats(x_fd, x_nulls_fd, y_fd, y_nulls_fd, start_pos, end_pos, opts, stats, errstr);
+
+  workers = calloc(nthreads, sizeof(pair_stats_worker));
+  if (!workers) {
+    *errstr = "out of memory";
+    return -1;
+  }
+
+  share = (end_pos - start_pos + nthreads - 1) / nthreads;
+  for (i = 0; i < nthreads; i++) {
+    workers[i].x_fd = x_fd;
+    workers[i].x_nulls_fd = x_nulls_fd;
+    workers[i].y_fd = y_fd;
+    workers[i].y_nulls_fd = y_nulls_fd;
+    workers[i].start_pos = start_pos + i * share;
+    workers[i].end_pos = i == nthreads - 1 ? end_pos : start_pos + (i + 1) * share;
+    workers[i].opts = opts;
+    pair_stats_init(&workers[i].stats);
+    // If we can't get a thread, just do it ourselves below:
+    if (i > 0) workers[i].started = !start_thread(&workers[i].thread, pair_stats_worker_main, &workers[i]);
+  }
+
+  for (i = 0; i < nthreads; i++) {
+    if (!workers[i].started) pair_stats_worker_main(&workers[i]);
+  }
+
+  for (i = 0; i < nthreads; i++) {
+    if (workers[i].started) pthread_join(workers[i].thread, NULL);
+    if (workers[i].result && !result) {
+      result = workers[i].result;
+      *errstr = workers[i].errstr;
+    }
+    pair_stats_merge(stats, &workers[i].stats);
+  }
+
+  free(workers);
+  return result;
+}
+
+/**
+ * build_pair_stats - Summarizes the pairs of two floatfiles read side by side
+ * where neither value is null, for covariance, correlation, and regression.
+ */
+int build_pair_stats(int x_fd, int x_nulls_fd, int y_fd, int y_nulls_fd, pair_stats *stats,
+                     const scan_options *opts, char **errstr) {
+  return parallel_pair_stats(x_fd, x_nulls_fd, y_fd, y_nulls_fd, 0, -1, opts, stats, errstr);
+}
+
+int build_pair_stats_with_bounds(int x_fd, int x_nulls_fd, int y_fd, int y_nulls_fd, pair_stats *stats,
+                                 ssize_t min_pos, ssize_t max_pos, const scan_options *opts, char **errstr) {
+  return parallel_pair_stats(x_fd, x_nulls_fd, y_fd, y_nulls_fd, min_pos, max_pos + 1, opts, stats, errstr);
+}
+
+static int pair_files_scan(void *ctx, int i, char **errstr) {
+  pair_file *f = &((pair_file *)ctx)[i];
+  scan_options opts;
+
+  if (f->skip) return 0;
+  opts = (scan_options) { .drop_behind = f->drop_behind, .threads = 1 };
+  pair_stats_init(&f->stats);
+  return scan_pair_stats(f->x_fd, f->x_nulls_fd, f->y_fd, f->y_nulls_fd, 0, -1, &opts, &f->stats, errstr);
+}
+
+/**
+ * build_pair_stats_for_files - Like build_pair_stats for each of `files`,
+ * scanning the pairs concurrently like build_histogram_for_files.
+ */
+int build_pair_stats_for_files(int nfiles, pair_file *files, const scan_options *opts, char **errstr) {
+  return run_file_pool(nfiles, pair_files_scan, files, opts, errstr);
+}
+
+/**
+ * rollup_chunks - How many records of rollup `level` cover `nvals` values.
+ */
+static ssize_t rollup_chunks(int level, ssize_t nvals) {
+  return (nvals + ROLLUP_VALS(level) - 1) / ROLLUP_VALS(level);
+}
+
+/**
+ * rollup_offset - Where record `chunk` of rollup `level` lives in the rollups file.
+ *
+ * The header comes first, then every record of every level in pre-order:
+ * each record is followed by its ROLLUP_FANOUT children, each followed by theirs, and so on.
+ * So the records covering the first `nvals` values are exactly the ones before
+ * the end of the last of them at level 0, with no gaps, and appending only ever grows the file at the end.
+ * Level-0 siblings sit side by side, but higher records are a whole subtree apart.
+ */
+static off_t rollup_offset(int level, ssize_t chunk) {
+  // How many records a subtree rooted at each level holds:
+  static const ssize_t subtree[ROLLUP_LEVELS] = {1, 9, 73, 585, 4681, 37449};
+  ssize_t record = (chunk >> (ROLLUP_FANOUT_BITS * (ROLLUP_LEVELS - 1 - level))) * subtree[ROLLUP_LEVELS - 1];
+  int l;
+
+  for (l = ROLLUP_LEVELS - 2; l >= level; l--) {
+    record += 1 + ((chunk >> (ROLLUP_FANOUT_BITS * (l - level))) & (ROLLUP_FANOUT - 1)) * subtree[l];
+  }
+  return (1 + record) * sizeof(block_stats);
+}
+
+/**
+ * rollup_file_size - How long the rollups file is when it covers `nvals` values.
+ */
+static off_t rollup_file_size(ssize_t nvals) {
+  if (nvals == 0) return sizeof(block_stats);
+  return rollup_offset(0, rollup_chunks(0, nvals) - 1) + sizeof(block_stats);
+}
+
+/**
+ * check_rollups - Reads the header of a floatfile's rollups
+ * and makes sure they cover exactly `nvals` values.
+ *
+ * Returns 0 if they do, 1 if there are no rollups or they don't match the data,
+ * or -1 on error.
+ */
+static int check_rollups(const rollup_files *rf, ssize_t nvals, block_stats *header, char **errstr) {
+  struct stat fileinfo;
+  ssize_t bytes_read;
+
+  if (!rf || rf->fd == -1) return 1;
+
+  bytes_read = pread(rf->fd, header, sizeof(block_stats), 0);
+  if (bytes_read == -1) {
+    *errstr = strerror(errno);
+    return -1;
+  }
+  if (bytes_read != sizeof(block_stats) || header->nvals != nvals) return 1;
+
+  if (fstat(rf->fd, &fileinfo)) {
+    *errstr = strerror(errno);
+    return -1;
+  }
+  return fileinfo.st_size == rollup_file_size(nvals) ? 0 : 1;
+}
+
+/**
+ * rollup_run - How many of the `n` records of rollup `level` starting with chunk `first`
+ * sit side by side in the file (see rollup_offset).
+ */
+static ssize_t rollup_run(int level, ssize_t first, ssize_t n) {
+  if (level > 0) return 1;
+  return min(n, ROLLUP_FANOUT - first % ROLLUP_FANOUT);
+}
+
+/**
+ * read_rollups - Reads `n` records of rollup `level`, starting with chunk `first`.
+ */
+static int read_rollups(const rollup_files *rf, int level, ssize_t first, ssize_t n, block_stats *records, char **errstr) {
+  ssize_t i, run, len;
+
+  for (i = 0; i < n; i += run) {
+    run = rollup_run(level, first + i, n - i);
+    len = run * sizeof(block_stats);
+    if (pread(rf->fd, records + i, len, rollup_offset(level, first + i)) != len) {
+      *errstr = "can't read rollups";
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * write_rollups - Writes `n` records of rollup `level`, starting with chunk `first`.
+ */
+static int write_rollups(const rollup_files *rf, int level, ssize_t first, ssize_t n, const block_stats *records, char **errstr) {
+  ssize_t i, run, len;
+
+  for (i = 0; i < n; i += run) {
+    run = rollup_run(level, first + i, n - i);
+    len = run * sizeof(block_stats);
+    if (pwrite(rf->fd, records + i, len, rollup_offset(level, first + i)) != len) {
+      *errstr = "can't write rollups";
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * start_rollups - Gets ready to append to the rollups of a floatfile that has `start_pos` values,
+ * reading their header into `rf->header` (or starting a fresh one if `start_pos` is 0).
+ *
+ * Returns 0 on success, 1 if the rollups don't match the data
+ * (so the caller should remove them), or -1 on error.
+ */
+int start_rollups(rollup_files *rf, ssize_t start_pos, char **errstr) {
+  if (start_pos == 0) {
+    rf->header.nvals = 0;
+    stats_init(&rf->header.stats);
+    return 0;
+  }
+  return check_rollups(rf, start_pos, &rf->header, errstr);
+}
+
+// How many records of each level append_rollups collects before writing them:
+#define ROLLUP_WRITE_BATCH 256
+
+/**
+ * append_rollups - Updates a floatfile's rollups after `len` values were appended
+ * to a floatfile that used to have `start_pos` values.
+ *
+ * Level `level` has one record for every ROLLUP_VALS(level) values,
+ * and the header has one for the whole floatfile.
+ * We summarize the new values one level-0 chunk at a time
+ * and merge each summary into the current record of every level,
+ * starting with the partial last records (if any).
+ * The header only changes in `rf->header`:
+ * call start_rollups first and finish_rollups once you're done appending,
+ * so appending block by block costs no more syncing than appending everything at once.
+ *
+ * Returns 0 on success, 1 if the rollups don't cover `start_pos` values
+ * (so the caller should remove them), or -1 on error.
+ */
+int append_rollups(rollup_files *rf, ssize_t start_pos, const float8 *vals, const bool *nulls, ssize_t len, char **errstr) {
+  block_stats *batches, *batch;
+  ssize_t batch_start[ROLLUP_LEVELS];   // the chunk of each level's first batched record
+  int batched[ROLLUP_LEVELS];           // how many records of each level we've batched, including the current one
+  float_stats piece;
+  ssize_t pos = start_pos, i = 0, n;
+  int level;
+
+  if (rf->header.nvals != start_pos) return 1;
+
+  batches = malloc(ROLLUP_LEVELS * ROLLUP_WRITE_BATCH * sizeof(block_stats));
+  if (!batches) {
+    *errstr = "out of memory";
+    return -1;
+  }
+
+  for (level = 0; level < ROLLUP_LEVELS; level++) {
+    batch = &batches[level * ROLLUP_WRITE_BATCH];
+    batch_start[level] = start_pos / ROLLUP_VALS(level);
+    batched[level] = 1;
+    if (start_pos % ROLLUP_VALS(level)) {
+      if (read_rollups(rf, level, batch_start[level], 1, batch, errstr)) goto bail;
+    } else {
+      batch->nvals = 0;
+      stats_init(&batch->stats);
+    }
+  }
+
+  while (i < len) {
+    n = min(ROLLUP_VALS(0) - pos % ROLLUP_VALS(0), len - i);
+    stats_init(&piece);
+    stats_vals(n, vals + i, nulls + i, &piece);
+
+    for (level = 0; level < ROLLUP_LEVELS; level++) {
+      batch = &batches[level * ROLLUP_WRITE_BATCH];
+      if (pos / ROLLUP_VALS(level) == batch_start[level] + batched[level]) {
+        // This piece starts the next chunk of this level:
+        if (batched[level] == ROLLUP_WRITE_BATCH) {
+          if (write_rollups(rf, level, batch_start[level], batched[level], batch, errstr)) goto bail;
+          batch_start[level] += batched[level];
+          batched[level] = 0;
+        }
+        batch[batched[level]].nvals = 0;
+        stats_init(&batch[batched[level]].stats);
+        batched[level]++;
+      }
+      batch[batched[level] - 1].nvals += n;
+      stats_merge(&batch[batched[level] - 1].stats, &piece);
+    }
+    rf->header.nvals += n;
+    stats_merge(&rf->header.stats, &piece);
+
+    pos += n;
+    i += n;
+  }
+
+  for (level = 0; level < ROLLUP_LEVELS; level++) {
+    batch = &batches[level * ROLLUP_WRITE_BATCH];
+    // If nothing was appended there is no current record to write:
+    if (batch[batched[level] - 1].nvals == 0) batched[level]--;
+    if (write_rollups(rf, level, batch_start[level], batched[level], batch, errstr)) goto bail;
+  }
+  free(batches);
+  return 0;
+
+bail:
+  free(batches);
+  return -1;
+}
+
+/**
+ * finish_rollups - Syncs the records we appended since start_rollups,
+ * then writes the header,
+ * so that if we crash part-way the header won't match the data
+ * and readers will ignore the rollups.
+ * The caller syncs the header.
+ */
+int finish_rollups(const rollup_files *rf, char **errstr) {
+  if (fsync(rf->fd)) {
+    *errstr = strerror(errno);
+    return -1;
+  }
+  if (pwrite(rf->fd, &rf->header, sizeof(block_stats), 0) != sizeof(block_stats)) {
+    *errstr = "can't write rollups";
+    return -1;
+  }
+  return 0;
+}
+
+// The most floatfiles rollup_walk can walk side by side:
+#define ROLLUP_MAX_FILES 2
+
+/**
+ * rollup_walk - Walks part of one or more floatfiles of the same length
+ * using their rollups, biggest chunks first.
+ *
+ * For each chunk entirely inside the range we ask `fits` whether its records
+ * (one per floatfile, in the order of `files`) tell us all we need.
+ * If so we pass them to `use`, and otherwise we try the chunk's children,
+ * or for a level-0 chunk we pass its values to `scan`.
+ * Everything is visited in order, and we save up neighboring values to scan,
+ * so that `scan` gets ranges as long as possible.
+ */
+typedef struct rollup_walk {
+  int nfiles;
+  const rollup_files *files[ROLLUP_MAX_FILES];
+  ssize_t nvals;
+  bool (*fits)(void *ctx, const block_stats *records);
+  int (*use)(void *ctx, int level, ssize_t chunk, const block_stats *records, char **errstr);
+  int (*scan)(void *ctx, ssize_t start_pos, ssize_t end_pos, char **errstr);
+  void *ctx;
+  // The values we haven't passed to `scan` yet:
+  ssize_t scan_start, scan_end;
+} rollup_walk;
+
+/**
+ * rollup_walk_flush - Scans the values we've saved up.
+ */
+static int rollup_walk_flush(rollup_walk *w, char **errstr) {
+  ssize_t start_pos = w->scan_start, end_pos = w->scan_end;
+
+  w->scan_start = w->scan_end = -1;
+  if (start_pos == end_pos) return 0;
+  return w->scan(w->ctx, start_pos, end_pos, errstr);
+}
+
+/**
+ * rollup_walk_chunks - Walks the chunks of rollup `level` from `start_pos` up to (not including) `end_pos`.
+ *
+ * We read up to ROLLUP_FANOUT records at a time,
+ * which is all the children of a chunk one level up.
+ */
+static int rollup_walk_chunks(rollup_walk *w, int level, ssize_t start_pos, ssize_t end_pos, char **errstr) {
+  block_stats batch[ROLLUP_MAX_FILES][ROLLUP_FANOUT], records[ROLLUP_MAX_FILES];
+  ssize_t size = ROLLUP_VALS(level);
+  ssize_t first = start_pos / size, end = (end_pos + size - 1) / size;
+  ssize_t c, i, n, lo, hi;
+  int f;
+
+  for (c = first; c < end; c += n) {
+    n = min(ROLLUP_FANOUT, end - c);
+    for (f = 0; f < w->nfiles; f++) {
+      if (read_rollups(w->files[f], level, c, n, batch[f], errstr)) return -1;
+    }
+
+    for (i = 0; i < n; i++) {
+      lo = Max((c + i) * size, start_pos);
+      hi = Min((c + i + 1) * size, end_pos);
+
+      // The last chunk may be short if it ends the file:
+      if (lo == (c + i) * size && hi == Min((c + i + 1) * size, w->nvals)) {
+        for (f = 0; f < w->nfiles; f++) records[f] = batch[f][i];
+        if (w->fits(w->ctx, records)) {
+          if (rollup_walk_flush(w, errstr)) return -1;
+          if (w->use(w->ctx, level, c + i, records, errstr)) return -1;
+          continue;
+        }
+      }
+
+      if (level > 0) {
+        if (rollup_walk_chunks(w, level - 1, lo, hi, errstr)) return -1;
+      } else if (w->scan_end == lo) {
+        w->scan_end = hi;
+      } else {
+        if (rollup_walk_flush(w, errstr)) return -1;
+        w->scan_start = lo;
+        w->scan_end = hi;
+      }
+    }
+  }
+  return 0;
+}
+
+/**
+ * walk_rollups - Runs `w` from `start_pos` up to (not including) `end_pos`.
+ */
+static int walk_rollups(rollup_walk *w, ssize_t start_pos, ssize_t end_pos, char **errstr) {
+  w->scan_start = w->scan_end = -1;
+  if (rollup_walk_chunks(w, ROLLUP_LEVELS - 1, start_pos, end_pos, errstr)) return -1;
+  return rollup_walk_flush(w, errstr);
+}
+
+/**
+ * floatfile_nvals - Sets `*nvals` to the length of the floatfile whose vals are in `x_fd`.
+ */
+static int floatfile_nvals(int x_fd, ssize_t *nvals, char **errstr) {
+  struct stat fileinfo;
+
+  if (fstat(x_fd, &fileinfo)) {
+    *errstr = strerror(errno);
+    return -1;
+  }
+  *nvals = fileinfo.st_size / sizeof(float8);
+  return 0;
+}
+
+/**
+ * value_index_chunks - How many chunks of a value index with `header` cover `nvals` values.
+ */
+static ssize_t value_index_chunks(const value_index_header *header, ssize_t nvals) {
+  return (nvals + header->chunk_vals - 1) / header->chunk_vals;
+}
+
+/**
+ * read_value_index_header - Reads the header of the value index in `index_fd` (which may be -1)
+ * and makes sure the file has a chunk for every value it says it covers.
+ *
+ * Returns 0 if it does, 1 if there is no index or it is broken, or -1 on error.
+ */
+static int read_value_index_header(int index_fd, value_index_header *header, char **errstr) {
+  struct stat fileinfo;
+  ssize_t bytes_read;
+
+  if (index_fd == -1) return 1;
+
+  bytes_read = pread(index_fd, header, sizeof(value_index_header), 0);
+  if (bytes_read == -1) {
+    *errstr = strerror(errno);
+    return -1;
+  }
+  if (bytes_read != sizeof(value_index_header) || header->nvals < 0 || header->chunk_vals < 1 ||
+      header->nbins < 1 || header->nbins > VALUE_INDEX_MAX_BINS) return 1;
+
+  if (fstat(index_fd, &fileinfo)) {
+    *errstr = strerror(errno);
+    return -1;
+  }
+  if (fileinfo.st_size < (off_t)(sizeof(value_index_header) + value_index_chunks(header, header->nvals) * sizeof(uint64))) return 1;
+  return 0;
+}
+
+/**
+ * check_value_index - Like read_value_index_header,
+ * but also returns 1 unless the index covers exactly `nvals` values.
+ */
+static int check_value_index(int index_fd, ssize_t nvals, value_index_header *header, char **errstr) {
+  int result = read_value_index_header(index_fd, header, errstr);
+
+  if (result == 0 && header->nvals != nvals) return 1;
+  return result;
+}
+
+/**
+ * value_index_bin - Returns the bin of `x`, i.e. how many edges are no bigger than it.
+ * Don't pass NaN.
+ */
+static inline int value_index_bin(const value_index_header *header, float8 x) {
+  int lo = 0, hi = header->nbins - 1, mid;
+
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (header->edges[mid] <= x) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+/**
+ * value_index_bins - Returns the bins holding the values from `lo` to `hi` (inclusive).
+ */
+static uint64 value_index_bins(const value_index_header *header, float8 lo, float8 hi) {
+  int first, last;
+
+  if (!(lo <= hi)) return 0;
+  first = value_index_bin(header, lo);
+  last = value_index_bin(header, hi);
+  return (last == 63 ? ~(uint64)0 : ((uint64)1 << (last + 1)) - 1) & ~(((uint64)1 << first) - 1);
+}
+
+/**
+ * index_filter - Which chunks of a floatfile a scan needs, according to its value index.
+ *
+ * `fd` is -1 if there is no index, or it can't help because we want every bin.
+ */
+typedef struct index_filter {
+  int fd;
+  value_index_header header;
+  uint64 want;
+} index_filter;
+
+/**
+ * open_index_filter - Sets up `f` to find the chunks that might have values from `lo` to `hi`,
+ * using the value index in `rf` (which may be NULL) if it matches the `nvals` values of the data.
+ */
+static int open_index_filter(const rollup_files *rf, ssize_t nvals, float8 lo, float8 hi, index_filter *f, char **errstr) {
+  int result;
+
+  f->fd = -1;
+  if (!rf) return 0;
+
+  result = check_value_index(rf->index_fd, nvals, &f->header, errstr);
+  if (result == -1) return -1;
+  if (result == 1) return 0;
+
+  f->want = value_index_bins(&f->header, lo, hi);
+  if (f->want != value_index_bins(&f->header, -INFINITY, INFINITY)) f->fd = rf->index_fd;
+  return 0;
+}
+
+// How many chunks of a value index we read or write at a time:
+#define VALUE_INDEX_BATCH 1024
+// Reading a little we don't need is cheaper than starting another scan:
+#define VALUE_INDEX_MIN_SKIP (16 * 1024)
+
+/**
+ * scan_index_filter - Passes `scan` the parts from `start_pos` up to (not including) `end_pos`
+ * whose chunks have a value in a bin that `f` wants,
+ * or the whole range if `f` has no index.
+ *
+ * We only skip stretches of at least VALUE_INDEX_MIN_SKIP values,
+ * so tiny chunks don't turn into lots of tiny scans.
+ */
+static int scan_index_filter(const index_filter *f, ssize_t start_pos, ssize_t end_pos,
+                             int (*scan)(void *ctx, ssize_t start_pos, ssize_t end_pos, char **errstr),
+                             void *ctx, char **errstr) {
+  uint64 bins[VALUE_INDEX_BATCH];
+  ssize_t size, first, end, c, i, n, len, lo, hi;
+  ssize_t run_start = -1, run_end = -1;
+
+  if (f->fd == -1) return scan(ctx, start_pos, end_pos, errstr);
+
+  size = f->header.chunk_vals;
+  first = start_pos / size;
+  end = (end_pos + size - 1) / size;
+  for (c = first; c < end; c += n) {
+    n = min(VALUE_INDEX_BATCH, end - c);
+    len = n * sizeof(uint64);
+    if (pread(f->fd, bins, len, sizeof(value_index_header) + c * sizeof(uint64)) != len) {
+      *errstr = "can't read value index";
+      return -1;
+    }
+    for (i = 0; i < n; i++) {
+      if (!(bins[i] & f->want)) continue;
+      lo = Max((c + i) * size, start_pos);
+      hi = Min((c + i + 1) * size, end_pos);
+      if (run_start != -1 && lo - run_end < VALUE_INDEX_MIN_SKIP) {
+        run_end = hi;
+        continue;
+      }
+      if (run_start != -1 && scan(ctx, run_start, run_end, errstr)) return -1;
+      run_start = lo;
+      run_end = hi;
+    }
+  }
+  if (run_start != -1) return scan(ctx, run_start, run_end, errstr);
+  return 0;
+}
+
+/**
+ * stats_walk - What build_stats_from_rollups needs while walking the rollups.
+ */
+typedef struct stats_walk {
+  int x_fd, x_nulls_fd;
+  const scan_options *opts;
+  float_stats *stats;
+} stats_walk;
+
+static bool stats_walk_fits(void *ctx, const block_stats *records) {
+  return true;
+}
+
+static int stats_walk_use(void *ctx, int level, ssize_t chunk, const block_stats *records, char **errstr) {
+  stats_merge(((stats_walk *)ctx)->stats, &records[0].stats);
+  return 0;
+}
+
+static int stats_walk_scan(void *ctx, ssize_t start_pos, ssize_t end_pos, char **errstr) {
+  stats_walk *sw = (stats_walk *)ctx;
+  float_stats edge;
+
+  if (parallel_stats(sw->x_fd, sw->x_nulls_fd, start_pos, end_pos, sw->opts, &edge, errstr)) return -1;
+  stats_merge(sw->stats, &edge);
+  return 0;
+}
+
+/**
+ * build_stats_from_rollups - Like build_stats_with_bounds,
+ * but uses the floatfile's rollups (`rf`) wherever it can.
+ *
+ * Every chunk entirely inside the range comes straight from its record,
+ * biggest first, so we only read about ROLLUP_FANOUT records per level
+ * plus the partial level-0 chunks at either edge,
+ * and the whole file needs no scan at all.
+ * If `rf` is NULL or the rollups don't match the data, we just scan.
+ * `end_pos` may be -1 for the end of the file.
+ * Sets `*nvals` to the length of the floatfile.
+ */
+int build_stats_from_rollups(int x_fd, int x_nulls_fd, const rollup_files *rf, ssize_t start_pos, ssize_t end_pos,
+                             float_stats *stats, ssize_t *nvals, const scan_options *opts, char **errstr) {
+  stats_walk sw = { .x_fd = x_fd, .x_nulls_fd = x_nulls_fd, .opts = opts, .stats = stats };
+  rollup_walk w = {
+    .nfiles = 1, .files = {rf},
+    .fits = stats_walk_fits, .use = stats_walk_use, .scan = stats_walk_scan, .ctx = &sw
+  };
+  block_stats header;
+  int result;
+
+  stats_init(stats);
+  if (floatfile_nvals(x_fd, nvals, errstr)) return -1;
+  if (end_pos == -1 || end_pos > *nvals) end_pos = *nvals;
+  if (start_pos >= end_pos) return 0;
+
+  result = check_rollups(rf, *nvals, &header, errstr);
+  if (result == -1) return -1;
+  if (result == 1) return parallel_stats(x_fd, x_nulls_fd, start_pos, end_pos, opts, stats, errstr);
+
+  if (start_pos == 0 && end_pos == *nvals) {
+    *stats = header.stats;
+    return 0;
+  }
+
+  w.nvals = *nvals;
+  return walk_rollups(&w, start_pos, end_pos, errstr);
+}
+
+/**
+ * hist_walk - What build_histograms_from_rollups needs while walking the rollups.
+ */
+typedef struct hist_walk {
+  int x_fd, x_nulls_fd;
+  int nspecs;
+  hist_spec *specs;
+  index_filter filter;
+  const scan_options *opts;
+} hist_walk;
+
+/**
+ * hist_spec_values - Sets `*lo` and `*hi` so that every value `spec` counts is between them.
+ *
+ * We pad them by a bucket so rounding can't count anything outside.
+ */
+static void hist_spec_values(const hist_spec *spec, float8 *lo, float8 *hi) {
+  float8 end;
+
+  if (spec->edges) {
+    *lo = spec->edges->edges[0];
+    *hi = spec->edges->edges[spec->edges->count];
+    return;
+  }
+  end = spec->min + spec->width * spec->count;
+  *lo = Min(spec->min, end) - fabs(spec->width);
+  *hi = Max(spec->min, end) + fabs(spec->width);
+  if (isnan(*lo) || isnan(*hi)) {
+    *lo = -INFINITY;
+    *hi = INFINITY;
+  }
+}
+
+/**
+ * rollup_bucket - Returns the bucket of `spec` that holds every value from `lo` to `hi`,
+ * -1 if they all miss the histogram, or -2 if they might not all land together.
+ *
+ * We find the buckets just like count_vals (or count_vals_edges),
+ * and a bigger value never gets a smaller bucket (or a negative width, a bigger one),
+ * so if the smallest and biggest values agree then everything between them does too.
+ */
+static int rollup_bucket(const hist_spec *spec, float8 lo, float8 hi) {
+  float8 lo_pos, hi_pos;
+  bool lo_in, hi_in;
+  int lo_bucket;
+
+  if (spec->edges) {
+    lo_bucket = bucket_edges_find(spec->edges, lo);
+    if (lo_bucket >= 0 && lo_bucket == bucket_edges_find(spec->edges, hi)) return lo_bucket;
+    if (hi < spec->edges->edges[0] || lo >= spec->edges->edges[spec->edges->count]) return -1;
+    return -2;
+  }
+
+  lo_pos = (lo - spec->min) / spec->width;
+  hi_pos = (hi - spec->min) / spec->width;
+  lo_in = lo_pos >= 0 && lo_pos < spec->count;
+  hi_in = hi_pos >= 0 && hi_pos < spec->count;
+  if (lo_in && hi_in && (int)lo_pos == (int)hi_pos) return (int)lo_pos;
+  if ((lo_pos < 0 && hi_pos < 0) || (lo_pos >= spec->count && hi_pos >= spec->count)) return -1;
+  return -2;
+}
+
+static bool hist_walk_fits(void *ctx, const block_stats *records) {
+  hist_walk *hw = (hist_walk *)ctx;
+  int s;
+
+  if (records[0].stats.count == 0) return true;
+  // NaNs are never counted, but the rollup can't say how many there are:
+  if (isnan(records[0].stats.sum)) return false;
+  for (s = 0; s < hw->nspecs; s++) {
+    if (rollup_bucket(&hw->specs[s], records[0].stats.min, records[0].stats.max) == -2) return false;
+  }
+  return true;
+}
+
+static int hist_walk_use(void *ctx, int level, ssize_t chunk, const block_stats *records, char **errstr) {
+  hist_walk *hw = (hist_walk *)ctx;
+  int s, bucket;
+
+  if (records[0].stats.count == 0) return 0;
+  for (s = 0; s < hw->nspecs; s++) {
+    bucket = rollup_bucket(&hw->specs[s], records[0].stats.min, records[0].stats.max);
+    if (bucket >= 0) hw->specs[s].counts[bucket] += records[0].stats.count;
+  }
+  return 0;
+}
+
+static int hist_walk_scan_range(void *ctx, ssize_t start_pos, ssize_t end_pos, char **errstr) {
+  hist_walk *hw = (hist_walk *)ctx;
+  hist_worker w = {
+    .ndims = 1,
+    .x_fd = hw->x_fd, .x_nulls_fd = hw->x_nulls_fd, .nspecs = hw->nspecs, .specs = hw->specs,
+    .start_pos = start_pos, .end_pos = end_pos, .opts = hw->opts
+  };
+  return parallel_histogram(&w, errstr);
+}
+
+static int hist_walk_scan(void *ctx, ssize_t start_pos, ssize_t end_pos, char **errstr) {
+  return scan_index_filter(&((hist_walk *)ctx)->filter, start_pos, end_pos, hist_walk_scan_range, ctx, errstr);
+}
+
+/**
+ * build_histograms_from_rollups - Like build_histograms_with_bounds,
+ * but skips reading any chunk whose rollup says its values
+ * all land in the same bucket (or miss) of every histogram.
+ *
+ * That pays off for smooth data and wide buckets,
+ * e.g. a coarse histogram of a slowly-changing sensor.
+ * For noisy data most chunks straddle a bucket boundary,
+ * so we read nearly everything anyway plus the rollups (under 1% more).
+ * If `rf` is NULL or the rollups don't match the data, we just scan.
+ * Either way if the floatfile has a value index we skip the chunks
+ * with no values anywhere near the histograms.
+ * `end_pos` may be -1 for the end of the file.
+ */
+int build_histograms_from_rollups(int x_fd, int x_nulls_fd, const rollup_files *rf, int nspecs, hist_spec *specs,
+                                  ssize_t start_pos, ssize_t end_pos, const scan_options *opts, char **errstr) {
+  hist_walk hw = { .x_fd = x_fd, .x_nulls_fd = x_nulls_fd, .nspecs = nspecs, .specs = specs, .opts = opts };
+  rollup_walk w = {
+    .nfiles = 1, .files = {rf},
+    .fits = hist_walk_fits, .use = hist_walk_use, .scan = hist_walk_scan, .ctx = &hw
+  };
+  block_stats header;
+  ssize_t nvals;
+  float8 lo = INFINITY, hi = -INFINITY, spec_lo, spec_hi;
+  int result, s;
+
+  if (floatfile_nvals(x_fd, &nvals, errstr)) return -1;
+  if (end_pos == -1 || end_pos > nvals) end_pos = nvals;
+  if (start_pos >= end_pos) return 0;
+
+  for (s = 0; s < nspecs; s++) {
+    hist_spec_values(&specs[s], &spec_lo, &spec_hi);
+    lo = Min(lo, spec_lo);
+    hi = Max(hi, spec_hi);
+  }
+  if (open_index_filter(rf, nvals, lo, hi, &hw.filter, errstr)) return -1;
+
+  result = check_rollups(rf, nvals, &header, errstr);
+  if (result == -1) return -1;
+  if (result == 1) return hist_walk_scan(&hw, start_pos, end_pos, errstr);
+
+  w.nvals = nvals;
+  return walk_rollups(&w, start_pos, end_pos, errstr);
+}
+
+int build_histogram_from_rollups(int x_fd, int x_nulls_fd, const rollup_files *rf, float8 x_min, float8 x_width, int32 x_count,
+                                 int64 *counts, ssize_t start_pos, ssize_t end_pos, const scan_options *opts, char **errstr) {
+  hist_spec spec = { .min = x_min, .width = x_width, .count = x_count, .counts = counts };
+  return build_histograms_from_rollups(x_fd, x_nulls_fd, rf, 1, &spec, start_pos, end_pos, opts, errstr);
+}
+
+/**
+ * build_histogram_edges - Like build_histogram_from_rollups, but with arbitrary bucket edges.
+ */
+int build_histogram_edges(int x_fd, int x_nulls_fd, const rollup_files *rf, const bucket_edges *edges, int64 *counts,
+                          ssize_t start_pos, ssize_t end_pos, const scan_options *opts, char **errstr) {
+  hist_spec spec = { .count = edges->count, .counts = counts, .edges = edges };
+  return build_histograms_from_rollups(x_fd, x_nulls_fd, rf, 1, &spec, start_pos, end_pos, opts, errstr);
+}
+
+/**
+ * build_histogram_auto - Like build_histogram_from_rollups,
+ * but chooses `x_count` buckets spanning the values' min and max,
+ * and sets `*x_min` and `*x_width` to them.
+ * If there are no (non-NaN) values we count nothing and set `*x_width` to 0.
+ *
+ * The min and max come from the rollups where they can.
+ * Otherwise we have to scan twice, so the first pass never drops behind,
+ * and the second one finds the blocks still in the page cache.
+ * We widen the buckets by an ulp or so if we must, so that the max lands in the last one.
+ */
+int build_histogram_auto(int x_fd, int x_nulls_fd, const rollup_files *rf, int32 x_count, int64 *counts,
+                         float8 *x_min, float8 *x_width, ssize_t start_pos, ssize_t end_pos,
+                         const scan_options *opts, char **errstr) {
+  scan_options first_pass = *opts;
+  float_stats stats;
+  ssize_t nvals;
+  float8 width;
+
+  first_pass.drop_behind = false;
+  if (build_stats_from_rollups(x_fd, x_nulls_fd, rf, start_pos, end_pos, &stats, &nvals, &first_pass, errstr)) return -1;
+
+  *x_min = stats.min;
+  *x_width = 0;
+  // NaNs count but never make it into the min and max:
+  if (stats.count == 0 || stats.min > stats.max) return 0;
+  if (isinf(stats.max - stats.min)) {
+    *errstr = "can't choose buckets for infinite values";
+    return -1;
+  }
+
+  width = (stats.max - stats.min) / x_count;
+  if (width == 0) width = 1;   // just one distinct value
+  while (!((stats.max - stats.min) / width < x_count)) width = nextafter(width, INFINITY);
+  *x_width = width;
+
+  return build_histogram_from_rollups(x_fd, x_nulls_fd, rf, stats.min, width, x_count, counts, start_pos, end_pos, opts, errstr);
+}
+
+/**
+ * scan_tdigest - Adds the values from `start_pos` up to (not including) `end_pos` to `td`.
+ */
+static int scan_tdigest(int x_fd, int x_nulls_fd, ssize_t start_pos, ssize_t end_pos,
+                        const scan_options *opts, tdigest *td, char **errstr) {
+  scanner sc;
+  scan_block *b;
+  int x_vals_read;
+
+  if (scanner_init(&sc, 1, &x_fd, &x_nulls_fd, start_pos, end_pos, opts, errstr)) {
+    scanner_finish(&sc);
+    return -1;
+  }
+
+  while ((x_vals_read = scanner_next(&sc, &b, errstr))) {
+    if (x_vals_read == -1) {
+      scanner_finish(&sc);
+      return -1;   // errstr is already set
+    }
+    tdigest_vals(td, x_vals_read, b->vals[0], b->nulls[0]);
+  }
+
+  scanner_finish(&sc);
+  return 0;
+}
+
+/**
+ * tdigest_worker - One thread's share of a t-digest.
+ */
+typedef struct tdigest_worker {
+  int x_fd, x_nulls_fd;
+  ssize_t start_pos, end_pos;
+  const scan_options *opts;
+  tdigest td;
+  char *errstr;
+  int result;
+  pthread_t thread;
+  bool started;
+} tdigest_worker;
+
+static void *tdigest_worker_main(void *arg) {
+  tdigest_worker *w = (tdigest_worker *)arg;
+
+  w->result = scan_tdigest(w->x_fd, w->x_nulls_fd, w->start_pos, w->end_pos, w->opts, &w->td, &w->errstr);
+  return NULL;
+}
+
+/**
+ * parallel_tdigest - Like parallel_stats, but builds a t-digest.
+ * Each worker builds its own digest and we merge them into `td` at the end.
+ */
+static int parallel_tdigest(int x_fd, int x_nulls_fd, ssize_t start_pos, ssize_t end_pos,
+                            const scan_options *opts, tdigest *td, char **errstr) {
+  tdigest_worker *workers;
+  int nthreads;
+  ssize_t share;
+  int i, result = 0;
+
+  nthreads = plan_threads(x_fd, start_pos, &end_pos, opts, errstr);
+  if (nthreads == -1) return -1;
+  if (nthreads <= 1) return scan_tdigest(x_fd, x_nulls_fd, start_pos, end_pos, opts, td, errstr);
+
+  workers = calloc(nthreads, sizeof(tdigest_worker));
+  if (!workers) {
+    *errstr = "out of memory";
+    return -1;
+  }
+
+  share = (end_pos - start_pos + nthreads - 1) / nthreads;
+  for (i = 0; i < nthreads; i++) {
+    workers[i].x_fd = x_fd;
+    workers[i].x_nulls_fd = x_nulls_fd;
+    workers[i].start_pos = start_pos + i * share;
+    workers[i].end_pos = i == nthreads - 1 ? end_pos : start_pos + (i + 1) * share;
+    workers[i].opts = opts;
+    if (tdigest_init(&workers[i].td)) {
+      workers[i].result = -1;
+      workers[i].errstr = "out of memory";
+      continue;
+    }
+    // If we can't get a thread, just do it ourselves below:
+    if (i > 0) workers[i].started = !start_thread(&workers[i].thread, tdigest_worker_main, &workers[i]);
+  }
+
+  for (i = 0; i < nthreads; i++) {
+    if (workers[i].td.buffer && !workers[i].started) tdigest_worker_main(&workers[i]);
+  }
+
+  for (i = 0; i < nthreads; i++) {
+    if (workers[i].started) pthread_join(workers[i].thread, NULL);
+    if (workers[i].result && !result) {
+      result = workers[i].result;
+      *errstr = workers[i].errstr;
+    }
+    if (workers[i].td.buffer) {
+      tdigest_merge(td, &workers[i].td);
+      tdigest_finish(&workers[i].td);
+    }
+  }
+
+  free(workers);
+  return result;
+}
+
+/**
+ * load_non_null_vals - Reads the values from `start_pos` up to (not including) `end_pos`
+ * into `vals`, skipping nulls and NaNs, and sets `*nvals` to how many there were.
+ */
+static int load_non_null_vals(int x_fd, int x_nulls_fd, ssize_t start_pos, ssize_t end_pos,
+                              float8 *vals, int64 *nvals, const scan_options *opts, char **errstr) {
+  scanner sc;
+  scan_block *b;
+  int x_vals_read, i;
+
+  *nvals = 0;
+  if (scanner_init(&sc, 1, &x_fd, &x_nulls_fd, start_pos, end_pos, opts, errstr)) {
+    scanner_finish(&sc);
+    return -1;
+  }
+
+  while ((x_vals_read = scanner_next(&sc, &b, errstr))) {
+    if (x_vals_read == -1) {
+      scanner_finish(&sc);
+      return -1;   // errstr is already set
+    }
+    for (i = 0; i < x_vals_read; i++) {
+      if (b->nulls[0][i] || isnan(b->vals[0][i])) continue;
+      vals[(*nvals)++] = b->vals[0][i];
+    }
+  }
+
+  scanner_finish(&sc);
+  return 0;
+}
+
+/**
+ * select_nth - Rearranges `vals[lo..hi]` (inclusive) so that `vals[k]` holds the value it would if they were sorted,
+ * with nothing bigger before it and nothing smaller after it.
+ *
+ * This is Hoare's quickselect, with a median-of-three pivot.
+ */
+static void select_nth(float8 *vals, ssize_t lo, ssize_t hi, ssize_t k) {
+  ssize_t i, j, mid;
+  float8 pivot, tmp;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (vals[mid] < vals[lo]) { tmp = vals[mid]; vals[mid] = vals[lo]; vals[lo] = tmp; }
+    if (vals[hi]  < vals[lo]) { tmp = vals[hi];  vals[hi]  = vals[lo]; vals[lo] = tmp; }
+    if (vals[hi]  < vals[mid]) { tmp = vals[hi]; vals[hi]  = vals[mid]; vals[mid] = tmp; }
+    pivot = vals[mid];
+
+    i = lo;
+    j = hi;
+    while (i <= j) {
+      while (vals[i] < pivot) i++;
+      while (vals[j] > pivot) j--;
+      if (i <= j) {
+        tmp = vals[i];
+        vals[i++] = vals[j];
+        vals[j--] = tmp;
+      }
+    }
+
+    if (k <= j) hi = j;
+    else if (k >= i) lo = i;
+    else return;
+  }
+}
+
+typedef struct fraction_order {
+  float8 fraction;
+  int i;
+} fraction_order;
+
+static int compare_fractions(const void *a, const void *b) {
+  float8 fa = ((const fraction_order *)a)->fraction, fb = ((const fraction_order *)b)->fraction;
+
+  return fa < fb ? -1 : fa > fb;
+}
+
+/**
+ * exact_percentiles - Computes percentiles exactly (interpolating like percentile_cont)
+ * by loading the values and selecting the ones we need.
+ *
+ * We handle the fractions in increasing order,
+ * so each selection only has to look at the values after the last one.
+ */
+static int exact_percentiles(int x_fd, int x_nulls_fd, ssize_t start_pos, ssize_t end_pos,
+                             int nfractions, const float8 *fractions, float8 *results,
+                             int64 *nvals, const scan_options *opts, char **errstr) {
+  float8 *vals;
+  fraction_order *order;
+  float8 pos, lo_val, hi_val;
+  ssize_t from = 0, lo, hi;
+  int i;
+
+  vals = malloc(Max(end_pos - start_pos, 1) * sizeof(float8));
+  order = malloc(Max(nfractions, 1) * sizeof(fraction_order));
+  if (!vals || !order) {
+    free(vals);
+    free(order);
+    *errstr = "out of memory";
+    return -1;
+  }
+
+  if (load_non_null_vals(x_fd, x_nulls_fd, start_pos, end_pos, vals, nvals, opts, errstr)) {
+    free(vals);
+    free(order);
+    return -1;
+  }
+
+  for (i = 0; i < nfractions; i++) {
+    order[i].fraction = fractions[i];
+    order[i].i = i;
+  }
+  qsort(order, nfractions, sizeof(fraction_order), compare_fractions);
+
+  for (i = 0; i < nfractions; i++) {
+    if (*nvals == 0) {
+      results[order[i].i] = NAN;
+      continue;
+    }
+    pos = order[i].fraction * (*nvals - 1);
+    lo = (ssize_t)floor(pos);
+    hi = (ssize_t)ceil(pos);
+    select_nth(vals, from, *nvals - 1, lo);
+    lo_val = vals[lo];
+    if (hi != lo) {
+      select_nth(vals, lo + 1, *nvals - 1, hi);
+      hi_val = vals[hi];
+      results[order[i].i] = lo_val + (hi_val - lo_val) * (pos - lo);
+    } else {
+      results[order[i].i] = lo_val;
+    }
+    from = lo;
+  }
+
+  free(vals);
+  free(order);
+  return 0;
+}
+
+/**
+ * percentiles - Finds the value at each of `fractions` (from 0 to 1)
+ * of the way through the sorted non-null values from `start_pos` up to `end_pos` (or -1 for the end),
+ * and sets `*nvals` to how many values there were.
+ * The results are NaN if there were none.
+ *
+ * If there are at most `exact_limit` values (counting nulls) we load them and get the exact answer.
+ * Otherwise we build a t-digest, which only needs one pass and very little memory,
+ * and can be split across threads.
+ */
+static int percentiles(int x_fd, int x_nulls_fd, ssize_t start_pos, ssize_t end_pos,
+                       int nfractions, const float8 *fractions, float8 *results,
+                       int64 *nvals, ssize_t exact_limit, const scan_options *opts, char **errstr) {
+  struct stat fileinfo;
+  tdigest td;
+  int i;
+
+  if (fstat(x_fd, &fileinfo)) {
+    *errstr = strerror(errno);
+    return -1;
+  }
+  if (end_pos == -1 || end_pos > fileinfo.st_size / sizeof(float8)) end_pos = fileinfo.st_size / sizeof(float8);
+  if (start_pos > end_pos) start_pos = end_pos;
+
+  if (end_pos - start_pos <= exact_limit) {
+    return exact_percentiles(x_fd, x_nulls_fd, start_pos, end_pos, nfractions, fractions, results, nvals, opts, errstr);
+  }
+
+  if (tdigest_init(&td)) {
+    *errstr = "out of memory";
+    return -1;
+  }
+  if (parallel_tdigest(x_fd, x_nulls_fd, start_pos, end_pos, opts, &td, errstr)) {
+    tdigest_finish(&td);
+    return -1;
+  }
+  for (i = 0; i < nfractions; i++) results[i] = tdigest_percentile(&td, fractions[i]);
+  *nvals = td.count;
+  tdigest_finish(&td);
+  return 0;
+}
+
+int build_percentiles(int x_fd, int x_nulls_fd, int nfractions, const float8 *fractions, float8 *results,
+                      int64 *nvals, ssize_t exact_limit, const scan_options *opts, char **errstr) {
+  return percentiles(x_fd, x_nulls_fd, 0, -1, nfractions, fractions, results, nvals, exact_limit, opts, errstr);
+}
+
+int build_percentiles_with_bounds(int x_fd, int x_nulls_fd, int nfractions, const float8 *fractions, float8 *results,
+                                  int64 *nvals, ssize_t min_pos, ssize_t max_pos, ssize_t exact_limit,
+                                  const scan_options *opts, char **errstr) {
+  return percentiles(x_fd, x_nulls_fd, min_pos, max_pos + 1, nfractions, fractions, results, nvals, exact_limit, opts, errstr);
+}
+
+/**
+ * index_vals - Adds the bins of the `n` values in `vals` to `*bins`.
+ */
+static void index_vals(const value_index_header *header, ssize_t n, const float8 *vals, const bool *nulls, uint64 *bins) {
+  ssize_t i;
+
+  for (i = 0; i < n; i++) {
+    if (!nulls[i] && !isnan(vals[i])) *bins |= (uint64)1 << value_index_bin(header, vals[i]);
+  }
+}
+
+/**
+ * write_value_index - Writes the bins of `n` chunks of a value index, starting with chunk `first`.
+ */
+static int write_value_index(int index_fd, ssize_t first, ssize_t n, const uint64 *bins, char **errstr) {
+  ssize_t len = n * sizeof(uint64);
+
+  if (pwrite(index_fd, bins, len, sizeof(value_index_header) + first * sizeof(uint64)) != len) {
+    *errstr = "can't write value index";
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * update_value_index - Brings the value index in `index_fd` up to date
+ * with whatever was appended to the floatfile since the index last saw it,
+ * reading the new values back from the floatfile.
+ *
+ * Like append_rollups we add to the partial last chunk (if any),
+ * sync the chunks, and write the header last.
+ * If we crash part-way a chunk may keep bins it doesn't need,
+ * which costs some reading but never a wrong answer.
+ *
+ * Returns 0 on success, 1 if the index doesn't match the data
+ * (so the caller should remove it), or -1 on error.
+ */
+int update_value_index(int index_fd, int x_fd, int x_nulls_fd, const scan_options *opts, char **errstr) {
+  value_index_header header;
+  uint64 *bins;
+  scanner sc;
+  scan_block *blk;
+  ssize_t nvals, pos, size, batch_start, batched = 1, i, n;
+  int vals_read, result;
+
+  result = read_value_index_header(index_fd, &header, errstr);
+  if (result) return result;
+  if (floatfile_nvals(x_fd, &nvals, errstr)) return -1;
+  if (header.nvals > nvals) return 1;
+  if (header.nvals == nvals) return 0;
+
+  bins = malloc(VALUE_INDEX_BATCH * sizeof(uint64));
+  if (!bins) {
+    *errstr = "out of memory";
+    return -1;
+  }
+
+  pos = header.nvals;
+  size = header.chunk_vals;
+  batch_start = pos / size;
+  bins[0] = 0;
+  if (pos % size && pread(index_fd, bins, sizeof(uint64), sizeof(value_index_header) + batch_start * sizeof(uint64)) != sizeof(uint64)) {
+    *errstr = "can't read value index";
+    goto bail;
+  }
+
+  if (scanner_init(&sc, 1, &x_fd, &x_nulls_fd, pos, nvals, opts, errstr)) {
+    scanner_finish(&sc);
+    goto bail;
+  }
+  while ((vals_read = scanner_next(&sc, &blk, errstr))) {
+    if (vals_read == -1) break;   // errstr is already set
+
+    for (i = 0; i < vals_read; i += n) {
+      if (pos / size == batch_start + batched) {
+        // These values start the next chunk:
+        if (batched == VALUE_INDEX_BATCH) {
+          if (write_value_index(index_fd, batch_start, batched, bins, errstr)) {
+            vals_read = -1;
+            break;
+          }
+          batch_start += batched;
+          batched = 0;
+        }
+        bins[batched++] = 0;
+      }
+      n = min(size - pos % size, vals_read - i);
+      index_vals(&header, n, blk->vals[0] + i, blk->nulls[0] + i, &bins[batched - 1]);
+      pos += n;
+    }
+    if (vals_read == -1) break;
+  }
+  scanner_finish(&sc);
+  if (vals_read == -1) goto bail;
+  if (pos != nvals) {
+    *errstr = "can't read floatfile";
+    goto bail;
+  }
+
+  if (write_value_index(index_fd, batch_start, batched, bins, errstr)) goto bail;
+  if (fsync(index_fd)) {
+    *errstr = strerror(errno);
+    goto bail;
+  }
+  free(bins);
+
+  header.nvals = nvals;
+  if (pwrite(index_fd, &header, sizeof(value_index_header), 0) != sizeof(value_index_header)) {
+    *errstr = "can't write value index";
+    return -1;
+  }
+  return 0;
+
+bail:
+  free(bins);
+  return -1;
+}
+
+/**
+ * build_value_index - Replaces whatever is in `index_fd` with a new value index
+ * of the floatfile in `x_fd` and `x_nulls_fd`, with up to `nbins` bins
+ * and a uint64 for every `chunk_vals` values.
+ *
+ * We put the edges at evenly-spaced percentiles (from build_percentiles, with `exact_limit`),
+ * so each bin starts with about as many values.
+ * Repeated values can make some edges the same, and then we have fewer bins.
+ * Values appended later fall in the first or last bin if they are out past the edges.
+ */
+int build_value_index(int index_fd, int x_fd, int x_nulls_fd, int nbins, int chunk_vals,
+                      ssize_t exact_limit, const scan_options *opts, char **errstr) {
+  value_index_header header;
+  float8 fractions[VALUE_INDEX_MAX_BINS - 1], edges[VALUE_INDEX_MAX_BINS - 1];
+  int64 nvals;
+  int i;
+
+  if (nbins < 1 || nbins > VALUE_INDEX_MAX_BINS || chunk_vals < 1) {
+    *errstr = "bad value index size";
+    return -1;
+  }
+
+  for (i = 0; i < nbins - 1; i++) fractions[i] = (i + 1.0) / nbins;
+  if (nbins > 1 && build_percentiles(x_fd, x_nulls_fd, nbins - 1, fractions, edges, &nvals, exact_limit, opts, errstr)) return -1;
+
+  memset(&header, 0, sizeof(value_index_header));
+  header.chunk_vals = chunk_vals;
+  header.nbins = 1;
+  for (i = 0; i < nbins - 1; i++) {
+    // There are no edges if there are no values:
+    if (isnan(edges[i]) || (header.nbins > 1 && edges[i] <= header.edges[header.nbins - 2])) continue;
+    header.edges[header.nbins - 1] = edges[i];
+    header.nbins++;
+  }
+
+  if (ftruncate(index_fd, 0)) {
+    *errstr = strerror(errno);
+    return -1;
+  }
+  if (pwrite(index_fd, &header, sizeof(value_index_header), 0) != sizeof(value_index_header)) {
+    *errstr = "can't write value index";
+    return -1;
+  }
+  return update_value_index(index_fd, x_fd, x_nulls_fd, opts, errstr);
+}
+
+/**
+ * downsample_bucket - One time bucket of build_downsample.
+ *
+ * We keep `t_sum` relative to `t_start` so that it doesn't lose precision
+ * when the timestamps are big (e.g. seconds since the epoch).
+ */
+typedef struct downsample_bucket {
+  int64 count;
+  float8 t_sum, x_sum;
+  float8 min_t, min_x;
+  float8 max_t, max_x;
+  // If the min/max came from a rollup we don't know its timestamp yet,
+  // just which chunk it is in (see find_rollup_extreme):
+  bool min_in_rollup, max_in_rollup;
+  int min_level, max_level;
+  ssize_t min_chunk, max_chunk;
+} downsample_bucket;
+
+/**
+ * downsample_bucket_of - Returns the bucket of timestamp `t`.
+ *
+ * find_bounds_start_end compares with floats,
+ * so anything just outside the range goes in the first/last bucket.
+ */
+static inline int downsample_bucket_of(float8 t, float8 t_start, float8 width, int nbuckets) {
+  float8 b;
+
+  if (!(width > 0)) return 0;
+  b = (t - t_start) / width;
+  if (b < 0) return 0;
+  if (b >= nbuckets) return nbuckets - 1;
+  return (int)b;
+}
+
+/**
+ * downsample_point - One (timestamp, value) pair and where it is in the files.
+ */
+typedef struct downsample_point {
+  ssize_t pos;
+  float8 t, x;
+} downsample_point;
+
+/**
+ * scan_downsample_buckets - Adds each (timestamp, value) pair from `start_pos` up to (not including) `end_pos`
+ * to its bucket, skipping nulls and NaNs, and finds the first and last pairs.
+ * `first->pos` is -1 if there were none.
+ */
+static int scan_downsample_buckets(int x_fd, int x_nulls_fd, int t_fd, int t_nulls_fd,
+                                   ssize_t start_pos, ssize_t end_pos, float8 t_start, float8 width,
+                                   int nbuckets, downsample_bucket *buckets,
+                                   downsample_point *first, downsample_point *last,
+                                   const scan_options *opts, char **errstr) {
+  int vals_fds[2] = {t_fd, x_fd};
+  int nulls_fds[2] = {t_nulls_fd, x_nulls_fd};
+  scanner sc;
+  scan_block *b;
+  downsample_bucket *bucket;
+  ssize_t pos = start_pos;
+  int vals_read, i;
+  float8 t, x;
+
+  first->pos = -1;
+  last->pos = -1;
+  if (scanner_init(&sc, 2, vals_fds, nulls_fds, start_pos, end_pos, opts, errstr)) {
+    scanner_finish(&sc);
+    return -1;
+  }
+
+  while ((vals_read = scanner_next(&sc, &b, errstr))) {
+    if (vals_read == -1) {
+      scanner_finish(&sc);
+      return -1;   // errstr is already set
+    }
+    for (i = 0; i < vals_read; i++) {
+      if (b->nulls[0][i] || b->nulls[1][i]) continue;
+      t = b->vals[0][i];
+      x = b->vals[1][i];
+      if (isnan(t) || isnan(x)) continue;
+
+      if (first->pos == -1) *first = (downsample_point){ .pos = pos + i, .t = t, .x = x };
+      *last = (downsample_point){ .pos = pos + i, .t = t, .x = x };
+
+      bucket = &buckets[downsample_bucket_of(t, t_start, width, nbuckets)];
+      if (bucket->count == 0 || x < bucket->min_x) {
+        bucket->min_t = t;
+        bucket->min_x = x;
+        bucket->min_in_rollup = false;
+      }
+      if (bucket->count == 0 || x > bucket->max_x) {
+        bucket->max_t = t;
+        bucket->max_x = x;
+        bucket->max_in_rollup = false;
+      }
+      bucket->count++;
+      bucket->t_sum += t - t_start;
+      bucket->x_sum += x;
+    }
+    pos += vals_read;
+  }
+
+  scanner_finish(&sc);
+  return 0;
+}
+
+/**
+ * downsample_walk - What rollup_downsample_buckets needs while walking the rollups.
+ */
+typedef struct downsample_walk {
+  int x_fd, x_nulls_fd, t_fd, t_nulls_fd;
+  float8 t_start, width;
+  int nbuckets;
+  downsample_bucket *buckets;
+  const scan_options *opts;
+} downsample_walk;
+
+// The records are the timestamps' then the values'.
+static bool downsample_walk_fits(void *ctx, const block_stats *records) {
+  downsample_walk *dw = (downsample_walk *)ctx;
+  const block_stats *t = &records[0], *x = &records[1];
+
+  return t->stats.count == t->nvals && x->stats.count == x->nvals &&
+         !isnan(t->stats.sum) && !isnan(x->stats.sum) &&
+         downsample_bucket_of(t->stats.min, dw->t_start, dw->width, dw->nbuckets) ==
+           downsample_bucket_of(t->stats.max, dw->t_start, dw->width, dw->nbuckets);
+}
+
+static int downsample_walk_use(void *ctx, int level, ssize_t chunk, const block_stats *records, char **errstr) {
+  downsample_walk *dw = (downsample_walk *)ctx;
+  const block_stats *t = &records[0], *x = &records[1];
+  downsample_bucket *bucket = &dw->buckets[downsample_bucket_of(t->stats.min, dw->t_start, dw->width, dw->nbuckets)];
+
+  if (bucket->count == 0 || x->stats.min < bucket->min_x) {
+    bucket->min_x = x->stats.min;
+    bucket->min_in_rollup = true;
+    bucket->min_level = level;
+    bucket->min_chunk = chunk;
+  }
+  if (bucket->count == 0 || x->stats.max > bucket->max_x) {
+    bucket->max_x = x->stats.max;
+    bucket->max_in_rollup = true;
+    bucket->max_level = level;
+    bucket->max_chunk = chunk;
+  }
+  bucket->count += x->nvals;
+  bucket->t_sum += x->nvals * (t->stats.mean - dw->t_start);
+  bucket->x_sum += x->stats.sum;
+  return 0;
+}
+
+static int downsample_walk_scan(void *ctx, ssize_t start_pos, ssize_t end_pos, char **errstr) {
+  downsample_walk *dw = (downsample_walk *)ctx;
+  downsample_point first, last;
+
+  return scan_downsample_buckets(dw->x_fd, dw->x_nulls_fd, dw->t_fd, dw->t_nulls_fd, start_pos, end_pos,
+                                 dw->t_start, dw->width, dw->nbuckets, dw->buckets, &first, &last, dw->opts, errstr);
+}
+
+/**
+ * find_rollup_extreme - Finds the timestamp of the first `x` in chunk `chunk` of rollup `level`,
+ * where `x` is the chunk's min (or max if `want_max`) and the chunk has no nulls or NaNs.
+ *
+ * We follow the first child with the same min/max down to level 0,
+ * then read just that chunk's values.
+ */
+static int find_rollup_extreme(const rollup_files *x_rollups, int x_fd, int t_fd, ssize_t nvals,
+                               int level, ssize_t chunk, float8 x, bool want_max, float8 *t, char **errstr) {
+  block_stats children[ROLLUP_FANOUT];
+  float8 xs[ROLLUP_VALS(0)], ts[ROLLUP_VALS(0)];
+  ssize_t first, n, i, len;
+
+  for (; level > 0; level--) {
+    first = chunk * ROLLUP_FANOUT;
+    n = min(ROLLUP_FANOUT, rollup_chunks(level - 1, nvals) - first);
+    if (read_rollups(x_rollups, level - 1, first, n, children, errstr)) return -1;
+    for (i = 0; i < n; i++) {
+      if ((want_max ? children[i].stats.max : children[i].stats.min) == x) break;
+    }
+    if (i == n) {
+      *errstr = "rollups don't match the data";
+      return -1;
+    }
+    chunk = first + i;
+  }
+
+  first = chunk * ROLLUP_VALS(0);
+  n = min(ROLLUP_VALS(0), nvals - first);
+  len = n * sizeof(float8);
+  if (pread(x_fd, xs, len, first * sizeof(float8)) != len || pread(t_fd, ts, len, first * sizeof(float8)) != len) {
+    *errstr = "can't read floatfile";
+    return -1;
+  }
+  for (i = 0; i < n; i++) {
+    if (xs[i] == x) {
+      *t = ts[i];
+      return 0;
+    }
+  }
+  *errstr = "rollups don't match the data";
+  return -1;
+}
+
+/**
+ * rollup_downsample_buckets - Like scan_downsample_buckets (but without the first and last points),
+ * except every chunk with no nulls or NaNs whose timestamps all fall in one bucket
+ * comes straight from the rollups.
+ *
+ * A rollup doesn't say where its min and max are,
+ * so if `find_extremes` we look up the timestamps of the ones that win their bucket afterwards.
+ * That costs a walk down the levels and one level-0 chunk per point,
+ * so we come out ahead whenever the buckets are much wider than ROLLUP_VALS(0) values.
+ * If either floatfile has no rollups (or they don't match the data) we just scan.
+ */
+static int rollup_downsample_buckets(int x_fd, int x_nulls_fd, const rollup_files *x_rollups,
+                                     int t_fd, int t_nulls_fd, const rollup_files *t_rollups,
+                                     ssize_t start_pos, ssize_t end_pos, float8 t_start, float8 width,
+                                     int nbuckets, downsample_bucket *buckets, bool find_extremes,
+                                     const scan_options *opts, char **errstr) {
+  downsample_walk dw = {
+    .x_fd = x_fd, .x_nulls_fd = x_nulls_fd, .t_fd = t_fd, .t_nulls_fd = t_nulls_fd,
+    .t_start = t_start, .width = width, .nbuckets = nbuckets, .buckets = buckets, .opts = opts
+  };
+  rollup_walk w = {
+    .nfiles = 2, .files = {t_rollups, x_rollups},
+    .fits = downsample_walk_fits, .use = downsample_walk_use, .scan = downsample_walk_scan, .ctx = &dw
+  };
+  block_stats x_header, t_header;
+  ssize_t nvals;
+  int result, i;
+  downsample_bucket *bucket;
+
+  if (floatfile_nvals(x_fd, &nvals, errstr)) return -1;
+  if (end_pos > nvals) end_pos = nvals;
+  if (start_pos >= end_pos) return 0;
+
+  result = check_rollups(x_rollups, nvals, &x_header, errstr);
+  if (result == 0) result = check_rollups(t_rollups, nvals, &t_header, errstr);
+  if (result == -1) return -1;
+  if (result == 1) return downsample_walk_scan(&dw, start_pos, end_pos, errstr);
+
+  w.nvals = nvals;
+  if (walk_rollups(&w, start_pos, end_pos, errstr)) return -1;
+  if (!find_extremes) return 0;
+
+  for (i = 0; i < nbuckets; i++) {
+    bucket = &buckets[i];
+    if (bucket->min_in_rollup &&
+        find_rollup_extreme(x_rollups, x_fd, t_fd, nvals, bucket->min_level, bucket->min_chunk,
+                            bucket->min_x, false, &bucket->min_t, errstr)) return -1;
+    if (bucket->max_in_rollup &&
+        find_rollup_extreme(x_rollups, x_fd, t_fd, nvals, bucket->max_level, bucket->max_chunk,
+                            bucket->max_x, true, &bucket->max_t, errstr)) return -1;
+  }
+  return 0;
+}
+
+/**
+ * scan_lttb - The second pass of Largest-Triangle-Three-Buckets.
+ *
+ * From each bucket we keep the point that makes the biggest triangle
+ * with the point we kept before it and the average of the next non-empty bucket
+ * (`next_ts`/`next_xs`, already worked out from the first pass).
+ * The first and last points are kept separately, so we skip them here.
+ * Since the timestamps are sorted we see the buckets in order,
+ * and we never need more than one bucket's best point in memory.
+ */
+static int scan_lttb(int x_fd, int x_nulls_fd, int t_fd, int t_nulls_fd,
+                     ssize_t start_pos, ssize_t end_pos, float8 t_start, float8 width,
+                     int nbuckets, const float8 *next_ts, const float8 *next_xs,
+                     const downsample_point *first, const downsample_point *last,
+                     float8 *out_ts, float8 *out_xs, int *out_count,
+                     const scan_options *opts, char **errstr) {
+  int vals_fds[2] = {t_fd, x_fd};
+  int nulls_fds[2] = {t_nulls_fd, x_nulls_fd};
+  scanner sc;
+  scan_block *b;
+  ssize_t pos = start_pos;
+  int vals_read, i, bucket, current = -1;
+  float8 t, x, area, best_area = -1;
+  downsample_point prev = *first, best = *first;
+
+  if (scanner_init(&sc, 2, vals_fds, nulls_fds, start_pos, end_pos, opts, errstr)) {
+    scanner_finish(&sc);
+    return -1;
+  }
+
+  while ((vals_read = scanner_next(&sc, &b, errstr))) {
+    if (vals_read == -1) {
+      scanner_finish(&sc);
+      return -1;   // errstr is already set
+    }
+    for (i = 0; i < vals_read; i++) {
+      if (b->nulls[0][i] || b->nulls[1][i]) continue;
+      if (pos + i == first->pos || pos + i == last->pos) continue;
+      t = b->vals[0][i];
+      x = b->vals[1][i];
+      if (isnan(t) || isnan(x)) continue;
+
+      // If a timestamp goes backwards, count it in the bucket we're already on:
+      bucket = downsample_bucket_of(t, t_start, width, nbuckets);
+      if (bucket > current) {
+        if (current != -1) {
+          out_ts[*out_count] = best.t;
+          out_xs[(*out_count)++] = best.x;
+          prev = best;
+        }
+        current = bucket;
+        best_area = -1;
+      }
+
+      area = fabs((prev.t - next_ts[current]) * (x - prev.x) - (prev.t - t) * (next_xs[current] - prev.x));
+      if (area > best_area) {
+        best_area = area;
+        best = (downsample_point){ .pos = pos + i, .t = t, .x = x };
+      }
+    }
+    pos += vals_read;
+  }
+  if (current != -1) {
+    out_ts[*out_count] = best.t;
+    out_xs[(*out_count)++] = best.x;
+  }
+
+  scanner_finish(&sc);
+  return 0;
+}
+
+/**
+ * build_downsample - Thins out the (timestamp, value) pairs from `min_pos` to `max_pos`
+ * (as found by find_bounds_start_end) to at most `n_points` points for a chart,
+ * by splitting `t_start` to `t_end` into equal time buckets.
+ *
+ * DOWNSAMPLE_MINMAX keeps the min and max of each of `n_points / 2` buckets, in time order,
+ * so spikes never disappear.
+ * DOWNSAMPLE_MEAN gives the mean timestamp and value of each of `n_points` buckets.
+ * DOWNSAMPLE_LTTB keeps the first and last points, and one actual point from each of `n_points - 2` buckets
+ * chosen by Largest-Triangle-Three-Buckets (Steinarsson 2013), which keeps the shape of the line.
+ * It reads the range twice instead of holding any of it in memory.
+ *
+ * DOWNSAMPLE_MINMAX and DOWNSAMPLE_MEAN use the floatfiles' rollups (if they both have them)
+ * for every chunk that fits inside one bucket (see rollup_downsample_buckets).
+ *
+ * Empty buckets give no points.
+ * `out_ts` and `out_xs` need room for `n_points` values,
+ * and we set `*out_count` to how many we wrote.
+ */
+int build_downsample(int x_fd, int x_nulls_fd, const rollup_files *x_rollups,
+                     int t_fd, int t_nulls_fd, const rollup_files *t_rollups, ssize_t min_pos, ssize_t max_pos,
+                     float8 t_start, float8 t_end, int n_points, downsample_method method,
+                     float8 *out_ts, float8 *out_xs, int *out_count, const scan_options *opts, char **errstr) {
+  downsample_bucket *buckets, *bucket;
+  downsample_point first, last, *p;
+  float8 *next_ts, *next_xs;
+  float8 width;
+  int nbuckets, i, result;
+
+  *out_count = 0;
+  switch (method) {
+    case DOWNSAMPLE_MINMAX: nbuckets = n_points / 2; break;
+    case DOWNSAMPLE_MEAN:   nbuckets = n_points; break;
+    case DOWNSAMPLE_LTTB:   nbuckets = n_points - 2; break;
+    default:
+      *errstr = "unknown downsampling method";
+      return -1;
+  }
+  if (nbuckets < 1) {
+    *errstr = "not enough points to downsample";
+    return -1;
+  }
+  width = (t_end - t_start) / nbuckets;
+
+  buckets = calloc(nbuckets, sizeof(downsample_bucket));
+  if (!buckets) {
+    *errstr = "out of memory";
+    return -1;
+  }
+
+  if (method == DOWNSAMPLE_LTTB) {
+    result = scan_downsample_buckets(x_fd, x_nulls_fd, t_fd, t_nulls_fd, min_pos, max_pos + 1, t_start, width,
+                                     nbuckets, buckets, &first, &last, opts, errstr);
+  } else {
+    result = rollup_downsample_buckets(x_fd, x_nulls_fd, x_rollups, t_fd, t_nulls_fd, t_rollups,
+                                       min_pos, max_pos + 1, t_start, width, nbuckets, buckets,
+                                       method == DOWNSAMPLE_MINMAX, opts, errstr);
+  }
+  if (result) {
+    free(buckets);
+    return -1;
+  }
+  if (method == DOWNSAMPLE_LTTB && first.pos == -1) {
+    free(buckets);
+    return 0;
+  }
+
+  switch (method) {
+    case DOWNSAMPLE_MINMAX:
+      for (i = 0; i < nbuckets; i++) {
+        if (buckets[i].count == 0) continue;
+        if (buckets[i].min_t == buckets[i].max_t) {
+          // Just one point (or they're all the same)
+          out_ts[*out_count] = buckets[i].min_t;
+          out_xs[(*out_count)++] = buckets[i].min_x;
+        } else if (buckets[i].min_t < buckets[i].max_t) {
+          out_ts[*out_count] = buckets[i].min_t;
+          out_xs[(*out_count)++] = buckets[i].min_x;
+          out_ts[*out_count] = buckets[i].max_t;
+          out_xs[(*out_count)++] = buckets[i].max_x;
+        } else {
+          out_ts[*out_count] = buckets[i].max_t;
+          out_xs[(*out_count)++] = buckets[i].max_x;
+          out_ts[*out_count] = buckets[i].min_t;
+          out_xs[(*out_count)++] = buckets[i].min_x;
+        }
+      }
+      break;
+
+    case DOWNSAMPLE_MEAN:
+      for (i = 0; i < nbuckets; i++) {
+        if (buckets[i].count == 0) continue;
+        out_ts[*out_count] = t_start + buckets[i].t_sum / buckets[i].count;
+        out_xs[(*out_count)++] = buckets[i].x_sum / buckets[i].count;
+      }
+      break;
+
+    case DOWNSAMPLE_LTTB:
+      out_ts[*out_count] = first.t;
+      out_xs[(*out_count)++] = first.x;
+      if (last.pos == first.pos) break;
+
+      // The buckets' averages shouldn't include the first and last points:
+      for (i = 0; i < 2; i++) {
+        p = i == 0 ? &first : &last;
+        bucket = &buckets[downsample_bucket_of(p->t, t_start, width, nbuckets)];
+        bucket->count--;
+        bucket->t_sum -= p->t - t_start;
+        bucket->x_sum -= p->x;
+      }
+
+      // Each bucket looks ahead to the average of the next non-empty one, or the last point:
+      next_ts = malloc(nbuckets * sizeof(float8));
+      next_xs = malloc(nbuckets * sizeof(float8));
+      if (!next_ts || !next_xs) {
+        free(next_ts);
+        free(next_xs);
+        free(buckets);
+        *errstr = "out of memory";
+        return -1;
+      }
+      next_ts[nbuckets - 1] = last.t;
+      next_xs[nbuckets - 1] = last.x;
+      for (i = nbuckets - 2; i >= 0; i--) {
+        if (buckets[i + 1].count > 0) {
+          next_ts[i] = t_start + buckets[i + 1].t_sum / buckets[i + 1].count;
+          next_xs[i] = buckets[i + 1].x_sum / buckets[i + 1].count;
+        } else {
+          next_ts[i] = next_ts[i + 1];
+          next_xs[i] = next_xs[i + 1];
+        }
+      }
+
+      result = scan_lttb(x_fd, x_nulls_fd, t_fd, t_nulls_fd, min_pos, max_pos + 1, t_start, width,
+                         nbuckets, next_ts, next_xs, &first, &last, out_ts, out_xs, out_count, opts, errstr);
+      free(next_ts);
+      free(next_xs);
+      if (result) {
+        free(buckets);
+        return -1;
+      }
+
+      out_ts[*out_count] = last.t;
+      out_xs[(*out_count)++] = last.x;
+      break;
+  }
+
+  free(buckets);
+  return 0;
+}
+
+/**
+ * time_bucket_of - Returns the bucket of timestamp `t`,
+ * or -1 if it is before `t_start` (or NaN), or `nbuckets` if it is at or after `t_end`.
+ */
+static inline int time_bucket_of(float8 t, float8 t_start, float8 t_end, float8 width, int nbuckets) {
+  if (t >= t_end) return nbuckets;
+  if (!(t >= t_start)) return -1;
+  return Min((int)((t - t_start) / width), nbuckets - 1);
+}
+
+/**
+ * scan_time_buckets - Adds each value from `start_pos` up to (not including) `end_pos`
+ * to the stats of its timestamp's bucket.
+ *
+ * The timestamps are sorted, so we hand stats_vals whole runs of values in the same bucket.
+ */
+static int scan_time_buckets(int x_fd, int x_nulls_fd, int t_fd, int t_nulls_fd,
+                             ssize_t start_pos, ssize_t end_pos, float8 t_start, float8 t_end, float8 width,
+                             int nbuckets, float_stats *buckets, const scan_options *opts, char **errstr) {
+  int vals_fds[2] = {t_fd, x_fd};
+  int nulls_fds[2] = {t_nulls_fd, x_nulls_fd};
+  scanner sc;
+  scan_block *b;
+  int vals_read, i, run_start, run_bucket, bucket;
+
+  if (scanner_init(&sc, 2, vals_fds, nulls_fds, start_pos, end_pos, opts, errstr)) {
+    scanner_finish(&sc);
+    return -1;
+  }
+
+  while ((vals_read = scanner_next(&sc, &b, errstr))) {
+    if (vals_read == -1) {
+      scanner_finish(&sc);
+      return -1;   // errstr is already set
+    }
+    run_start = 0;
+    run_bucket = -1;
+    for (i = 0; i <= vals_read; i++) {
+      if (i == vals_read) bucket = -1;
+      else if (b->nulls[0][i]) bucket = -1;
+      else bucket = time_bucket_of(b->vals[0][i], t_start, t_end, width, nbuckets);
+      if (i > 0 && bucket == run_bucket) continue;
+
+      if (run_bucket >= 0 && run_bucket < nbuckets) {
+        stats_vals(i - run_start, b->vals[1] + run_start, b->nulls[1] + run_start, &buckets[run_bucket]);
+      }
+      run_start = i;
+      run_bucket = bucket;
+    }
+  }
+
+  scanner_finish(&sc);
+  return 0;
+}
+
+/**
+ * time_buckets_walk - What build_time_buckets needs while walking the rollups.
+ */
+typedef struct time_buckets_walk {
+  int x_fd, x_nulls_fd, t_fd, t_nulls_fd;
+  float8 t_start, t_end, width;
+  int nbuckets;
+  float_stats *buckets;
+  const scan_options *opts;
+} time_buckets_walk;
+
+// The records are the timestamps' then the values'.
+static bool time_buckets_walk_fits(void *ctx, const block_stats *records) {
+  time_buckets_walk *tw = (time_buckets_walk *)ctx;
+  const block_stats *t = &records[0];
+
+  return t->stats.count == t->nvals && !isnan(t->stats.sum) &&
+         time_bucket_of(t->stats.min, tw->t_start, tw->t_end, tw->width, tw->nbuckets) ==
+           time_bucket_of(t->stats.max, tw->t_start, tw->t_end, tw->width, tw->nbuckets);
+}
+
+static int time_buckets_walk_use(void *ctx, int level, ssize_t chunk, const block_stats *records, char **errstr) {
+  time_buckets_walk *tw = (time_buckets_walk *)ctx;
+  int bucket = time_bucket_of(records[0].stats.min, tw->t_start, tw->t_end, tw->width, tw->nbuckets);
+
+  if (bucket >= 0 && bucket < tw->nbuckets) stats_merge(&tw->buckets[bucket], &records[1].stats);
+  return 0;
+}
+
+static int time_buckets_walk_scan(void *ctx, ssize_t start_pos, ssize_t end_pos, char **errstr) {
+  time_buckets_walk *tw = (time_buckets_walk *)ctx;
+
+  return scan_time_buckets(tw->x_fd, tw->x_nulls_fd, tw->t_fd, tw->t_nulls_fd, start_pos, end_pos,
+                           tw->t_start, tw->t_end, tw->width, tw->nbuckets, tw->buckets, tw->opts, errstr);
+}
+
+/**
+ * build_time_buckets - Splits `t_start` up to (not including) `t_end` into `nbuckets` buckets
+ * `width` apart, and collects the stats of the values whose timestamps fall in each one,
+ * reading the two floatfiles side by side.
+ *
+ * `min_pos` and `max_pos` are from find_bounds_start_end, but since that compares with floats
+ * we check each timestamp against the range again here.
+ * Values with a null timestamp are skipped.
+ *
+ * Every chunk whose timestamps have no nulls or NaNs and fall in one bucket
+ * comes straight from the rollups (if both floatfiles have them),
+ * so we only read the values where the buckets change.
+ */
+int build_time_buckets(int x_fd, int x_nulls_fd, const rollup_files *x_rollups,
+                       int t_fd, int t_nulls_fd, const rollup_files *t_rollups, ssize_t min_pos, ssize_t max_pos,
+                       float8 t_start, float8 t_end, float8 width, int nbuckets, float_stats *buckets,
+                       const scan_options *opts, char **errstr) {
+  time_buckets_walk tw = {
+    .x_fd = x_fd, .x_nulls_fd = x_nulls_fd, .t_fd = t_fd, .t_nulls_fd = t_nulls_fd,
+    .t_start = t_start, .t_end = t_end, .width = width, .nbuckets = nbuckets, .buckets = buckets, .opts = opts
+  };
+  rollup_walk w = {
+    .nfiles = 2, .files = {t_rollups, x_rollups},
+    .fits = time_buckets_walk_fits, .use = time_buckets_walk_use, .scan = time_buckets_walk_scan, .ctx = &tw
+  };
+  block_stats x_header, t_header;
+  ssize_t nvals, end_pos = max_pos + 1;
+  int result, i;
+
+  for (i = 0; i < nbuckets; i++) stats_init(&buckets[i]);
+
+  if (floatfile_nvals(x_fd, &nvals, errstr)) return -1;
+  if (end_pos > nvals) end_pos = nvals;
+  if (min_pos >= end_pos) return 0;
+
+  result = check_rollups(x_rollups, nvals, &x_header, errstr);
+  if (result == 0) result = check_rollups(t_rollups, nvals, &t_header, errstr);
+  if (result == -1) return -1;
+  if (result == 1) return time_buckets_walk_scan(&tw, min_pos, end_pos, errstr);
+
+  w.nvals = nvals;
+  return walk_rollups(&w, min_pos, end_pos, errstr);
+}
+
+int build_histogram_2d(int x_fd, int x_nulls_fd, float8 x_min, float8 x_width, int32 x_count,
+                       int y_fd, int y_nulls_fd, float8 y_min, float8 y_width, int32 y_count,
+                       int64 *counts, const scan_options *opts, char **errstr) {
+  hist_worker w = {
+    .ndims = 2,
+    .x_fd = x_fd, .x_nulls_fd = x_nulls_fd, .x_min = x_min, .x_width = x_width, .x_count = x_count,
+    .y_fd = y_fd, .y_nulls_fd = y_nulls_fd, .y_min = y_min, .y_width = y_width, .y_count = y_count,
+    .counts = counts, .start_pos = 0, .end_pos = -1, .opts = opts
+  };
+  return parallel_histogram(&w, errstr);
+}
+
+int build_histogram_2d_with_bounds(int x_fd, int x_nulls_fd, float8 x_min, float8 x_width, int32 x_count,
+                                   int y_fd, int y_nulls_fd, float8 y_min, float8 y_width, int32 y_count,
+                                   int64 *counts, ssize_t min_pos, ssize_t max_pos, const scan_options *opts, char **errstr) {
+  hist_worker w = {
+    .ndims = 2,
+    .x_fd = x_fd, .x_nulls_fd = x_nulls_fd, .x_min = x_min, .x_width = x_width, .x_count = x_count,
+    .y_fd = y_fd, .y_nulls_fd = y_nulls_fd, .y_min = y_min, .y_width = y_width, .y_count = y_count,
+    .counts = counts, .start_pos = min_pos, .end_pos = max_pos + 1, .opts = opts
+  };
+  return parallel_histogram(&w, errstr);
+}
+
+/**
+ * build_bucket_stats - Adds each y to the stats of its x's bucket,
+ * reading the two floatfiles side by side like build_histogram_2d.
+ * Pairs where either is null, or x is outside the buckets, are skipped.
+ */
+int build_bucket_stats(int x_fd, int x_nulls_fd, float8 x_min, float8 x_width, int32 x_count,
+                       int y_fd, int y_nulls_fd, float_stats *buckets, const scan_options *opts, char **errstr) {
+  hist_worker w = {
+    .ndims = 2,
+    .x_fd = x_fd, .x_nulls_fd = x_nulls_fd, .x_min = x_min, .x_width = x_width, .x_count = x_count,
+    .y_fd = y_fd, .y_nulls_fd = y_nulls_fd, .y_stats = buckets,
+    .start_pos = 0, .end_pos = -1, .opts = opts
+  };
+  int i;
+
+  for (i = 0; i < x_count; i++) stats_init(&buckets[i]);
+  return parallel_histogram(&w, errstr);
+}
+
+int build_bucket_stats_with_bounds(int x_fd, int x_nulls_fd, float8 x_min, float8 x_width, int32 x_count,
+                                   int y_fd, int y_nulls_fd, float_stats *buckets,
+                                   ssize_t min_pos, ssize_t max_pos, const scan_options *opts, char **errstr) {
+  hist_worker w = {
+    .ndims = 2,
+    .x_fd = x_fd, .x_nulls_fd = x_nulls_fd, .x_min = x_min, .x_width = x_width, .x_count = x_count,
+    .y_fd = y_fd, .y_nulls_fd = y_nulls_fd, .y_stats = buckets,
+    .start_pos = min_pos, .end_pos = max_pos + 1, .opts = opts
+  };
+  int i;
+
+  for (i = 0; i < x_count; i++) stats_init(&buckets[i]);
+  return parallel_histogram(&w, errstr);
+}
+
+/**
+ * build_histogram_nd - Counts the tuples of `ndims` floatfiles read side by side
+ * into a row-major histogram with `dims[i].count` buckets along dimension `i`.
+ * Tuples with a null (or a value outside the buckets) in any dimension are skipped.
+ */
+int build_histogram_nd(int ndims, const hist_dimension *dims, int64 *counts, const scan_options *opts, char **errstr) {
+  hist_worker w = {
+    .ndims = ndims, .dims = dims, .x_fd = dims[0].fd,
+    .counts = counts, .start_pos = 0, .end_pos = -1, .opts = opts
+  };
+  return parallel_histogram(&w, errstr);
+}
+
+int build_histogram_nd_with_bounds(int ndims, const hist_dimension *dims, int64 *counts,
+                                   ssize_t min_pos, ssize_t max_pos, const scan_options *opts, char **errstr) {
+  hist_worker w = {
+    .ndims = ndims, .dims = dims, .x_fd = dims[0].fd,
+    .counts = counts, .start_pos = min_pos, .end_pos = max_pos + 1, .opts = opts
+  };
+  return parallel_histogram(&w, errstr);
+}
+
+// Sparse histograms with more buckets than this never get a dense array,
+// even when there are enough tuples to fill it (each thread would need a copy):
+#define MAX_DENSE_SPARSE_BUCKETS (16*1024*1024)
+
+/**
+ * sparse_histogram_nd - Counts like scan_histogram_nd into `counts`,
+ * but we only count densely (and then copy out the non-empty buckets)
+ * when the grid has no more buckets than there are tuples to count.
+ * Otherwise most buckets would stay empty, so we count into the hash table directly.
+ */
+static int sparse_histogram_nd(int ndims, const hist_dimension *dims, sparse_counts *counts,
+                               ssize_t start_pos, ssize_t end_pos, const scan_options *opts, char **errstr) {
+  hist_worker w = {
+    .ndims = ndims, .dims = dims, .x_fd = dims[0].fd,
+    .sparse = counts, .start_pos = start_pos, .end_pos = end_pos, .opts = opts
+  };
+  size_t bucket_count = 1, j;
+  ssize_t nvals;
+  int64 *dense;
+  int d, result;
+
+  for (d = 0; d < ndims; d++) bucket_count *= dims[d].count;
+  if (floatfile_nvals(dims[0].fd, &nvals, errstr)) return -1;
+  if (end_pos != -1 && end_pos < nvals) nvals = end_pos;
+  nvals -= start_pos;
+
+  if (nvals <= 0 || bucket_count > nvals || bucket_count > MAX_DENSE_SPARSE_BUCKETS) {
+    return parallel_histogram(&w, errstr);
+  }
+
+  dense = calloc(bucket_count, sizeof(int64));
+  if (!dense) {
+    *errstr = "out of memory";
+    return -1;
+  }
+  w.sparse = NULL;
+  w.counts = dense;
+  result = parallel_histogram(&w, errstr);
+  for (j = 0; j < bucket_count && !result; j++) {
+    if (dense[j] && sparse_counts_add(counts, j, dense[j])) {
+      *errstr = "out of memory";
+      result = -1;
+    }
+  }
+  free(dense);
+  return result;
+}
+
+/**
+ * build_sparse_histogram_nd - Like build_histogram_nd,
+ * but only keeps the buckets that aren't empty, in `counts`.
+ * The grid can't have more than INT_MAX buckets.
+ */
+int build_sparse_histogram_nd(int ndims, const hist_dimension *dims, sparse_counts *counts,
+                              const scan_options *opts, char **errstr) {
+  return sparse_histogram_nd(ndims, dims, counts, 0, -1, opts, errstr);
+}
+
+int build_sparse_histogram_nd_with_bounds(int ndims, const hist_dimension *dims, sparse_counts *counts,
+                                          ssize_t min_pos, ssize_t max_pos, const scan_options *opts, char **errstr) {
+  return sparse_histogram_nd(ndims, dims, counts, min_pos, max_pos + 1, opts, errstr);
+}
+
+/**
+ * write_derived_block - Appends `n` values to the floatfile in `out_fd` and `out_nulls_fd`,
+ * and to `out_rollups` (see build_combine), where `pos` is how many it had before.
+ */
+static int write_derived_block(int out_fd, int out_nulls_fd, rollup_files *out_rollups, int *rollups_result,
+                               ssize_t pos, const float8 *out, const bool *out_nulls, int n, char **errstr) {
+  char *rollups_errstr = NULL;
+
+  if (write(out_nulls_fd, out_nulls, n * sizeof(bool)) != n * sizeof(bool) ||
+      write(out_fd, out, n * sizeof(float8)) != n * sizeof(float8)) {
+    *errstr = "can't write floatfile";
+    return -1;
+  }
+  if (out_rollups && *rollups_result == 0) {
+    *rollups_result = append_rollups(out_rollups, pos, out, out_nulls, n, &rollups_errstr);
+  }
+  return 0;
+}
+
+/**
+ * build_combine - Writes `a` `op` `b` to the empty floatfile in `out_fd` and `out_nulls_fd`,
+ * one block at a time, where `a` and `b` are floatfiles of the same length,
+ * or if `b_fd` is -1 then `b` is the scalar `b`. Unary ops ignore `b` altogether.
+ * See combine_vals for what each value becomes.
+ *
+ * We append each block to `out_rollups` too (unless it's NULL or `*rollups_result` is already nonzero),
+ * but they're just a cache, so if that fails we stop and set `*rollups_result`.
+ * Appending only writes their records, never their header (see append_rollups).
+ * We never fsync: that's up to the caller, once at the end,
+ * along with finish_rollups.
+ */
+int build_combine(int a_fd, int a_nulls_fd, int b_fd, int b_nulls_fd, float8 b, combine_op op,
+                  int out_fd, int out_nulls_fd, rollup_files *out_rollups, int *rollups_result,
+                  const scan_options *opts, char **errstr) {
+  int vals_fds[2] = {a_fd, b_fd};
+  int nulls_fds[2] = {a_nulls_fd, b_nulls_fd};
+  int ndims = b_fd == -1 || COMBINE_UNARY(op) ? 1 : 2;
+  ssize_t a_nvals, b_nvals, pos = 0;
+  scanner sc;
+  scan_block *blk;
+  float8 *out;
+  bool *out_nulls;
+  int vals_read;
+
+  if (ndims == 2) {
+    if (floatfile_nvals(a_fd, &a_nvals, errstr) || floatfile_nvals(b_fd, &b_nvals, errstr)) return -1;
+    if (a_nvals != b_nvals) {
+      *errstr = "floatfiles must have the same length";
+      return -1;
+    }
+  }
+
+  out = malloc(HIST_BUFFER * sizeof(float8));
+  out_nulls = malloc(HIST_BUFFER * sizeof(bool));
+  if (!out || !out_nulls) {
+    free(out);
+    free(out_nulls);
+    *errstr = "out of memory";
+    return -1;
+  }
+  if (scanner_init(&sc, ndims, vals_fds, nulls_fds, 0, -1, opts, errstr)) {
+    scanner_finish(&sc);
+    free(out);
+    free(out_nulls);
+    return -1;
+  }
+
+  while ((vals_read = scanner_next(&sc, &blk, errstr))) {
+    if (vals_read == -1) break;   // errstr is already set
+
+    combine_vals(op, vals_read, blk->vals[0], blk->nulls[0],
+                 ndims == 2 ? blk->vals[1] : NULL, ndims == 2 ? blk->nulls[1] : NULL, b, out, out_nulls);
+    if (write_derived_block(out_fd, out_nulls_fd, out_rollups, rollups_result, pos, out, out_nulls, vals_read, errstr)) {
+      vals_read = -1;
+      break;
+    }
+    pos += vals_read;
+  }
+
+  scanner_finish(&sc);
+  free(out);
+  free(out_nulls);
+  return vals_read == -1 ? -1 : 0;
+}
+
+/**
+ * build_rolling - Appends `func` of each window of `window` values of `x`
+ * (see rolling_vals) to the floatfile in `out_fd` and `out_nulls_fd`,
+ * which already has the first `out_start` of them.
+ *
+ * To pick up where it left off we start reading `window - 1` values before `out_start`,
+ * and only write the results from `out_start` on.
+ * The rollups and fsync work like build_combine.
+ */
+int build_rolling(int x_fd, int x_nulls_fd, rolling_func func, int window, ssize_t out_start,
+                  int out_fd, int out_nulls_fd, rollup_files *out_rollups, int *rollups_result,
+                  const scan_options *opts, char **errstr) {
+  rolling_window rw;
+  ssize_t nvals, pos;
+  scanner sc;
+  scan_block *blk;
+  float8 *out;
+  bool *out_nulls;
+  int vals_read, skip;
+
+  if (floatfile_nvals(x_fd, &nvals, errstr)) return -1;
+  if (out_start > nvals) {
+    *errstr = "the floatfile to extend is longer than its input";
+    return -1;
+  }
+
+  out = malloc(HIST_BUFFER * sizeof(float8));
+  out_nulls = malloc(HIST_BUFFER * sizeof(bool));
+  if (rolling_window_init(&rw, func, window) || !out || !out_nulls) {
+    rolling_window_finish(&rw);
+    free(out);
+    free(out_nulls);
+    *errstr = "out of memory";
+    return -1;
+  }
+  pos = Max(0, out_start - (rw.window - 1));
+  if (scanner_init(&sc, 1, &x_fd, &x_nulls_fd, pos, -1, opts, errstr)) {
+    scanner_finish(&sc);
+    rolling_window_finish(&rw);
+    free(out);
+    free(out_nulls);
+    return -1;
+  }
+
+  while ((vals_read = scanner_next(&sc, &blk, errstr))) {
+    if (vals_read == -1) break;   // errstr is already set
+
+    rolling_vals(&rw, vals_read, blk->vals[0], blk->nulls[0], out, out_nulls);
+    skip = Max(0, Min(out_start - pos, vals_read));
+    if (skip < vals_read &&
+        write_derived_block(out_fd, out_nulls_fd, out_rollups, rollups_result, pos + skip,
+                            out + skip, out_nulls + skip, vals_read - skip, errstr)) {
+      vals_read = -1;
+      break;
+    }
+    pos += vals_read;
+  }
+
+  scanner_finish(&sc);
+  rolling_window_finish(&rw);
+  free(out);
+  free(out_nulls);
+  return vals_read == -1 ? -1 : 0;
+}
+
+/**
+ * where_add - Adds the `n` positions from `start` on to `wr`,
+ * growing it as needed (but never past `wr->max_len`).
+ *
+ * In ranges mode a run that starts where the last one ended just lengthens it.
+ */
+static int where_add(where_result *wr, int64 start, int64 n, char **errstr) {
+  ssize_t need = wr->ranges ? 2 : n, cap;
+  int64 *vals;
+  int64 i;
+
+  if (wr->ranges && wr->len > 0 && wr->vals[wr->len - 2] + wr->vals[wr->len - 1] == start) {
+    wr->vals[wr->len - 1] += n;
+    return 0;
+  }
+
+  if (wr->len + need > wr->cap) {
+    if (wr->len + need > wr->max_len) {
+      *errstr = wr->ranges ? "too many matching ranges" : "too many matching positions";
+      return -1;
+    }
+    cap = Min(Max(wr->cap * 2, Max(wr->len + need, 1024)), wr->max_len);
+    vals = realloc(wr->vals, cap * sizeof(int64));
+    if (!vals) {
+      *errstr = "out of memory";
+      return -1;
+    }
+    wr->vals = vals;
+    wr->cap = cap;
+  }
+
+  if (wr->ranges) {
+    wr->vals[wr->len++] = start;
+    wr->vals[wr->len++] = n;
+  } else {
+    for (i = 0; i < n; i++) wr->vals[wr->len++] = start + i;
+  }
+  return 0;
+}
+
+/**
+ * where_walk - What build_where needs while walking the rollups.
+ */
+typedef struct where_walk {
+  int x_fd, x_nulls_fd;
+  float8 lo, hi;
+  where_result *wr;
+  int32 *matches;
+  index_filter filter;
+  const scan_options *opts;
+} where_walk;
+
+// A chunk fits if none of it can match, or all of it does:
+static bool where_walk_fits(void *ctx, const block_stats *records) {
+  where_walk *ww = (where_walk *)ctx;
+  const float_stats *s = &records[0].stats;
+
+  return s->count == 0 || s->max < ww->lo || s->min > ww->hi ||
+         (s->count == records[0].nvals && !isnan(s->sum) && s->min >= ww->lo && s->max <= ww->hi);
+}
+
+static int where_walk_use(void *ctx, int level, ssize_t chunk, const block_stats *records, char **errstr) {
+  where_walk *ww = (where_walk *)ctx;
+  const float_stats *s = &records[0].stats;
+
+  if (s->count == 0 || s->max < ww->lo || s->min > ww->hi) return 0;
+  return where_add(ww->wr, chunk * ROLLUP_VALS(level), records[0].nvals, errstr);
+}
+
+static int where_walk_scan_range(void *ctx, ssize_t start_pos, ssize_t end_pos, char **errstr) {
+  where_walk *ww = (where_walk *)ctx;
+  scanner sc;
+  scan_block *blk;
+  ssize_t pos = start_pos;
+  int vals_read, found, i, run;
+
+  if (scanner_init(&sc, 1, &ww->x_fd, &ww->x_nulls_fd, start_pos, end_pos, ww->opts, errstr)) {
+    scanner_finish(&sc);
+    return -1;
+  }
+
+  while ((vals_read = scanner_next(&sc, &blk, errstr))) {
+    if (vals_read == -1) break;   // errstr is already set
+
+    found = find_matching_vals(vals_read, blk->vals[0], blk->nulls[0], ww->lo, ww->hi, ww->matches);
+    // Hand each run of consecutive matches over at once:
+    for (i = 0; i < found; i += run) {
+      run = 1;
+      while (i + run < found && ww->matches[i + run] == ww->matches[i] + run) run++;
+      if (where_add(ww->wr, pos + ww->matches[i], run, errstr)) {
+        vals_read = -1;
+        break;
+      }
+    }
+    if (vals_read == -1) break;
+    pos += vals_read;
+  }
+
+  scanner_finish(&sc);
+  return vals_read == -1 ? -1 : 0;
+}
+
+static int where_walk_scan(void *ctx, ssize_t start_pos, ssize_t end_pos, char **errstr) {
+  return scan_index_filter(&((where_walk *)ctx)->filter, start_pos, end_pos, where_walk_scan_range, ctx, errstr);
+}
+
+/**
+ * build_where - Finds the positions of the non-null values from `lo` to `hi` (inclusive)
+ * between `start_pos` and `end_pos` (or -1 for the end of the file), in order,
+ * and adds them to `wr` (which should start empty; free `wr->vals` afterwards).
+ *
+ * Where the rollups (`rf`, which may be NULL) show a chunk can't match, we skip it,
+ * and where they show all of it matches we take it without reading it.
+ * Otherwise we compare a block at a time with SIMD,
+ * except for the chunks whose value index bins (if there is an index) are all outside `lo` to `hi`.
+ */
+int build_where(int x_fd, int x_nulls_fd, const rollup_files *rf, float8 lo, float8 hi,
+                ssize_t start_pos, ssize_t end_pos, where_result *wr, const scan_options *opts, char **errstr) {
+  where_walk ww = { .x_fd = x_fd, .x_nulls_fd = x_nulls_fd, .lo = lo, .hi = hi, .wr = wr, .opts = opts };
+  rollup_walk w = {
+    .nfiles = 1, .files = {rf},
+    .fits = where_walk_fits, .use = where_walk_use, .scan = where_walk_scan, .ctx = &ww
+  };
+  block_stats header;
+  ssize_t nvals;
+  int result;
+
+  if (floatfile_nvals(x_fd, &nvals, errstr)) return -1;
+  if (end_pos == -1 || end_pos > nvals) end_pos = nvals;
+  if (start_pos >= end_pos) return 0;
+
+  if (open_index_filter(rf, nvals, lo, hi, &ww.filter, errstr)) return -1;
+
+  ww.matches = malloc(HIST_BUFFER * sizeof(int32));
+  if (!ww.matches) {
+    *errstr = "out of memory";
+    return -1;
+  }
+
+  result = check_rollups(rf, nvals, &header, errstr);
+  if (result == 0) {
+    w.nvals = nvals;
+    result = walk_rollups(&w, start_pos, end_pos, errstr);
+  } else if (result == 1) {
+    result = where_walk_scan(&ww, start_pos, end_pos, errstr);
+  }
+
+  free(ww.matches);
+  return result;
+}
+
+/**
+ * event_add - Adds a run from `start` up to `end` to `er`,
+ * growing it as needed (but never past `er->max_len`).
+ */
+static int event_add(event_result *er, int64 start, int64 end, float8 peak, char **errstr) {
+  value_event *events;
+  ssize_t cap;
+
+  if (er->len == er->cap) {
+    if (er->len >= er->max_len) {
+      *errstr = "too many events";
+      return -1;
+    }
+    cap = Min(Max(er->cap * 2, 1024), er->max_len);
+    events = realloc(er->events, cap * sizeof(value_event));
+    if (!events) {
+      *errstr = "out of memory";
+      return -1;
+    }
+    er->events = events;
+    er->cap = cap;
+  }
+
+  er->events[er->len].start = start;
+  er->events[er->len].end = end;
+  er->events[er->len].peak = peak;
+  er->len++;
+  return 0;
+}
+
+/**
+ * next_bit - Returns the first position from `i` on whose bit in `bits` is set (or clear if not `set`),
+ * or `n` if there isn't one before `n`.
+ */
+static inline int next_bit(const uint64 *bits, int i, int n, bool set) {
+  uint64 word;
+
+  while (i < n) {
+    word = (set ? bits[i / 64] : ~bits[i / 64]) & (~(uint64)0 << (i % 64));
+    if (word) return Min(i - i % 64 + __builtin_ctzll(word), n);
+    i += 64 - i % 64;
+  }
+  return n;
+}
+
+/**
+ * scan_events - Adds each run of at least `min_len` non-null values above `threshold`
+ * from `start_pos` up to (not including) `end_pos` to `er`.
+ *
+ * mark_vals_above turns each block into a bit per value with SIMD,
+ * and then we jump from the start of a run to its end (and on to the next start) a word at a time,
+ * so only the values inside a run are read again, for its peak.
+ * If `keep_edges` we also keep the shorter runs that touch either end of the range,
+ * since they may carry on into the next share (see build_events).
+ */
+static int scan_events(int x_fd, int x_nulls_fd, float8 threshold, int min_len, ssize_t start_pos, ssize_t end_pos,
+                       bool keep_edges, event_result *er, const scan_options *opts, char **errstr) {
+  scanner sc;
+  scan_block *blk;
+  uint64 *bits;
+  const float8 *xs;
+  ssize_t pos = start_pos, run_start = -1;
+  float8 peak = 0;
+  int vals_read, i, j, k;
+
+  bits = malloc((HIST_BUFFER + 63) / 64 * sizeof(uint64));
+  if (!bits) {
+    *errstr = "out of memory";
+    return -1;
+  }
+
+  if (scanner_init(&sc, 1, &x_fd, &x_nulls_fd, start_pos, end_pos, opts, errstr)) {
+    scanner_finish(&sc);
+    free(bits);
+    return -1;
+  }
+
+  while ((vals_read = scanner_next(&sc, &blk, errstr))) {
+    if (vals_read == -1) break;   // errstr is already set
+
+    xs = blk->vals[0];
+    mark_vals_above(vals_read, xs, blk->nulls[0], threshold, bits);
+    for (i = 0; i < vals_read; i = j) {
+      if (run_start == -1) {
+        i = next_bit(bits, i, vals_read, true);
+        if (i == vals_read) break;
+        run_start = pos + i;
+        peak = xs[i];
+      }
+      j = next_bit(bits, i, vals_read, false);
+      for (k = i; k < j; k++) peak = Max(peak, xs[k]);
+      if (j == vals_read) break;   // the run may go on into the next block
+
+      if ((pos + j - run_start >= min_len || (keep_edges && run_start == start_pos)) &&
+          event_add(er, run_start, pos + j, peak, errstr)) {
+        vals_read = -1;
+        break;
+      }
+      run_start = -1;
+    }
+    if (vals_read == -1) break;
+    pos += vals_read;
+  }
+
+  // A run still going at the end touches it:
+  if (vals_read != -1 && run_start != -1 && (pos - run_start >= min_len || keep_edges) &&
+      event_add(er, run_start, pos, peak, errstr)) {
+    vals_read = -1;
+  }
+
+  scanner_finish(&sc);
+  free(bits);
+  return vals_read == -1 ? -1 : 0;
+}
+
+/**
+ * events_worker - One thread's share of build_events.
+ */
+typedef struct events_worker {
+  int x_fd, x_nulls_fd;
+  float8 threshold;
+  int min_len;
+  ssize_t start_pos, end_pos;
+  const scan_options *opts;
+  event_result er;
+  char *errstr;
+  int result;
+  pthread_t thread;
+  bool started;
+} events_worker;
+
+static void *events_worker_main(void *arg) {
+  events_worker *w = (events_worker *)arg;
+
+  w->result = scan_events(w->x_fd, w->x_nulls_fd, w->threshold, w->min_len, w->start_pos, w->end_pos,
+                          true, &w->er, w->opts, &w->errstr);
+  return NULL;
+}
+
+/**
+ * build_events - Finds each run of at least `min_len` consecutive non-null values above `threshold`
+ * between `start_pos` and `end_pos` (or -1 for the end of the file), in order,
+ * and adds it to `er` (which should start empty; free `er->events` afterwards).
+ * A null or NaN ends a run.
+ *
+ * Like parallel_stats we split the range across up to opts->threads workers.
+ * Each one keeps the runs touching the ends of its share whatever their length,
+ * so we can join a run that ends where one share stops
+ * to the run that starts where the next one begins, before checking `min_len`.
+ */
+int build_events(int x_fd, int x_nulls_fd, float8 threshold, int min_len,
+                 ssize_t start_pos, ssize_t end_pos, event_result *er, const scan_options *opts, char **errstr) {
+  events_worker *workers;
+  value_event run = { .start = 0, .end = -1, .peak = 0 };
+  const value_event *e;
+  ssize_t nvals, share, k;
+  int nthreads, i, result = 0;
+
+  if (floatfile_nvals(x_fd, &nvals, errstr)) return -1;
+  if (end_pos == -1 || end_pos > nvals) end_pos = nvals;
+  if (start_pos >= end_pos) return 0;
+
+  nthreads = plan_threads(x_fd, start_pos, &end_pos, opts, errstr);
+  if (nthreads == -1) return -1;
+  if (nthreads <= 1) return scan_events(x_fd, x_nulls_fd, threshold, min_len, start_pos, end_pos, false, er, opts, errstr);
+
+  workers = calloc(nthreads, sizeof(events_worker));
+  if (!workers) {
+    *errstr = "out of memory";
+    return -1;
+  }
+
+  share = (end_pos - start_pos + nthreads - 1) / nthreads;
+  for (i = 0; i < nthreads; i++) {
+    workers[i].x_fd = x_fd;
+    workers[i].x_nulls_fd = x_nulls_fd;
+    workers[i].threshold = threshold;
+    workers[i].min_len = min_len;
+    workers[i].start_pos = start_pos + i * share;
+    workers[i].end_pos = i == nthreads - 1 ? end_pos : start_pos + (i + 1) * share;
+    workers[i].opts = opts;
+    workers[i].er.max_len = er->max_len;
+    // If we can't get a thread, just do it ourselves below:
+    if (i > 0) workers[i].started = !start_thread(&workers[i].thread, events_worker_main, &workers[i]);
+  }
+
+  for (i = 0; i < nthreads; i++) {
+    if (!workers[i].started) events_worker_main(&workers[i]);
+  }
+
+  for (i = 0; i < nthreads; i++) {
+    if (workers[i].started) pthread_join(workers[i].thread, NULL);
+    if (workers[i].result && !result) {
+      result = workers[i].result;
+      *errstr = workers[i].errstr;
+    }
+  }
+
+  // Runs in one share never touch, so a run starting where the last one ended crossed a boundary:
+  for (i = 0; i < nthreads && !result; i++) {
+    for (k = 0; k < workers[i].er.len && !result; k++) {
+      e = &workers[i].er.events[k];
+      if (e->start == run.end) {
+        run.end = e->end;
+        run.peak = Max(run.peak, e->peak);
+        continue;
+      }
+      if (run.end - run.start >= min_len) result = event_add(er, run.start, run.end, run.peak, errstr);
+      run = *e;
+    }
+  }
+  if (!result && run.end - run.start >= min_len) result = event_add(er, run.start, run.end, run.peak, errstr);
+
+  for (i = 0; i < nthreads; i++) free(workers[i].er.events);
+  free(workers);
+  return result;
+}
+
+/**
+ * asof_grow - Makes room for `n` more rows in `out`'s arrays (but never past `out->max_len`).
+ */
+static int asof_grow(asof_output *out, ssize_t n, char **errstr) {
+  ssize_t cap;
+  void *p;
+
+  if (out->len + n <= out->cap) return 0;
+  if (out->len + n > out->max_len) {
+    *errstr = "too many rows to return";
+    return -1;
+  }
+  cap = Min(Max(out->cap * 2, Max(out->len + n, 1024)), out->max_len);
+
+#define ASOF_GROW(field) \
+  if (!(p = realloc(out->field, cap * sizeof(*out->field)))) goto oom; \
+  out->field = p;
+  ASOF_GROW(ts)
+  ASOF_GROW(t_nulls)
+  ASOF_GROW(as)
+  ASOF_GROW(a_nulls)
+  ASOF_GROW(bs)
+  ASOF_GROW(b_nulls)
+#undef ASOF_GROW
+
+  out->cap = cap;
+  return 0;
+
+oom:
+  *errstr = "out of memory";
+  return -1;
+}
+
+/**
+ * asof_emit - Adds `n` lined-up rows to `out` (see asof_output).
+ * `pos` is how many rows it had before.
+ */
+static int asof_emit(asof_output *out, ssize_t pos, int n, const float8 *ts, const bool *t_nulls,
+                     const float8 *as, const bool *a_nulls, const float8 *bs, const bool *b_nulls, char **errstr) {
+  if (out->a_fd != -1) {
+    return write_derived_block(out->a_fd, out->a_nulls_fd, out->a_rollups, out->a_rollups_result, pos, as, a_nulls, n, errstr) ||
+           write_derived_block(out->b_fd, out->b_nulls_fd, out->b_rollups, out->b_rollups_result, pos, bs, b_nulls, n, errstr) ? -1 : 0;
+  }
+
+  if (asof_grow(out, n, errstr)) return -1;
+  memcpy(out->ts + out->len, ts, n * sizeof(float8));
+  memcpy(out->t_nulls + out->len, t_nulls, n * sizeof(bool));
+  memcpy(out->as + out->len, as, n * sizeof(float8));
+  memcpy(out->a_nulls + out->len, a_nulls, n * sizeof(bool));
+  memcpy(out->bs + out->len, bs, n * sizeof(float8));
+  memcpy(out->b_nulls + out->len, b_nulls, n * sizeof(bool));
+  out->len += n;
+  return 0;
+}
+
+/**
+ * asof_start_b - Starts scanning `b` (its timestamps and values) at its first row
+ * no more than `tolerance` before `t`, the first timestamp of `a` we look up,
+ * since no row before that could ever match.
+ * find_bounds_start_end compares with floats, so we round the bound down.
+ *
+ * Sets `*b_done` instead if there is no such row.
+ * Either way call scanner_finish afterwards.
+ */
+static int asof_start_b(scanner *b_sc, int *b_vals_fds, int *b_nulls_fds, float8 t, float8 tolerance,
+                        bool *b_done, const scan_options *opts, char **errstr) {
+  float min_t = nextafterf((float)(t - tolerance), -INFINITY);
+  ssize_t min_pos, max_pos;
+
+  memset(b_sc, 0, sizeof(scanner));
+  if (find_bounds_start_end(b_vals_fds[0], b_nulls_fds[0], min_t, min_t, &min_pos, &max_pos, opts, errstr)) return -1;
+  if (min_pos == -1) {
+    *b_done = true;
+    return 0;
+  }
+  return scanner_init(b_sc, 2, b_vals_fds, b_nulls_fds, min_pos, -1, opts, errstr);
+}
+
+/**
+ * build_asof_join - Lines up floatfile `b` with floatfile `a` by their timestamps,
+ * for `a`'s rows from `start_pos` up to (not including) `end_pos` (or -1 for the end of the file),
+ * and puts each row's timestamp, `a` value, and `b` value in `out`.
+ *
+ * Each row of `a` gets the value of the last row of `b` whose timestamp is at or before its own,
+ * if that is no more than `tolerance` earlier, or else a null,
+ * like a LEFT JOIN LATERAL picking the latest earlier row.
+ * A row of `a` with a null or NaN timestamp always gets a null,
+ * and a row of `b` with one is skipped.
+ *
+ * Both timestamps floatfiles must be in order (ties are fine),
+ * since we read all four floatfiles just once, a block at a time,
+ * with `b` one step behind `a` like a merge join.
+ * `b` starts from its first row that could match `a`'s first (see asof_start_b).
+ * Each values floatfile must be as long as its timestamps.
+ */
+int build_asof_join(int a_t_fd, int a_t_nulls_fd, int a_fd, int a_nulls_fd,
+                    int b_t_fd, int b_t_nulls_fd, int b_fd, int b_nulls_fd,
+                    ssize_t start_pos, ssize_t end_pos, float8 tolerance,
+                    asof_output *out, const scan_options *opts, char **errstr) {
+  int a_vals_fds[2] = {a_t_fd, a_fd}, a_nulls_fds[2] = {a_t_nulls_fd, a_nulls_fd};
+  int b_vals_fds[2] = {b_t_fd, b_fd}, b_nulls_fds[2] = {b_t_nulls_fd, b_nulls_fd};
+  ssize_t a_t_nvals, a_nvals, b_t_nvals, b_nvals, pos = 0;
+  scanner a_sc, b_sc;
+  scan_block *a_blk, *b_blk = NULL;
+  float8 *bs;
+  bool *b_nulls;
+  const float8 *ts;
+  const bool *t_nulls;
+  float8 t, prev_t = -INFINITY, b_t, last_t = 0, last_b = 0;
+  bool have_last = false, last_null = true, b_started = false, b_done = false;
+  int a_vals_read, b_vals_read = 0, b_i = 0, i;
+
+  if (floatfile_nvals(a_t_fd, &a_t_nvals, errstr) || floatfile_nvals(a_fd, &a_nvals, errstr) ||
+      floatfile_nvals(b_t_fd, &b_t_nvals, errstr) || floatfile_nvals(b_fd, &b_nvals, errstr)) return -1;
+  if (a_t_nvals != a_nvals || b_t_nvals != b_nvals) {
+    *errstr = "floatfiles must be as long as their timestamps";
+    return -1;
+  }
+  if (end_pos == -1 || end_pos > a_nvals) end_pos = a_nvals;
+  if (start_pos >= end_pos) return 0;
+
+  bs = malloc(HIST_BUFFER * sizeof(float8));
+  b_nulls = malloc(HIST_BUFFER * sizeof(bool));
+  if (!bs || !b_nulls) {
+    free(bs);
+    free(b_nulls);
+    *errstr = "out of memory";
+    return -1;
+  }
+  if (scanner_init(&a_sc, 2, a_vals_fds, a_nulls_fds, start_pos, end_pos, opts, errstr)) {
+    scanner_finish(&a_sc);
+    free(bs);
+    free(b_nulls);
+    return -1;
+  }
+
+  while ((a_vals_read = scanner_next(&a_sc, &a_blk, errstr))) {
+    if (a_vals_read == -1) break;   // errstr is already set
+
+    ts = a_blk->vals[0];
+    t_nulls = a_blk->nulls[0];
+    for (i = 0; i < a_vals_read; i++) {
+      bs[i] = 0;
+      b_nulls[i] = true;
+      if (t_nulls[i] || isnan(ts[i])) continue;
+      t = ts[i];
+      if (t < prev_t) {
+        *errstr = "timestamps must be in order";
+        a_vals_read = -1;
+        break;
+      }
+      prev_t = t;
+
+      if (!b_started) {
+        b_started = true;
+        if (asof_start_b(&b_sc, b_vals_fds, b_nulls_fds, t, tolerance, &b_done, opts, errstr)) {
+          a_vals_read = -1;
+          break;
+        }
+      }
+
+      // Move `b` up to the last row at or before `t`:
+      while (!b_done) {
+        if (b_i == b_vals_read) {
+          b_vals_read = scanner_next(&b_sc, &b_blk, errstr);
+          b_i = 0;
+          if (b_vals_read == -1) break;
+          if (b_vals_read == 0) {
+            b_done = true;
+            break;
+          }
+        }
+        if (!b_blk->nulls[0][b_i] && !isnan(b_blk->vals[0][b_i])) {
+          b_t = b_blk->vals[0][b_i];
+          if (b_t > t) break;
+          if (have_last && b_t < last_t) {
+            *errstr = "timestamps must be in order";
+            b_vals_read = -1;
+            break;
+          }
+          have_last = true;
+          last_t = b_t;
+          last_b = b_blk->vals[1][b_i];
+          last_null = b_blk->nulls[1][b_i];
+        }
+        b_i++;
+      }
+      if (b_vals_read == -1) {
+        a_vals_read = -1;
+        break;
+      }
+
+      if (have_last && t - last_t <= tolerance) {
+        bs[i] = last_b;
+        b_nulls[i] = last_null;
+      }
+    }
+    if (a_vals_read == -1) break;
+
+    if (asof_emit(out, pos, a_vals_read, ts, t_nulls, a_blk->vals[1], a_blk->nulls[1], bs, b_nulls, errstr)) {
+      a_vals_read = -1;
+      break;
+    }
+    pos += a_vals_read;
+  }
+
+  scanner_finish(&a_sc);
+  if (b_started) scanner_finish(&b_sc);
+  free(bs);
+  free(b_nulls);
+  return a_vals_read == -1 ? -1 : 0;
+}
+
+// Reading a page or two we don't need is cheaper than another pread:
+#define GATHER_GAP_VALS 1024
+// The most values one pread can cover:
+#define GATHER_SPAN_VALS (64 * 1024)
+
+/**
+ * gather_item - One position to gather, and where its value goes.
+ */
+typedef struct gather_item {
+  int64 pos;
+  ssize_t i;
+} gather_item;
+
+static int compare_gather_items(const void *a, const void *b) {
+  int64 x = ((const gather_item *)a)->pos, y = ((const gather_item *)b)->pos;
+
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/**
+ * build_gather - Sets `vals[i]` and `nulls[i]` to the value at `positions[i]`,
+ * or NULL if it's past either end of the floatfile.
+ *
+ * We visit the positions in order (sorting them first if we have to),
+ * and read each run of them that falls within a few pages of each other
+ * with one pread of the values and one of the nulls,
+ * so nearby positions cost no more syscalls than one.
+ */
+int build_gather(int x_fd, int x_nulls_fd, ssize_t npositions, const int64 *positions,
+                 float8 *vals, bool *nulls, char **errstr) {
+  gather_item *items;
+  float8 *span_vals;
+  bool *span_nulls;
+  ssize_t nvals, k, j, len, i;
+  int64 first, last;
+  bool sorted = true;
+  int result = 0;
+
+  if (floatfile_nvals(x_fd, &nvals, errstr)) return -1;
+  if (npositions == 0) return 0;
+
+  items = malloc(npositions * sizeof(gather_item));
+  span_vals = malloc(GATHER_SPAN_VALS * sizeof(float8));
+  span_nulls = malloc(GATHER_SPAN_VALS * sizeof(bool));
+  if (!items || !span_vals || !span_nulls) {
+    *errstr = "out of memory";
+    result = -1;
+    goto done;
+  }
+
+  for (k = 0; k < npositions; k++) {
+    items[k].pos = positions[k];
+    items[k].i = k;
+    if (k > 0 && positions[k] < positions[k - 1]) sorted = false;
+  }
+  if (!sorted) qsort(items, npositions, sizeof(gather_item), compare_gather_items);
+
+  for (k = 0; k < npositions; k = j) {
+    first = items[k].pos;
+    if (first < 0 || first >= nvals) {
+      vals[items[k].i] = 0;
+      nulls[items[k].i] = true;
+      j = k + 1;
+      continue;
+    }
+
+    last = first;
+    for (j = k + 1; j < npositions; j++) {
+      if (items[j].pos >= nvals || items[j].pos - last > GATHER_GAP_VALS ||
+          items[j].pos - first >= GATHER_SPAN_VALS) break;
+      last = items[j].pos;
+    }
+
+    len = last - first + 1;
+    if (pread(x_fd, span_vals, len * sizeof(float8), first * sizeof(float8)) != len * sizeof(float8) ||
+        pread(x_nulls_fd, span_nulls, len * sizeof(bool), first * sizeof(bool)) != len * sizeof(bool)) {
+      *errstr = "can't read floatfile";
+      result = -1;
+      goto done;
+    }
+    for (i = k; i < j; i++) {
+      vals[items[i].i] = span_vals[items[i].pos - first];
+      nulls[items[i].i] = span_nulls[items[i].pos - first];
+    }
+  }
+
+done:
+  free(items);
+  free(span_vals);
+  free(span_nulls);
+  return result;
+}
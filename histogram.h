@@ -1,15 +1,300 @@
-int find_bounds_start_end(int t_fd, int t_nulls_fd, float min_t, float max_t, ssize_t *min_pos, ssize_t *max_pos, char **errstr);
+/**
+ * histogram.h - Scans over floatfiles that don't need Postgres.
+ *
+ * Include kernels.h first.
+ */
+
+/**
+ * scan_options - Tunes how we read the files we are scanning.
+ *
+ * `drop_behind` - Tell the OS to forget each block once we've consumed it,
+ *                 so a big cold scan doesn't evict everyone else's hot pages.
+ * `threads` - Split histograms across up to this many threads.
+ *             0 or 1 means just use the calling thread.
+ */
+typedef struct scan_options {
+  bool drop_behind;
+  int threads;
+} scan_options;
+
+/**
+ * hist_spec - One 1d histogram to count a floatfile into.
+ *
+ * `counts` must have room for `count` buckets.
+ * If `edges` is set the buckets come from it (with the same `count`) instead of `min` and `width`.
+ */
+typedef struct hist_spec {
+  float8 min;
+  float8 width;
+  int32 count;
+  int64 *counts;
+  const bucket_edges *edges;
+} hist_spec;
+
+/**
+ * hist_dimension - One floatfile of an N-d histogram and its buckets.
+ */
+typedef struct hist_dimension {
+  int fd, nulls_fd;
+  float8 min;
+  float8 width;
+  int32 count;
+} hist_dimension;
+
+/**
+ * hist_file - One of the files for build_histogram_for_files.
+ *
+ * `drop_behind` is per file since auto mode depends on each file's size.
+ */
+typedef struct hist_file {
+  int x_fd, x_nulls_fd;
+  bool drop_behind;
+  int64 *counts;
+} hist_file;
+
+/**
+ * pair_file - One of the pairs of files for build_pair_stats_for_files.
+ *
+ * Like hist_file, `drop_behind` is per pair. Pairs with `skip` set are left alone.
+ */
+typedef struct pair_file {
+  int x_fd, x_nulls_fd, y_fd, y_nulls_fd;
+  bool drop_behind;
+  bool skip;
+  pair_stats stats;
+} pair_file;
+
+/**
+ * block_stats - Summary statistics for part of a floatfile,
+ * kept up to date as it grows.
+ * These are the records of a floatfile's rollups.
+ *
+ * `nvals` counts every value, null or not.
+ */
+typedef struct block_stats {
+  int64 nvals;
+  float_stats stats;
+} block_stats;
+
+/**
+ * where_result - The positions build_where has found so far.
+ *
+ * If `ranges` then `vals` holds a start and a length for each run of consecutive positions instead.
+ * It never grows past `max_len` elements.
+ */
+typedef struct where_result {
+  int64 *vals;
+  ssize_t len, cap, max_len;
+  bool ranges;
+} where_result;
+
+/**
+ * value_event - One run of consecutive values above a threshold,
+ * from `start` up to (not including) `end`, and the largest of them.
+ */
+typedef struct value_event {
+  int64 start, end;
+  float8 peak;
+} value_event;
+
+/**
+ * event_result - The runs build_events has found so far.
+ * It never grows past `max_len` runs.
+ */
+typedef struct event_result {
+  value_event *events;
+  ssize_t len, cap, max_len;
+} event_result;
+
+typedef enum {
+  DOWNSAMPLE_MINMAX,
+  DOWNSAMPLE_MEAN,
+  DOWNSAMPLE_LTTB
+} downsample_method;
+
+// A floatfile's rollups summarize it at several resolutions:
+// each record of level 0 covers 2^10 values,
+// and each level up covers ROLLUP_FANOUT times as many, up to 2^25.
+#define ROLLUP_LEVELS 6
+#define ROLLUP_BASE_BITS 10
+#define ROLLUP_FANOUT_BITS 3
+#define ROLLUP_FANOUT (1 << ROLLUP_FANOUT_BITS)
+#define ROLLUP_VALS(level) ((ssize_t)1 << (ROLLUP_BASE_BITS + ROLLUP_FANOUT_BITS * (level)))
+
+/**
+ * rollup_files - The open file of a floatfile's rollups (`fd`):
+ * a header with one block_stats for the whole floatfile,
+ * then the block_stats of every level (see rollup_offset).
+ * We keep the floatfile's value index here too (`index_fd`),
+ * since the same scans use it, but a floatfile can have either without the other.
+ *
+ * Both fds are -1 (NO_ROLLUPS) if the floatfile has neither.
+ */
+typedef struct rollup_files {
+  int fd;
+  int index_fd;
+  block_stats header;   // what we'll write to the start of `fd` once we're done appending
+} rollup_files;
+
+#define NO_ROLLUPS { .fd = -1, .index_fd = -1 }
+
+/**
+ * asof_output - Where build_asof_join puts the rows it lines up.
+ *
+ * If `a_fd` is -1 we collect them in the arrays (free them afterwards),
+ * which never grow past `max_len` rows.
+ * Otherwise we append the values to the floatfiles in `a_fd` and `b_fd` (and their rollups, like build_combine),
+ * leaving out the timestamps.
+ */
+typedef struct asof_output {
+  int a_fd, a_nulls_fd, b_fd, b_nulls_fd;
+  rollup_files *a_rollups, *b_rollups;
+  int *a_rollups_result, *b_rollups_result;
+  float8 *ts, *as, *bs;
+  bool *t_nulls, *a_nulls, *b_nulls;
+  ssize_t len, cap, max_len;
+} asof_output;
+
+// A value index splits the values into at most this many bins,
+// so each chunk's bins fit in a uint64:
+#define VALUE_INDEX_MAX_BINS 64
+
+/**
+ * value_index_header - The start of a floatfile's value index.
+ *
+ * The index has a uint64 for every `chunk_vals` values after the header,
+ * with bit `b` set if any of those values is in bin `b`.
+ * There are `nbins` bins split by `nbins - 1` increasing `edges`:
+ * bin 0 holds everything below `edges[0]`, and the last one everything from the last edge up.
+ * NULLs and NaNs aren't in any bin.
+ * `nvals` says how many values the index covers,
+ * and we write it last, so if it doesn't match the floatfile we ignore the index.
+ */
+typedef struct value_index_header {
+  int64 nvals;
+  int32 chunk_vals;
+  int32 nbins;
+  float8 edges[VALUE_INDEX_MAX_BINS - 1];
+} value_index_header;
+
+int find_bounds_start_end(int t_fd, int t_nulls_fd, float min_t, float max_t, ssize_t *min_pos, ssize_t *max_pos, const scan_options *opts, char **errstr);
 
 int build_histogram(int x_fd, int x_nulls_fd, float8 x_min, float8 x_width, int32 x_count,
-                    int64 *counts, char **errstr);
+                    int64 *counts, const scan_options *opts, char **errstr);
 
 int build_histogram_2d(int x_fd, int x_nulls_fd, float8 x_min, float8 x_width, int32 x_count,
                        int y_fd, int y_nulls_fd, float8 y_min, float8 y_width, int32 y_count,
-                       int64 *counts, char **errstr);
+                       int64 *counts, const scan_options *opts, char **errstr);
 
 int build_histogram_with_bounds(int x_fd, int x_nulls_fd, float8 x_min, float8 x_width, int32 x_count,
-                                int64 *counts, ssize_t min_pos, ssize_t max_pos, char **errstr);
+                                int64 *counts, ssize_t min_pos, ssize_t max_pos, const scan_options *opts, char **errstr);
 
 int build_histogram_2d_with_bounds(int x_fd, int x_nulls_fd, float8 x_min, float8 x_width, int32 x_count,
                                    int y_fd, int y_nulls_fd, float8 y_min, float8 y_width, int32 y_count,
-                                   int64 *counts, ssize_t min_pos, ssize_t max_pos, char **errstr);
+                                   int64 *counts, ssize_t min_pos, ssize_t max_pos, const scan_options *opts, char **errstr);
+
+int build_histogram_nd(int ndims, const hist_dimension *dims, int64 *counts, const scan_options *opts, char **errstr);
+
+int build_histogram_nd_with_bounds(int ndims, const hist_dimension *dims, int64 *counts,
+                                   ssize_t min_pos, ssize_t max_pos, const scan_options *opts, char **errstr);
+
+int build_sparse_histogram_nd(int ndims, const hist_dimension *dims, sparse_counts *counts,
+                              const scan_options *opts, char **errstr);
+
+int build_sparse_histogram_nd_with_bounds(int ndims, const hist_dimension *dims, sparse_counts *counts,
+                                          ssize_t min_pos, ssize_t max_pos, const scan_options *opts, char **errstr);
+
+int build_bucket_stats(int x_fd, int x_nulls_fd, float8 x_min, float8 x_width, int32 x_count,
+                       int y_fd, int y_nulls_fd, float_stats *buckets, const scan_options *opts, char **errstr);
+
+int build_bucket_stats_with_bounds(int x_fd, int x_nulls_fd, float8 x_min, float8 x_width, int32 x_count,
+                                   int y_fd, int y_nulls_fd, float_stats *buckets,
+                                   ssize_t min_pos, ssize_t max_pos, const scan_options *opts, char **errstr);
+
+int build_histograms(int x_fd, int x_nulls_fd, int nspecs, hist_spec *specs,
+                     const scan_options *opts, char **errstr);
+
+int build_histograms_with_bounds(int x_fd, int x_nulls_fd, int nspecs, hist_spec *specs,
+                                 ssize_t min_pos, ssize_t max_pos, const scan_options *opts, char **errstr);
+
+int build_histogram_for_files(int nfiles, hist_file *files, float8 x_min, float8 x_width, int32 x_count,
+                              const scan_options *opts, char **errstr);
+
+int build_stats(int x_fd, int x_nulls_fd, float_stats *stats, const scan_options *opts, char **errstr);
+
+int build_stats_with_bounds(int x_fd, int x_nulls_fd, float_stats *stats,
+                            ssize_t min_pos, ssize_t max_pos, const scan_options *opts, char **errstr);
+
+int build_pair_stats(int x_fd, int x_nulls_fd, int y_fd, int y_nulls_fd, pair_stats *stats,
+                     const scan_options *opts, char **errstr);
+
+int build_pair_stats_with_bounds(int x_fd, int x_nulls_fd, int y_fd, int y_nulls_fd, pair_stats *stats,
+                                 ssize_t min_pos, ssize_t max_pos, const scan_options *opts, char **errstr);
+
+int build_pair_stats_for_files(int nfiles, pair_file *files, const scan_options *opts, char **errstr);
+
+int start_rollups(rollup_files *rf, ssize_t start_pos, char **errstr);
+
+int append_rollups(rollup_files *rf, ssize_t start_pos, const float8 *vals, const bool *nulls, ssize_t len, char **errstr);
+
+int finish_rollups(const rollup_files *rf, char **errstr);
+
+int build_value_index(int index_fd, int x_fd, int x_nulls_fd, int nbins, int chunk_vals,
+                      ssize_t exact_limit, const scan_options *opts, char **errstr);
+
+int update_value_index(int index_fd, int x_fd, int x_nulls_fd, const scan_options *opts, char **errstr);
+
+int build_stats_from_rollups(int x_fd, int x_nulls_fd, const rollup_files *rf, ssize_t start_pos, ssize_t end_pos,
+                             float_stats *stats, ssize_t *nvals, const scan_options *opts, char **errstr);
+
+int build_histogram_from_rollups(int x_fd, int x_nulls_fd, const rollup_files *rf, float8 x_min, float8 x_width, int32 x_count,
+                                 int64 *counts, ssize_t start_pos, ssize_t end_pos, const scan_options *opts, char **errstr);
+
+int build_histogram_auto(int x_fd, int x_nulls_fd, const rollup_files *rf, int32 x_count, int64 *counts,
+                         float8 *x_min, float8 *x_width, ssize_t start_pos, ssize_t end_pos,
+                         const scan_options *opts, char **errstr);
+
+int build_histogram_edges(int x_fd, int x_nulls_fd, const rollup_files *rf, const bucket_edges *edges, int64 *counts,
+                          ssize_t start_pos, ssize_t end_pos, const scan_options *opts, char **errstr);
+
+int build_histograms_from_rollups(int x_fd, int x_nulls_fd, const rollup_files *rf, int nspecs, hist_spec *specs,
+                                  ssize_t start_pos, ssize_t end_pos, const scan_options *opts, char **errstr);
+
+int build_combine(int a_fd, int a_nulls_fd, int b_fd, int b_nulls_fd, float8 b, combine_op op,
+                  int out_fd, int out_nulls_fd, rollup_files *out_rollups, int *rollups_result,
+                  const scan_options *opts, char **errstr);
+
+int build_rolling(int x_fd, int x_nulls_fd, rolling_func func, int window, ssize_t out_start,
+                  int out_fd, int out_nulls_fd, rollup_files *out_rollups, int *rollups_result,
+                  const scan_options *opts, char **errstr);
+
+int build_where(int x_fd, int x_nulls_fd, const rollup_files *rf, float8 lo, float8 hi,
+                ssize_t start_pos, ssize_t end_pos, where_result *wr, const scan_options *opts, char **errstr);
+
+int build_events(int x_fd, int x_nulls_fd, float8 threshold, int min_len,
+                 ssize_t start_pos, ssize_t end_pos, event_result *er, const scan_options *opts, char **errstr);
+
+int build_asof_join(int a_t_fd, int a_t_nulls_fd, int a_fd, int a_nulls_fd,
+                    int b_t_fd, int b_t_nulls_fd, int b_fd, int b_nulls_fd,
+                    ssize_t start_pos, ssize_t end_pos, float8 tolerance,
+                    asof_output *out, const scan_options *opts, char **errstr);
+
+int build_gather(int x_fd, int x_nulls_fd, ssize_t npositions, const int64 *positions,
+                 float8 *vals, bool *nulls, char **errstr);
+
+int build_percentiles(int x_fd, int x_nulls_fd, int nfractions, const float8 *fractions, float8 *results,
+                      int64 *nvals, ssize_t exact_limit, const scan_options *opts, char **errstr);
+
+int build_percentiles_with_bounds(int x_fd, int x_nulls_fd, int nfractions, const float8 *fractions, float8 *results,
+                                  int64 *nvals, ssize_t min_pos, ssize_t max_pos, ssize_t exact_limit,
+                                  const scan_options *opts, char **errstr);
+
+int build_downsample(int x_fd, int x_nulls_fd, const rollup_files *x_rollups,
+                     int t_fd, int t_nulls_fd, const rollup_files *t_rollups, ssize_t min_pos, ssize_t max_pos,
+                     float8 t_start, float8 t_end, int n_points, downsample_method method,
+                     float8 *out_ts, float8 *out_xs, int *out_count, const scan_options *opts, char **errstr);
+
+int build_time_buckets(int x_fd, int x_nulls_fd, const rollup_files *x_rollups,
+                       int t_fd, int t_nulls_fd, const rollup_files *t_rollups, ssize_t min_pos, ssize_t max_pos,
+                       float8 t_start, float8 t_end, float8 width, int nbuckets, float_stats *buckets,
+                       const scan_options *opts, char **errstr);
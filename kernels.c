@@ -0,0 +1,1819 @@
+/**
+ * kernels.c - Counting kernels for the histograms,
+ * with SIMD versions chosen at runtime.
+ *
+ * Counting happens in two steps.
+ * First we find the bucket of each value that lands in the histogram
+ * (this is the part with SIMD versions),
+ * then we add those buckets to the counts (see add_positions).
+ *
+ * Every version must give exactly the same counts as the scalar one,
+ * so the SIMD versions still divide by the bucket width
+ * (multiplying by its reciprocal can round a value into the neighboring bucket),
+ * use ordered comparisons so NaNs are never counted,
+ * and truncate toward zero like the scalar `(int)` cast.
+ */
+
+#include <math.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <postgres.h>
+
+#include "kernels.h"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define HAVE_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+// How many positions we find before adding them up.
+// Small enough that they stay in L1.
+#define POSITIONS_CHUNK 4096
+
+// Replicated counts get up to COUNTER_COPIES copies,
+// as many as fit in REPLICATED_BYTES (well inside L2).
+// Histograms too big for two copies count directly:
+#define REPLICATED_BYTES (128*1024)
+#define COUNTER_COPIES 4
+
+// We only rotate through the copies for a chunk of positions
+// if at least 1/SKEW_FRACTION of its first SKEW_SAMPLE positions
+// repeat the one before. Otherwise the copies just cost us cache:
+#define SKEW_SAMPLE 256
+#define SKEW_FRACTION 4
+
+// Histograms with more buckets than this don't even fit in the last-level cache,
+// so we partition each block by tile first:
+#define MIN_BLOCKED_BUCKETS (4*1024*1024)
+#define TILE_BITS 15
+
+// Sparse tables start with room for this many buckets:
+#define MIN_SPARSE_CAPACITY 1024
+
+typedef int (*find_positions_fn)(int, const float8 *, const bool *, float8, float8, int, int32 *);
+typedef int (*find_positions_2d_fn)(int, const float8 *, const bool *, float8, float8, int,
+                                    const float8 *, const bool *, float8, float8, int, int32 *);
+typedef int (*find_positions_nd_fn)(int, int, const float8 *const *, const bool *const *,
+                                    const float8 *, const float8 *, const int32 *, int32 *);
+typedef int (*find_indexed_positions_fn)(int, const float8 *, const bool *, const bool *, float8, float8, int, int32 *, int32 *);
+typedef int (*find_edges_positions_fn)(int, const float8 *, const bool *, const bucket_edges *, int32 *);
+typedef void (*combine_fn)(combine_op, int, const float8 *, const float8 *, float8, float8 *);
+typedef int (*find_matches_fn)(int, const float8 *, const bool *, float8, float8, int32 *);
+typedef void (*mark_above_fn)(int, const float8 *, const bool *, float8, uint64 *);
+
+/**
+ * find_positions_scalar - Writes the bucket of each non-null value that falls in the histogram
+ * to `positions`, and returns how many there were.
+ */
+static int find_positions_scalar(int more_vals, const float8 *xs, const bool *x_nulls, float8 x_min, float8 x_width, int x_count, int32 *positions) {
+  size_t i;
+  int found = 0;
+  float8 x;
+  float8 x_pos;
+
+  for (i = 0; i < more_vals; i += 1) {
+    if (x_nulls[i]) continue;
+    x = xs[i];
+
+    x_pos = (x - x_min) / x_width;
+
+    if (x_pos >= 0 && x_pos < x_count) {
+      positions[found++] = (int)x_pos;
+    }
+  }
+
+  return found;
+}
+
+static int find_positions_2d_scalar(int more_vals, const float8 *xs, const bool *x_nulls, float8 x_min, float8 x_width, int x_count, const float8 *ys, const bool *y_nulls, float8 y_min, float8 y_width, int y_count, int32 *positions) {
+  size_t i;
+  int found = 0;
+  float8 x, y;
+  float8 x_pos, y_pos;
+
+  for (i = 0; i < more_vals; i += 1) {
+    if (x_nulls[i] || y_nulls[i]) continue;
+    x = xs[i];
+    y = ys[i];
+
+    x_pos = (x - x_min) / x_width;
+    y_pos = (y - y_min) / y_width;
+
+    if (x_pos >= 0 && x_pos < x_count && y_pos >= 0 && y_pos < y_count) {
+      positions[found++] = (int)x_pos * y_count + (int)y_pos;
+    }
+  }
+
+  return found;
+}
+
+/**
+ * find_positions_nd_scalar - Like find_positions_2d_scalar, but for any number of dimensions.
+ * The positions are row-major, so the last dimension varies fastest.
+ */
+static int find_positions_nd_scalar(int more_vals, int ndims, const float8 *const *xs, const bool *const *x_nulls,
+                                    const float8 *x_mins, const float8 *x_widths, const int32 *x_counts, int32 *positions) {
+  size_t i;
+  int found = 0;
+  int d, position;
+  float8 x_pos;
+
+  for (i = 0; i < more_vals; i += 1) {
+    position = 0;
+    for (d = 0; d < ndims; d++) {
+      if (x_nulls[d][i]) break;
+      x_pos = (xs[d][i] - x_mins[d]) / x_widths[d];
+      if (!(x_pos >= 0 && x_pos < x_counts[d])) break;
+      position = position * x_counts[d] + (int)x_pos;
+    }
+    if (d == ndims) positions[found++] = position;
+  }
+
+  return found;
+}
+
+/**
+ * find_indexed_positions_scalar - Like find_positions_scalar,
+ * but also skips the values whose `y_nulls` is set,
+ * and writes where each one we keep is in the block to `indexes`.
+ */
+static int find_indexed_positions_scalar(int more_vals, const float8 *xs, const bool *x_nulls, const bool *y_nulls, float8 x_min, float8 x_width, int x_count, int32 *positions, int32 *indexes) {
+  size_t i;
+  int found = 0;
+  float8 x_pos;
+
+  for (i = 0; i < more_vals; i += 1) {
+    if (x_nulls[i] || y_nulls[i]) continue;
+
+    x_pos = (xs[i] - x_min) / x_width;
+
+    if (x_pos >= 0 && x_pos < x_count) {
+      positions[found] = (int)x_pos;
+      indexes[found++] = i;
+    }
+  }
+
+  return found;
+}
+
+/**
+ * edge_key - Returns a uint64 that sorts like `x` (unless it's NaN).
+ *
+ * Positive floats already sort like their bits,
+ * so we just flip the sign bit, and flip every bit of negative ones.
+ * Adding 0 turns -0 into 0 so they get the same key.
+ */
+static inline uint64 edge_key(float8 x) {
+  uint64 bits;
+
+  x += 0.0;
+  memcpy(&bits, &x, sizeof(bits));
+  return bits ^ ((uint64)((int64)bits >> 63) | UINT64CONST(0x8000000000000000));
+}
+
+/**
+ * edges_position - Returns the bucket of `x`, which must be in [edges[0], edges[count]).
+ *
+ * With an index we look up the bucket where x's run of keys starts,
+ * and since the run crosses at most one edge we step over it if we must.
+ * Otherwise we binary search, with a loop that only depends on `count`
+ * so the compiler can use conditional moves instead of branches.
+ */
+static inline int edges_position(const bucket_edges *be, float8 x) {
+  const float8 *base = be->edges;
+  int len, k;
+
+  if (be->index) {
+    k = be->index[(edge_key(x) - be->first_key) >> be->shift];
+    return k + (x >= be->edges[k + 1]);
+  }
+
+  for (len = be->count; len > 1; len -= len >> 1) {
+    base = base[len >> 1] <= x ? base + (len >> 1) : base;
+  }
+  return base - be->edges;
+}
+
+/**
+ * find_edges_positions_scalar - Like find_positions_scalar, but for buckets with arbitrary edges.
+ */
+static int find_edges_positions_scalar(int more_vals, const float8 *xs, const bool *x_nulls, const bucket_edges *be, int32 *positions) {
+  float8 lo = be->edges[0], hi = be->edges[be->count];
+  size_t i;
+  int found = 0;
+  float8 x;
+
+  for (i = 0; i < more_vals; i += 1) {
+    if (x_nulls[i]) continue;
+    x = xs[i];
+
+    if (x >= lo && x < hi) {
+      positions[found++] = edges_position(be, x);
+    }
+  }
+
+  return found;
+}
+
+/**
+ * combine_one - Returns `x` `op` `y`.
+ *
+ * min and max return NaN if either value is NaN, like the arithmetic ops.
+ * We write them so the SIMD versions can give exactly the same answers.
+ */
+static inline float8 combine_one(combine_op op, float8 x, float8 y) {
+  switch (op) {
+    case COMBINE_ADD:  return x + y;
+    case COMBINE_SUB:  return x - y;
+    case COMBINE_MUL:  return x * y;
+    case COMBINE_DIV:  return x / y;
+    case COMBINE_MIN:  return (x < y || x != x) ? x : y;
+    case COMBINE_MAX:  return (x > y || x != x) ? x : y;
+    case COMBINE_NEG:  return -x;
+    case COMBINE_ABS:  return fabs(x);
+    case COMBINE_SQRT: return sqrt(x);
+    case COMBINE_EXP:  return exp(x);
+    case COMBINE_LN:   return log(x);
+  }
+  return NAN;
+}
+
+/**
+ * combine_scalar - Sets each `out[i]` to `as[i]` `op` `bs[i]`,
+ * or `as[i]` `op` `b` if `bs` is NULL.
+ */
+static void combine_scalar(combine_op op, int more_vals, const float8 *as, const float8 *bs, float8 b, float8 *out) {
+  int i;
+
+  if (bs) {
+    for (i = 0; i < more_vals; i++) out[i] = combine_one(op, as[i], bs[i]);
+  } else {
+    for (i = 0; i < more_vals; i++) out[i] = combine_one(op, as[i], b);
+  }
+}
+
+/**
+ * find_matches_scalar - Writes the index of each non-null value from `lo` to `hi` (inclusive)
+ * to `matches`, and returns how many there were.
+ *
+ * We write every index and only advance past the ones that match,
+ * so there is no branch to mispredict.
+ */
+static int find_matches_scalar(int more_vals, const float8 *xs, const bool *x_nulls, float8 lo, float8 hi, int32 *matches) {
+  int i, found = 0;
+
+  for (i = 0; i < more_vals; i++) {
+    matches[found] = i;
+    found += !x_nulls[i] & (xs[i] >= lo) & (xs[i] <= hi);
+  }
+
+  return found;
+}
+
+/**
+ * mark_above_scalar - Sets bit `i % 64` of `bits[i / 64]` for each non-null value above `threshold`
+ * and clears the rest, including the unused bits of the last word.
+ */
+static void mark_above_scalar(int more_vals, const float8 *xs, const bool *x_nulls, float8 threshold, uint64 *bits) {
+  int i;
+
+  memset(bits, 0, (more_vals + 63) / 64 * sizeof(uint64));
+  for (i = 0; i < more_vals; i++) {
+    bits[i / 64] |= (uint64)(!x_nulls[i] & (xs[i] > threshold)) << (i % 64);
+  }
+}
+
+#ifdef HAVE_X86_KERNELS
+
+/**
+ * not_null_mask_4 - Returns a bit for each of the four nulls flags that is false.
+ */
+__attribute__((target("avx2")))
+static inline int not_null_mask_4(const bool *nulls) {
+  int32 flags;
+
+  memcpy(&flags, nulls, sizeof(flags));
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_cvtsi32_si128(flags), _mm_setzero_si128())) & 0xf;
+}
+
+/**
+ * in_range_4 - Finds each value's bucket position,
+ * and returns a bit for each one that falls in [0, count).
+ */
+__attribute__((target("avx2")))
+static inline int in_range_4(const float8 *xs, __m256d mins, __m256d widths, __m256d counts, int32 *positions) {
+  __m256d pos = _mm256_div_pd(_mm256_sub_pd(_mm256_loadu_pd(xs), mins), widths);
+  __m256d ok = _mm256_and_pd(_mm256_cmp_pd(pos, _mm256_setzero_pd(), _CMP_GE_OQ),
+                             _mm256_cmp_pd(pos, counts, _CMP_LT_OQ));
+
+  _mm_storeu_si128((__m128i *)positions, _mm256_cvttpd_epi32(pos));
+  return _mm256_movemask_pd(ok);
+}
+
+__attribute__((target("avx2")))
+static int find_positions_avx2(int more_vals, const float8 *xs, const bool *x_nulls, float8 x_min, float8 x_width, int x_count, int32 *positions) {
+  __m256d mins = _mm256_set1_pd(x_min);
+  __m256d widths = _mm256_set1_pd(x_width);
+  __m256d bucket_counts = _mm256_set1_pd(x_count);
+  int32 x_pos[4];
+  int i, mask, found = 0;
+
+  for (i = 0; i + 4 <= more_vals; i += 4) {
+    mask = in_range_4(xs + i, mins, widths, bucket_counts, x_pos) & not_null_mask_4(x_nulls + i);
+    while (mask) {
+      positions[found++] = x_pos[__builtin_ctz(mask)];
+      mask &= mask - 1;
+    }
+  }
+
+  return found + find_positions_scalar(more_vals - i, xs + i, x_nulls + i, x_min, x_width, x_count, positions + found);
+}
+
+__attribute__((target("avx2")))
+static int find_positions_2d_avx2(int more_vals, const float8 *xs, const bool *x_nulls, float8 x_min, float8 x_width, int x_count, const float8 *ys, const bool *y_nulls, float8 y_min, float8 y_width, int y_count, int32 *positions) {
+  __m256d x_mins = _mm256_set1_pd(x_min), y_mins = _mm256_set1_pd(y_min);
+  __m256d x_widths = _mm256_set1_pd(x_width), y_widths = _mm256_set1_pd(y_width);
+  __m256d x_counts = _mm256_set1_pd(x_count), y_counts = _mm256_set1_pd(y_count);
+  int32 x_pos[4], y_pos[4];
+  int i, k, mask, found = 0;
+
+  for (i = 0; i + 4 <= more_vals; i += 4) {
+    mask = in_range_4(xs + i, x_mins, x_widths, x_counts, x_pos) &
+           in_range_4(ys + i, y_mins, y_widths, y_counts, y_pos) &
+           not_null_mask_4(x_nulls + i) & not_null_mask_4(y_nulls + i);
+    while (mask) {
+      k = __builtin_ctz(mask);
+      positions[found++] = x_pos[k] * y_count + y_pos[k];
+      mask &= mask - 1;
+    }
+  }
+
+  return found + find_positions_2d_scalar(more_vals - i, xs + i, x_nulls + i, x_min, x_width, x_count,
+                                                         ys + i, y_nulls + i, y_min, y_width, y_count, positions + found);
+}
+
+__attribute__((target("avx2")))
+static int find_positions_nd_avx2(int more_vals, int ndims, const float8 *const *xs, const bool *const *x_nulls,
+                                  const float8 *x_mins, const float8 *x_widths, const int32 *x_counts, int32 *positions) {
+  __m256d mins[MAX_DIMENSIONS], widths[MAX_DIMENSIONS], bucket_counts[MAX_DIMENSIONS];
+  int32 x_pos[MAX_DIMENSIONS][4];
+  const float8 *tail_xs[MAX_DIMENSIONS];
+  const bool *tail_nulls[MAX_DIMENSIONS];
+  int i, k, d, mask, position, found = 0;
+
+  for (d = 0; d < ndims; d++) {
+    mins[d] = _mm256_set1_pd(x_mins[d]);
+    widths[d] = _mm256_set1_pd(x_widths[d]);
+    bucket_counts[d] = _mm256_set1_pd(x_counts[d]);
+  }
+
+  for (i = 0; i + 4 <= more_vals; i += 4) {
+    mask = 0xf;
+    for (d = 0; d < ndims; d++) {
+      mask &= in_range_4(xs[d] + i, mins[d], widths[d], bucket_counts[d], x_pos[d]) & not_null_mask_4(x_nulls[d] + i);
+    }
+    while (mask) {
+      k = __builtin_ctz(mask);
+      position = 0;
+      for (d = 0; d < ndims; d++) position = position * x_counts[d] + x_pos[d][k];
+      positions[found++] = position;
+      mask &= mask - 1;
+    }
+  }
+
+  for (d = 0; d < ndims; d++) {
+    tail_xs[d] = xs[d] + i;
+    tail_nulls[d] = x_nulls[d] + i;
+  }
+  return found + find_positions_nd_scalar(more_vals - i, ndims, tail_xs, tail_nulls, x_mins, x_widths, x_counts, positions + found);
+}
+
+__attribute__((target("avx2")))
+static int find_indexed_positions_avx2(int more_vals, const float8 *xs, const bool *x_nulls, const bool *y_nulls, float8 x_min, float8 x_width, int x_count, int32 *positions, int32 *indexes) {
+  __m256d mins = _mm256_set1_pd(x_min);
+  __m256d widths = _mm256_set1_pd(x_width);
+  __m256d bucket_counts = _mm256_set1_pd(x_count);
+  int32 x_pos[4];
+  int i, k, mask, found = 0, tail;
+
+  for (i = 0; i + 4 <= more_vals; i += 4) {
+    mask = in_range_4(xs + i, mins, widths, bucket_counts, x_pos) &
+           not_null_mask_4(x_nulls + i) & not_null_mask_4(y_nulls + i);
+    while (mask) {
+      k = __builtin_ctz(mask);
+      positions[found] = x_pos[k];
+      indexes[found++] = i + k;
+      mask &= mask - 1;
+    }
+  }
+
+  tail = find_indexed_positions_scalar(more_vals - i, xs + i, x_nulls + i, y_nulls + i, x_min, x_width, x_count,
+                                       positions + found, indexes + found);
+  for (k = 0; k < tail; k++) indexes[found + k] += i;
+  return found + tail;
+}
+
+/**
+ * find_edges_positions_avx2 - Like find_edges_positions_scalar, four values at a time.
+ *
+ * The binary search takes the same steps for every value, so we can gather each step's edges.
+ * To look up the index we swap any value outside the edges for the first edge,
+ * so that every lane reads inside the index.
+ */
+__attribute__((target("avx2")))
+static int find_edges_positions_avx2(int more_vals, const float8 *xs, const bool *x_nulls, const bucket_edges *be, int32 *positions) {
+  __m256d lo = _mm256_set1_pd(be->edges[0]), hi = _mm256_set1_pd(be->edges[be->count]);
+  __m256i sign_bit = _mm256_set1_epi64x(UINT64CONST(0x8000000000000000));
+  __m256i first_key = _mm256_set1_epi64x(be->first_key);
+  __m256i one = _mm256_set1_epi64x(1);
+  __m128i shift = _mm_cvtsi32_si128(be->shift);
+  __m256d x, ok, next;
+  __m256i k, half, bits, cells;
+  int64 ks[4];
+  int i, j, len, mask, found = 0;
+
+  for (i = 0; i + 4 <= more_vals; i += 4) {
+    x = _mm256_loadu_pd(xs + i);
+    ok = _mm256_and_pd(_mm256_cmp_pd(x, lo, _CMP_GE_OQ), _mm256_cmp_pd(x, hi, _CMP_LT_OQ));
+    mask = _mm256_movemask_pd(ok) & not_null_mask_4(x_nulls + i);
+    if (!mask) continue;
+
+    if (be->index) {
+      x = _mm256_add_pd(_mm256_blendv_pd(lo, x, ok), _mm256_setzero_pd());
+      bits = _mm256_castpd_si256(x);
+      bits = _mm256_xor_si256(bits, _mm256_or_si256(_mm256_cmpgt_epi64(_mm256_setzero_si256(), bits), sign_bit));
+      cells = _mm256_srl_epi64(_mm256_sub_epi64(bits, first_key), shift);
+      k = _mm256_cvtepi32_epi64(_mm256_i64gather_epi32(be->index, cells, 4));
+      next = _mm256_i64gather_pd(be->edges, _mm256_add_epi64(k, one), 8);
+      k = _mm256_sub_epi64(k, _mm256_castpd_si256(_mm256_cmp_pd(next, x, _CMP_LE_OQ)));
+    } else {
+      k = _mm256_setzero_si256();
+      for (len = be->count; len > 1; len -= len >> 1) {
+        half = _mm256_set1_epi64x(len >> 1);
+        next = _mm256_i64gather_pd(be->edges, _mm256_add_epi64(k, half), 8);
+        k = _mm256_add_epi64(k, _mm256_and_si256(half, _mm256_castpd_si256(_mm256_cmp_pd(next, x, _CMP_LE_OQ))));
+      }
+    }
+
+    _mm256_storeu_si256((__m256i *)ks, k);
+    while (mask) {
+      j = __builtin_ctz(mask);
+      positions[found++] = ks[j];
+      mask &= mask - 1;
+    }
+  }
+
+  return found + find_edges_positions_scalar(more_vals - i, xs + i, x_nulls + i, be, positions + found);
+}
+
+/**
+ * combine_avx2 - Like combine_scalar, four values at a time.
+ *
+ * There are no SIMD versions of exp and log, so those are just scalar.
+ */
+__attribute__((target("avx2")))
+static void combine_avx2(combine_op op, int more_vals, const float8 *as, const float8 *bs, float8 b, float8 *out) {
+  __m256d sign_bit = _mm256_set1_pd(-0.0);
+  __m256d x, y, r;
+  int i;
+
+  if (op == COMBINE_EXP || op == COMBINE_LN) {
+    combine_scalar(op, more_vals, as, bs, b, out);
+    return;
+  }
+
+  y = _mm256_set1_pd(b);
+  for (i = 0; i + 4 <= more_vals; i += 4) {
+    x = _mm256_loadu_pd(as + i);
+    if (bs) y = _mm256_loadu_pd(bs + i);
+    switch (op) {
+      case COMBINE_ADD:  r = _mm256_add_pd(x, y); break;
+      case COMBINE_SUB:  r = _mm256_sub_pd(x, y); break;
+      case COMBINE_MUL:  r = _mm256_mul_pd(x, y); break;
+      case COMBINE_DIV:  r = _mm256_div_pd(x, y); break;
+      // min_pd and max_pd return y unless x wins, so we just have to keep an x that's NaN:
+      case COMBINE_MIN:  r = _mm256_blendv_pd(_mm256_min_pd(x, y), x, _mm256_cmp_pd(x, x, _CMP_UNORD_Q)); break;
+      case COMBINE_MAX:  r = _mm256_blendv_pd(_mm256_max_pd(x, y), x, _mm256_cmp_pd(x, x, _CMP_UNORD_Q)); break;
+      case COMBINE_NEG:  r = _mm256_xor_pd(x, sign_bit); break;
+      case COMBINE_ABS:  r = _mm256_andnot_pd(sign_bit, x); break;
+      case COMBINE_SQRT: r = _mm256_sqrt_pd(x); break;
+      default:           r = x; break;
+    }
+    _mm256_storeu_pd(out + i, r);
+  }
+
+  combine_scalar(op, more_vals - i, as + i, bs ? bs + i : NULL, b, out + i);
+}
+
+__attribute__((target("avx2")))
+static int find_matches_avx2(int more_vals, const float8 *xs, const bool *x_nulls, float8 lo, float8 hi, int32 *matches) {
+  __m256d los = _mm256_set1_pd(lo), his = _mm256_set1_pd(hi);
+  __m256d x;
+  int i, k, mask, tail, found = 0;
+
+  for (i = 0; i + 4 <= more_vals; i += 4) {
+    x = _mm256_loadu_pd(xs + i);
+    mask = _mm256_movemask_pd(_mm256_and_pd(_mm256_cmp_pd(x, los, _CMP_GE_OQ), _mm256_cmp_pd(x, his, _CMP_LE_OQ))) &
+           not_null_mask_4(x_nulls + i);
+    while (mask) {
+      matches[found++] = i + __builtin_ctz(mask);
+      mask &= mask - 1;
+    }
+  }
+
+  // The scalar version numbers the rest from 0:
+  tail = find_matches_scalar(more_vals - i, xs + i, x_nulls + i, lo, hi, matches + found);
+  for (k = found; k < found + tail; k++) matches[k] += i;
+  return found + tail;
+}
+
+__attribute__((target("avx2")))
+static void mark_above_avx2(int more_vals, const float8 *xs, const bool *x_nulls, float8 threshold, uint64 *bits) {
+  __m256d thresholds = _mm256_set1_pd(threshold);
+  uint64 word;
+  int i, j;
+
+  // A word at a time, so the tail is the only part that needs the scalar version:
+  for (i = 0; i + 64 <= more_vals; i += 64) {
+    word = 0;
+    for (j = 0; j < 64; j += 4) {
+      word |= (uint64)(_mm256_movemask_pd(_mm256_cmp_pd(_mm256_loadu_pd(xs + i + j), thresholds, _CMP_GT_OQ)) &
+                       not_null_mask_4(x_nulls + i + j)) << j;
+    }
+    bits[i / 64] = word;
+  }
+
+  if (i < more_vals) mark_above_scalar(more_vals - i, xs + i, x_nulls + i, threshold, bits + i / 64);
+}
+
+/**
+ * not_null_mask_8 - Returns a bit for each of the eight nulls flags that is false.
+ */
+__attribute__((target("avx512f")))
+static inline __mmask8 not_null_mask_8(const bool *nulls) {
+  int64 flags;
+
+  memcpy(&flags, nulls, sizeof(flags));
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_cvtsi64_si128(flags), _mm_setzero_si128())) & 0xff;
+}
+
+__attribute__((target("avx512f")))
+static inline __mmask8 in_range_8(const float8 *xs, __m512d mins, __m512d widths, __m512d counts, int32 *positions) {
+  __m512d pos = _mm512_div_pd(_mm512_sub_pd(_mm512_loadu_pd(xs), mins), widths);
+  __mmask8 ok = _mm512_cmp_pd_mask(pos, _mm512_setzero_pd(), _CMP_GE_OQ) &
+                _mm512_cmp_pd_mask(pos, counts, _CMP_LT_OQ);
+
+  _mm256_storeu_si256((__m256i *)positions, _mm512_cvttpd_epi32(pos));
+  return ok;
+}
+
+__attribute__((target("avx512f")))
+static int find_positions_avx512(int more_vals, const float8 *xs, const bool *x_nulls, float8 x_min, float8 x_width, int x_count, int32 *positions) {
+  __m512d mins = _mm512_set1_pd(x_min);
+  __m512d widths = _mm512_set1_pd(x_width);
+  __m512d bucket_counts = _mm512_set1_pd(x_count);
+  int32 x_pos[8];
+  int i, found = 0;
+  unsigned int mask;
+
+  for (i = 0; i + 8 <= more_vals; i += 8) {
+    mask = in_range_8(xs + i, mins, widths, bucket_counts, x_pos) & not_null_mask_8(x_nulls + i);
+    while (mask) {
+      positions[found++] = x_pos[__builtin_ctz(mask)];
+      mask &= mask - 1;
+    }
+  }
+
+  return found + find_positions_scalar(more_vals - i, xs + i, x_nulls + i, x_min, x_width, x_count, positions + found);
+}
+
+__attribute__((target("avx512f")))
+static int find_positions_2d_avx512(int more_vals, const float8 *xs, const bool *x_nulls, float8 x_min, float8 x_width, int x_count, const float8 *ys, const bool *y_nulls, float8 y_min, float8 y_width, int y_count, int32 *positions) {
+  __m512d x_mins = _mm512_set1_pd(x_min), y_mins = _mm512_set1_pd(y_min);
+  __m512d x_widths = _mm512_set1_pd(x_width), y_widths = _mm512_set1_pd(y_width);
+  __m512d x_counts = _mm512_set1_pd(x_count), y_counts = _mm512_set1_pd(y_count);
+  int32 x_pos[8], y_pos[8];
+  int i, k, found = 0;
+  unsigned int mask;
+
+  for (i = 0; i + 8 <= more_vals; i += 8) {
+    mask = in_range_8(xs + i, x_mins, x_widths, x_counts, x_pos) &
+           in_range_8(ys + i, y_mins, y_widths, y_counts, y_pos) &
+           not_null_mask_8(x_nulls + i) & not_null_mask_8(y_nulls + i);
+    while (mask) {
+      k = __builtin_ctz(mask);
+      positions[found++] = x_pos[k] * y_count + y_pos[k];
+      mask &= mask - 1;
+    }
+  }
+
+  return found + find_positions_2d_scalar(more_vals - i, xs + i, x_nulls + i, x_min, x_width, x_count,
+                                                         ys + i, y_nulls + i, y_min, y_width, y_count, positions + found);
+}
+
+__attribute__((target("avx512f")))
+static int find_positions_nd_avx512(int more_vals, int ndims, const float8 *const *xs, const bool *const *x_nulls,
+                                    const float8 *x_mins, const float8 *x_widths, const int32 *x_counts, int32 *positions) {
+  __m512d mins[MAX_DIMENSIONS], widths[MAX_DIMENSIONS], bucket_counts[MAX_DIMENSIONS];
+  int32 x_pos[MAX_DIMENSIONS][8];
+  const float8 *tail_xs[MAX_DIMENSIONS];
+  const bool *tail_nulls[MAX_DIMENSIONS];
+  int i, k, d, position, found = 0;
+  unsigned int mask;
+
+  for (d = 0; d < ndims; d++) {
+    mins[d] = _mm512_set1_pd(x_mins[d]);
+    widths[d] = _mm512_set1_pd(x_widths[d]);
+    bucket_counts[d] = _mm512_set1_pd(x_counts[d]);
+  }
+
+  for (i = 0; i + 8 <= more_vals; i += 8) {
+    mask = 0xff;
+    for (d = 0; d < ndims; d++) {
+      mask &= in_range_8(xs[d] + i, mins[d], widths[d], bucket_counts[d], x_pos[d]) & not_null_mask_8(x_nulls[d] + i);
+    }
+    while (mask) {
+      k = __builtin_ctz(mask);
+      position = 0;
+      for (d = 0; d < ndims; d++) position = position * x_counts[d] + x_pos[d][k];
+      positions[found++] = position;
+      mask &= mask - 1;
+    }
+  }
+
+  for (d = 0; d < ndims; d++) {
+    tail_xs[d] = xs[d] + i;
+    tail_nulls[d] = x_nulls[d] + i;
+  }
+  return found + find_positions_nd_scalar(more_vals - i, ndims, tail_xs, tail_nulls, x_mins, x_widths, x_counts, positions + found);
+}
+
+__attribute__((target("avx512f")))
+static int find_indexed_positions_avx512(int more_vals, const float8 *xs, const bool *x_nulls, const bool *y_nulls, float8 x_min, float8 x_width, int x_count, int32 *positions, int32 *indexes) {
+  __m512d mins = _mm512_set1_pd(x_min);
+  __m512d widths = _mm512_set1_pd(x_width);
+  __m512d bucket_counts = _mm512_set1_pd(x_count);
+  int32 x_pos[8];
+  int i, k, found = 0, tail;
+  unsigned int mask;
+
+  for (i = 0; i + 8 <= more_vals; i += 8) {
+    mask = in_range_8(xs + i, mins, widths, bucket_counts, x_pos) &
+           not_null_mask_8(x_nulls + i) & not_null_mask_8(y_nulls + i);
+    while (mask) {
+      k = __builtin_ctz(mask);
+      positions[found] = x_pos[k];
+      indexes[found++] = i + k;
+      mask &= mask - 1;
+    }
+  }
+
+  tail = find_indexed_positions_scalar(more_vals - i, xs + i, x_nulls + i, y_nulls + i, x_min, x_width, x_count,
+                                       positions + found, indexes + found);
+  for (k = 0; k < tail; k++) indexes[found + k] += i;
+  return found + tail;
+}
+
+__attribute__((target("avx512f")))
+static int find_edges_positions_avx512(int more_vals, const float8 *xs, const bool *x_nulls, const bucket_edges *be, int32 *positions) {
+  __m512d lo = _mm512_set1_pd(be->edges[0]), hi = _mm512_set1_pd(be->edges[be->count]);
+  __m512i sign_bit = _mm512_set1_epi64(UINT64CONST(0x8000000000000000));
+  __m512i first_key = _mm512_set1_epi64(be->first_key);
+  __m512i one = _mm512_set1_epi64(1);
+  __m128i shift = _mm_cvtsi32_si128(be->shift);
+  __m512d x, next;
+  __m512i k, half, bits, cells;
+  __mmask8 ok;
+  int64 ks[8];
+  int i, j, len, found = 0;
+  unsigned int mask;
+
+  for (i = 0; i + 8 <= more_vals; i += 8) {
+    x = _mm512_loadu_pd(xs + i);
+    ok = _mm512_cmp_pd_mask(x, lo, _CMP_GE_OQ) & _mm512_cmp_pd_mask(x, hi, _CMP_LT_OQ);
+    mask = ok & not_null_mask_8(x_nulls + i);
+    if (!mask) continue;
+
+    if (be->index) {
+      x = _mm512_add_pd(_mm512_mask_blend_pd(ok, lo, x), _mm512_setzero_pd());
+      bits = _mm512_castpd_si512(x);
+      bits = _mm512_xor_si512(bits, _mm512_or_si512(_mm512_srai_epi64(bits, 63), sign_bit));
+      cells = _mm512_srl_epi64(_mm512_sub_epi64(bits, first_key), shift);
+      k = _mm512_cvtepi32_epi64(_mm512_i64gather_epi32(cells, be->index, 4));
+      next = _mm512_i64gather_pd(_mm512_add_epi64(k, one), be->edges, 8);
+      k = _mm512_mask_add_epi64(k, _mm512_cmp_pd_mask(next, x, _CMP_LE_OQ), k, one);
+    } else {
+      k = _mm512_setzero_si512();
+      for (len = be->count; len > 1; len -= len >> 1) {
+        half = _mm512_set1_epi64(len >> 1);
+        next = _mm512_i64gather_pd(_mm512_add_epi64(k, half), be->edges, 8);
+        k = _mm512_mask_add_epi64(k, _mm512_cmp_pd_mask(next, x, _CMP_LE_OQ), k, half);
+      }
+    }
+
+    _mm512_storeu_si512(ks, k);
+    while (mask) {
+      j = __builtin_ctz(mask);
+      positions[found++] = ks[j];
+      mask &= mask - 1;
+    }
+  }
+
+  return found + find_edges_positions_scalar(more_vals - i, xs + i, x_nulls + i, be, positions + found);
+}
+
+__attribute__((target("avx512f")))
+static void combine_avx512(combine_op op, int more_vals, const float8 *as, const float8 *bs, float8 b, float8 *out) {
+  __m512i sign_bit = _mm512_set1_epi64(UINT64CONST(0x8000000000000000));
+  __m512d x, y, r;
+  int i;
+
+  if (op == COMBINE_EXP || op == COMBINE_LN) {
+    combine_scalar(op, more_vals, as, bs, b, out);
+    return;
+  }
+
+  y = _mm512_set1_pd(b);
+  for (i = 0; i + 8 <= more_vals; i += 8) {
+    x = _mm512_loadu_pd(as + i);
+    if (bs) y = _mm512_loadu_pd(bs + i);
+    switch (op) {
+      case COMBINE_ADD:  r = _mm512_add_pd(x, y); break;
+      case COMBINE_SUB:  r = _mm512_sub_pd(x, y); break;
+      case COMBINE_MUL:  r = _mm512_mul_pd(x, y); break;
+      case COMBINE_DIV:  r = _mm512_div_pd(x, y); break;
+      case COMBINE_MIN:  r = _mm512_mask_mov_pd(_mm512_min_pd(x, y), _mm512_cmp_pd_mask(x, x, _CMP_UNORD_Q), x); break;
+      case COMBINE_MAX:  r = _mm512_mask_mov_pd(_mm512_max_pd(x, y), _mm512_cmp_pd_mask(x, x, _CMP_UNORD_Q), x); break;
+      case COMBINE_NEG:  r = _mm512_castsi512_pd(_mm512_xor_si512(_mm512_castpd_si512(x), sign_bit)); break;
+      case COMBINE_ABS:  r = _mm512_castsi512_pd(_mm512_andnot_si512(sign_bit, _mm512_castpd_si512(x))); break;
+      case COMBINE_SQRT: r = _mm512_sqrt_pd(x); break;
+      default:           r = x; break;
+    }
+    _mm512_storeu_pd(out + i, r);
+  }
+
+  combine_scalar(op, more_vals - i, as + i, bs ? bs + i : NULL, b, out + i);
+}
+
+__attribute__((target("avx512f")))
+static int find_matches_avx512(int more_vals, const float8 *xs, const bool *x_nulls, float8 lo, float8 hi, int32 *matches) {
+  __m512d los = _mm512_set1_pd(lo), his = _mm512_set1_pd(hi);
+  __m512d x;
+  int i, k, tail, found = 0;
+  unsigned int mask;
+
+  for (i = 0; i + 8 <= more_vals; i += 8) {
+    x = _mm512_loadu_pd(xs + i);
+    mask = _mm512_cmp_pd_mask(x, los, _CMP_GE_OQ) & _mm512_cmp_pd_mask(x, his, _CMP_LE_OQ) &
+           not_null_mask_8(x_nulls + i);
+    while (mask) {
+      matches[found++] = i + __builtin_ctz(mask);
+      mask &= mask - 1;
+    }
+  }
+
+  // The scalar version numbers the rest from 0:
+  tail = find_matches_scalar(more_vals - i, xs + i, x_nulls + i, lo, hi, matches + found);
+  for (k = found; k < found + tail; k++) matches[k] += i;
+  return found + tail;
+}
+
+__attribute__((target("avx512f")))
+static void mark_above_avx512(int more_vals, const float8 *xs, const bool *x_nulls, float8 threshold, uint64 *bits) {
+  __m512d thresholds = _mm512_set1_pd(threshold);
+  uint64 word;
+  int i, j;
+
+  for (i = 0; i + 64 <= more_vals; i += 64) {
+    word = 0;
+    for (j = 0; j < 64; j += 8) {
+      word |= (uint64)(_mm512_cmp_pd_mask(_mm512_loadu_pd(xs + i + j), thresholds, _CMP_GT_OQ) &
+                       not_null_mask_8(x_nulls + i + j)) << j;
+    }
+    bits[i / 64] = word;
+  }
+
+  if (i < more_vals) mark_above_scalar(more_vals - i, xs + i, x_nulls + i, threshold, bits + i / 64);
+}
+
+#endif
+
+static find_positions_fn find_positions = find_positions_scalar;
+static find_positions_2d_fn find_positions_2d = find_positions_2d_scalar;
+static find_positions_nd_fn find_positions_nd = find_positions_nd_scalar;
+static find_indexed_positions_fn find_indexed_positions = find_indexed_positions_scalar;
+static find_edges_positions_fn find_edges_positions = find_edges_positions_scalar;
+static combine_fn combine = combine_scalar;
+static find_matches_fn find_matches = find_matches_scalar;
+static mark_above_fn mark_above = mark_above_scalar;
+static const char *kernel_name = "scalar";
+static pthread_once_t kernels_chosen = PTHREAD_ONCE_INIT;
+
+static void choose_kernels(void) {
+#ifdef HAVE_X86_KERNELS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) {
+    find_positions = find_positions_avx512;
+    find_positions_2d = find_positions_2d_avx512;
+    find_positions_nd = find_positions_nd_avx512;
+    find_indexed_positions = find_indexed_positions_avx512;
+    find_edges_positions = find_edges_positions_avx512;
+    combine = combine_avx512;
+    find_matches = find_matches_avx512;
+    mark_above = mark_above_avx512;
+    kernel_name = "avx512";
+  } else if (__builtin_cpu_supports("avx2")) {
+    find_positions = find_positions_avx2;
+    find_positions_2d = find_positions_2d_avx2;
+    find_positions_nd = find_positions_nd_avx2;
+    find_indexed_positions = find_indexed_positions_avx2;
+    find_edges_positions = find_edges_positions_avx2;
+    combine = combine_avx2;
+    find_matches = find_matches_avx2;
+    mark_above = mark_above_avx2;
+    kernel_name = "avx2";
+  }
+#endif
+}
+
+/**
+ * replicated_copies - How many copies of `bucket_count` counts
+ * fit in REPLICATED_BYTES, up to COUNTER_COPIES.
+ */
+static int replicated_copies(size_t bucket_count) {
+  size_t copies = REPLICATED_BYTES / (bucket_count * sizeof(int64) + 1);
+
+  return copies < COUNTER_COPIES ? (int)copies : COUNTER_COPIES;
+}
+
+/**
+ * hist_counter_init - Prepares to count into `counts`,
+ * which has `bucket_count` buckets.
+ *
+ * Small histograms get up to COUNTER_COPIES private copies of the counts
+ * (fewer the more buckets there are, so they still fit in L2),
+ * and when the positions are skewed we rotate through them,
+ * so that a run of values in the same bucket
+ * doesn't make every increment wait on the one before it.
+ * Histograms too big for the cache get a scratch array
+ * so we can sort each block's positions by tile before counting them.
+ *
+ * Returns 0 on success or -1 if we ran out of memory.
+ * Either way call hist_counter_finish afterwards.
+ */
+int hist_counter_init(hist_counter *hc, int64 *counts, size_t bucket_count) {
+  count_strategy strategy;
+
+  if (replicated_copies(bucket_count) >= 2) {
+    strategy = COUNT_REPLICATED;
+  } else if (bucket_count >= MIN_BLOCKED_BUCKETS) {
+    strategy = COUNT_BLOCKED;
+  } else {
+    strategy = COUNT_DIRECT;
+  }
+
+  return hist_counter_init_with_strategy(hc, counts, bucket_count, strategy);
+}
+
+/**
+ * hist_counter_init_with_strategy - Like hist_counter_init,
+ * but you choose the strategy (e.g. to benchmark them).
+ */
+int hist_counter_init_with_strategy(hist_counter *hc, int64 *counts, size_t bucket_count, count_strategy strategy) {
+  pthread_once(&kernels_chosen, choose_kernels);
+
+  memset(hc, 0, sizeof(hist_counter));
+  hc->counts = counts;
+  hc->bucket_count = bucket_count;
+  hc->strategy = strategy;
+
+  if (strategy == COUNT_REPLICATED) {
+    // Benchmarks may ask for copies even when they don't fit:
+    hc->copies = replicated_copies(bucket_count);
+    if (hc->copies < 2) hc->copies = 2;
+    hc->replicas = calloc(hc->copies * bucket_count, sizeof(int64));
+    if (!hc->replicas) return -1;
+  } else if (strategy == COUNT_BLOCKED) {
+    hc->tile_count = (bucket_count >> TILE_BITS) + 1;
+    hc->tile_starts = malloc((hc->tile_count + 1) * sizeof(size_t));
+    if (!hc->tile_starts) return -1;
+  }
+
+  return 0;
+}
+
+/**
+ * hist_counter_finish - Folds any private copies back into the caller's counts
+ * and frees our scratch space.
+ */
+void hist_counter_finish(hist_counter *hc) {
+  size_t i;
+  int c;
+
+  if (hc->replicas) {
+    for (c = 0; c < hc->copies; c++) {
+      for (i = 0; i < hc->bucket_count; i++) {
+        hc->counts[i] += hc->replicas[c * hc->bucket_count + i];
+      }
+    }
+  }
+
+  free(hc->replicas);
+  free(hc->positions);
+  free(hc->partitioned);
+  free(hc->tile_starts);
+  memset(hc, 0, sizeof(hist_counter));
+}
+
+/**
+ * hist_counter_init_sparse - Prepares to count into `sparse` instead of a dense array.
+ *
+ * Returns 0 on success or -1 if we ran out of memory.
+ * Either way call hist_counter_finish afterwards.
+ */
+int hist_counter_init_sparse(hist_counter *hc, sparse_counts *sparse) {
+  pthread_once(&kernels_chosen, choose_kernels);
+
+  memset(hc, 0, sizeof(hist_counter));
+  hc->sparse = sparse;
+  hc->strategy = COUNT_SPARSE;
+  return 0;
+}
+
+/**
+ * sparse_slot - Returns where `bucket` is in `entries`, or the free slot where it should go.
+ *
+ * We scramble the bucket with Fibonacci hashing (keeping the top bits),
+ * because the buckets of a 2d histogram's column are a multiple of y_count apart,
+ * and those would all land in a few slots if we just masked them.
+ */
+static inline size_t sparse_slot(const sparse_entry *entries, size_t capacity, int32 bucket) {
+  int shift = 64 - __builtin_ctzll(capacity);
+  size_t i = (size_t)(((uint64)(uint32)bucket * UINT64CONST(0x9E3779B97F4A7C15)) >> shift);
+
+  while (entries[i].bucket != bucket && entries[i].bucket != SPARSE_EMPTY) i = (i + 1) & (capacity - 1);
+  return i;
+}
+
+static sparse_entry *sparse_entries(size_t capacity) {
+  sparse_entry *entries = malloc(capacity * sizeof(sparse_entry));
+  size_t i;
+
+  if (!entries) return NULL;
+  for (i = 0; i < capacity; i++) entries[i].bucket = SPARSE_EMPTY;
+  return entries;
+}
+
+/**
+ * sparse_counts_init - Starts an empty table with room for about `expected` buckets.
+ *
+ * Returns 0 on success or -1 if we ran out of memory.
+ * Either way call sparse_counts_finish afterwards.
+ */
+int sparse_counts_init(sparse_counts *sc, size_t expected) {
+  memset(sc, 0, sizeof(sparse_counts));
+  sc->capacity = MIN_SPARSE_CAPACITY;
+  while (sc->capacity < 2 * expected) sc->capacity *= 2;
+  sc->entries = sparse_entries(sc->capacity);
+  return sc->entries ? 0 : -1;
+}
+
+void sparse_counts_finish(sparse_counts *sc) {
+  free(sc->entries);
+  memset(sc, 0, sizeof(sparse_counts));
+}
+
+/**
+ * sparse_counts_grow - Doubles the table and rehashes everything into it.
+ */
+static int sparse_counts_grow(sparse_counts *sc) {
+  size_t capacity = sc->capacity * 2;
+  sparse_entry *entries = sparse_entries(capacity);
+  size_t i;
+
+  if (!entries) return -1;
+  for (i = 0; i < sc->capacity; i++) {
+    if (sc->entries[i].bucket == SPARSE_EMPTY) continue;
+    entries[sparse_slot(entries, capacity, sc->entries[i].bucket)] = sc->entries[i];
+  }
+  free(sc->entries);
+  sc->entries = entries;
+  sc->capacity = capacity;
+  return 0;
+}
+
+/**
+ * sparse_counts_add - Adds `count` to `bucket`.
+ *
+ * Returns 0 on success or -1 if we ran out of memory.
+ */
+int sparse_counts_add(sparse_counts *sc, int32 bucket, int64 count) {
+  size_t i = sparse_slot(sc->entries, sc->capacity, bucket);
+
+  if (sc->entries[i].bucket == SPARSE_EMPTY) {
+    if ((sc->used + 1) * 2 > sc->capacity) {
+      if (sparse_counts_grow(sc)) return -1;
+      i = sparse_slot(sc->entries, sc->capacity, bucket);
+    }
+    sc->entries[i].bucket = bucket;
+    sc->entries[i].count = 0;
+    sc->used++;
+  }
+  sc->entries[i].count += count;
+  return 0;
+}
+
+/**
+ * sparse_counts_merge - Adds all of `from`'s counts to `into`.
+ *
+ * Returns 0 on success or -1 if we ran out of memory.
+ */
+int sparse_counts_merge(sparse_counts *into, const sparse_counts *from) {
+  size_t i;
+
+  for (i = 0; i < from->capacity; i++) {
+    if (from->entries[i].bucket == SPARSE_EMPTY) continue;
+    if (sparse_counts_add(into, from->entries[i].bucket, from->entries[i].count)) return -1;
+  }
+  return 0;
+}
+
+static int compare_sparse_entries(const void *a, const void *b) {
+  int32 x = ((const sparse_entry *)a)->bucket, y = ((const sparse_entry *)b)->bucket;
+
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * sparse_counts_sort - Moves the buckets to the front of `entries`, in order.
+ * You can't add to the table after this.
+ */
+void sparse_counts_sort(sparse_counts *sc) {
+  size_t i, n = 0;
+
+  for (i = 0; i < sc->capacity; i++) {
+    if (sc->entries[i].bucket != SPARSE_EMPTY) sc->entries[n++] = sc->entries[i];
+  }
+  qsort(sc->entries, n, sizeof(sparse_entry), compare_sparse_entries);
+}
+
+/**
+ * reserve_positions - Makes sure we have room for `n` positions (and as many partitioned ones).
+ */
+static int reserve_positions(hist_counter *hc, size_t n) {
+  int32 *positions, *partitioned;
+
+  if (n <= hc->positions_capacity) return 0;
+
+  positions = realloc(hc->positions, n * sizeof(int32));
+  if (!positions) return -1;
+  hc->positions = positions;
+
+  if (hc->strategy == COUNT_BLOCKED) {
+    partitioned = realloc(hc->partitioned, n * sizeof(int32));
+    if (!partitioned) return -1;
+    hc->partitioned = partitioned;
+  }
+
+  hc->positions_capacity = n;
+  return 0;
+}
+
+/**
+ * add_blocked - Counts `found` positions into a histogram that is too big for the cache.
+ *
+ * We do a counting sort of the positions by tile (2^TILE_BITS buckets),
+ * so that the increments walk through the counts one cache-sized tile at a time
+ * instead of missing the cache on nearly every value.
+ */
+static void add_blocked(hist_counter *hc, const int32 *positions, int found) {
+  size_t *starts = hc->tile_starts;
+  int32 *partitioned = hc->partitioned;
+  int64 *counts = hc->counts;
+  size_t t, next, total = 0;
+  int i;
+
+  memset(starts, 0, (hc->tile_count + 1) * sizeof(size_t));
+  for (i = 0; i < found; i++) starts[positions[i] >> TILE_BITS] += 1;
+  for (t = 0; t < hc->tile_count; t++) {
+    next = total + starts[t];
+    starts[t] = total;
+    total = next;
+  }
+  for (i = 0; i < found; i++) partitioned[starts[positions[i] >> TILE_BITS]++] = positions[i];
+  for (i = 0; i < found; i++) counts[partitioned[i]] += 1;
+}
+
+/**
+ * add_sparse - Counts `found` positions into a sparse histogram.
+ *
+ * A run of positions in the same bucket (common when the values change slowly)
+ * costs just one lookup.
+ */
+static int add_sparse(hist_counter *hc, const int32 *positions, int found) {
+  int i, j;
+
+  for (i = 0; i < found; i = j) {
+    for (j = i + 1; j < found && positions[j] == positions[i]; j++);
+    if (sparse_counts_add(hc->sparse, positions[i], j - i)) return -1;
+  }
+  return 0;
+}
+
+/**
+ * positions_skewed - Whether enough of the first positions
+ * repeat the one before them that rotating through copies will pay.
+ */
+static bool positions_skewed(const int32 *positions, int found) {
+  int sample = found < SKEW_SAMPLE ? found : SKEW_SAMPLE;
+  int repeats = 0;
+  int i;
+
+  for (i = 1; i < sample; i++) repeats += positions[i] == positions[i - 1];
+  return repeats * SKEW_FRACTION >= sample;
+}
+
+/**
+ * add_replicated - Counts `found` positions
+ * by rotating through `hc`'s copies if they look skewed,
+ * or straight into its counts if they don't.
+ */
+static void add_replicated(hist_counter *hc, const int32 *positions, int found) {
+  int64 *copies[COUNTER_COPIES];
+  int i, c;
+
+  if (!positions_skewed(positions, found)) {
+    for (i = 0; i < found; i++) hc->counts[positions[i]] += 1;
+    return;
+  }
+
+  for (c = 0; c < hc->copies; c++) copies[c] = hc->replicas + c * hc->bucket_count;
+  for (i = 0; i + hc->copies <= found; i += hc->copies) {
+    for (c = 0; c < hc->copies; c++) copies[c][positions[i + c]] += 1;
+  }
+  for (; i < found; i++) copies[0][positions[i]] += 1;
+}
+
+/**
+ * add_positions - Counts `found` positions the way `hc` wants.
+ *
+ * Returns 0 on success or -1 if we ran out of memory.
+ */
+static int add_positions(hist_counter *hc, const int32 *positions, int found) {
+  int64 *counts = hc->counts;
+  int i;
+
+  switch (hc->strategy) {
+    case COUNT_REPLICATED:
+      add_replicated(hc, positions, found);
+      break;
+    case COUNT_BLOCKED:
+      add_blocked(hc, positions, found);
+      break;
+    case COUNT_SPARSE:
+      return add_sparse(hc, positions, found);
+    default:
+      for (i = 0; i < found; i++) counts[positions[i]] += 1;
+      break;
+  }
+  return 0;
+}
+
+/**
+ * count_vals - Adds the non-null values that fall within the histogram to its counts.
+ *
+ * Returns 0 on success or -1 if we ran out of memory.
+ */
+int count_vals(hist_counter *hc, int more_vals, float8 *xs, bool *x_nulls, float8 x_min, float8 x_width, int x_count) {
+  // Blocked counting wants the whole block at once, so it can partition it:
+  int chunk = hc->strategy == COUNT_BLOCKED ? more_vals : POSITIONS_CHUNK;
+  int i, n, found;
+
+  if (reserve_positions(hc, Min(chunk, more_vals))) return -1;
+
+  for (i = 0; i < more_vals; i += n) {
+    n = Min(chunk, more_vals - i);
+    found = find_positions(n, xs + i, x_nulls + i, x_min, x_width, x_count, hc->positions);
+    if (add_positions(hc, hc->positions, found)) return -1;
+  }
+  return 0;
+}
+
+int count_vals_2d(hist_counter *hc, int more_vals, float8 *xs, bool *x_nulls, float8 x_min, float8 x_width, int x_count,
+                  float8 *ys, bool *y_nulls, float8 y_min, float8 y_width, int y_count) {
+  int chunk = hc->strategy == COUNT_BLOCKED ? more_vals : POSITIONS_CHUNK;
+  int i, n, found;
+
+  if (reserve_positions(hc, Min(chunk, more_vals))) return -1;
+
+  for (i = 0; i < more_vals; i += n) {
+    n = Min(chunk, more_vals - i);
+    found = find_positions_2d(n, xs + i, x_nulls + i, x_min, x_width, x_count,
+                                 ys + i, y_nulls + i, y_min, y_width, y_count, hc->positions);
+    if (add_positions(hc, hc->positions, found)) return -1;
+  }
+  return 0;
+}
+
+/**
+ * count_vals_nd - Like count_vals_2d, but for `ndims` floatfiles read side by side.
+ *
+ * One and two dimensions go through count_vals and count_vals_2d,
+ * whose kernels don't have to loop over the dimensions.
+ */
+int count_vals_nd(hist_counter *hc, int more_vals, int ndims, float8 *const *xs, bool *const *x_nulls,
+                  const float8 *x_mins, const float8 *x_widths, const int32 *x_counts) {
+  int chunk = hc->strategy == COUNT_BLOCKED ? more_vals : POSITIONS_CHUNK;
+  const float8 *chunk_xs[MAX_DIMENSIONS];
+  const bool *chunk_nulls[MAX_DIMENSIONS];
+  int i, d, n, found;
+
+  if (ndims == 1) return count_vals(hc, more_vals, xs[0], x_nulls[0], x_mins[0], x_widths[0], x_counts[0]);
+  if (ndims == 2) return count_vals_2d(hc, more_vals, xs[0], x_nulls[0], x_mins[0], x_widths[0], x_counts[0],
+                                                      xs[1], x_nulls[1], x_mins[1], x_widths[1], x_counts[1]);
+
+  if (reserve_positions(hc, Min(chunk, more_vals))) return -1;
+
+  for (i = 0; i < more_vals; i += n) {
+    n = Min(chunk, more_vals - i);
+    for (d = 0; d < ndims; d++) {
+      chunk_xs[d] = xs[d] + i;
+      chunk_nulls[d] = x_nulls[d] + i;
+    }
+    found = find_positions_nd(n, ndims, chunk_xs, chunk_nulls, x_mins, x_widths, x_counts, hc->positions);
+    if (add_positions(hc, hc->positions, found)) return -1;
+  }
+  return 0;
+}
+
+// An edges index can have this many entries per bucket (or MIN_INDEX_CELLS, if that's more)
+// before we'd rather binary search:
+#define INDEX_CELLS_PER_BUCKET 8
+#define MIN_INDEX_CELLS 4096
+
+/**
+ * bucket_edges_init - Prepares to count into the buckets between `edges`.
+ *
+ * The index splits the keys (see edge_key) from the first edge to the last
+ * into runs of 2^`shift`, no longer than the shortest bucket,
+ * so each run crosses at most one edge,
+ * and records the bucket where each run starts.
+ * Log-scale edges are about evenly spaced in keys, so they get a small index.
+ * If the index would be too big (or we can't allocate it) we binary search instead.
+ */
+void bucket_edges_init(bucket_edges *be, const float8 *edges, int32 count) {
+  uint64 gap, min_gap = ~UINT64CONST(0), cells, c, start;
+  int k;
+
+  memset(be, 0, sizeof(bucket_edges));
+  be->edges = edges;
+  be->count = count;
+  if (count < 1) return;
+
+  be->first_key = edge_key(edges[0]);
+  for (k = 0; k < count; k++) {
+    gap = edge_key(edges[k + 1]) - edge_key(edges[k]);
+    if (gap < min_gap) min_gap = gap;
+  }
+  if (min_gap == 0) return;   // they aren't increasing, but let's not crash
+  be->shift = 63 - __builtin_clzll(min_gap);
+  cells = ((edge_key(edges[count]) - be->first_key) >> be->shift) + 1;
+  if (cells > Max(MIN_INDEX_CELLS, (uint64)INDEX_CELLS_PER_BUCKET * count)) return;
+
+  be->index = malloc(cells * sizeof(int32));
+  if (!be->index) return;
+  k = 0;
+  for (c = 0; c < cells; c++) {
+    start = be->first_key + (c << be->shift);
+    while (k + 1 < count && edge_key(edges[k + 1]) <= start) k++;
+    be->index[c] = k;
+  }
+}
+
+void bucket_edges_finish(bucket_edges *be) {
+  free(be->index);
+  memset(be, 0, sizeof(bucket_edges));
+}
+
+/**
+ * bucket_edges_find - Returns the bucket of `x`, or -1 if it's outside the edges (or NaN).
+ */
+int bucket_edges_find(const bucket_edges *be, float8 x) {
+  if (!(x >= be->edges[0] && x < be->edges[be->count])) return -1;
+  return edges_position(be, x);
+}
+
+/**
+ * count_vals_edges - Like count_vals, but for buckets with arbitrary edges.
+ */
+int count_vals_edges(hist_counter *hc, int more_vals, float8 *xs, bool *x_nulls, const bucket_edges *be) {
+  int chunk = hc->strategy == COUNT_BLOCKED ? more_vals : POSITIONS_CHUNK;
+  int i, n, found;
+
+  if (reserve_positions(hc, Min(chunk, more_vals))) return -1;
+
+  for (i = 0; i < more_vals; i += n) {
+    n = Min(chunk, more_vals - i);
+    found = find_edges_positions(n, xs + i, x_nulls + i, be, hc->positions);
+    if (add_positions(hc, hc->positions, found)) return -1;
+  }
+  return 0;
+}
+
+/**
+ * stats_init - Starts with no values.
+ */
+void stats_init(float_stats *stats) {
+  memset(stats, 0, sizeof(float_stats));
+  stats->min = INFINITY;
+  stats->max = -INFINITY;
+}
+
+// How many independent accumulators stats_vals keeps,
+// so the compiler can put them in one vector register:
+#define STATS_LANES 4
+
+/**
+ * stats_vals - Adds the non-null values in one block to `stats`.
+ *
+ * We make two passes over the block while it is still in cache:
+ * first the count, sum, min, and max, then the squared deviations from the block's mean.
+ * Then we merge the block into `stats` (see stats_merge).
+ * Nulls are masked out rather than skipped so that the loops have no branches.
+ */
+void stats_vals(int more_vals, const float8 *xs, const bool *x_nulls, float_stats *stats) {
+  int64 counts[STATS_LANES] = {0};
+  float8 sums[STATS_LANES] = {0}, m2s[STATS_LANES] = {0};
+  float8 mins[STATS_LANES], maxs[STATS_LANES];
+  float_stats block;
+  float8 x, d;
+  bool ok;
+  int i, k, lanes;
+
+  for (k = 0; k < STATS_LANES; k++) {
+    mins[k] = INFINITY;
+    maxs[k] = -INFINITY;
+  }
+
+  // The last partial group of lanes goes through the same loop body, one lane at a time:
+  for (i = 0; i < more_vals; i += STATS_LANES) {
+    lanes = Min(STATS_LANES, more_vals - i);
+    for (k = 0; k < lanes; k++) {
+      ok = !x_nulls[i + k];
+      x = ok ? xs[i + k] : 0;
+      counts[k] += ok;
+      sums[k] += x;
+      mins[k] = ok && x < mins[k] ? x : mins[k];
+      maxs[k] = ok && x > maxs[k] ? x : maxs[k];
+    }
+  }
+
+  stats_init(&block);
+  for (k = 0; k < STATS_LANES; k++) {
+    block.count += counts[k];
+    block.sum += sums[k];
+    block.min = Min(block.min, mins[k]);
+    block.max = Max(block.max, maxs[k]);
+  }
+  if (block.count == 0) return;
+  block.mean = block.sum / block.count;
+
+  for (i = 0; i < more_vals; i += STATS_LANES) {
+    lanes = Min(STATS_LANES, more_vals - i);
+    for (k = 0; k < lanes; k++) {
+      d = x_nulls[i + k] ? 0 : xs[i + k] - block.mean;
+      m2s[k] += d * d;
+    }
+  }
+  for (k = 0; k < STATS_LANES; k++) block.m2 += m2s[k];
+
+  stats_merge(stats, &block);
+}
+
+/**
+ * stats_merge - Adds `from`'s values to `into`,
+ * using Chan et al.'s formula to combine the means and squared deviations.
+ */
+void stats_merge(float_stats *into, const float_stats *from) {
+  int64 count = into->count + from->count;
+  float8 delta;
+
+  if (from->count == 0) return;
+  if (into->count == 0) {
+    *into = *from;
+    return;
+  }
+
+  delta = from->mean - into->mean;
+  into->mean += delta * from->count / count;
+  into->m2 += from->m2 + delta * delta * ((float8)into->count * from->count / count);
+  into->sum += from->sum;
+  into->min = Min(into->min, from->min);
+  into->max = Max(into->max, from->max);
+  into->count = count;
+}
+
+/**
+ * pair_stats_init - Starts with no pairs.
+ */
+void pair_stats_init(pair_stats *stats) {
+  memset(stats, 0, sizeof(pair_stats));
+}
+
+/**
+ * pair_stats_vals - Adds the pairs in one block where neither value is null to `stats`.
+ *
+ * Like stats_vals we make two passes over the block while it is still in cache,
+ * first for the means and then for the deviations from them,
+ * with STATS_LANES accumulators and nulls masked out so the loops have no branches.
+ */
+void pair_stats_vals(int more_vals, const float8 *xs, const bool *x_nulls, const float8 *ys, const bool *y_nulls,
+                     pair_stats *stats) {
+  int64 counts[STATS_LANES] = {0};
+  float8 x_sums[STATS_LANES] = {0}, y_sums[STATS_LANES] = {0};
+  float8 x_m2s[STATS_LANES] = {0}, y_m2s[STATS_LANES] = {0}, cs[STATS_LANES] = {0};
+  float8 x_sum = 0, y_sum = 0, dx, dy;
+  pair_stats block;
+  bool ok;
+  int i, k, lanes;
+
+  for (i = 0; i < more_vals; i += STATS_LANES) {
+    lanes = Min(STATS_LANES, more_vals - i);
+    for (k = 0; k < lanes; k++) {
+      ok = !x_nulls[i + k] & !y_nulls[i + k];
+      counts[k] += ok;
+      x_sums[k] += ok ? xs[i + k] : 0;
+      y_sums[k] += ok ? ys[i + k] : 0;
+    }
+  }
+
+  pair_stats_init(&block);
+  for (k = 0; k < STATS_LANES; k++) {
+    block.count += counts[k];
+    x_sum += x_sums[k];
+    y_sum += y_sums[k];
+  }
+  if (block.count == 0) return;
+  block.mean_x = x_sum / block.count;
+  block.mean_y = y_sum / block.count;
+
+  for (i = 0; i < more_vals; i += STATS_LANES) {
+    lanes = Min(STATS_LANES, more_vals - i);
+    for (k = 0; k < lanes; k++) {
+      ok = !x_nulls[i + k] & !y_nulls[i + k];
+      dx = ok ? xs[i + k] - block.mean_x : 0;
+      dy = ok ? ys[i + k] - block.mean_y : 0;
+      x_m2s[k] += dx * dx;
+      y_m2s[k] += dy * dy;
+      cs[k] += dx * dy;
+    }
+  }
+  for (k = 0; k < STATS_LANES; k++) {
+    block.m2_x += x_m2s[k];
+    block.m2_y += y_m2s[k];
+    block.c_xy += cs[k];
+  }
+
+  pair_stats_merge(stats, &block);
+}
+
+/**
+ * pair_stats_merge - Adds `from`'s pairs to `into`, like stats_merge.
+ */
+void pair_stats_merge(pair_stats *into, const pair_stats *from) {
+  int64 count = into->count + from->count;
+  float8 dx, dy, weight;
+
+  if (from->count == 0) return;
+  if (into->count == 0) {
+    *into = *from;
+    return;
+  }
+
+  dx = from->mean_x - into->mean_x;
+  dy = from->mean_y - into->mean_y;
+  weight = (float8)into->count * from->count / count;
+  into->mean_x += dx * from->count / count;
+  into->mean_y += dy * from->count / count;
+  into->m2_x += from->m2_x + dx * dx * weight;
+  into->m2_y += from->m2_y + dy * dy * weight;
+  into->c_xy += from->c_xy + dx * dy * weight;
+  into->count = count;
+}
+
+/**
+ * bucket_stats_counter_init - Prepares to add values to the stats in `buckets`,
+ * which has `bucket_count` buckets.
+ *
+ * Returns 0 on success or -1 if we ran out of memory.
+ * Either way call bucket_stats_counter_finish afterwards.
+ */
+int bucket_stats_counter_init(bucket_stats_counter *bc, float_stats *buckets, size_t bucket_count) {
+  size_t i;
+
+  memset(bc, 0, sizeof(bucket_stats_counter));
+  bc->buckets = buckets;
+  bc->bucket_count = bucket_count;
+  bc->block = malloc(Max(bucket_count, 1) * sizeof(float_stats));
+  bc->positions = malloc(POSITIONS_CHUNK * sizeof(int32));
+  bc->indexes = malloc(POSITIONS_CHUNK * sizeof(int32));
+  bc->touched = malloc(POSITIONS_CHUNK * sizeof(int32));
+  if (!bc->block || !bc->positions || !bc->indexes || !bc->touched) return -1;
+  for (i = 0; i < bucket_count; i++) stats_init(&bc->block[i]);
+  return 0;
+}
+
+void bucket_stats_counter_finish(bucket_stats_counter *bc) {
+  free(bc->block);
+  free(bc->positions);
+  free(bc->indexes);
+  free(bc->touched);
+  memset(bc, 0, sizeof(bucket_stats_counter));
+}
+
+/**
+ * bucket_stats_vals - Adds each non-null y to the stats of its x's bucket,
+ * skipping the pairs where x is null or outside the buckets.
+ *
+ * Like stats_vals we work on a chunk at a time while it is in cache:
+ * find the pairs' buckets (this is the part with SIMD versions),
+ * add up each bucket's count, sum, min, and max for the chunk,
+ * then its squared deviations from the chunk's mean,
+ * and merge just the buckets we touched into the totals.
+ */
+void bucket_stats_vals(bucket_stats_counter *bc, int more_vals, const float8 *xs, const bool *x_nulls,
+                       float8 x_min, float8 x_width, int x_count, const float8 *ys, const bool *y_nulls) {
+  int32 *positions = bc->positions, *indexes = bc->indexes, *touched = bc->touched;
+  float_stats *block = bc->block, *s;
+  int i, j, n, found, ntouched;
+  float8 y, d;
+
+  pthread_once(&kernels_chosen, choose_kernels);
+
+  for (i = 0; i < more_vals; i += n) {
+    n = Min(POSITIONS_CHUNK, more_vals - i);
+    found = find_indexed_positions(n, xs + i, x_nulls + i, y_nulls + i, x_min, x_width, x_count, positions, indexes);
+
+    ntouched = 0;
+    for (j = 0; j < found; j++) {
+      s = &block[positions[j]];
+      y = ys[i + indexes[j]];
+      if (s->count++ == 0) touched[ntouched++] = positions[j];
+      s->sum += y;
+      s->min = y < s->min ? y : s->min;
+      s->max = y > s->max ? y : s->max;
+    }
+    for (j = 0; j < ntouched; j++) {
+      s = &block[touched[j]];
+      s->mean = s->sum / s->count;
+    }
+    for (j = 0; j < found; j++) {
+      s = &block[positions[j]];
+      d = ys[i + indexes[j]] - s->mean;
+      s->m2 += d * d;
+    }
+    for (j = 0; j < ntouched; j++) {
+      stats_merge(&bc->buckets[touched[j]], &block[touched[j]]);
+      stats_init(&block[touched[j]]);
+    }
+  }
+}
+
+/**
+ * combine_vals - Sets each `out[i]` to `as[i]` `op` `bs[i]` (or `b` if `bs` is NULL),
+ * or just `op` `as[i]` if `op` is unary.
+ *
+ * `out_nulls[i]` is true wherever either input is NULL (`b_nulls` can be NULL too),
+ * and then `out[i]` is whatever the op made of the values beneath the NULLs.
+ * Otherwise the IEEE rules apply, so dividing by 0 gives an infinity or NaN instead of an error.
+ */
+void combine_vals(combine_op op, int more_vals, const float8 *as, const bool *a_nulls,
+                  const float8 *bs, const bool *b_nulls, float8 b, float8 *out, bool *out_nulls) {
+  uint64 a_word, b_word;
+  int i;
+
+  pthread_once(&kernels_chosen, choose_kernels);
+
+  combine(op, more_vals, as, bs, b, out);
+
+  if (!b_nulls || COMBINE_UNARY(op)) {
+    memcpy(out_nulls, a_nulls, more_vals * sizeof(bool));
+    return;
+  }
+  // bools are bytes of 0 or 1, so we can OR eight at a time:
+  for (i = 0; i + 8 <= more_vals; i += 8) {
+    memcpy(&a_word, a_nulls + i, 8);
+    memcpy(&b_word, b_nulls + i, 8);
+    a_word |= b_word;
+    memcpy(out_nulls + i, &a_word, 8);
+  }
+  for (; i < more_vals; i++) out_nulls[i] = a_nulls[i] | b_nulls[i];
+}
+
+/**
+ * find_matching_vals - Writes the index of each non-null value from `lo` to `hi` (inclusive)
+ * to `matches` (which needs room for `more_vals`), in order, and returns how many there were.
+ *
+ * NaNs never match, since every comparison with them is false.
+ */
+int find_matching_vals(int more_vals, const float8 *xs, const bool *x_nulls, float8 lo, float8 hi, int32 *matches) {
+  pthread_once(&kernels_chosen, choose_kernels);
+
+  return find_matches(more_vals, xs, x_nulls, lo, hi, matches);
+}
+
+/**
+ * mark_vals_above - Sets bit `i % 64` of `bits[i / 64]` (which needs room for `more_vals` bits)
+ * for each non-null value above `threshold`, and clears the others.
+ *
+ * NaNs are never above, since every comparison with them is false.
+ */
+void mark_vals_above(int more_vals, const float8 *xs, const bool *x_nulls, float8 threshold, uint64 *bits) {
+  pthread_once(&kernels_chosen, choose_kernels);
+
+  mark_above(more_vals, xs, x_nulls, threshold, bits);
+}
+
+/**
+ * count_vals_kernel_name - Tells which version of the kernels we're using.
+ */
+const char *count_vals_kernel_name(void) {
+  pthread_once(&kernels_chosen, choose_kernels);
+  return kernel_name;
+}
+
+/**
+ * rolling_window_init - Prepares to compute `func` over windows of `window` values.
+ * ROLLING_DIFF always uses a window of 2.
+ *
+ * Returns 0 on success or -1 if we ran out of memory.
+ * Either way call rolling_window_finish afterwards.
+ */
+int rolling_window_init(rolling_window *rw, rolling_func func, int window) {
+  memset(rw, 0, sizeof(rolling_window));
+  rw->func = func;
+  rw->window = func == ROLLING_DIFF ? 2 : window;
+  rw->vals = malloc(rw->window * sizeof(float8));
+  rw->nulls = malloc(rw->window * sizeof(bool));
+  if (!rw->vals || !rw->nulls) return -1;
+  if (func == ROLLING_MIN || func == ROLLING_MAX) {
+    rw->deque = malloc(rw->window * sizeof(int64));
+    if (!rw->deque) return -1;
+  }
+  return 0;
+}
+
+void rolling_window_finish(rolling_window *rw) {
+  free(rw->vals);
+  free(rw->nulls);
+  free(rw->deque);
+  memset(rw, 0, sizeof(rolling_window));
+}
+
+/**
+ * rolling_add - Adds (or if `sign` is -1, removes) `x` from the window's sum and squared deviations.
+ *
+ * We keep NaNs and infinities out of them, and just count them,
+ * so that one can leave the window again without spoiling the sum.
+ */
+static inline void rolling_add(rolling_window *rw, float8 x, int sign) {
+  float8 old_mean, new_mean;
+
+  if (isnan(x)) {
+    rw->nans += sign;
+  } else if (isinf(x)) {
+    if (x > 0) rw->pos_infs += sign;
+    else rw->neg_infs += sign;
+  } else {
+    old_mean = rw->count ? rw->sum / rw->count : 0;
+    rw->count += sign;
+    rw->sum += sign * x;
+    new_mean = rw->count ? rw->sum / rw->count : 0;
+    // Welford's update, run backwards when removing:
+    rw->m2 += sign * (x - old_mean) * (x - new_mean);
+  }
+}
+
+/**
+ * rolling_recompute - Sets the window's sum and squared deviations from scratch.
+ *
+ * Adding and removing values lets rounding errors pile up,
+ * so we start over once every `window` values, which still costs O(1) per value.
+ */
+static void rolling_recompute(rolling_window *rw) {
+  int64 count = 0;
+  float8 sum = 0, mean, d, m2 = 0;
+  int i, n = Min(rw->seen, rw->window);
+
+  for (i = 0; i < n; i++) {
+    if (!rw->nulls[i] && isfinite(rw->vals[i])) {
+      count++;
+      sum += rw->vals[i];
+    }
+  }
+  mean = count ? sum / count : 0;
+  for (i = 0; i < n; i++) {
+    if (!rw->nulls[i] && isfinite(rw->vals[i])) {
+      d = rw->vals[i] - mean;
+      m2 += d * d;
+    }
+  }
+  rw->count = count;
+  rw->sum = sum;
+  rw->m2 = m2;
+}
+
+/**
+ * rolling_result - Sets `*out` to `func` of the window, or returns true if it's NULL.
+ *
+ * Like floatfile_stats, a NaN makes the sum, mean, and stddev NaN, but min and max skip it.
+ * A window with no values (or for stddev, fewer than two) is NULL.
+ */
+static bool rolling_result(rolling_window *rw, float8 *out) {
+  int64 n = rw->count + rw->nans + rw->pos_infs + rw->neg_infs;
+  int64 head;
+
+  switch (rw->func) {
+    case ROLLING_SUM:
+    case ROLLING_MEAN:
+      if (n == 0) return true;
+      if (rw->nans || (rw->pos_infs && rw->neg_infs)) *out = NAN;
+      else if (rw->pos_infs) *out = INFINITY;
+      else if (rw->neg_infs) *out = -INFINITY;
+      else *out = rw->func == ROLLING_SUM ? rw->sum : rw->sum / rw->count;
+      return false;
+    case ROLLING_STDDEV:
+      if (n < 2) return true;
+      *out = rw->nans || rw->pos_infs || rw->neg_infs ? NAN : sqrt(Max(rw->m2, 0) / (rw->count - 1));
+      return false;
+    case ROLLING_MIN:
+    case ROLLING_MAX:
+      if (rw->deque_len == 0) return true;
+      head = rw->deque[rw->deque_head];
+      *out = rw->vals[head % rw->window];
+      return false;
+    default:
+      return true;
+  }
+}
+
+/**
+ * rolling_vals - Slides the window over `more_vals` more values,
+ * setting `out[i]` to `func` of the window ending at `xs[i]`.
+ *
+ * The first `window - 1` windows are short, like `ROWS BETWEEN window - 1 PRECEDING AND CURRENT ROW`.
+ * ROLLING_DIFF gives each value minus the one before, or NULL if either is NULL (or there isn't one).
+ * Min and max keep a deque of the positions whose values could still win,
+ * so every value goes in and out of it at most once.
+ */
+void rolling_vals(rolling_window *rw, int more_vals, const float8 *xs, const bool *x_nulls,
+                  float8 *out, bool *out_nulls) {
+  int window = rw->window;
+  int64 pos, old_pos, tail;
+  int i, slot;
+  float8 x, old;
+  bool old_null, is_max = rw->func == ROLLING_MAX;
+
+  for (i = 0; i < more_vals; i++) {
+    pos = rw->seen;
+    slot = pos % window;
+    x = xs[i];
+
+    if (rw->func == ROLLING_DIFF) {
+      old_null = pos == 0 || rw->nulls[(pos - 1) % window];
+      out_nulls[i] = old_null || x_nulls[i];
+      out[i] = out_nulls[i] ? 0 : x - rw->vals[(pos - 1) % window];
+    } else if (rw->func == ROLLING_MIN || rw->func == ROLLING_MAX) {
+      // Drop the position leaving the window, then every value the new one beats:
+      old_pos = pos - window;
+      if (rw->deque_len && rw->deque[rw->deque_head] == old_pos) {
+        rw->deque_head = (rw->deque_head + 1) % window;
+        rw->deque_len--;
+      }
+      if (!x_nulls[i] && !isnan(x)) {
+        while (rw->deque_len) {
+          tail = rw->deque[(rw->deque_head + rw->deque_len - 1) % window];
+          old = rw->vals[tail % window];
+          if (is_max ? old > x : old < x) break;
+          rw->deque_len--;
+        }
+        rw->deque[(rw->deque_head + rw->deque_len) % window] = pos;
+        rw->deque_len++;
+      }
+    } else {
+      if (pos >= window && !rw->nulls[slot]) rolling_add(rw, rw->vals[slot], -1);
+      if (!x_nulls[i]) rolling_add(rw, x, 1);
+    }
+
+    rw->vals[slot] = x;
+    rw->nulls[slot] = x_nulls[i];
+    rw->seen++;
+
+    if (rw->func != ROLLING_DIFF) {
+      if (rw->seen % window == 0 && rw->func <= ROLLING_STDDEV) rolling_recompute(rw);
+      out_nulls[i] = rolling_result(rw, &out[i]);
+      if (out_nulls[i]) out[i] = 0;
+    }
+  }
+}
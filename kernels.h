@@ -0,0 +1,225 @@
+/**
+ * kernels.h - The inner loops that count values into buckets.
+ *
+ * Like histogram.c these have no Postgres dependencies.
+ * We pick the fastest version the CPU supports the first time they are called.
+ */
+
+/**
+ * float_stats - Summary statistics of some non-null values.
+ *
+ * We keep the mean and the sum of squared deviations from it (`m2`)
+ * instead of a sum of squares, so the variance stays accurate
+ * even when the values are large compared to their spread.
+ * min and max are meaningless when count is 0.
+ */
+typedef struct float_stats {
+  int64 count;
+  float8 sum;
+  float8 min, max;
+  float8 mean;
+  float8 m2;
+} float_stats;
+
+/**
+ * pair_stats - Summary statistics of some (x, y) pairs where neither is null.
+ *
+ * Like float_stats we keep the means and the sums of squared deviations from them,
+ * plus the sum of the products of the x and y deviations (`c_xy`),
+ * which is all that covariance, correlation, and a least-squares line need.
+ */
+typedef struct pair_stats {
+  int64 count;
+  float8 mean_x, mean_y;
+  float8 m2_x, m2_y;
+  float8 c_xy;
+} pair_stats;
+
+// The most floatfiles we read side by side,
+// which is also the most dimensions a Postgres array can have:
+#define MAX_DIMENSIONS 6
+
+typedef enum {
+  COUNT_DIRECT,       // increment the caller's counts
+  COUNT_REPLICATED,   // rotate through private copies when skewed, then add them up at the end
+  COUNT_BLOCKED,      // partition each block by tile so the increments stay in cache
+  COUNT_SPARSE        // add to a hash table of just the buckets we've seen
+} count_strategy;
+
+/**
+ * sparse_entry - One slot of a sparse_counts table.
+ *
+ * `bucket` is SPARSE_EMPTY if the slot is free.
+ */
+typedef struct sparse_entry {
+  int64 count;
+  int32 bucket;
+} sparse_entry;
+
+#define SPARSE_EMPTY -1
+
+/**
+ * sparse_counts - The counts of a histogram too big to keep densely,
+ * in an open-addressing hash table keyed by bucket.
+ *
+ * `capacity` is always a power of 2, and we keep it at least twice `used`.
+ * After sparse_counts_sort the first `used` entries are the buckets in order
+ * and it isn't a hash table anymore.
+ */
+typedef struct sparse_counts {
+  sparse_entry *entries;
+  size_t capacity;
+  size_t used;
+} sparse_counts;
+
+int sparse_counts_init(sparse_counts *sc, size_t expected);
+void sparse_counts_finish(sparse_counts *sc);
+int sparse_counts_add(sparse_counts *sc, int32 bucket, int64 count);
+int sparse_counts_merge(sparse_counts *into, const sparse_counts *from);
+void sparse_counts_sort(sparse_counts *sc);
+
+/**
+ * hist_counter - Everything count_vals needs to add to one histogram's counts.
+ * COUNT_SPARSE counters add to `sparse` instead of `counts`.
+ *
+ * Each thread needs its own.
+ */
+typedef struct hist_counter {
+  int64 *counts;
+  size_t bucket_count;
+  count_strategy strategy;
+  int64 *replicas;
+  int copies;
+  int32 *positions;
+  int32 *partitioned;
+  size_t positions_capacity;
+  size_t *tile_starts;
+  size_t tile_count;
+  sparse_counts *sparse;
+} hist_counter;
+
+int hist_counter_init(hist_counter *hc, int64 *counts, size_t bucket_count);
+int hist_counter_init_with_strategy(hist_counter *hc, int64 *counts, size_t bucket_count, count_strategy strategy);
+int hist_counter_init_sparse(hist_counter *hc, sparse_counts *sparse);
+void hist_counter_finish(hist_counter *hc);
+
+int count_vals(hist_counter *hc, int more_vals, float8 *xs, bool *x_nulls, float8 x_min, float8 x_width, int x_count);
+
+int count_vals_2d(hist_counter *hc, int more_vals, float8 *xs, bool *x_nulls, float8 x_min, float8 x_width, int x_count,
+                  float8 *ys, bool *y_nulls, float8 y_min, float8 y_width, int y_count);
+
+int count_vals_nd(hist_counter *hc, int more_vals, int ndims, float8 *const *xs, bool *const *x_nulls,
+                  const float8 *x_mins, const float8 *x_widths, const int32 *x_counts);
+
+/**
+ * bucket_edges - Buckets with arbitrary edges:
+ * bucket k holds the values from edges[k] up to (not including) edges[k + 1].
+ *
+ * `edges` must be increasing, and there must be `count` + 1 of them.
+ * If bucket_edges_init can build a small enough `index` we use it to find each value's bucket,
+ * otherwise we binary search.
+ */
+typedef struct bucket_edges {
+  const float8 *edges;
+  int32 count;
+  uint64 first_key;
+  int shift;
+  int32 *index;
+} bucket_edges;
+
+void bucket_edges_init(bucket_edges *be, const float8 *edges, int32 count);
+void bucket_edges_finish(bucket_edges *be);
+int bucket_edges_find(const bucket_edges *be, float8 x);
+
+int count_vals_edges(hist_counter *hc, int more_vals, float8 *xs, bool *x_nulls, const bucket_edges *be);
+
+/**
+ * combine_op - What combine_vals does with each pair of values (or each value, for the unary ones).
+ */
+typedef enum combine_op {
+  COMBINE_ADD,
+  COMBINE_SUB,
+  COMBINE_MUL,
+  COMBINE_DIV,
+  COMBINE_MIN,
+  COMBINE_MAX,
+  COMBINE_NEG,
+  COMBINE_ABS,
+  COMBINE_SQRT,
+  COMBINE_EXP,
+  COMBINE_LN
+} combine_op;
+
+#define COMBINE_UNARY(op) ((op) >= COMBINE_NEG)
+
+void combine_vals(combine_op op, int more_vals, const float8 *as, const bool *a_nulls,
+                  const float8 *bs, const bool *b_nulls, float8 b, float8 *out, bool *out_nulls);
+
+int find_matching_vals(int more_vals, const float8 *xs, const bool *x_nulls, float8 lo, float8 hi, int32 *matches);
+
+void mark_vals_above(int more_vals, const float8 *xs, const bool *x_nulls, float8 threshold, uint64 *bits);
+
+/**
+ * rolling_func - What rolling_vals computes over each window.
+ */
+typedef enum rolling_func {
+  ROLLING_SUM,
+  ROLLING_MEAN,
+  ROLLING_STDDEV,
+  ROLLING_MIN,
+  ROLLING_MAX,
+  ROLLING_DIFF
+} rolling_func;
+
+/**
+ * rolling_window - The last `window` values we've seen, and what rolling_vals knows about them.
+ *
+ * `vals` and `nulls` are a ring buffer indexed by position mod `window`.
+ * For min and max `deque` holds the positions of the values that could still win, in order.
+ */
+typedef struct rolling_window {
+  rolling_func func;
+  int window;
+  int64 seen;
+  float8 *vals;
+  bool *nulls;
+  int64 count, nans, pos_infs, neg_infs;
+  float8 sum, m2;
+  int64 *deque;
+  int deque_head, deque_len;
+} rolling_window;
+
+int rolling_window_init(rolling_window *rw, rolling_func func, int window);
+void rolling_window_finish(rolling_window *rw);
+void rolling_vals(rolling_window *rw, int more_vals, const float8 *xs, const bool *x_nulls,
+                  float8 *out, bool *out_nulls);
+
+const char *count_vals_kernel_name(void);
+
+void stats_init(float_stats *stats);
+void stats_vals(int more_vals, const float8 *xs, const bool *x_nulls, float_stats *stats);
+void stats_merge(float_stats *into, const float_stats *from);
+
+void pair_stats_init(pair_stats *stats);
+void pair_stats_vals(int more_vals, const float8 *xs, const bool *x_nulls, const float8 *ys, const bool *y_nulls,
+                     pair_stats *stats);
+void pair_stats_merge(pair_stats *into, const pair_stats *from);
+
+/**
+ * bucket_stats_counter - Everything bucket_stats_vals needs to add to the stats of one set of buckets.
+ *
+ * Each thread needs its own.
+ */
+typedef struct bucket_stats_counter {
+  float_stats *buckets;
+  size_t bucket_count;
+  float_stats *block;
+  int32 *positions;
+  int32 *indexes;
+  int32 *touched;
+} bucket_stats_counter;
+
+int bucket_stats_counter_init(bucket_stats_counter *bc, float_stats *buckets, size_t bucket_count);
+void bucket_stats_counter_finish(bucket_stats_counter *bc);
+void bucket_stats_vals(bucket_stats_counter *bc, int more_vals, const float8 *xs, const bool *x_nulls,
+                       float8 x_min, float8 x_width, int x_count, const float8 *ys, const bool *y_nulls);
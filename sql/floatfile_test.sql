@@ -1,5 +1,17 @@
 CREATE EXTENSION floatfile;
 
+-- Whether a floatfile's info (from its rollups, when it has them) agrees with its values:
+
+CREATE FUNCTION check_info(filename text,
+  OUT length bigint, OUT same_count boolean, OUT same_sum boolean, OUT same_min boolean, OUT same_max boolean,
+  OUT same_stddev boolean)
+AS $$
+  SELECT  info.length, info.count = s.count, info.sum = s.sum, info.min = s.min, info.max = s.max,
+          abs(info.stddev - s.stddev) < 1e-6
+  FROM    floatfile_info(filename) info,
+          (SELECT count(v), sum(v), min(v), max(v), stddev(v) FROM unnest(load_floatfile(filename)) v) s
+$$ LANGUAGE sql;
+
 SELECT save_floatfile('test', '{1,2,3,NULL,4,NULL}'::float[]);
 SELECT load_floatfile('test');
 SELECT extend_floatfile('test', '{NULL,5}'::float[]);
@@ -224,3 +236,676 @@ SELECT drop_floatfile('testspace', 'b');
 SELECT drop_floatfile('testspace', 't');
 
 DROP TABLESPACE testspace;
+
+-- Scan mode tests:
+
+SELECT save_floatfile('a', '{1,1,1,1,NULL}'::float[]);
+SET floatfile.scan_mode = 'drop_behind';
+SELECT floatfile_to_hist('a', 0::float, 1::float, 5);
+SET floatfile.scan_mode = 'cached';
+SELECT floatfile_to_hist('a', 0::float, 1::float, 5);
+SET floatfile.scan_mode = 'auto';
+SET floatfile.drop_behind_threshold = 0;
+SELECT floatfile_to_hist('a', 0::float, 1::float, 5);
+RESET floatfile.drop_behind_threshold;
+RESET floatfile.scan_mode;
+SELECT drop_floatfile('a');
+SELECT save_floatfile('big', array_agg((i % 1000)::float)) FROM generate_series(1, 300000) i;
+SET floatfile.scan_mode = 'cached';
+CREATE TEMP TABLE cached_hists AS
+SELECT  floatfile_to_hist('big', 0::float, 10::float, 100) AS hist,
+        floatfile_to_hist2d('big', 'big', 0::float, 0::float, 100::float, 100::float, 10, 10) AS hist2d;
+SET floatfile.scan_mode = 'auto';
+SET floatfile.drop_behind_threshold = '1MB';
+SELECT  floatfile_to_hist('big', 0::float, 10::float, 100) = hist AS same_hist,
+        floatfile_to_hist2d('big', 'big', 0::float, 0::float, 100::float, 100::float, 10, 10) = hist2d AS same_hist2d,
+        hist = array_fill(3000, ARRAY[100]) AS right_hist
+FROM    cached_hists;
+RESET floatfile.drop_behind_threshold;
+RESET floatfile.scan_mode;
+DROP TABLE cached_hists;
+SELECT drop_floatfile('big');
+
+-- Multi-block scan tests:
+
+SET floatfile.rollups = off;
+SELECT save_floatfile('big', array_agg(i::float)) FROM generate_series(0, 599999) i;
+SELECT save_floatfile('half', array_agg(i::float)) FROM generate_series(0, 299999) i;
+RESET floatfile.rollups;
+SELECT floatfile_to_hist('big', 0::float, 100000::float, 6);
+SELECT floatfile_to_hist('big', 0::float, 100000::float, 6, 'big', 50000::float, 549999::float);
+SELECT floatfile_to_hist2d('big', 'big', 0::float, 0::float, 300000::float, 300000::float, 2, 2);
+SELECT count, sum, min, max FROM floatfile_stats('big', 'big', 262000, 262300);
+SELECT * FROM floatfile_asof_join('big', 'big', 'big', 'big', 100000, 100002, 0);
+SELECT floatfile_to_hist2d('big', 'half', 0::float, 0::float, 300000::float, 300000::float, 2, 2);
+SELECT drop_floatfile('big');
+SELECT drop_floatfile('half');
+
+-- Threaded histogram tests:
+
+SET floatfile.scan_threads = 4;
+SELECT save_floatfile('a', '{1,1,1,1,NULL}'::float[]);
+SELECT save_floatfile('b', '{1,1,0,NULL,1}'::float[]);
+SELECT floatfile_to_hist('a', 0::float, 1::float, 5);
+SELECT floatfile_to_hist2d('a', 'b', 0::float, 0::float, 1::float, 1::float, 5, 2);
+SELECT drop_floatfile('a');
+SELECT drop_floatfile('b');
+RESET floatfile.scan_threads;
+SET floatfile.rollups = off;
+SELECT save_floatfile('bx', array_agg(CASE WHEN i % 97 = 0 THEN NULL ELSE ((i * 7919) % 10007)::float END))
+FROM generate_series(1, 1100000) i;
+SELECT save_floatfile('by', array_agg(((i * 104729) % 1009)::float)) FROM generate_series(1, 1100000) i;
+SELECT save_floatfile('bt', array_agg(i::float)) FROM generate_series(1, 1100000) i;
+RESET floatfile.rollups;
+CREATE TEMP TABLE unthreaded_hists AS
+SELECT  floatfile_to_hist('bx', 0::float, 100::float, 101) AS hist,
+        floatfile_to_hist('bx', 0::float, 100::float, 101, 'bt', 12345::float, 1012345::float) AS bounded_hist,
+        floatfile_to_hist2d('bx', 'by', 0::float, 0::float, 1000::float, 100::float, 11, 11) AS hist2d,
+        floatfile_to_hist2d('bx', 'by', 0::float, 0::float, 1000::float, 100::float, 11, 11,
+                            'bt', 12345::float, 1012345::float) AS bounded_hist2d;
+SET floatfile.scan_threads = 4;
+SELECT  floatfile_to_hist('bx', 0::float, 100::float, 101) = hist AS same_hist,
+        floatfile_to_hist('bx', 0::float, 100::float, 101, 'bt', 12345::float, 1012345::float) = bounded_hist
+          AS same_bounded_hist,
+        floatfile_to_hist2d('bx', 'by', 0::float, 0::float, 1000::float, 100::float, 11, 11) = hist2d AS same_hist2d,
+        floatfile_to_hist2d('bx', 'by', 0::float, 0::float, 1000::float, 100::float, 11, 11,
+                            'bt', 12345::float, 1012345::float) = bounded_hist2d AS same_bounded_hist2d,
+        (SELECT sum(c) FROM unnest(hist) c) AS hist_count,
+        (SELECT sum(c) FROM unnest(bounded_hist2d) c) AS bounded_hist2d_count
+FROM    unthreaded_hists;
+RESET floatfile.scan_threads;
+DROP TABLE unthreaded_hists;
+SELECT drop_floatfile('bx');
+SELECT drop_floatfile('by');
+SELECT drop_floatfile('bt');
+
+-- Multiple histogram tests:
+
+SELECT save_floatfile('t', '{1,2,3,NULL,4,5}'::float[]);
+SELECT save_floatfile('a', '{1,1,1.2,1.2,1.8,1.8}'::float[]);
+SELECT * FROM floatfile_to_hists('a', '{0,-0.115}'::float[], '{1,0.23}'::float[], '{5,10}'::int[]);
+SELECT * FROM floatfile_to_hists('a', '{0,-0.115}'::float[], '{1,0.23}'::float[], '{5,10}'::int[], 't', 2::float, 4::float);
+SELECT * FROM floatfile_to_hists('a', '{0,-0.115}'::float[], '{1,0.23}'::float[], '{5,10}'::int[], 't', 7::float, 8::float);
+SELECT * FROM floatfile_to_hists(NULL, 'a', '{0,-0.115}'::float[], '{1,0.23}'::float[], '{5,10}'::int[]);
+SELECT * FROM floatfile_to_hists(NULL, 'a', '{0,-0.115}'::float[], '{1,0.23}'::float[], '{5,10}'::int[], NULL, 't', 2::float, 4::float);
+SELECT * FROM floatfile_to_hists('a', '{}'::float[], '{}'::float[], '{}'::int[]);
+SELECT * FROM floatfile_to_hists('a', '{0,-0.115}'::float[], '{1}'::float[], '{5,10}'::int[]);
+SELECT drop_floatfile('a');
+SELECT drop_floatfile('t');
+
+-- Histograms over many files tests:
+
+SELECT save_floatfile('a', '{1,1,1,1,NULL}'::float[]);
+SELECT save_floatfile('b', '{1,1,0,NULL,1}'::float[]);
+SELECT * FROM floatfile_to_hist(ARRAY['a', NULL, 'b', 'a'], 0::float, 1::float, 5);
+SELECT * FROM floatfile_to_hist(NULL, ARRAY['b', 'a'], 0::float, 1::float, 5);
+SET floatfile.scan_threads = 4;
+SELECT * FROM floatfile_to_hist(ARRAY['a', 'b'], 0::float, 1::float, 5);
+RESET floatfile.scan_threads;
+SELECT * FROM floatfile_to_hist(ARRAY['a', 'missing'], 0::float, 1::float, 5);
+SELECT  classid, objid
+FROM    pg_locks
+WHERE   database = (SELECT oid FROM pg_database WHERE datname = current_database())
+AND     locktype = 'advisory';
+SELECT drop_floatfile('a');
+SELECT drop_floatfile('b');
+
+-- Stats tests:
+
+SELECT save_floatfile('t', '{1,2,3,NULL,4,5}'::float[]);
+SELECT save_floatfile('a', '{1,2,3,NULL,4,8}'::float[]);
+SELECT save_floatfile('b', '{1,2,3,NULL,4}'::float[]);
+SELECT * FROM floatfile_stats('b');
+SELECT * FROM floatfile_stats(NULL, 'b');
+SELECT * FROM floatfile_stats('a', 't', 2::float, 4::float);
+SELECT * FROM floatfile_stats(NULL, 'a', NULL, 't', 2::float, 4::float);
+SELECT * FROM floatfile_stats('a', 't', 5::float, 6::float);
+SELECT * FROM floatfile_stats('a', 't', 7::float, 8::float);
+SELECT drop_floatfile('a');
+SELECT drop_floatfile('b');
+SELECT drop_floatfile('t');
+
+-- Info tests:
+
+SELECT save_floatfile('a', '{1,2,NULL}'::float[]);
+SELECT extend_floatfile('a', '{3,4}'::float[]);
+SELECT extend_floatfile('a', '{NULL}'::float[]);
+SELECT * FROM floatfile_info('a');
+SELECT * FROM floatfile_info(NULL, 'a');
+SELECT extend_floatfile('b', '{NULL,NULL}'::float[]);
+SELECT * FROM floatfile_info('b');
+-- Span several rollup records:
+SELECT save_floatfile('c', array(SELECT generate_series(1, 70000)::float));
+SELECT extend_floatfile('c', array(SELECT generate_series(70001, 140000)::float));
+SELECT save_floatfile('t', array(SELECT generate_series(1, 140000)::float));
+SELECT * FROM floatfile_info('c');
+SELECT * FROM floatfile_stats('c');
+SELECT * FROM floatfile_stats('c', 't', 100::float, 139000::float);
+SELECT drop_floatfile('a');
+SELECT drop_floatfile('b');
+SELECT drop_floatfile('c');
+SELECT drop_floatfile('t');
+
+-- Percentile tests:
+
+SELECT save_floatfile('t', '{1,2,3,4,5,6}'::float[]);
+SELECT save_floatfile('a', '{5,1,NULL,4,2,8}'::float[]);
+SELECT floatfile_percentiles('a', '{0,0.5,0.625,0.75,1}'::float[]);
+SELECT floatfile_percentiles(NULL, 'a', '{0.5}'::float[]);
+SELECT floatfile_percentiles('a', '{0.5}'::float[], 't', 2::float, 5::float);
+SELECT floatfile_percentiles(NULL, 'a', '{0.5}'::float[], NULL, 't', 2::float, 5::float);
+SELECT floatfile_percentiles('a', '{0.5}'::float[], 't', 7::float, 8::float);
+SELECT floatfile_percentiles('a', '{1.5}'::float[]);
+-- Estimate with a t-digest, which is exact for so few values:
+SET floatfile.exact_percentile_limit = 0;
+SELECT floatfile_percentiles('a', '{0,0.5,0.625,0.75,1}'::float[]);
+RESET floatfile.exact_percentile_limit;
+SELECT drop_floatfile('a');
+SELECT drop_floatfile('t');
+
+-- Downsample tests:
+
+SELECT save_floatfile('t', '{1,2,3,4,5,6,7,8,9,10}'::float[]);
+SELECT save_floatfile('a', '{5,1,NULL,4,2,8,3,3,9,0}'::float[]);
+SELECT * FROM floatfile_downsample('a', 't', 1::float, 10::float, 4, 'minmax');
+SELECT * FROM floatfile_downsample(NULL, 'a', NULL, 't', 1::float, 10::float, 4, 'minmax');
+SELECT * FROM floatfile_downsample('a', 't', 1::float, 10::float, 3, 'mean');
+SELECT * FROM floatfile_downsample('a', 't', 1::float, 10::float, 5, 'lttb');
+SELECT * FROM floatfile_downsample('a', 't', 3::float, 8::float, 2, 'minmax');
+SELECT * FROM floatfile_downsample('a', 't', 20::float, 30::float, 4, 'mean');
+SELECT * FROM floatfile_downsample('a', 't', 1::float, 10::float, 4, 'median');
+SELECT drop_floatfile('a');
+SELECT drop_floatfile('t');
+
+-- Rollup tests:
+
+SELECT save_floatfile('t', array(SELECT generate_series(1, 100000)::float));
+SELECT save_floatfile('r', array(SELECT generate_series(1, 1000)::float));
+SELECT extend_floatfile('r', array(SELECT generate_series(1001, 100000)::float));
+SELECT save_floatfile('n', array(SELECT (CASE WHEN i % 10000 = 0 THEN NULL WHEN i = 5000 THEN 'NaN' ELSE i END)::float FROM generate_series(1, 100000) i));
+-- The same without rollups, so we scan it:
+SET floatfile.rollups = off;
+SELECT save_floatfile('n2', array(SELECT (CASE WHEN i % 10000 = 0 THEN NULL WHEN i = 5000 THEN 'NaN' ELSE i END)::float FROM generate_series(1, 100000) i));
+RESET floatfile.rollups;
+SELECT floatfile_to_hist('r', 0::float, 25000::float, 4);
+SELECT floatfile_to_hist('r', 0::float, 25000::float, 4, 't', 1000::float, 60000::float);
+SELECT floatfile_to_hist('n', 0::float, 25000::float, 4) = floatfile_to_hist('n2', 0::float, 25000::float, 4);
+SELECT * FROM floatfile_stats('r', 't', 1000::float, 60000::float);
+SELECT * FROM floatfile_info('r');
+SELECT floatfile_info('n') = floatfile_info('n2');
+SELECT * FROM floatfile_downsample('r', 't', 1::float, 100000::float, 8, 'minmax');
+SELECT * FROM floatfile_downsample('r', 't', 1::float, 100000::float, 4, 'mean');
+SELECT a.timestamps = b.timestamps AND a.vals = b.vals
+FROM    floatfile_downsample('n', 't', 1::float, 100000::float, 20, 'minmax') a,
+        floatfile_downsample('n2', 't', 1::float, 100000::float, 20, 'minmax') b;
+SELECT drop_floatfile('n');
+SELECT drop_floatfile('n2');
+SELECT drop_floatfile('r');
+SELECT drop_floatfile('t');
+
+-- Time bucket tests:
+
+SELECT save_floatfile('t', '{1,2,3,4,5,6,7,8,9,10}'::float[]);
+SELECT save_floatfile('a', '{5,1,NULL,4,2,8,3,3,9,0}'::float[]);
+SELECT floatfile_time_buckets('a', 't', 1::float, 11::float, 4::float, '{count,sum,min,max,mean,stddev}');
+SELECT floatfile_time_buckets(NULL, 'a', NULL, 't', 1::float, 11::float, 4::float, '{sum}');
+-- The end is exclusive:
+SELECT floatfile_time_buckets('a', 't', 1::float, 10::float, 3::float, '{count,mean}');
+-- Empty buckets:
+SELECT floatfile_time_buckets('a', 't', 1::float, 21::float, 5::float, '{count,max,stddev}');
+SELECT floatfile_time_buckets('a', 't', 20::float, 30::float, 5::float, '{count,sum}');
+SELECT floatfile_time_buckets('a', 't', 1::float, 11::float, 4::float, '{median}');
+SELECT floatfile_time_buckets('a', 't', 1::float, 11::float, 0::float, '{count}');
+SELECT drop_floatfile('a');
+SELECT drop_floatfile('t');
+-- With rollups:
+SELECT save_floatfile('t', array(SELECT generate_series(1, 100000)::float));
+SELECT save_floatfile('r', array(SELECT generate_series(1, 100000)::float));
+SELECT save_floatfile('n', array(SELECT (CASE WHEN i % 10000 = 0 THEN NULL WHEN i = 5000 THEN 'NaN' ELSE i END)::float FROM generate_series(1, 100000) i));
+SET floatfile.rollups = off;
+SELECT save_floatfile('n2', array(SELECT (CASE WHEN i % 10000 = 0 THEN NULL WHEN i = 5000 THEN 'NaN' ELSE i END)::float FROM generate_series(1, 100000) i));
+RESET floatfile.rollups;
+SELECT floatfile_time_buckets('r', 't', 0::float, 100000::float, 25000::float, '{count,sum}');
+SELECT (SELECT array_agg(b) FROM floatfile_time_buckets('n', 't', 0::float, 100000::float, 3000::float, '{count,sum,min,max}') b) =
+       (SELECT array_agg(b) FROM floatfile_time_buckets('n2', 't', 0::float, 100000::float, 3000::float, '{count,sum,min,max}') b);
+SELECT drop_floatfile('n');
+SELECT drop_floatfile('n2');
+SELECT drop_floatfile('r');
+SELECT drop_floatfile('t');
+
+-- Bucket aggregate tests:
+
+SELECT save_floatfile('x', '{0.5,1.5,1.7,NULL,2.2,3.9,5,-1,2.5,0.1}'::float[]);
+SELECT save_floatfile('y', '{10,20,30,40,NULL,5,7,8,9,1}'::float[]);
+SELECT save_floatfile('t', '{1,2,3,4,5,6,7,8,9,10}'::float[]);
+SELECT floatfile_bucket_agg('x', 'y', 0::float, 1::float, 4, 'count');
+SELECT floatfile_bucket_agg('x', 'y', 0::float, 1::float, 4, 'sum');
+SELECT floatfile_bucket_agg('x', 'y', 0::float, 1::float, 4, 'min');
+SELECT floatfile_bucket_agg('x', 'y', 0::float, 1::float, 4, 'max');
+SELECT floatfile_bucket_agg('x', 'y', 0::float, 1::float, 4, 'mean');
+SELECT floatfile_bucket_agg('x', 'y', 0::float, 1::float, 4, 'stddev');
+SELECT floatfile_bucket_agg('x', 'y', 0::float, 1::float, 4, 'sum', 't', 1::float, 5::float);
+SELECT floatfile_bucket_agg(NULL, 'x', NULL, 'y', 0::float, 1::float, 4, 'count');
+SELECT floatfile_bucket_agg(NULL, 'x', NULL, 'y', 0::float, 1::float, 4, 'max', NULL, 't', 1::float, 5::float);
+SELECT floatfile_bucket_agg('x', 'y', 0::float, 1::float, 4, 'median');
+SELECT drop_floatfile('t');
+SELECT drop_floatfile('x');
+SELECT drop_floatfile('y');
+
+-- N-d histogram tests:
+
+SELECT save_floatfile('a', '{0,1,0,1,NULL,0}'::float[]);
+SELECT save_floatfile('b', '{0,0,1,1,0,0}'::float[]);
+SELECT save_floatfile('c', '{0,1,2,0,1,2}'::float[]);
+SELECT save_floatfile('t', '{1,2,3,4,5,6}'::float[]);
+SELECT floatfile_to_histnd('{a,b,c}', '{0,0,0}', '{1,1,1}', '{2,2,3}');
+SELECT floatfile_to_histnd('{a,b,c}', '{0,0,0}', '{1,1,1}', '{2,2,3}', 't', 1::float, 3::float);
+SELECT floatfile_to_histnd(NULL, '{a,b,c}', '{0,0,0}', '{1,1,1}', '{2,2,3}');
+SELECT floatfile_to_histnd(NULL, '{a,b,c}', '{0,0,0}', '{1,1,1}', '{2,2,3}', NULL, 't', 1::float, 3::float);
+SELECT floatfile_to_histnd('{c}', '{0}', '{1}', '{3}');
+SELECT floatfile_to_histnd('{a,b}', '{0,0}', '{1,1}', '{2,2}') = floatfile_to_hist2d('a', 'b', 0, 0, 1, 1, 2, 2);
+SELECT floatfile_to_histnd('{a,b,c}', '{0,0}', '{1,1}', '{2,2}');
+SELECT floatfile_to_histnd('{a,a,a,a,a,a,a}', '{0,0,0,0,0,0,0}', '{1,1,1,1,1,1,1}', '{2,2,2,2,2,2,2}');
+SELECT drop_floatfile('a');
+SELECT drop_floatfile('b');
+SELECT drop_floatfile('c');
+SELECT drop_floatfile('t');
+
+-- Sparse histogram tests:
+
+SELECT save_floatfile('a', '{0,1,0,1,NULL,0}'::float[]);
+SELECT save_floatfile('b', '{0,0,1,1,0,0}'::float[]);
+SELECT save_floatfile('c', '{0,1,2,0,1,2}'::float[]);
+SELECT save_floatfile('t', '{1,2,3,4,5,6}'::float[]);
+SELECT * FROM floatfile_to_histnd_sparse('{a,b,c}', '{0,0,0}', '{1,1,1}', '{2,2,3}');
+SELECT * FROM floatfile_to_histnd_sparse('{c}', '{0}', '{1}', '{3}');
+SELECT * FROM floatfile_to_histnd_sparse('{a,b}', '{0,0}', '{0.0001,0.0001}', '{40000,40000}');
+SELECT * FROM floatfile_to_histnd_sparse('{a,b,c}', '{0,0,0}', '{1,1,1}', '{2,2,3}', 't', 1::float, 3::float);
+SELECT * FROM floatfile_to_histnd_sparse(NULL, '{a,b,c}', '{0,0,0}', '{1,1,1}', '{2,2,3}');
+SELECT * FROM floatfile_to_histnd_sparse(NULL, '{a,b,c}', '{0,0,0}', '{1,1,1}', '{2,2,3}', NULL, 't', 1::float, 3::float);
+SELECT * FROM floatfile_to_histnd_sparse('{a,b}', '{0,0}', '{1,1}', '{100000,100000}');
+SELECT drop_floatfile('a');
+SELECT drop_floatfile('b');
+SELECT drop_floatfile('c');
+SELECT drop_floatfile('t');
+
+-- Auto histogram tests:
+
+SELECT save_floatfile('a', '{2,3,5,NULL,8,2.5,NaN}'::float[]);
+SELECT save_floatfile('t', '{1,2,3,4,5,6,7}'::float[]);
+SELECT save_floatfile('b', '{7,NULL,7}'::float[]);
+SELECT save_floatfile('n', '{NULL,NULL}'::float[]);
+SELECT * FROM floatfile_to_hist_auto('a', 3);
+SELECT * FROM floatfile_to_hist_auto('a', 2, 't', 1::float, 3::float);
+SELECT * FROM floatfile_to_hist_auto(NULL, 'a', 3);
+SELECT * FROM floatfile_to_hist_auto(NULL, 'a', 2, NULL, 't', 1::float, 3::float);
+SELECT * FROM floatfile_to_hist_auto('b', 2);
+SELECT * FROM floatfile_to_hist_auto('n', 2);
+SELECT * FROM floatfile_to_hist_auto('a', 0);
+SELECT drop_floatfile('a');
+SELECT drop_floatfile('t');
+SELECT drop_floatfile('b');
+SELECT drop_floatfile('n');
+
+-- Edge histogram tests:
+
+SELECT save_floatfile('a', '{-0,0.5,1,NULL,3,10,NaN,-2,100}'::float[]);
+SELECT save_floatfile('t', '{1,2,3,4,5,6,7,8,9}'::float[]);
+SELECT floatfile_to_hist_edges('a', '{0,1,10,100}');
+SELECT floatfile_to_hist_edges('a', '{-Infinity,0,Infinity}');
+SELECT floatfile_to_hist_edges('a', '{0,1,10,100}', 't', 1::float, 5::float);
+SELECT floatfile_to_hist_edges(NULL, 'a', '{0,1,10,100}');
+SELECT floatfile_to_hist_edges(NULL, 'a', '{0,1,10,100}', NULL, 't', 1::float, 5::float);
+SELECT floatfile_to_hist_log('a', 0.5, 2, 4);
+SELECT floatfile_to_hist_log('a', 0.5, 2, 4, 't', 1::float, 3::float);
+SELECT floatfile_to_hist_log(NULL, 'a', 0.5, 2, 4);
+SELECT floatfile_to_hist_log(NULL, 'a', 0.5, 2, 4, NULL, 't', 1::float, 3::float);
+SELECT floatfile_to_hist_edges('a', '{1,1,2}');
+SELECT floatfile_to_hist_edges('a', '{1}');
+SELECT floatfile_to_hist_log('a', 0, 2, 4);
+SELECT floatfile_to_hist_log('a', 1, 1, 4);
+SELECT drop_floatfile('a');
+SELECT drop_floatfile('t');
+
+-- Combine tests:
+
+SELECT save_floatfile('a', '{1,2,NULL,4,-0,NaN}'::float[]);
+SELECT save_floatfile('b', '{2,0,3,NULL,5,1}'::float[]);
+SELECT save_floatfile('short', '{1,2}'::float[]);
+SELECT floatfile_combine('c', '+', 'a', 'b');
+SELECT load_floatfile('c');
+SELECT drop_floatfile('c');
+SELECT floatfile_combine('c', '/', 'a', 'b');
+SELECT load_floatfile('c');
+SELECT drop_floatfile('c');
+SELECT floatfile_combine('c', 'max', 'a', 'b');
+SELECT load_floatfile('c');
+SELECT drop_floatfile('c');
+SELECT floatfile_combine('c', '*', 'a', 2);
+SELECT load_floatfile('c');
+SELECT drop_floatfile('c');
+SELECT floatfile_apply('c', 'abs', 'a');
+SELECT load_floatfile('c');
+SELECT drop_floatfile('c');
+SELECT floatfile_apply('c', 'sqrt', 'a');
+SELECT load_floatfile('c');
+SELECT drop_floatfile('c');
+SELECT floatfile_combine(NULL, 'c', '-', 'a', 'b');
+SELECT load_floatfile('c');
+SELECT drop_floatfile('c');
+SELECT floatfile_combine(NULL, 'c', 'min', 'a', 1.5);
+SELECT load_floatfile('c');
+SELECT drop_floatfile('c');
+SELECT floatfile_apply(NULL, 'c', 'neg', 'a');
+SELECT load_floatfile('c');
+SELECT drop_floatfile('c');
+SELECT floatfile_combine('c', '+', 'a', 'short');
+SELECT floatfile_combine('c', 'abs', 'a', 'b');
+SELECT floatfile_combine('c', '%', 'a', 'b');
+SELECT floatfile_apply('c', '+', 'a');
+SELECT floatfile_combine('a', '+', 'a', 'b');
+SELECT floatfile_combine('c', '-', 'b', 'a');
+SELECT load_floatfile('c');
+SELECT drop_floatfile('c');
+SELECT drop_floatfile('a');
+SELECT drop_floatfile('b');
+SELECT drop_floatfile('short');
+-- Span several blocks, so the rollups are appended to one block at a time:
+SELECT save_floatfile('a', array_agg(CASE WHEN i % 1000 = 0 THEN NULL ELSE i::float END)) FROM generate_series(1, 600000) i;
+SELECT save_floatfile('b', array_agg((i % 7)::float)) FROM generate_series(1, 600000) i;
+SELECT save_floatfile('t', array_agg(i::float)) FROM generate_series(1, 600000) i;
+SELECT floatfile_combine('c', '+', 'a', 'b');
+SELECT * FROM check_info('c');
+SELECT  stats.count, stats.count = s.count AS same_count, stats.sum = s.sum AS same_sum,
+        stats.min = s.min AS same_min, stats.max = s.max AS same_max
+FROM    floatfile_stats('c', 't', 100000::float, 500000::float) stats,
+        (SELECT count(v), sum(v), min(v), max(v) FROM unnest((load_floatfile('c'))[100000:500000]) v) s;
+SELECT drop_floatfile('a');
+SELECT drop_floatfile('b');
+SELECT drop_floatfile('c');
+SELECT drop_floatfile('t');
+
+-- Rolling tests:
+
+SELECT save_floatfile('x', '{1,2,NULL,4,8,3,-1}'::float[]);
+SELECT save_floatfile('y', '{1,NaN,2,3}'::float[]);
+SELECT floatfile_rolling('r', 'x', 3, 'sum');
+SELECT load_floatfile('r');
+SELECT drop_floatfile('r');
+SELECT floatfile_rolling('r', 'x', 3, 'mean');
+SELECT load_floatfile('r');
+SELECT drop_floatfile('r');
+SELECT floatfile_rolling('r', 'x', 3, 'stddev');
+SELECT load_floatfile('r');
+SELECT drop_floatfile('r');
+SELECT floatfile_rolling('r', 'x', 3, 'min');
+SELECT load_floatfile('r');
+SELECT drop_floatfile('r');
+SELECT floatfile_rolling('r', 'x', 3, 'max');
+SELECT load_floatfile('r');
+SELECT drop_floatfile('r');
+SELECT floatfile_rolling('r', 'x', 1, 'sum');
+SELECT load_floatfile('r');
+SELECT drop_floatfile('r');
+SELECT floatfile_rolling('r', 'y', 2, 'sum');
+SELECT load_floatfile('r');
+SELECT drop_floatfile('r');
+SELECT floatfile_rolling('r', 'y', 2, 'max');
+SELECT load_floatfile('r');
+SELECT drop_floatfile('r');
+SELECT floatfile_diff('r', 'x');
+SELECT load_floatfile('r');
+SELECT drop_floatfile('r');
+SELECT floatfile_rolling(NULL, 'r', 'x', 2, 'mean');
+SELECT load_floatfile('r');
+SELECT drop_floatfile('r');
+SELECT floatfile_diff(NULL, 'r', 'y');
+SELECT load_floatfile('r');
+SELECT drop_floatfile('r');
+SELECT floatfile_rolling('r', 'x', 0, 'sum');
+SELECT floatfile_rolling('r', 'x', 3, 'median');
+SELECT floatfile_rolling('x', 'x', 3, 'sum');
+SELECT floatfile_rolling('y', 'x', 3, 'sum');
+SELECT save_floatfile('z', '{1,2,NULL,4}'::float[]);
+SELECT floatfile_extend_rolling('r', 'z', 3, 'sum');
+SELECT load_floatfile('r');
+SELECT floatfile_extend_diff('d', 'z');
+SELECT extend_floatfile('z', '{8,3,-1}'::float[]);
+SELECT floatfile_extend_rolling('r', 'z', 3, 'sum');
+SELECT load_floatfile('r');
+SELECT floatfile_extend_rolling(NULL, 'r', 'z', 3, 'sum');
+SELECT load_floatfile('r');
+SELECT drop_floatfile('r');
+SELECT floatfile_extend_diff(NULL, 'd', 'z');
+SELECT load_floatfile('d');
+SELECT floatfile_extend_diff('d', 'y');
+SELECT load_floatfile('d');
+SELECT drop_floatfile('d');
+SELECT drop_floatfile('x');
+SELECT drop_floatfile('y');
+SELECT drop_floatfile('z');
+SELECT save_floatfile('x', array_agg(CASE WHEN i % 1000 = 0 THEN NULL ELSE (i % 100)::float END))
+FROM generate_series(1, 600000) i;
+SELECT save_floatfile('z', array_agg(CASE WHEN i % 1000 = 0 THEN NULL ELSE (i % 100)::float END))
+FROM generate_series(1, 300000) i;
+SELECT floatfile_rolling('r', 'x', 5, 'sum');
+SELECT floatfile_extend_rolling('rz', 'z', 5, 'sum');
+SELECT extend_floatfile('z', array_agg(CASE WHEN i % 1000 = 0 THEN NULL ELSE (i % 100)::float END))
+FROM generate_series(300001, 600000) i;
+SELECT floatfile_extend_rolling('rz', 'z', 5, 'sum');
+SELECT * FROM check_info('r');
+SELECT * FROM check_info('rz');
+SELECT load_floatfile('r') = load_floatfile('rz') AS same_rolling;
+SELECT drop_floatfile('r');
+SELECT drop_floatfile('rz');
+SELECT drop_floatfile('x');
+SELECT drop_floatfile('z');
+
+-- Where tests:
+
+SELECT save_floatfile('w', '{1,5,6,NULL,7,NaN,3,6,6}'::float[]);
+SELECT save_floatfile('t', '{1,2,3,4,5,6,7,8,9}'::float[]);
+SELECT floatfile_where('w', 5, 7);
+SELECT floatfile_where('w', '-Infinity', 'Infinity');
+SELECT floatfile_where('w', 100, 200);
+SELECT floatfile_where('w', 5, 7, 't', 3, 8);
+SELECT floatfile_where(NULL, 'w', 5, 7);
+SELECT floatfile_where(NULL, 'w', 5, 7, NULL, 't', 3, 8);
+SELECT * FROM floatfile_where_ranges('w', 5, 7);
+SELECT * FROM floatfile_where_ranges('w', 100, 200);
+SELECT * FROM floatfile_where_ranges('w', 5, 7, 't', 3, 8);
+SELECT * FROM floatfile_where_ranges(NULL, 'w', 5, 7);
+SELECT * FROM floatfile_where_ranges(NULL, 'w', 5, 7, NULL, 't', 3, 8);
+SELECT load_floatfile_at('w', '{5,1,10,0,2}');
+SELECT load_floatfile_at('w', floatfile_where('w', 5, 7));
+SELECT load_floatfile_at(NULL, 'w', '{4,3}');
+SELECT load_floatfile_at('w', '{}');
+SELECT load_floatfile_at('w', '{1,NULL}');
+SELECT drop_floatfile('w');
+SELECT drop_floatfile('t');
+
+-- Index tests:
+
+SELECT save_floatfile('ix', '{1,2,3,100,4,5,NULL,NaN,6,200}'::float[]);
+SELECT floatfile_create_index('ix', 4, 2);
+SELECT floatfile_where('ix', 50, 300);
+SELECT floatfile_where('ix', 2, 5);
+SELECT * FROM floatfile_where_ranges('ix', 1, 5);
+SELECT floatfile_to_hist('ix', 100::float, 50::float, 3);
+SELECT extend_floatfile('ix', '{150,7,-3}'::float[]);
+SELECT floatfile_where('ix', 50, 300);
+SELECT floatfile_where('ix', '-Infinity', 0);
+SELECT floatfile_drop_index('ix');
+SELECT floatfile_where('ix', 50, 300);
+SELECT floatfile_drop_index('ix');
+SELECT floatfile_create_index(NULL, 'ix', 64, 1);
+SELECT floatfile_where(NULL, 'ix', 150, 150);
+SELECT floatfile_drop_index(NULL, 'ix');
+SET floatfile.index_bins = 8;
+SET floatfile.index_chunk_size = 3;
+SELECT save_floatfile('iy', '{5,4,3,2,1,NULL,1000}'::float[]);
+RESET floatfile.index_bins;
+RESET floatfile.index_chunk_size;
+SELECT extend_floatfile('iy', '{2000}'::float[]);
+SELECT floatfile_where('iy', 500, 5000);
+SELECT floatfile_to_hist('iy', 0::float, 2::float, 3);
+SELECT floatfile_create_index('ix', 0, 1024);
+SELECT floatfile_create_index('ix', 65, 1024);
+SELECT floatfile_create_index('ix', 8, 0);
+SELECT floatfile_create_index('nope', 8, 1024);
+SELECT drop_floatfile('ix');
+SELECT drop_floatfile('iy');
+
+-- Events tests:
+
+SELECT save_floatfile('e', '{1,5,6,NULL,7,8,9,2,NaN,10,11,3,12}'::float[]);
+SELECT save_floatfile('t', '{1,2,3,4,5,6,7,8,9,10,11,12,13}'::float[]);
+SELECT * FROM floatfile_events('e', 4, 1);
+SELECT * FROM floatfile_events('e', 4, 2);
+SELECT * FROM floatfile_events('e', 4, 3);
+SELECT * FROM floatfile_events('e', 100, 1);
+SELECT * FROM floatfile_events('e', 4, 2, 't', 6, 13);
+SELECT * FROM floatfile_events(NULL, 'e', 4, 3);
+SELECT * FROM floatfile_events(NULL, 'e', 4, 2, NULL, 't', 6, 13);
+SELECT * FROM floatfile_events('e', 4, 0);
+SELECT drop_floatfile('e');
+SELECT drop_floatfile('t');
+-- Runs that cross blocks, and with threads the shares' boundaries too:
+SELECT save_floatfile('e', array_agg(CASE WHEN i BETWEEN 262141 AND 262150 OR i BETWEEN 274996 AND 275005
+                                             OR i BETWEEN 537143 AND 537146 OR i BETWEEN 549991 AND 825010
+                                             OR i BETWEEN 1099996 AND 1100000
+                                        THEN (10 + (i * 37) % 101)::float ELSE 0 END))
+FROM generate_series(1, 1100000) i;
+SELECT * FROM floatfile_events('e', 5, 5);
+SET floatfile.scan_threads = 4;
+SELECT * FROM floatfile_events('e', 5, 5);
+RESET floatfile.scan_threads;
+SELECT drop_floatfile('e');
+
+-- As-of join tests:
+
+SELECT save_floatfile('at', '{1,2,3,4,5,6}'::float[]);
+SELECT save_floatfile('a', '{10,20,NULL,40,50,60}'::float[]);
+SELECT save_floatfile('bt', '{0.5,2,2,4.5,NULL,5.8}'::float[]);
+SELECT save_floatfile('b', '{100,200,210,NULL,999,580}'::float[]);
+SELECT save_floatfile('at2', '{3,1}'::float[]);
+SELECT * FROM floatfile_asof_join('at', 'a', 'bt', 'b', 1, 6, 1);
+SELECT * FROM floatfile_asof_join('at', 'a', 'bt', 'b', 1, 6, 0);
+SELECT * FROM floatfile_asof_join('at', 'a', 'bt', 'b', 2, 4, 1);
+SELECT * FROM floatfile_asof_join('at', 'a', 'bt', 'b', 10, 20, 1);
+SELECT * FROM floatfile_asof_join(NULL, 'at', 'a', 'bt', 'b', 2, 4, 1);
+SELECT * FROM floatfile_asof_join('at', 'a', 'bt', 'b', 1, 6, -1);
+SELECT * FROM floatfile_asof_join('at2', 'a', 'bt', 'b', 1, 6, 1);
+SELECT * FROM floatfile_asof_join('at2', 'at2', 'bt', 'b', 1, 6, 1);
+SELECT floatfile_save_asof_join('oa', 'ob', 'at', 'a', 'bt', 'b', 1, 6, 1);
+SELECT load_floatfile('oa'), load_floatfile('ob');
+SELECT floatfile_to_hist2d('oa', 'ob', 0::float, 0::float, 50::float, 300::float, 2, 2);
+SELECT floatfile_save_asof_join('oa', 'oc', 'at', 'a', 'bt', 'b', 1, 6, 1);
+SELECT floatfile_save_asof_join('oc', 'oc', 'at', 'a', 'bt', 'b', 1, 6, 1);
+SELECT floatfile_save_asof_join(NULL, 'oc', 'od', 'at', 'a', 'bt', 'b', 2, 4, 1);
+SELECT load_floatfile('oc'), load_floatfile('od');
+SELECT drop_floatfile('at');
+SELECT drop_floatfile('a');
+SELECT drop_floatfile('bt');
+SELECT drop_floatfile('b');
+SELECT drop_floatfile('at2');
+SELECT drop_floatfile('oa');
+SELECT drop_floatfile('ob');
+SELECT drop_floatfile('oc');
+SELECT drop_floatfile('od');
+SELECT save_floatfile('at', array_agg(i::float)) FROM generate_series(1, 600000) i;
+SELECT save_floatfile('a', array_agg(CASE WHEN i % 1000 = 0 THEN NULL ELSE (i % 100)::float END))
+FROM generate_series(1, 600000) i;
+SELECT save_floatfile('bt', array_agg((2 * i)::float)) FROM generate_series(1, 300000) i;
+SELECT save_floatfile('b', array_agg((i % 50)::float)) FROM generate_series(1, 300000) i;
+SELECT floatfile_save_asof_join('oa', 'ob', 'at', 'a', 'bt', 'b', 1, 600000, 1);
+SELECT * FROM check_info('oa');
+SELECT * FROM check_info('ob');
+SELECT * FROM floatfile_asof_join('at', 'a', 'bt', 'b', 500001, 500004, 1.5);
+SELECT drop_floatfile('at');
+SELECT drop_floatfile('a');
+SELECT drop_floatfile('bt');
+SELECT drop_floatfile('b');
+SELECT drop_floatfile('oa');
+SELECT drop_floatfile('ob');
+
+-- Correlation tests:
+
+SELECT save_floatfile('x', '{1,2,3,4,NULL,6}'::float[]);
+SELECT save_floatfile('y', '{3,1,4,1,5,NULL}'::float[]);
+SELECT save_floatfile('t', '{1,2,3,4,5,6}'::float[]);
+SELECT save_floatfile('u', '{1,2,3,4,5,6}'::float[]);
+SELECT save_floatfile('v', '{2,4,6,8,10,12}'::float[]);
+SELECT save_floatfile('k', '{7,7,7,7,7,7}'::float[]);
+SELECT save_floatfile('n', '{NULL,NULL,NULL,NULL,NULL,NULL}'::float[]);
+SELECT save_floatfile('s', '{1,2}'::float[]);
+SELECT floatfile_corr('x', 'y');
+SELECT floatfile_corr('u', 'v');
+SELECT floatfile_corr('u', 'k');
+SELECT floatfile_corr('x', 'y', 't', 1, 3);
+SELECT floatfile_corr(NULL, 'x', NULL, 'y');
+SELECT floatfile_corr(NULL, 'x', NULL, 'y', NULL, 't', 1, 3);
+SELECT floatfile_corr('x', NULL);
+SELECT * FROM floatfile_covar('x', 'y');
+SELECT * FROM floatfile_covar('x', 'y', 't', 1, 1);
+SELECT * FROM floatfile_covar('x', 'y', 't', 10, 20);
+SELECT * FROM floatfile_covar(NULL, 'u', NULL, 'v');
+SELECT * FROM floatfile_regr('x', 'y');
+SELECT * FROM floatfile_regr('u', 'v');
+SELECT * FROM floatfile_regr('u', 'k');
+SELECT * FROM floatfile_regr('k', 'u');
+SELECT * FROM floatfile_regr('u', 'n');
+SELECT * FROM floatfile_regr('x', 'y', 't', 2, 4);
+SELECT * FROM floatfile_regr(NULL, 'x', NULL, 'y', NULL, 't', 2, 4);
+SELECT floatfile_corr('x', 's');
+SELECT * FROM floatfile_pair_stats('{x,u,NULL,u}', '{y,v,v,k}');
+SELECT * FROM floatfile_pair_stats(NULL, '{k}', '{u}');
+SELECT * FROM floatfile_pair_stats('{}', '{}');
+SELECT * FROM floatfile_pair_stats('{x,u}', '{y}');
+SELECT * FROM floatfile_pair_stats('{x}', '{s}');
+SET floatfile.rollups = off;
+SELECT save_floatfile('px', array_agg(CASE WHEN i % 101 = 0 THEN NULL ELSE ((i * 7919) % 10007)::float END))
+FROM generate_series(1, 1100000) i;
+SELECT save_floatfile('py', array_agg(CASE WHEN i % 97 = 0 THEN NULL ELSE ((i * 7919) % 10007) / 2.0 + i % 13 END::float))
+FROM generate_series(1, 1100000) i;
+SELECT save_floatfile('pt', array_agg(i::float)) FROM generate_series(1, 1100000) i;
+RESET floatfile.rollups;
+CREATE TEMP TABLE unthreaded_pairs AS
+SELECT  floatfile_corr('px', 'py') AS corr,
+        floatfile_corr('px', 'py', 'pt', 12345, 1012345) AS bounded_corr,
+        (floatfile_regr('px', 'py')).*;
+CREATE TEMP TABLE unthreaded_pair_stats AS
+SELECT  * FROM floatfile_pair_stats('{px,py,px}', '{py,px,px}') WITH ORDINALITY;
+SET floatfile.scan_threads = 4;
+SELECT  abs(floatfile_corr('px', 'py') - u.corr) < 1e-12 AS same_corr,
+        abs(floatfile_corr('px', 'py', 'pt', 12345, 1012345) - u.bounded_corr) < 1e-12 AS same_bounded_corr,
+        r.count, r.count = u.count AS same_count,
+        abs(r.slope - u.slope) < 1e-12 AS same_slope,
+        abs(r.intercept - u.intercept) < 1e-9 AS same_intercept,
+        abs(r.r2 - u.r2) < 1e-12 AS same_r2
+FROM    unthreaded_pairs u, floatfile_regr('px', 'py') r;
+SELECT  u.ordinality, t.count, t.count = u.count AS same_count,
+        abs(t.corr - u.corr) < 1e-12 AS same_corr,
+        abs(t.covar_samp - u.covar_samp) < 1e-6 AS same_covar_samp,
+        abs(t.slope - u.slope) < 1e-12 AS same_slope
+FROM    unthreaded_pair_stats u
+JOIN    floatfile_pair_stats('{px,py,px}', '{py,px,px}') WITH ORDINALITY t USING (ordinality)
+ORDER BY u.ordinality;
+SELECT  abs(floatfile_corr('px', 'py') - corr(y, x)) < 1e-12 AS same_corr_as_sql,
+        abs((floatfile_regr('px', 'py')).slope - regr_slope(y, x)) < 1e-12 AS same_slope_as_sql,
+        abs((floatfile_regr('px', 'py')).intercept - regr_intercept(y, x)) < 1e-9 AS same_intercept_as_sql
+FROM    unnest(load_floatfile('px'), load_floatfile('py')) p(x, y);
+RESET floatfile.scan_threads;
+DROP TABLE unthreaded_pairs;
+DROP TABLE unthreaded_pair_stats;
+SELECT drop_floatfile('px');
+SELECT drop_floatfile('py');
+SELECT drop_floatfile('pt');
+SELECT drop_floatfile('x');
+SELECT drop_floatfile('y');
+SELECT drop_floatfile('t');
+SELECT drop_floatfile('u');
+SELECT drop_floatfile('v');
+SELECT drop_floatfile('k');
+SELECT drop_floatfile('n');
+SELECT drop_floatfile('s');
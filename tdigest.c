@@ -0,0 +1,253 @@
+/**
+ * tdigest.c - A merging t-digest for approximate percentiles.
+ *
+ * We collect values in a buffer, sort it, and merge it into the centroids
+ * in one pass, joining neighbors as long as the joined centroid
+ * stays within one unit of the scale function.
+ * Two digests merge the same way, so each thread can build its own
+ * and we combine them at the end.
+ * NaNs are ignored like nulls.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include <postgres.h>
+
+#include "tdigest.h"
+
+// Enough room for a full buffer on top of the centroids we already have.
+// Every two neighboring centroids span more than one unit of the scale function,
+// which spans TDIGEST_COMPRESSION / 2 units in all,
+// so there are never more than TDIGEST_COMPRESSION + 1 centroids after a merge.
+#define TDIGEST_CAPACITY (TDIGEST_COMPRESSION + 16 + TDIGEST_BUFFER)
+
+// We sort the buffer with an LSD radix sort, this many bits at a time:
+#define RADIX_BITS 11
+#define RADIX_SIZE (1 << RADIX_BITS)
+#define RADIX_PASSES ((64 + RADIX_BITS - 1) / RADIX_BITS)
+
+#define SIGN_BIT ((uint64)1 << 63)
+
+/**
+ * radix_key - Maps a float to an unsigned int with the same order.
+ */
+static inline uint64 radix_key(float8 x) {
+  uint64 bits;
+
+  memcpy(&bits, &x, sizeof(bits));
+  return bits & SIGN_BIT ? ~bits : bits | SIGN_BIT;
+}
+
+/**
+ * sort_vals - Sorts `vals` (which has no NaNs), using `scratch` for room.
+ */
+static void sort_vals(float8 *vals, float8 *scratch, int n) {
+  int counts[RADIX_PASSES][RADIX_SIZE];
+  float8 *from = vals, *to = scratch, *tmp;
+  int i, p, d, sum, c;
+  uint64 key;
+
+  memset(counts, 0, sizeof(counts));
+  for (i = 0; i < n; i++) {
+    key = radix_key(vals[i]);
+    for (p = 0; p < RADIX_PASSES; p++) counts[p][(key >> (p * RADIX_BITS)) & (RADIX_SIZE - 1)]++;
+  }
+
+  for (p = 0; p < RADIX_PASSES; p++) {
+    // Skip digits that are the same for every value (e.g. the exponent of similar values):
+    if (counts[p][(radix_key(from[0]) >> (p * RADIX_BITS)) & (RADIX_SIZE - 1)] == n) continue;
+
+    sum = 0;
+    for (d = 0; d < RADIX_SIZE; d++) {
+      c = counts[p][d];
+      counts[p][d] = sum;
+      sum += c;
+    }
+    for (i = 0; i < n; i++) {
+      d = (radix_key(from[i]) >> (p * RADIX_BITS)) & (RADIX_SIZE - 1);
+      to[counts[p][d]++] = from[i];
+    }
+    tmp = from;
+    from = to;
+    to = tmp;
+  }
+
+  if (from != vals) memcpy(vals, from, n * sizeof(float8));
+}
+
+/**
+ * tdigest_next_limit - Returns the fraction of the values
+ * that the next centroid may reach, if it starts at fraction `q`.
+ *
+ * This is the k1 scale function, k(q) = δ/2π asin(2q - 1),
+ * which keeps the centroids small near q = 0 and q = 1.
+ */
+static float8 tdigest_next_limit(float8 q) {
+  float8 k = TDIGEST_COMPRESSION / (2 * M_PI) * asin(2 * q - 1) + 1;
+
+  if (k >= TDIGEST_COMPRESSION / 4.0) return 1;
+  return (sin(k * 2 * M_PI / TDIGEST_COMPRESSION) + 1) / 2;
+}
+
+int tdigest_init(tdigest *td) {
+  memset(td, 0, sizeof(tdigest));
+  td->min = INFINITY;
+  td->max = -INFINITY;
+  td->means = malloc(TDIGEST_CAPACITY * sizeof(float8));
+  td->weights = malloc(TDIGEST_CAPACITY * sizeof(int64));
+  td->merged_means = malloc(TDIGEST_CAPACITY * sizeof(float8));
+  td->merged_weights = malloc(TDIGEST_CAPACITY * sizeof(int64));
+  td->buffer = malloc(TDIGEST_BUFFER * sizeof(float8));
+  td->sort_scratch = malloc(TDIGEST_BUFFER * sizeof(float8));
+  if (!td->means || !td->weights || !td->merged_means || !td->merged_weights || !td->buffer || !td->sort_scratch) {
+    tdigest_finish(td);
+    return -1;
+  }
+  return 0;
+}
+
+void tdigest_finish(tdigest *td) {
+  free(td->means);
+  free(td->weights);
+  free(td->merged_means);
+  free(td->merged_weights);
+  free(td->buffer);
+  free(td->sort_scratch);
+  td->means = td->merged_means = td->buffer = td->sort_scratch = NULL;
+  td->weights = td->merged_weights = NULL;
+}
+
+/**
+ * tdigest_merge_sorted - Merges `n` more sorted centroids into `td`.
+ *
+ * If `weights` is NULL each one is a single value.
+ * `count` is their total weight.
+ */
+static void tdigest_merge_sorted(tdigest *td, const float8 *means, const int64 *weights, int n, int64 count) {
+  int64 total = td->count + count;
+  int64 so_far = 0, cur_weight = 0, w;
+  float8 limit = total * tdigest_next_limit(0);
+  float8 cur_mean = 0, mean;
+  float8 *tmp_means;
+  int64 *tmp_weights;
+  int i = 0, j = 0, merged = 0;
+
+  while (i < td->ncentroids || j < n) {
+    if (j == n || (i < td->ncentroids && td->means[i] <= means[j])) {
+      mean = td->means[i];
+      w = td->weights[i++];
+    } else {
+      mean = means[j];
+      w = weights ? weights[j] : 1;
+      j++;
+    }
+
+    if (cur_weight == 0) {
+      cur_mean = mean;
+      cur_weight = w;
+    } else if (so_far + cur_weight + w <= limit) {
+      cur_weight += w;
+      // Don't turn two infinities into a NaN:
+      if (mean != cur_mean) cur_mean += (mean - cur_mean) * w / cur_weight;
+    } else {
+      td->merged_means[merged] = cur_mean;
+      td->merged_weights[merged++] = cur_weight;
+      so_far += cur_weight;
+      limit = total * tdigest_next_limit((float8)so_far / total);
+      cur_mean = mean;
+      cur_weight = w;
+    }
+  }
+  if (cur_weight) {
+    td->merged_means[merged] = cur_mean;
+    td->merged_weights[merged++] = cur_weight;
+  }
+
+  tmp_means = td->means;
+  td->means = td->merged_means;
+  td->merged_means = tmp_means;
+  tmp_weights = td->weights;
+  td->weights = td->merged_weights;
+  td->merged_weights = tmp_weights;
+  td->ncentroids = merged;
+  td->count = total;
+}
+
+/**
+ * tdigest_flush - Merges the buffered values into the centroids.
+ */
+static void tdigest_flush(tdigest *td) {
+  if (td->nbuffered == 0) return;
+
+  sort_vals(td->buffer, td->sort_scratch, td->nbuffered);
+  td->min = Min(td->min, td->buffer[0]);
+  td->max = Max(td->max, td->buffer[td->nbuffered - 1]);
+  tdigest_merge_sorted(td, td->buffer, NULL, td->nbuffered, td->nbuffered);
+  td->nbuffered = 0;
+}
+
+/**
+ * tdigest_vals - Adds the non-null values in one block to `td`.
+ */
+void tdigest_vals(tdigest *td, int more_vals, const float8 *xs, const bool *x_nulls) {
+  int i;
+
+  for (i = 0; i < more_vals; i++) {
+    if (x_nulls[i] || isnan(xs[i])) continue;
+    td->buffer[td->nbuffered++] = xs[i];
+    if (td->nbuffered == TDIGEST_BUFFER) tdigest_flush(td);
+  }
+}
+
+/**
+ * tdigest_merge - Adds everything in `from` to `into`.
+ */
+void tdigest_merge(tdigest *into, tdigest *from) {
+  tdigest_flush(into);
+  tdigest_flush(from);
+  if (from->count == 0) return;
+
+  into->min = Min(into->min, from->min);
+  into->max = Max(into->max, from->max);
+  tdigest_merge_sorted(into, from->means, from->weights, from->ncentroids, from->count);
+}
+
+/**
+ * tdigest_percentile - Estimates the value at `fraction` (from 0 to 1) of the way through the sorted values,
+ * interpolating like percentile_cont. Returns NaN if there are no values.
+ *
+ * We treat each centroid as sitting at the middle of its values
+ * (so single values sit exactly where percentile_cont puts them)
+ * and interpolate between neighboring centroids,
+ * or between the min/max and the first/last centroid.
+ */
+float8 tdigest_percentile(tdigest *td, float8 fraction) {
+  float8 index, pos, val, left_pos, left_val;
+  float8 so_far = 0;
+  int i;
+
+  tdigest_flush(td);
+  if (td->count == 0) return NAN;
+
+  index = fraction * (td->count - 1) + 0.5;
+  left_pos = 0.5;
+  left_val = td->min;
+  for (i = 0; i <= td->ncentroids; i++) {
+    if (i < td->ncentroids) {
+      pos = so_far + td->weights[i] / 2.0;
+      val = td->means[i];
+      so_far += td->weights[i];
+    } else {
+      pos = td->count - 0.5;
+      val = td->max;
+    }
+    if (index <= pos) {
+      if (pos == left_pos || val == left_val) return val;
+      return left_val + (val - left_val) * (index - left_pos) / (pos - left_pos);
+    }
+    left_pos = pos;
+    left_val = val;
+  }
+  return td->max;
+}
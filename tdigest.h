@@ -0,0 +1,43 @@
+/**
+ * tdigest.h - A mergeable sketch of a distribution, for approximate percentiles.
+ *
+ * Like histogram.c this has no Postgres dependencies.
+ */
+
+// How many centroids a digest keeps (roughly).
+// More centroids are more accurate, especially near the median;
+// the tails are accurate either way.
+#define TDIGEST_COMPRESSION 500
+
+// How many values we collect before sorting them into the centroids:
+#define TDIGEST_BUFFER (16*1024)
+
+/**
+ * tdigest - A merging t-digest (Dunning & Ertl, "Computing Extremely Accurate Quantiles Using t-Digests").
+ *
+ * The centroids are sorted by mean.
+ * We keep them small near either end of the distribution (the k1 scale function),
+ * so the percentiles people care about most (p99, p999) are the most accurate,
+ * and a digest with fewer values than the compression is exact.
+ * Each thread needs its own.
+ */
+typedef struct tdigest {
+  int64 count;
+  float8 min, max;
+  int ncentroids;
+  float8 *means;
+  int64 *weights;
+  // Where we merge into, then swap with means/weights:
+  float8 *merged_means;
+  int64 *merged_weights;
+  int nbuffered;
+  float8 *buffer;
+  float8 *sort_scratch;
+} tdigest;
+
+int tdigest_init(tdigest *td);
+void tdigest_finish(tdigest *td);
+
+void tdigest_vals(tdigest *td, int more_vals, const float8 *xs, const bool *x_nulls);
+void tdigest_merge(tdigest *into, tdigest *from);
+float8 tdigest_percentile(tdigest *td, float8 fraction);